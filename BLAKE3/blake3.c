@@ -617,3 +617,71 @@ void blake3_hasher_reset(blake3_hasher *self) {
   chunk_state_reset(&self->chunk, self->key, 0);
   self->cv_stack_len = 0;
 }
+
+// DirHash additions: primitives used to build a long BLAKE3 stream from
+// cached subtree chaining values instead of re-reading the matching input.
+
+uint64_t blake3_hasher_count(const blake3_hasher *self) {
+  return self->chunk.chunk_counter * BLAKE3_CHUNK_LEN +
+         (uint64_t)chunk_state_len(&self->chunk);
+}
+
+void blake3_hasher_compress_chunks(const blake3_hasher *self,
+                                   const uint8_t *input, size_t num_chunks,
+                                   uint64_t chunk_counter, uint8_t *out_cvs) {
+  // These chunks are never the root: the caller only uses them as the
+  // children of a subtree of at least 2 chunks.
+  size_t degree = blake3_simd_degree();
+  while (num_chunks > 0) {
+    size_t n = num_chunks < degree ? num_chunks : degree;
+    compress_chunks_parallel(input, n * BLAKE3_CHUNK_LEN, self->key,
+                             chunk_counter, self->chunk.flags, out_cvs);
+    input += n * BLAKE3_CHUNK_LEN;
+    out_cvs += n * BLAKE3_OUT_LEN;
+    chunk_counter += n;
+    num_chunks -= n;
+  }
+}
+
+void blake3_hasher_parent_cv(const blake3_hasher *self,
+                             const uint8_t cv_pair[2 * BLAKE3_OUT_LEN],
+                             uint8_t out_cv[BLAKE3_OUT_LEN]) {
+  output_t output = parent_output(cv_pair, self->key, self->chunk.flags);
+  output_chaining_value(&output, out_cv);
+}
+
+int blake3_hasher_push_subtree(blake3_hasher *self,
+                               const uint8_t cv_pair[2 * BLAKE3_OUT_LEN],
+                               uint64_t subtree_chunks) {
+  // The subtree must be a power of 2 of at least 2 chunks, and it must start
+  // on a chunk boundary that is a multiple of its size.
+  size_t len = chunk_state_len(&self->chunk);
+  if ((len != 0 && len != BLAKE3_CHUNK_LEN) || subtree_chunks < 2 ||
+      (subtree_chunks & (subtree_chunks - 1)) != 0) {
+    return 0;
+  }
+  uint64_t chunk_counter = self->chunk.chunk_counter + (len ? 1 : 0);
+  if ((chunk_counter & (subtree_chunks - 1)) != 0) {
+    return 0;
+  }
+
+  // A complete chunk kept in the chunk state is not the root since more
+  // input follows. Same as blake3_hasher_update().
+  if (len == BLAKE3_CHUNK_LEN) {
+    output_t output = chunk_state_output(&self->chunk);
+    uint8_t chunk_cv[32];
+    output_chaining_value(&output, chunk_cv);
+    hasher_push_cv(self, chunk_cv, self->chunk.chunk_counter);
+    chunk_state_reset(&self->chunk, self->key, chunk_counter);
+  }
+
+  // Push the two halves separately, like blake3_hasher_update() does, so
+  // that the top of this subtree can still be ROOT finalized.
+  uint8_t cv[BLAKE3_OUT_LEN];
+  memcpy(cv, cv_pair, BLAKE3_OUT_LEN);
+  hasher_push_cv(self, cv, chunk_counter);
+  memcpy(cv, &cv_pair[BLAKE3_OUT_LEN], BLAKE3_OUT_LEN);
+  hasher_push_cv(self, cv, chunk_counter + (subtree_chunks / 2));
+  self->chunk.chunk_counter += subtree_chunks;
+  return 1;
+}
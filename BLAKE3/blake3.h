@@ -75,6 +75,30 @@ BLAKE3_API void blake3_hasher_finalize_seek(const blake3_hasher *self, uint64_t
                                             uint8_t *out, size_t out_len);
 BLAKE3_API void blake3_hasher_reset(blake3_hasher *self);
 
+// DirHash additions, see blake3.c
+BLAKE3_API uint64_t blake3_hasher_count(const blake3_hasher *self);
+BLAKE3_API void blake3_hasher_compress_chunks(const blake3_hasher *self,
+                                              const uint8_t *input, size_t num_chunks,
+                                              uint64_t chunk_counter, uint8_t *out_cvs);
+BLAKE3_API void blake3_hasher_parent_cv(const blake3_hasher *self,
+                                        const uint8_t cv_pair[2 * BLAKE3_OUT_LEN],
+                                        uint8_t out_cv[BLAKE3_OUT_LEN]);
+BLAKE3_API int blake3_hasher_push_subtree(blake3_hasher *self,
+                                          const uint8_t cv_pair[2 * BLAKE3_OUT_LEN],
+                                          uint64_t subtree_chunks);
+
+// DirHash additions, see blake3_dispatch.c. The flags match the detected x86
+// features; they are always 0 on other platforms.
+#define BLAKE3_FEATURE_SSE2 (1 << 0)
+#define BLAKE3_FEATURE_SSSE3 (1 << 1)
+#define BLAKE3_FEATURE_SSE41 (1 << 2)
+#define BLAKE3_FEATURE_AVX (1 << 3)
+#define BLAKE3_FEATURE_AVX2 (1 << 4)
+#define BLAKE3_FEATURE_AVX512F (1 << 5)
+#define BLAKE3_FEATURE_AVX512VL (1 << 6)
+BLAKE3_API uint32_t blake3_cpu_features(void);
+BLAKE3_API void blake3_set_cpu_features_mask(uint32_t mask);
+
 #ifdef __cplusplus
 }
 #endif
@@ -115,7 +115,7 @@ static /* Allow the variable to be controlled manually for testing */
 static
 #endif
     enum cpu_feature
-    get_cpu_features(void) {
+    detect_cpu_features(void) {
 
   /* If TSAN detects a data race here, try compiling with -DBLAKE3_ATOMICS=1 */
   enum cpu_feature features = ATOMIC_LOAD(g_cpu_features);
@@ -168,6 +168,24 @@ static
   }
 }
 
+// DirHash addition: mask applied to the detected CPU features so that each
+// SIMD implementation can be benchmarked. It is not synchronized and must only
+// be changed while no other thread is hashing.
+static uint32_t g_cpu_features_mask = ~(uint32_t)0;
+
+static enum cpu_feature get_cpu_features(void) {
+  return (enum cpu_feature)((uint32_t)detect_cpu_features() &
+                            g_cpu_features_mask);
+}
+
+uint32_t blake3_cpu_features(void) {
+  return (uint32_t)detect_cpu_features() & ~(uint32_t)UNDEFINED;
+}
+
+void blake3_set_cpu_features_mask(uint32_t mask) {
+  g_cpu_features_mask = mask;
+}
+
 void blake3_compress_in_place(uint32_t cv[8],
                               const uint8_t block[BLAKE3_BLOCK_LEN],
                               uint8_t block_len, uint64_t counter,
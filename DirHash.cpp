@@ -51,21 +51,30 @@
 #define _CRT_SECURE_NO_WARNINGS
 #pragma warning(disable : 4995)
 
+#ifdef _WIN32
 #include <ntstatus.h>
 
 #define WIN32_NO_STATUS
 #include <windows.h>
+#include <winternl.h>
 #include <WinCrypt.h>
 #include <bcrypt.h>
 #include <Shlwapi.h>
 #include <pathcch.h>
+#include <tchar.h>
+#include <io.h>
+#include <strsafe.h>
+#else
+#include "Platform.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
-#include <tchar.h>
 #include <fcntl.h>
-#include <io.h>
 #include <time.h>
-#include <strsafe.h>
 #if !defined (_M_ARM64) && !defined (_M_ARM)
 #include <openssl/sha.h>
 #include <openssl/md5.h>
@@ -80,13 +89,24 @@
 #include <string>
 #include <list>
 #include <map>
+#include <unordered_set>
+#include <queue>
 #include <vector>
 #ifdef USE_STREEBOG
 #include "Streebog.h"
 #endif
+#include "DirHashLib.h"
 
 #define DIRHASH_VERSION	"1.26.1"
 
+#ifdef _WIN32
+#define PATH_SEPARATOR			L'\\'
+#define PATH_SEPARATOR_STRING	L"\\"
+#else
+#define PATH_SEPARATOR			L'/'
+#define PATH_SEPARATOR_STRING	L"/"
+#endif
+
 
 using namespace std;
 
@@ -94,19 +114,15 @@ typedef vector<unsigned char> ByteArray;
 
 class CFilePtr;
 
-static BYTE g_pbBuffer[4096];
-static TCHAR g_szCanonalizedName[MAX_PATH + 1];
+// scratch buffers of the thread walking the inputs
+static thread_local BYTE t_pbBuffer[4096];
+static thread_local TCHAR t_szCanonalizedName[MAX_PATH + 1];
 static WORD  g_wAttributes = FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED;
 static volatile WORD  g_wCurrentAttributes;
 static HANDLE g_hConsole = NULL;
 static CONSOLE_SCREEN_BUFFER_INFO g_originalConsoleInfo;
-static vector<shared_ptr<CFilePtr>> outputFiles;
 static bool g_bLowerCase = false;
-static bool g_bUseMsCrypto = false;
-static bool g_bMismatchFound = false;
-static bool g_bSkipError = false;
 static bool g_bNoLogo = false;
-static bool g_bNoFollow = false;
 static HANDLE g_hThreads[256];
 static WORD ThreadProcessorGroups[256] = { 0 };
 static DWORD g_threadsCount = 0;
@@ -118,16 +134,12 @@ static HANDLE g_hStopEvent = NULL;
 static HANDLE g_hOutputReadyEvent = NULL;
 static HANDLE g_hOutputStopEvent = NULL;
 static HANDLE g_hOutputThread = NULL;
-static std::wstring g_szLastErrorMsg;
 static wstring g_currentDirectory;
-static bool g_sumFileSkipped = false;
-static bool g_bSumRelativePath = false;
 static bool g_bIncludeLastDir = false;
-static wstring g_inputDirPath;
-static size_t g_inputDirPathLength = 0;
 static bool g_bLongPathNamesEnabled = false;
-static list<wstring> onlySpecList;
-static list<wstring> excludeSpecList;
+static bool g_bSumExtended = false;
+static bool g_bTrustMetadata = false;
+static volatile LONG g_trustedEntriesCount = 0;
 
 
 typedef BOOL(WINAPI* SetThreadGroupAffinityFn)(
@@ -164,12 +176,6 @@ PathAllocCanonicalizeFn PathAllocCanonicalizePtr = NULL;
 PathAllocCombineFn PathAllocCombinePtr = NULL;
 PathCchSkipRootFn PathCchSkipRootPtr = NULL;
 
-// Used for sorting directory content
-bool compare_nocase(LPCWSTR first, LPCWSTR second)
-{
-	return _wcsicmp(first, second) < 0;
-}
-
 TCHAR ToHex(unsigned char b)
 {
 	if (b >= 0 && b <= 9)
@@ -267,18 +273,61 @@ std::wstring FormatString(LPCTSTR fmt, ...)
 	return ret;
 }
 
+// serializes console messages with the progress line drawn by the -progress render thread
+static CRITICAL_SECTION g_consoleLock;
+static bool g_bConsoleLockInitialized = false;
+static size_t g_progressLineLength = 0;
+// set by -json: the standard output only receives NDJSON records and messages are written to the standard error
+static bool g_bJsonOutput = false;
+
+void ClearProgressLine()
+{
+	if (g_progressLineLength)
+	{
+		_tprintf(_T("\r"));
+		for (size_t i = 0; i < g_progressLineLength; i++)
+			_tprintf(_T(" "));
+		_tprintf(_T("\r"));
+		g_progressLineLength = 0;
+	}
+}
+
 void ShowMessage(WORD attributes, LPCTSTR szMsg, va_list args)
 {
+	if (g_bJsonOutput)
+	{
+		_vftprintf(stderr, szMsg, args);
+		return;
+	}
+	if (g_bConsoleLockInitialized)
+	{
+		EnterCriticalSection(&g_consoleLock);
+		ClearProgressLine();
+	}
 	SetConsoleTextAttribute(g_hConsole, attributes);
 	_vtprintf(szMsg, args);
 	SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+	if (g_bConsoleLockInitialized)
+		LeaveCriticalSection(&g_consoleLock);
 }
 
 void ShowMessageDirect(WORD attributes, LPCTSTR szMsg)
 {	
+	if (g_bJsonOutput)
+	{
+		_ftprintf(stderr, L"%s", szMsg);
+		return;
+	}
+	if (g_bConsoleLockInitialized)
+	{
+		EnterCriticalSection(&g_consoleLock);
+		ClearProgressLine();
+	}
 	SetConsoleTextAttribute(g_hConsole, attributes);
 	_tprintf(L"%s", szMsg);
 	SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+	if (g_bConsoleLockInitialized)
+		LeaveCriticalSection(&g_consoleLock);
 }
 
 void ShowError(LPCTSTR szMsg, ...)
@@ -307,6 +356,7 @@ void ShowWarningDirect(LPCTSTR szMsg)
 	ShowMessageDirect(FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY, szMsg);
 }
 
+#ifdef _WIN32
 typedef  NTSTATUS(WINAPI* RtlGetVersionFn)(
 	PRTL_OSVERSIONINFOW lpVersionInformation);
 
@@ -328,6 +378,539 @@ BOOL GetWindowsVersion(OSVERSIONINFOW* pOSversion)
 
 	return bRet;
 }
+#endif
+
+// ---------------------------------------------
+/*
+ * Run statistics collected by -stats.
+ *
+ * Each thread updates its own THREAD_STATS block, registered on first use, so the hot path has no synchronization.
+ * The blocks are aggregated at exit once the worker threads have stopped. Phase times are summed over all threads.
+ * Latency histograms use power of 2 buckets of microseconds and the read size histogram power of 2 buckets of
+ * bytes. A sampler thread records the depth of the jobs queue and of the output backlog at a fixed interval.
+ */
+
+enum StatsPhase
+{
+	STATS_ENUMERATE,
+	STATS_REPARSE_PROBE,
+	STATS_OPEN,
+	STATS_READ,
+	STATS_HASH,
+	STATS_FINALIZE,
+	STATS_OUTPUT,
+	STATS_PHASES_COUNT
+};
+
+enum StatsCounter
+{
+	STATS_DIRECTORIES,
+	STATS_FILES_HASHED,
+	STATS_FILES_SKIPPED,
+	STATS_FILES_FAILED,
+	STATS_BYTES_READ,
+	STATS_COUNTERS_COUNT
+};
+
+#define STATS_BUCKETS				40
+#define STATS_MAX_ALGORITHMS		16
+#define STATS_SAMPLE_INTERVAL		100 // milliseconds
+#define STATS_MAX_SAMPLES			36000
+
+typedef struct _THREAD_STATS
+{
+	ULONGLONG phaseTicks[STATS_PHASES_COUNT];
+	ULONGLONG phaseCalls[STATS_PHASES_COUNT];
+	ULONGLONG counters[STATS_COUNTERS_COUNT];
+	ULONGLONG openLatency[STATS_BUCKETS];
+	ULONGLONG readLatency[STATS_BUCKETS];
+	ULONGLONG readSize[STATS_BUCKETS];
+	LPCTSTR algorithms[STATS_MAX_ALGORITHMS];
+	ULONGLONG algorithmBytes[STATS_MAX_ALGORITHMS];
+} THREAD_STATS;
+
+typedef struct _QUEUE_SAMPLE
+{
+	DWORD elapsedMs;
+	LONG jobs;
+	LONG outputs;
+} QUEUE_SAMPLE;
+
+// number of entries in the jobs and outputs lists, used by the statistics sampler
+static volatile LONG g_pendingJobs = 0;
+static volatile LONG g_pendingOutputs = 0;
+
+static thread_local THREAD_STATS* t_pThreadStats = NULL;
+
+static const LPCWSTR g_statsPhaseNames[STATS_PHASES_COUNT] = { L"enumeration", L"reparseProbes", L"opens", L"reads", L"hashing", L"finalize", L"output" };
+
+// write a text file encoded in UTF-8 without BOM
+bool WriteUtf8File(LPCWSTR szPath, const wstring& szContent)
+{
+	bool bRet = false;
+	FILE* f = _wfopen(szPath, L"wb");
+	if (f)
+	{
+		int cbText = szContent.empty() ? 0 : WideCharToMultiByte(CP_UTF8, 0, szContent.c_str(), (int)szContent.length(), NULL, 0, NULL, NULL);
+		vector<char> text(cbText + 1);
+		if (cbText)
+			WideCharToMultiByte(CP_UTF8, 0, szContent.c_str(), (int)szContent.length(), text.data(), cbText, NULL, NULL);
+		bRet = (fwrite(text.data(), 1, cbText, f) == (size_t)cbText);
+		if (fclose(f))
+			bRet = false;
+	}
+	return bRet;
+}
+
+class CRunStats
+{
+protected:
+	CRITICAL_SECTION m_lock;
+	vector<THREAD_STATS*> m_threads;
+	vector<QUEUE_SAMPLE> m_samples;
+	LARGE_INTEGER m_frequency;
+	LONGLONG m_startTicks;
+	double m_elapsed;
+
+	static int GetBucket(ULONGLONG value)
+	{
+		int bucket = 0;
+		while (value && (bucket < STATS_BUCKETS - 1))
+		{
+			value >>= 1;
+			bucket++;
+		}
+		return bucket;
+	}
+
+	// upper bound of the bucket holding the given percentile of the values
+	static ULONGLONG GetHistogramPercentile(const ULONGLONG* histogram, double percentile)
+	{
+		ULONGLONG total = 0, count = 0;
+		for (int i = 0; i < STATS_BUCKETS; i++)
+			total += histogram[i];
+		for (int i = 0; i < STATS_BUCKETS; i++)
+		{
+			count += histogram[i];
+			if (total && ((double)count >= percentile * (double)total / 100.0))
+				return i ? (1ULL << i) - 1 : 0;
+		}
+		return 0;
+	}
+
+	static wstring FormatHistogram(const ULONGLONG* histogram)
+	{
+		wstring szJson = L"[";
+		for (int i = 0; i < STATS_BUCKETS; i++)
+			szJson += FormatString(L"%s%llu", i ? L", " : L"", histogram[i]);
+		return szJson + L"]";
+	}
+
+	double TicksToSeconds(ULONGLONG ticks) const { return (double)ticks / (double)m_frequency.QuadPart; }
+
+	THREAD_STATS& GetThreadStats()
+	{
+		if (!t_pThreadStats)
+		{
+			t_pThreadStats = new THREAD_STATS;
+			memset(t_pThreadStats, 0, sizeof(THREAD_STATS));
+			EnterCriticalSection(&m_lock);
+			m_threads.push_back(t_pThreadStats);
+			LeaveCriticalSection(&m_lock);
+		}
+		return *t_pThreadStats;
+	}
+
+	void Aggregate(THREAD_STATS& total, map<wstring, ULONGLONG>& algorithmBytes) const
+	{
+		memset(&total, 0, sizeof(total));
+		for (size_t t = 0; t < m_threads.size(); t++)
+		{
+			const THREAD_STATS& s = *m_threads[t];
+			for (int i = 0; i < STATS_PHASES_COUNT; i++)
+			{
+				total.phaseTicks[i] += s.phaseTicks[i];
+				total.phaseCalls[i] += s.phaseCalls[i];
+			}
+			for (int i = 0; i < STATS_COUNTERS_COUNT; i++)
+				total.counters[i] += s.counters[i];
+			for (int i = 0; i < STATS_BUCKETS; i++)
+			{
+				total.openLatency[i] += s.openLatency[i];
+				total.readLatency[i] += s.readLatency[i];
+				total.readSize[i] += s.readSize[i];
+			}
+			for (int i = 0; (i < STATS_MAX_ALGORITHMS) && s.algorithms[i]; i++)
+				algorithmBytes[s.algorithms[i]] += s.algorithmBytes[i];
+		}
+	}
+
+public:
+	CRunStats() : m_elapsed(0.0)
+	{
+		InitializeCriticalSection(&m_lock);
+		QueryPerformanceFrequency(&m_frequency);
+		m_startTicks = Now();
+	}
+
+	~CRunStats()
+	{
+		for (size_t i = 0; i < m_threads.size(); i++)
+			delete m_threads[i];
+		DeleteCriticalSection(&m_lock);
+	}
+
+	static LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void AddPhase(StatsPhase phase, LONGLONG ticks)
+	{
+		THREAD_STATS& s = GetThreadStats();
+		s.phaseTicks[phase] += (ULONGLONG)ticks;
+		s.phaseCalls[phase]++;
+		if (phase == STATS_OPEN)
+			s.openLatency[GetBucket((ULONGLONG)ticks * 1000000 / m_frequency.QuadPart)]++;
+	}
+
+	void AddRead(DWORD cbRead, LONGLONG ticks)
+	{
+		THREAD_STATS& s = GetThreadStats();
+		s.phaseTicks[STATS_READ] += (ULONGLONG)ticks;
+		s.phaseCalls[STATS_READ]++;
+		s.counters[STATS_BYTES_READ] += cbRead;
+		s.readLatency[GetBucket((ULONGLONG)ticks * 1000000 / m_frequency.QuadPart)]++;
+		s.readSize[GetBucket(cbRead)]++;
+	}
+
+	void AddHashedBytes(LPCTSTR szHashId, ULONGLONG cbHashed)
+	{
+		THREAD_STATS& s = GetThreadStats();
+		// IDs are string literals so comparing pointers is enough in most cases
+		for (int i = 0; i < STATS_MAX_ALGORITHMS; i++)
+		{
+			if (!s.algorithms[i] || (s.algorithms[i] == szHashId) || !_tcscmp(s.algorithms[i], szHashId))
+			{
+				s.algorithms[i] = szHashId;
+				s.algorithmBytes[i] += cbHashed;
+				break;
+			}
+		}
+	}
+
+	void Increment(StatsCounter counter) { GetThreadStats().counters[counter]++; }
+
+	// only called by the sampler thread
+	void AddQueueSample()
+	{
+		if (m_samples.size() < STATS_MAX_SAMPLES)
+		{
+			QUEUE_SAMPLE sample;
+			sample.elapsedMs = (DWORD)(TicksToSeconds(Now() - m_startTicks) * 1000.0);
+			sample.jobs = g_pendingJobs;
+			sample.outputs = g_pendingOutputs;
+			m_samples.push_back(sample);
+		}
+	}
+
+	void Stop() { m_elapsed = TicksToSeconds(Now() - m_startTicks); }
+
+	wstring FormatSummary() const
+	{
+		THREAD_STATS total;
+		map<wstring, ULONGLONG> algorithmBytes;
+		LONG maxJobs = 0, maxOutputs = 0;
+		double sumJobs = 0.0, sumOutputs = 0.0;
+
+		Aggregate(total, algorithmBytes);
+		for (size_t i = 0; i < m_samples.size(); i++)
+		{
+			maxJobs = max(maxJobs, m_samples[i].jobs);
+			maxOutputs = max(maxOutputs, m_samples[i].outputs);
+			sumJobs += m_samples[i].jobs;
+			sumOutputs += m_samples[i].outputs;
+		}
+
+		wstring szSummary = FormatString(L"Statistics (times are summed over all threads):\n  Elapsed time: %.3f s\n", m_elapsed);
+		szSummary += FormatString(L"  Files: %llu hashed, %llu skipped, %llu failed in %llu directories\n",
+			total.counters[STATS_FILES_HASHED], total.counters[STATS_FILES_SKIPPED], total.counters[STATS_FILES_FAILED], total.counters[STATS_DIRECTORIES]);
+		for (int i = 0; i < STATS_PHASES_COUNT; i++)
+			szSummary += FormatString(L"  %-14s %10.3f s in %llu calls\n", (wstring(g_statsPhaseNames[i]) + L":").c_str(), TicksToSeconds(total.phaseTicks[i]), total.phaseCalls[i]);
+		szSummary += FormatString(L"  Open latency: p50 <= %llu us, p90 <= %llu us, p99 <= %llu us\n",
+			GetHistogramPercentile(total.openLatency, 50.0), GetHistogramPercentile(total.openLatency, 90.0), GetHistogramPercentile(total.openLatency, 99.0));
+		szSummary += FormatString(L"  Read latency: p50 <= %llu us, p90 <= %llu us, p99 <= %llu us\n",
+			GetHistogramPercentile(total.readLatency, 50.0), GetHistogramPercentile(total.readLatency, 90.0), GetHistogramPercentile(total.readLatency, 99.0));
+		szSummary += FormatString(L"  Read size: %llu bytes read, p50 <= %llu bytes, p99 <= %llu bytes\n",
+			total.counters[STATS_BYTES_READ], GetHistogramPercentile(total.readSize, 50.0), GetHistogramPercentile(total.readSize, 99.0));
+		for (map<wstring, ULONGLONG>::const_iterator It = algorithmBytes.begin(); It != algorithmBytes.end(); It++)
+			szSummary += FormatString(L"  Bytes hashed with %s: %llu\n", It->first.c_str(), It->second);
+		if (!m_samples.empty())
+		{
+			szSummary += FormatString(L"  Jobs queue depth: max %ld, average %.1f\n", maxJobs, sumJobs / (double)m_samples.size());
+			szSummary += FormatString(L"  Output backlog: max %ld, average %.1f\n", maxOutputs, sumOutputs / (double)m_samples.size());
+		}
+		return szSummary;
+	}
+
+	wstring FormatJson() const
+	{
+		THREAD_STATS total;
+		map<wstring, ULONGLONG> algorithmBytes;
+		Aggregate(total, algorithmBytes);
+
+		wstring szJson = FormatString(L"{\n  \"elapsedSeconds\": %.6f,\n  \"threads\": %llu,\n", m_elapsed, (ULONGLONG)m_threads.size());
+		szJson += FormatString(L"  \"files\": { \"hashed\": %llu, \"skipped\": %llu, \"failed\": %llu },\n  \"directories\": %llu,\n  \"bytesRead\": %llu,\n",
+			total.counters[STATS_FILES_HASHED], total.counters[STATS_FILES_SKIPPED], total.counters[STATS_FILES_FAILED], total.counters[STATS_DIRECTORIES], total.counters[STATS_BYTES_READ]);
+		szJson += L"  \"phases\": {";
+		for (int i = 0; i < STATS_PHASES_COUNT; i++)
+			szJson += FormatString(L"%s\n    \"%s\": { \"seconds\": %.6f, \"calls\": %llu }", i ? L"," : L"", g_statsPhaseNames[i], TicksToSeconds(total.phaseTicks[i]), total.phaseCalls[i]);
+		szJson += L"\n  },\n  \"bytesHashed\": {";
+		for (map<wstring, ULONGLONG>::const_iterator It = algorithmBytes.begin(); It != algorithmBytes.end(); It++)
+			szJson += FormatString(L"%s\n    \"%s\": %llu", (It == algorithmBytes.begin()) ? L"" : L",", It->first.c_str(), It->second);
+		szJson += L"\n  },\n  \"histograms\": {\n    \"buckets\": \"bucket 0 counts zero values, bucket i counts values from 2^(i-1) to 2^i - 1\",\n";
+		szJson += L"    \"openLatencyMicroseconds\": " + FormatHistogram(total.openLatency) + L",\n";
+		szJson += L"    \"readLatencyMicroseconds\": " + FormatHistogram(total.readLatency) + L",\n";
+		szJson += L"    \"readSizeBytes\": " + FormatHistogram(total.readSize) + L"\n  },\n";
+		szJson += FormatString(L"  \"queueSamples\": { \"intervalMs\": %d, \"samples\": [", STATS_SAMPLE_INTERVAL);
+		for (size_t i = 0; i < m_samples.size(); i++)
+			szJson += FormatString(L"%s[%lu, %ld, %ld]", i ? L", " : L"", m_samples[i].elapsedMs, m_samples[i].jobs, m_samples[i].outputs);
+		szJson += L"] }\n}\n";
+		return szJson;
+	}
+};
+
+static CRunStats* g_pRunStats = NULL;
+
+// ---------------------------------------------
+/*
+ * Timeline of a run exported by -trace in the Chrome Trace Event format.
+ *
+ * Each thread records its spans in its own ring buffer, registered on first use, so recording is a few stores
+ * without synchronization. When a buffer is full the oldest spans are overwritten. The buffers are written to the
+ * trace file at exit once the worker threads have stopped. Span names are the -stats phases, plus one span per
+ * directory listing that carries the directory path.
+ */
+
+#define TRACE_EVENTS_PER_THREAD		65536
+#define TRACE_DIRECTORY				STATS_PHASES_COUNT
+
+typedef struct _TRACE_EVENT
+{
+	LONGLONG start;
+	LONGLONG end;
+	int span;
+	LPWSTR szDetail;
+} TRACE_EVENT;
+
+typedef struct _TRACE_THREAD
+{
+	DWORD threadId;
+	WCHAR szName[32];
+	vector<TRACE_EVENT> events;
+	size_t next;
+	ULONGLONG total;
+} TRACE_THREAD;
+
+static thread_local TRACE_THREAD* t_pTraceThread = NULL;
+
+// append a string in UTF-8 to a JSON text, with quotes and escaping
+void AppendJsonString(string& szJson, LPCWSTR szValue)
+{
+	int cbValue = WideCharToMultiByte(CP_UTF8, 0, szValue, -1, NULL, 0, NULL, NULL);
+	vector<char> value(cbValue > 0 ? cbValue : 1, 0);
+	if (cbValue > 0)
+		WideCharToMultiByte(CP_UTF8, 0, szValue, -1, value.data(), cbValue, NULL, NULL);
+
+	szJson += '"';
+	for (const char* p = value.data(); *p; p++)
+	{
+		unsigned char c = (unsigned char)*p;
+		if (c == '"' || c == '\\')
+		{
+			szJson += '\\';
+			szJson += (char)c;
+		}
+		else if (c < 0x20)
+		{
+			char szEscape[8];
+			snprintf(szEscape, sizeof(szEscape), "\\u%.4X", c);
+			szJson += szEscape;
+		}
+		else
+			szJson += (char)c;
+	}
+	szJson += '"';
+}
+
+class CTrace
+{
+protected:
+	CRITICAL_SECTION m_lock;
+	vector<TRACE_THREAD*> m_threads;
+	LARGE_INTEGER m_frequency;
+	LONGLONG m_startTicks;
+
+	TRACE_THREAD& GetThread()
+	{
+		if (!t_pTraceThread)
+		{
+			t_pTraceThread = new TRACE_THREAD;
+			t_pTraceThread->threadId = GetCurrentThreadId();
+			wcscpy(t_pTraceThread->szName, L"thread");
+			t_pTraceThread->events.resize(TRACE_EVENTS_PER_THREAD);
+			t_pTraceThread->next = 0;
+			t_pTraceThread->total = 0;
+			for (size_t i = 0; i < t_pTraceThread->events.size(); i++)
+				t_pTraceThread->events[i].szDetail = NULL;
+			EnterCriticalSection(&m_lock);
+			m_threads.push_back(t_pTraceThread);
+			LeaveCriticalSection(&m_lock);
+		}
+		return *t_pTraceThread;
+	}
+
+	double ToMicroseconds(LONGLONG ticks) const { return (double)ticks * 1000000.0 / (double)m_frequency.QuadPart; }
+
+public:
+	CTrace()
+	{
+		InitializeCriticalSection(&m_lock);
+		QueryPerformanceFrequency(&m_frequency);
+		m_startTicks = Now();
+	}
+
+	~CTrace()
+	{
+		for (size_t t = 0; t < m_threads.size(); t++)
+		{
+			for (size_t i = 0; i < m_threads[t]->events.size(); i++)
+				free(m_threads[t]->events[i].szDetail);
+			delete m_threads[t];
+		}
+		DeleteCriticalSection(&m_lock);
+	}
+
+	static LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void SetThreadName(LPCWSTR szName)
+	{
+		TRACE_THREAD& thread = GetThread();
+		StringCchCopyW(thread.szName, ARRAYSIZE(thread.szName), szName);
+	}
+
+	void AddSpan(int span, LONGLONG start, LONGLONG end, LPCWSTR szDetail = NULL)
+	{
+		TRACE_THREAD& thread = GetThread();
+		TRACE_EVENT& event = thread.events[thread.next];
+		free(event.szDetail);
+		event.start = start;
+		event.end = end;
+		event.span = span;
+		event.szDetail = szDetail ? _wcsdup(szDetail) : NULL;
+		thread.next = (thread.next + 1) % thread.events.size();
+		thread.total++;
+	}
+
+	// only called once all threads that recorded spans are stopped
+	bool Save(LPCWSTR szPath) const
+	{
+		FILE* f = _wfopen(szPath, L"wb");
+		if (!f)
+			return false;
+
+		ULONGLONG dropped = 0;
+		bool bFirst = true;
+		string szEvent;
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+		for (size_t t = 0; t < m_threads.size(); t++)
+		{
+			const TRACE_THREAD& thread = *m_threads[t];
+			szEvent = bFirst ? "" : ",\n";
+			szEvent += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + to_string(thread.threadId) + ",\"args\":{\"name\":";
+			AppendJsonString(szEvent, FormatString(L"%s %u", thread.szName, thread.threadId).c_str());
+			szEvent += "}}";
+			fputs(szEvent.c_str(), f);
+			bFirst = false;
+
+			size_t count = (size_t)min(thread.total, (ULONGLONG)thread.events.size());
+			size_t first = (thread.total > thread.events.size()) ? thread.next : 0;
+			dropped += thread.total - count;
+			for (size_t n = 0; n < count; n++)
+			{
+				const TRACE_EVENT& event = thread.events[(first + n) % thread.events.size()];
+				char szTimes[96];
+				snprintf(szTimes, sizeof(szTimes), ",\"ts\":%.3f,\"dur\":%.3f", ToMicroseconds(event.start - m_startTicks), ToMicroseconds(event.end - event.start));
+				szEvent = ",\n{\"name\":";
+				AppendJsonString(szEvent, (event.span == TRACE_DIRECTORY) ? L"directory" : g_statsPhaseNames[event.span]);
+				szEvent += ",\"ph\":\"X\",\"pid\":1,\"tid\":" + to_string(thread.threadId) + szTimes;
+				if (event.szDetail)
+				{
+					szEvent += ",\"args\":{\"path\":";
+					AppendJsonString(szEvent, event.szDetail);
+					szEvent += "}";
+				}
+				szEvent += "}";
+				fputs(szEvent.c_str(), f);
+			}
+		}
+		fprintf(f, "\n],\"otherData\":{\"droppedEvents\":%llu}}\n", dropped);
+
+		return (fclose(f) == 0);
+	}
+};
+
+static CTrace* g_pTrace = NULL;
+
+// measure the duration of the enclosing scope for -stats and -trace
+class CStatsScope
+{
+protected:
+	StatsPhase m_phase;
+	LONGLONG m_start;
+public:
+	CStatsScope(StatsPhase phase) : m_phase(phase), m_start((g_pRunStats || g_pTrace) ? CRunStats::Now() : 0) {}
+	~CStatsScope()
+	{
+		if (m_start)
+		{
+			DWORD dwErr = GetLastError();
+			LONGLONG end = CRunStats::Now();
+			if (g_pRunStats)
+				g_pRunStats->AddPhase(m_phase, end - m_start);
+			if (g_pTrace)
+				g_pTrace->AddSpan(m_phase, m_start, end);
+			SetLastError(dwErr);
+		}
+	}
+};
+
+inline bool IsPathSeparator(WCHAR c)
+{
+#ifdef _WIN32
+	return (c == L'\\' || c == L'/');
+#else
+	// backslash is a valid file name character on POSIX
+	return (c == L'/');
+#endif
+}
+
+// convert '/' to '\\' on Windows. Nothing to do on POSIX where '/' is the only separator.
+inline void NormalizePathSeparators(wstring& path)
+{
+#ifdef _WIN32
+	std::replace(path.begin(), path.end(), L'/', L'\\');
+#else
+	UNREFERENCED_PARAMETER(path);
+#endif
+}
 
 LPCWSTR GetFileName(LPCWSTR szPath)
 {
@@ -336,17 +919,17 @@ LPCWSTR GetFileName(LPCWSTR szPath)
 	if (len <= 1)
 		return szPath;
 	ptr = szPath + (len - 1);
-	if (*ptr == L'\\' || *ptr == L'/')
+	if (IsPathSeparator(*ptr))
 		ptr--;
 
 	while (ptr != szPath)
 	{
-		if (*ptr == L'\\' || *ptr == L'/')
+		if (IsPathSeparator(*ptr))
 			break;
 		ptr--;
 	}
 
-	if (*ptr == L'\\' || *ptr == L'/')
+	if (IsPathSeparator(*ptr))
 		return ptr + 1;
 	else
 		return ptr;
@@ -359,6 +942,9 @@ bool IsDriveLetter(WCHAR c)
 
 bool IsAbsolutPath(LPCWSTR szPath)
 {
+#ifndef _WIN32
+	return (szPath[0] == L'/');
+#else
 	bool bRet = false;
 	size_t pathLen = wcslen(szPath);
 	if (pathLen > MAX_PATH)
@@ -395,6 +981,7 @@ bool IsAbsolutPath(LPCWSTR szPath)
 	}
 
 	return bRet;
+#endif
 }
 
 wstring EnsureAbsolut(LPCWSTR szPath)
@@ -403,7 +990,7 @@ wstring EnsureAbsolut(LPCWSTR szPath)
 	size_t pathLen = wcslen(szPath);
 	if (pathLen)
 	{
-		WCHAR g_szCanonalizedName[MAX_PATH + 1];
+		WCHAR szCanonalizedName[MAX_PATH + 1];
 		if (IsAbsolutPath(strVal.c_str()))
 		{
 			if (pathLen > MAX_PATH)
@@ -421,8 +1008,8 @@ wstring EnsureAbsolut(LPCWSTR szPath)
 			else
 			{
 
-				if (PathCanonicalizeW(g_szCanonalizedName, strVal.c_str()))
-					strVal = g_szCanonalizedName;
+				if (PathCanonicalizeW(szCanonalizedName, strVal.c_str()))
+					strVal = szCanonalizedName;
 			}
 		}
 		else
@@ -445,9 +1032,9 @@ wstring EnsureAbsolut(LPCWSTR szPath)
 
 			if (!bDone && ((wcslen(szParent) + pathLen) < MAX_PATH))
 			{
-				if (PathCombineW(g_szCanonalizedName, szParent, strVal.c_str()))
+				if (PathCombineW(szCanonalizedName, szParent, strVal.c_str()))
 				{
-					strVal = g_szCanonalizedName;
+					strVal = szCanonalizedName;
 					bDone = true;
 				}
 			}
@@ -489,7 +1076,7 @@ wstring EnsureAbsolut(LPCWSTR szPath)
  * 
  */
 
-
+#ifdef _WIN32
 typedef struct _REPARSE_DATA_BUFFER {
 	ULONG  ReparseTag;
 	USHORT  ReparseDataLength;
@@ -516,8 +1103,16 @@ typedef struct _REPARSE_DATA_BUFFER {
 	};
 } REPARSE_DATA_BUFFER, * PREPARSE_DATA_BUFFER;
 
+#endif
+
 bool IsReparsePoint(LPCTSTR szPath)
 {
+	CStatsScope statsScope(STATS_REPARSE_PROBE);
+#ifndef _WIN32
+	// symbolic links are the only reparse points on POSIX. GetFileAttributesW doesn't follow them.
+	DWORD dwAttributes = GetFileAttributesW(szPath);
+	return (dwAttributes != INVALID_FILE_ATTRIBUTES) && (dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT);
+#else
 	bool bRet = false;
 	HANDLE hFile;
 
@@ -550,6 +1145,18 @@ bool IsReparsePoint(LPCTSTR szPath)
 		delete[](BYTE*) rdata;
 	}
 	return bRet;
+#endif
+}
+
+// same as IsReparsePoint for an entry returned by FindFirstFile/FindNextFile: the attributes and the reparse tag of
+// the entry are used so that only the reparse points whose tag is not known are opened
+bool IsReparsePoint(LPCTSTR szPath, DWORD dwAttributes, DWORD dwReparseTag)
+{
+	if (!(dwAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+		return false;
+	if (dwReparseTag)
+		return (dwReparseTag == IO_REPARSE_TAG_SYMLINK) || (dwReparseTag == IO_REPARSE_TAG_MOUNT_POINT);
+	return IsReparsePoint(szPath);
 }
 
 class CPath
@@ -565,7 +1172,7 @@ public:
 
 	explicit CPath(LPCWSTR szPath) : m_path(szPath)
 	{
-		std::replace(m_path.begin(), m_path.end(), L'/', L'\\');
+		NormalizePathSeparators(m_path);
 		m_absolutPath = EnsureAbsolut(m_path.c_str());
 	}
 
@@ -589,16 +1196,16 @@ public:
 	CPath& operator = (LPCWSTR p)
 	{
 		m_path = p;
-		std::replace(m_path.begin(), m_path.end(), L'/', L'\\');
+		NormalizePathSeparators(m_path);
 		m_absolutPath = EnsureAbsolut(m_path.c_str());
 		return *this;
 	}
 
 	void AppendName(LPCWSTR szName)
 	{
-		m_path += L"\\";
+		m_path += PATH_SEPARATOR_STRING;
 		m_path += szName;
-		m_absolutPath += L"\\";
+		m_absolutPath += PATH_SEPARATOR_STRING;
 		m_absolutPath += szName;
 	}
 
@@ -678,6 +1285,68 @@ public:
 	}
 };
 
+// ---------------------------------------------
+/*
+ * State of a hashing operation.
+ *
+ * The functions of the engine use the operation pointed by t_pOperation instead of global variables so that the
+ * contexts of libdirhash can hash at the same time using the same worker threads. The command line runs a single
+ * operation, g_defaultOperation, which is the current one of all threads by default. The jobs and the listings
+ * queued for the worker threads carry their operation and the workers make it current while they process them, like
+ * the input roots. The options that libdirhash doesn't expose (-progress, -trace, -blocks, -incremental,
+ * -sumExtended, -trustMetadata, ...) are only used by the command line and they stay in global variables.
+ */
+
+class CNameMatcher;
+class CHashCache;
+class CJsonOutput;
+class CLinkedFiles;
+struct _threadParam;
+
+class CHashOperation
+{
+protected:
+	// forbid copying
+	CHashOperation(const CHashOperation&) {}
+	CHashOperation& operator = (const CHashOperation&) { return *this; }
+
+public:
+	vector<shared_ptr<CFilePtr>> m_outputFiles;
+	bool m_bUseMsCrypto;
+	bool m_bSkipError;
+	bool m_bNoFollow;
+	bool m_bMismatchFound;
+	volatile bool m_bCancelRequested; // set by DirHashCancel and by the control handler
+	DWORD m_threadsCount; // worker threads used by the operation, 0 if the files are hashed by the walker
+	wstring m_szLastErrorMsg;
+	bool m_bSumFileSkipped;
+	bool m_bSumRelativePath;
+	wstring m_inputDirPath;
+	size_t m_inputDirPathLength;
+	list<wstring> m_onlySpecList;
+	list<wstring> m_excludeSpecList;
+	// -exclude patterns applying to files and directories, -exclude patterns applying only to directories and -only patterns
+	CNameMatcher* m_pExcludeMatcher;
+	CNameMatcher* m_pExcludeDirMatcher;
+	CNameMatcher* m_pOnlyMatcher;
+	CPath m_verificationFileName;
+	CHashCache* m_pHashCache;
+	CPath m_cacheFileName;
+	CJsonOutput* m_pJsonOutput;
+	CLinkedFiles* m_pLinkedFiles;
+	bool m_bDeferJobs; // set by the walker of -largestFirst while the inputs are enumerated
+	vector<struct _threadParam*> m_deferredJobs;
+	volatile LONG m_unfinishedJobs; // jobs and listings queued or being processed
+	HANDLE m_hJobsDoneEvent;
+	HANDLE m_hListingDoneEvent;
+
+	CHashOperation();
+	~CHashOperation();
+};
+
+static CHashOperation g_defaultOperation;
+static thread_local CHashOperation* t_pOperation = &g_defaultOperation;
+
 
 
 // ---------------------------------------------
@@ -714,6 +1383,7 @@ public:
 class Hash
 {
 public:
+	virtual ~Hash() {}
 	virtual void Init() = 0;
 	virtual void Update(LPCBYTE pbData, size_t dwLength) = 0;
 	virtual void Final(LPBYTE pbDigest) = 0;
@@ -1061,6 +1731,11 @@ public:
 	LPCTSTR GetID() { return _T("Blake3"); }
 	int GetHashSize() { return BLAKE3_OUT_LEN; }
 
+	// access to the BLAKE3 tree, used by the incremental directory digest (-incremental)
+	ULONGLONG GetStreamPosition() const { return blake3_hasher_count(&m_ctx); }
+	void CompressChunks(LPCBYTE pbData, size_t chunksCount, ULONGLONG chunkCounter, LPBYTE pbCvs) const { blake3_hasher_compress_chunks(&m_ctx, pbData, chunksCount, chunkCounter, pbCvs); }
+	void ComputeParentCv(LPCBYTE pbCvPair, LPBYTE pbCv) const { blake3_hasher_parent_cv(&m_ctx, pbCvPair, pbCv); }
+	bool PushSubtree(LPCBYTE pbCvPair, ULONGLONG chunksCount) { return blake3_hasher_push_subtree(&m_ctx, pbCvPair, chunksCount) ? true : false; }
 };
 
 bool Hash::IsHashId(LPCTSTR szHashId)
@@ -1211,7 +1886,7 @@ Hash* Hash::GetHash(LPCTSTR szHashId)
 {
 	if (!szHashId || (_tcsicmp(szHashId, _T("SHA1")) == 0))
 	{
-		if (g_bUseMsCrypto)
+		if (t_pOperation->m_bUseMsCrypto)
 		{
 			return new Sha1Cng();
 		}
@@ -1222,7 +1897,7 @@ Hash* Hash::GetHash(LPCTSTR szHashId)
 	}
 	if (_tcsicmp(szHashId, _T("SHA256")) == 0)
 	{
-		if (g_bUseMsCrypto)
+		if (t_pOperation->m_bUseMsCrypto)
 		{
 			return new Sha256Cng();
 		}
@@ -1233,7 +1908,7 @@ Hash* Hash::GetHash(LPCTSTR szHashId)
 	}
 	if (_tcsicmp(szHashId, _T("SHA384")) == 0)
 	{
-		if (g_bUseMsCrypto)
+		if (t_pOperation->m_bUseMsCrypto)
 		{
 			return new Sha384Cng();
 		}
@@ -1244,7 +1919,7 @@ Hash* Hash::GetHash(LPCTSTR szHashId)
 	}
 	if (_tcsicmp(szHashId, _T("SHA512")) == 0)
 	{
-		if (g_bUseMsCrypto)
+		if (t_pOperation->m_bUseMsCrypto)
 		{
 			return new Sha512Cng();
 		}
@@ -1255,7 +1930,7 @@ Hash* Hash::GetHash(LPCTSTR szHashId)
 	}
 	if (_tcsicmp(szHashId, _T("MD5")) == 0)
 	{
-		if (g_bUseMsCrypto)
+		if (t_pOperation->m_bUseMsCrypto)
 		{
 			return new Md5Cng();
 		}
@@ -1303,1699 +1978,8212 @@ void UpdateHashes(vector<shared_ptr<Hash>>& pHashes, LPCBYTE pbBuffer, size_t dw
 	}
 }
 
+// Names are hashed as UTF-16LE without terminating NUL, which is the in-memory representation on Windows.
+// On platforms where wchar_t is 32-bit, names are converted first so that -hashnames gives the same result.
+void UpdateHashesWithName(vector<shared_ptr<Hash>>& pHashes, LPCWSTR szName)
+{
+#ifdef _WIN32
+	UpdateHashes(pHashes, (LPCBYTE)szName, wcslen(szName) * sizeof(WCHAR));
+#else
+	vector<BYTE> utf16;
+	utf16.reserve(wcslen(szName) * 2);
+	for (LPCWSTR ptr = szName; *ptr; ptr++)
+	{
+		unsigned int c = (unsigned int)*ptr;
+		if (c >= 0x10000)
+		{
+			c -= 0x10000;
+			unsigned int high = 0xD800 + (c >> 10), low = 0xDC00 + (c & 0x3FF);
+			utf16.push_back((BYTE)high); utf16.push_back((BYTE)(high >> 8));
+			utf16.push_back((BYTE)low); utf16.push_back((BYTE)(low >> 8));
+		}
+		else
+		{
+			utf16.push_back((BYTE)c); utf16.push_back((BYTE)(c >> 8));
+		}
+	}
+	UpdateHashes(pHashes, utf16.data(), utf16.size());
+#endif
+}
+
 // ----------------------------------------------------------
 
-class HashResultEntry
+// File metadata stored in extended SUM files (-sumExtended) and used for cheap pre-checks during verification
+class FileMetadata
 {
 public:
-	wstring m_hashName;
-	ByteArray m_digest;
-	mutable bool m_processed;
+	bool m_bValid;
+	ULONGLONG m_size;
+	ULONGLONG m_lastWriteTime; // FILETIME value (100-nanosecond intervals since January 1, 1601 UTC)
+	DWORD m_volumeSerial;
+	ULONGLONG m_fileIndex; // 0 if unknown
+	ULONGLONG m_changeTime; // 0 if unknown. Not stored in SUM files
 
-	HashResultEntry() : m_hashName(L""), m_processed (false){}
-	HashResultEntry(const HashResultEntry& hre) : m_hashName(hre.m_hashName), m_digest(hre.m_digest), m_processed (hre.m_processed) {}
-	~HashResultEntry() {}
+	FileMetadata() : m_bValid(false), m_size(0), m_lastWriteTime(0), m_volumeSerial(0), m_fileIndex(0), m_changeTime(0) {}
 
-	HashResultEntry& operator = (const HashResultEntry& hre) { m_hashName = hre.m_hashName; m_digest = hre.m_digest; m_processed = hre.m_processed; return *this; }
-};
+	void Set(ULONGLONG size, const FILETIME& lastWriteTime, DWORD volumeSerial, ULONGLONG fileIndex)
+	{
+		m_bValid = true;
+		m_size = size;
+		m_lastWriteTime = (((ULONGLONG)lastWriteTime.dwHighDateTime) << 32) | (ULONGLONG)lastWriteTime.dwLowDateTime;
+		m_volumeSerial = volumeSerial;
+		m_fileIndex = fileIndex;
+	}
 
-class CDirContent
-{
-protected:
-	CPath m_szPath;
-	bool m_bIsDir;
-public:
-	CDirContent(CPath szPath, LPCWSTR szName, bool bIsDir) : m_bIsDir(bIsDir), m_szPath(szPath)
+	void Set(const WIN32_FIND_DATA& ffd)
 	{
-		m_szPath.AppendName(szName);
+		Set((((ULONGLONG)ffd.nFileSizeHigh) << 32) | (ULONGLONG)ffd.nFileSizeLow, ffd.ftLastWriteTime, 0, 0);
 	}
 
-	CDirContent(const CDirContent& content) : m_bIsDir(content.m_bIsDir), m_szPath(content.m_szPath) {}
+	bool Set(HANDLE hFile)
+	{
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(hFile, &info))
+			return false;
+		Set((((ULONGLONG)info.nFileSizeHigh) << 32) | (ULONGLONG)info.nFileSizeLow,
+			info.ftLastWriteTime,
+			info.dwVolumeSerialNumber,
+			(((ULONGLONG)info.nFileIndexHigh) << 32) | (ULONGLONG)info.nFileIndexLow);
+		return true;
+	}
 
-	CDirContent& operator = (const CDirContent& content)
+	bool QueryChangeTime(HANDLE hFile)
 	{
-		m_bIsDir = content.m_bIsDir;
-		m_szPath = content.m_szPath;
-		return *this;
+		FILE_BASIC_INFO basicInfo;
+		if (!GetFileInformationByHandleEx(hFile, FileBasicInfo, &basicInfo, sizeof(basicInfo)))
+			return false;
+		m_changeTime = (ULONGLONG)basicInfo.ChangeTime.QuadPart;
+		return true;
 	}
 
-	bool IsDir() const { return m_bIsDir; }
-	const CPath& GetPath() const { return m_szPath; }
-	operator LPCWSTR () { return m_szPath.GetPathValue().c_str(); }
+	bool HasFileId() const { return m_bValid && (m_fileIndex != 0); }
 };
 
-bool IsExcludedName(LPCTSTR szName, bool bIsFile)
+class HashResultEntry
 {
-    // Include check
-    if (bIsFile && !onlySpecList.empty()) {// -only applied only to files
-        bool matched = false;
-        for (list<wstring>::iterator It = onlySpecList.begin(); It != onlySpecList.end(); It++) {
-            if (PathMatchSpec(szName, It->c_str())) {
-                matched = true;
-                break;
-            }
-        }
-        
-		return !matched;
-    }
-
-    // Exclude check
-	for (list<wstring>::iterator It = excludeSpecList.begin(); It != excludeSpecList.end(); It++)
-	{
-		if (PathMatchSpec(szName, It->c_str()))
-			return true;
-	}
+public:
+	wstring m_hashName;
+	ByteArray m_digest;
+	FileMetadata m_metadata;
+	mutable bool m_processed;
 
-	return false;
-}
+	HashResultEntry() : m_hashName(L""), m_processed (false){}
+	HashResultEntry(const HashResultEntry& hre) : m_hashName(hre.m_hashName), m_digest(hre.m_digest), m_metadata(hre.m_metadata), m_processed (hre.m_processed) {}
+	~HashResultEntry() {}
 
-// return the file name. If it is too long, it is shortness so that the progress line 
-LPCTSTR GetShortFileName(LPCTSTR szFilePath, unsigned long long fileSize)
-{
-	static TCHAR szShortName[256];
-	size_t l, bufferSize = ARRAYSIZE(szShortName);
-	int maxPrintLen = _scprintf(" [==========] 100.00 %% (%llu/%llu)", fileSize, fileSize); // 10 steps for progress bar
-	LPCTSTR ptr = &szFilePath[_tcslen(szFilePath) - 1];
+	HashResultEntry& operator = (const HashResultEntry& hre) { m_hashName = hre.m_hashName; m_digest = hre.m_digest; m_metadata = hre.m_metadata; m_processed = hre.m_processed; return *this; }
+};
 
-	// Get file name part from the path
-	while ((ptr != szFilePath) && (*ptr != _T('\\')) && (*ptr != _T('/')))
+// Build a SUM file line. When metadata is valid, the extended format is used:
+//   DIGEST:SIZE:MTIME:VOLUMESERIAL-FILEINDEX  PATH
+// The metadata is attached to the digest because any character, including ':', can start a path on POSIX systems
+// while a digest is always followed by a space in the plain format.
+wstring FormatSumLine(LPCTSTR szDigestHex, LPCWSTR szPath, const FileMetadata& metadata)
+{
+	wstring szLine = szDigestHex;
+	if (metadata.m_bValid)
 	{
-		ptr--;
+		szLine += FormatString(L":%llu:%llu:%.8X-%.16llX", metadata.m_size, metadata.m_lastWriteTime, metadata.m_volumeSerial, metadata.m_fileIndex);
 	}
-	ptr++;
+	szLine += L"  ";
+	szLine += szPath;
+	szLine += L"\n";
+	return szLine;
+}
 
-	// calculate maximum length for file name	
-	bufferSize = (g_originalConsoleInfo.dwSize.X > (maxPrintLen + 1)) ? min(bufferSize, (g_originalConsoleInfo.dwSize.X - 1 - maxPrintLen)) : 9;
+// Parse the metadata that follows the digest in an extended SUM line. szField starts with ':' and must only
+// contain the metadata
+bool ParseSumMetadata(const wchar_t* szField, FileMetadata& metadata)
+{
+	unsigned long long size = 0, lastWriteTime = 0, fileIndex = 0;
+	unsigned int volumeSerial = 0;
+	int consumed = 0;
 
-	l = _tcslen(ptr);
-	if (l < bufferSize)
-		_tcscpy(szShortName, ptr);
-	else
-	{
-		size_t prefixLen = (bufferSize / 2 - 2);
-		size_t suffixLen = bufferSize - prefixLen - 4;
+	if (*szField != L':')
+		return false;
 
-		memcpy(szShortName, ptr, prefixLen * sizeof(TCHAR));
-		memcpy(((unsigned char*)szShortName) + prefixLen * sizeof(TCHAR), _T("..."), 3 * sizeof(TCHAR));
-		memcpy(((unsigned char*)szShortName) + (prefixLen + 3) * sizeof(TCHAR), ptr + (l - suffixLen), suffixLen * sizeof(TCHAR));
-		szShortName[bufferSize - 1] = 0;
+	if ((4 == swscanf(szField, L":%llu:%llu:%8X-%16llX%n", &size, &lastWriteTime, &volumeSerial, &fileIndex, &consumed)) && consumed && !szField[consumed])
+	{
+		metadata.m_bValid = true;
+		metadata.m_size = size;
+		metadata.m_lastWriteTime = lastWriteTime;
+		metadata.m_volumeSerial = (DWORD)volumeSerial;
+		metadata.m_fileIndex = fileIndex;
+		return true;
 	}
-	return szShortName;
+
+	return false;
 }
 
-void DisplayProgress(LPCTSTR szFileName, unsigned long long currentSize, unsigned long long fileSize, clock_t startTime, clock_t& lastBlockTime)
+// Convert a path read from a SUM file to the form used by the enumeration
+void NormalizeSumEntryName(wstring& entryName, bool normalizePath)
 {
-	clock_t t = clock();
-	if (lastBlockTime == 0 || currentSize == fileSize || ((t - lastBlockTime) >= CLOCKS_PER_SEC))
-	{
-		unsigned long long maxPos = 10ull;
-		unsigned long long pos = (currentSize * maxPos) / fileSize;
-		double pourcentage = ((double)currentSize / (double)fileSize) * 100.0;
-
-		lastBlockTime = t;
-
-		_tprintf(_T("\r%s ["), szFileName);
-		for (unsigned long long i = 0; i < maxPos; i++)
-		{
-			if (i < pos)
-				_tprintf(_T("="));
-			else
-				_tprintf(_T(" "));
-		}
-		_tprintf(_T("] %.2f %% (%llu/%llu)"), pourcentage, currentSize, fileSize);
+#ifdef _WIN32
+	// replace '/' by '\' for compatibility with checksum format on *nix platforms
+	std::replace(entryName.begin(), entryName.end(), L'/', L'\\');
+#else
+	// replace '\' by '/' for compatibility with checksum files generated on Windows
+	std::replace(entryName.begin(), entryName.end(), L'\\', L'/');
+#endif
 
-		_tprintf(_T("\r"));
+	// check that entreName starts by the input directory value. Otherwise add it.
+	if ( normalizePath && t_pOperation->m_inputDirPathLength && ((entryName.length() < t_pOperation->m_inputDirPathLength)
+		||	(_wcsicmp(t_pOperation->m_inputDirPath.c_str(), entryName.substr(0, t_pOperation->m_inputDirPathLength).c_str())))
+		)
+	{
+		entryName = t_pOperation->m_inputDirPath + entryName;
 	}
 }
 
-void ClearProgress()
+// Parse one line of a SUM file (without its line terminator). digestLen is the digest size used by the previous
+// lines of the file (0 for the first one) and it is updated on success.
+bool ParseSumLine(wchar_t* szLine, size_t l, size_t& digestLen, bool normalizePath, wstring& entryName, ByteArray& digest, FileMetadata& metadata)
 {
-	_tprintf(_T("\r"));
-	for (int i = 0; i < g_originalConsoleInfo.dwSize.X - 1; i++)
+	// extract hash which is followed by two or one space characters
+	wchar_t* ptr = wcschr(szLine, L' ');
+	if (ptr)
 	{
-		_tprintf(_T(" "));
+		*ptr = 0;
+		ptr++;
+		// look for begining of file path
+		while (ptr != &szLine[l - 1] && *ptr == L' ')
+			ptr++;
+		// parse metadata attached to the digest if present (extended SUM format)
+		wchar_t* szMetadata = wcschr(szLine, L':');
+		if (szMetadata)
+		{
+			if (!ParseSumMetadata(szMetadata, metadata))
+				return false;
+			*szMetadata = 0;
+		}
+		// remove '*' if present (this is for unix checksum compatibility)
+		if (ptr != &szLine[l - 1] && *ptr == L'*')
+			ptr++;
+		if (ptr != &szLine[l - 1])
+		{
+			// hash length must be one of the supported ones (16, 20, 32, 48, 64)
+			if (FromHex(szLine, digest))
+			{
+				if ((digestLen != 0 && digestLen == digest.size())
+					|| (digestLen == 0 && Hash::IsHashSize ((int) digest.size()))
+					)
+				{
+					entryName = ptr;
+					NormalizeSumEntryName(entryName, normalizePath);
+					digestLen = digest.size();
+					return true;
+				}
+			}
+		}
 	}
 
-	_tprintf(_T("\r"));
+	return false;
 }
 
-typedef struct _threadParam
-{
-	CPath filePath;
-	ULONGLONG fileSize;
-	bool bQuiet;
-	bool bShowProgress;
-	bool bSumMode;
-	bool bSumVerificationMode;
-	ByteArray pbExpectedDigest;
-	vector<shared_ptr<Hash>> pHashes;
-
-	_threadParam(const CPath& fp) : filePath(fp), fileSize(0), bQuiet(false), bShowProgress(false), bSumMode(false), bSumVerificationMode(false) {}
-} threadParam;
-
-typedef struct _JOB_ITEM {
-	SLIST_ENTRY ItemEntry;
-	threadParam* pParam;
-} JOB_ITEM, * PJOB_ITEM;
+// ---------------------------------------------
+/*
+ * Binary SUM file format. It is designed to be memory mapped so that verification can start immediately
+ * regardless of the number of entries. All values are little-endian.
+ *
+ *   BINARY_SUM_HEADER
+ *   digests   : entryCount fixed-size digests, in entry order
+ *   metadata  : entryCount BINARY_SUM_METADATA records (only if BINARY_SUM_FLAG_METADATA is set)
+ *   index     : one 64-bit offset in the string table per restart block
+ *   strings   : for each entry, varint shared prefix length, varint suffix length and UTF-16 suffix
+ *
+ * Entries are sorted by path in ordinal UTF-16 order. Every BINARY_SUM_RESTART_INTERVAL entries, the path
+ * is stored in full (shared prefix length is 0) so that a lookup is a binary search over the index followed
+ * by a short linear scan inside a single block.
+ */
 
-typedef struct _OUTPUT_ITEM {
-	SLIST_ENTRY ItemEntry;
-	std::wstring* pParam;
-	std::wstring* pConsoleParam;
-	bool bQuiet;
-	bool bError;
-	bool bSkipOutputFile;
-	size_t nOutputFile;
-} OUTPUT_ITEM, * POUTPUT_ITEM;
+#define BINARY_SUM_MAGIC				"DHSUMBIN"
+#define BINARY_SUM_VERSION				1
+#define BINARY_SUM_RESTART_INTERVAL		16
+#define BINARY_SUM_FLAG_METADATA		0x00000001
 
-PSLIST_HEADER g_jobsList = NULL;
-PSLIST_HEADER g_outputsList = NULL;
+#pragma pack(push, 1)
+typedef struct
+{
+	char magic[8];
+	DWORD version;
+	DWORD digestSize;
+	ULONGLONG entryCount;
+	DWORD restartInterval;
+	DWORD flags;
+	ULONGLONG digestsOffset;
+	ULONGLONG metadataOffset;
+	ULONGLONG indexOffset;
+	ULONGLONG stringsOffset;
+	ULONGLONG stringsSize;
+	ULONGLONG fileSize;
+} BINARY_SUM_HEADER;
 
-void FreejobList()
+typedef struct
 {
-	JOB_ITEM* pJob;
-	
-	while (pJob = (JOB_ITEM*)InterlockedPopEntrySList(g_jobsList))
+	ULONGLONG size;
+	ULONGLONG lastWriteTime;
+	ULONGLONG fileIndex;
+	DWORD volumeSerial;
+	DWORD reserved;
+} BINARY_SUM_METADATA;
+#pragma pack(pop)
+
+// Stored paths always use '\\' as separator and UTF-16 code units so that binary SUM files can be exchanged
+// between platforms. This is the native representation on Windows, elsewhere paths are translated.
+#ifdef _WIN32
+inline const wstring& ToBinarySumPath(const wstring& path) { return path; }
+inline const wstring& FromBinarySumPath(const wstring& path) { return path; }
+#else
+wstring ToBinarySumPath(const wstring& path)
+{
+	wstring ret;
+	ret.reserve(path.length());
+	for (size_t i = 0; i < path.length(); i++)
 	{
-		threadParam* p = pJob->pParam;
-		delete p;
-		_aligned_free(pJob);
+		unsigned int c = (unsigned int)path[i];
+		if (c >= 0x10000)
+		{
+			c -= 0x10000;
+			ret += (wchar_t)(0xD800 + (c >> 10));
+			ret += (wchar_t)(0xDC00 + (c & 0x3FF));
+		}
+		else
+			ret += (c == L'/') ? L'\\' : (wchar_t)c;
 	}
-
-	InterlockedFlushSList(g_jobsList);
-	_aligned_free(g_jobsList);
-
+	return ret;
 }
 
-void FreeOutputList()
+wstring FromBinarySumPath(const wstring& path)
 {
-	OUTPUT_ITEM* pOutput;
-
-	while ((pOutput = (OUTPUT_ITEM*)InterlockedPopEntrySList(g_outputsList)))
+	wstring ret;
+	ret.reserve(path.length());
+	for (size_t i = 0; i < path.length(); i++)
 	{
-		std::wstring* p = pOutput->pParam;
-		delete p;
-		_aligned_free(pOutput);
+		unsigned int c = (unsigned int)path[i];
+		if ((c >= 0xD800) && (c < 0xDC00) && ((i + 1) < path.length()) && ((unsigned int)path[i + 1] >= 0xDC00) && ((unsigned int)path[i + 1] < 0xE000))
+		{
+			ret += (wchar_t)(0x10000 + ((c - 0xD800) << 10) + ((unsigned int)path[i + 1] - 0xDC00));
+			i++;
+		}
+		else
+			ret += (c == L'\\') ? L'/' : (wchar_t)c;
 	}
-
-	InterlockedFlushSList(g_outputsList);
-	_aligned_free(g_outputsList);
-
+	return ret;
 }
+#endif
 
-void AddHashJobEntry(threadParam* pParam)
+class CBinarySumFile
 {
-	JOB_ITEM* pJobItem = (JOB_ITEM*)_aligned_malloc(sizeof(JOB_ITEM), MEMORY_ALLOCATION_ALIGNMENT);
-	if (NULL == pJobItem)
-		return;
-
-	pJobItem->pParam = pParam;
-	InterlockedPushEntrySList(g_jobsList, &(pJobItem->ItemEntry));
-}
+protected:
+	HANDLE m_hFile;
+	HANDLE m_hMapping;
+	const BYTE* m_pbView;
+	const BINARY_SUM_HEADER* m_pHeader;
+	const BYTE* m_pbDigests;
+	const BINARY_SUM_METADATA* m_pMetadata;
+	const ULONGLONG* m_pIndex;
+	const BYTE* m_pbStrings;
+	const BYTE* m_pbStringsEnd;
+	mutable vector<LONG> m_processed; // one bit per entry, set with InterlockedOr by the hashing threads
 
-void AddOutputEntry(std::wstring* pParam, std::wstring* pConsoleParam, bool bQuiet, bool bError, bool bSkipOutputFile, size_t nOutputFile)
-{
-	OUTPUT_ITEM* pOutputItem = (OUTPUT_ITEM*)_aligned_malloc(sizeof(OUTPUT_ITEM), MEMORY_ALLOCATION_ALIGNMENT);
-	if (NULL == pOutputItem)
-		return;
+	// forbid copying
+	CBinarySumFile(const CBinarySumFile&) {}
+	CBinarySumFile& operator = (const CBinarySumFile&) { return *this; }
 
-	pOutputItem->pParam = pParam;
-	pOutputItem->pConsoleParam = pConsoleParam;
-	pOutputItem->bQuiet = bQuiet;
-	pOutputItem->bError = bError;
-	pOutputItem->bSkipOutputFile = bSkipOutputFile;
-	pOutputItem->nOutputFile = nOutputFile;
-	InterlockedPushEntrySList(g_outputsList, &(pOutputItem->ItemEntry));
+	bool ReadVarint(const BYTE*& p, ULONGLONG& value) const
+	{
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			if (p >= m_pbStringsEnd)
+				return false;
+			BYTE b = *p++;
+			value |= ((ULONGLONG)(b & 0x7F)) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
 
-	SetEvent(g_hOutputReadyEvent);
-}
+	// decode the entry at p, using the content of path as the previous entry path
+	bool DecodeEntry(const BYTE*& p, wstring& path) const
+	{
+		ULONGLONG sharedLen, suffixLen;
+		if (!ReadVarint(p, sharedLen) || !ReadVarint(p, suffixLen) || (sharedLen > path.length()) || (suffixLen > (ULONGLONG)(m_pbStringsEnd - p) / 2))
+			return false;
+		path.resize((size_t)sharedLen);
+		for (ULONGLONG i = 0; i < suffixLen; i++, p += 2)
+			path += (WCHAR)(p[0] | (p[1] << 8));
+		return true;
+	}
 
-void AddHashJob(const CPath& filePath, ULONGLONG fileSize, bool bQuiet, bool bShowProgress, bool bSumMode, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, vector<shared_ptr<Hash>>& pHashes)
-{
-	threadParam* p = new threadParam(filePath);
-	p->fileSize = fileSize;
-	p->bQuiet = bQuiet;
-	p->bShowProgress = bShowProgress;
-	p->bSumMode = bSumMode;
-	p->bSumVerificationMode = bSumVerificationMode;
-	if (bSumVerificationMode && pbExpectedDigest)
+	// ordinal comparison between path and the full path stored at the beginning of a restart block
+	bool CompareRestartEntry(ULONGLONG block, const wstring& path, int& result) const
 	{
-		// In verification mode, we always have a single hash
-		p->pbExpectedDigest.resize(pHashes[0]->GetHashSize());
-		memcpy(p->pbExpectedDigest.data(), pbExpectedDigest, pHashes[0]->GetHashSize());
+		const BYTE* p = m_pbStrings + m_pIndex[block];
+		ULONGLONG sharedLen, suffixLen;
+		if ((p >= m_pbStringsEnd) || !ReadVarint(p, sharedLen) || !ReadVarint(p, suffixLen) || sharedLen || (suffixLen > (ULONGLONG)(m_pbStringsEnd - p) / 2))
+			return false;
+		size_t l = (size_t) min((ULONGLONG)path.length(), suffixLen);
+		for (size_t i = 0; i < l; i++, p += 2)
+		{
+			unsigned int u = p[0] | (p[1] << 8);
+			unsigned int c = (unsigned int)path[i];
+			if (c != u)
+			{
+				result = (c < u) ? -1 : 1;
+				return true;
+			}
+		}
+		result = (path.length() == suffixLen) ? 0 : ((path.length() < suffixLen) ? -1 : 1);
+		return true;
 	}
-	p->pHashes = pHashes;
 
-	AddHashJobEntry(p);
+public:
+	CBinarySumFile() : m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL), m_pbView(NULL), m_pHeader(NULL), m_pbDigests(NULL), m_pMetadata(NULL), m_pIndex(NULL), m_pbStrings(NULL), m_pbStringsEnd(NULL)
+	{
 
-	SetEvent(g_hReadyEvent);
-}
+	}
 
-void ProcessFile(HANDLE f, ULONGLONG fileSize, LPCTSTR szFilePath, bool bQuiet, bool bShowProgress, bool bSumMode, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, vector<shared_ptr<Hash>>& pHashes, LPBYTE pbBuffer, size_t cbBuffer)
-{
-	bShowProgress = !bQuiet && bShowProgress && !g_threadsCount; // no progress shown in case of multitheaded computation
-	unsigned long long currentSize = 0;
-	clock_t startTime = bShowProgress ? clock() : 0;
-	clock_t lastBlockTime = 0;
-	LPCTSTR szFileName = bShowProgress ? GetShortFileName(szFilePath, fileSize) : NULL;
-	DWORD cbCount = 0;
+	~CBinarySumFile()
+	{
+		Close();
+	}
 
-	while (ReadFile(f, pbBuffer, (DWORD) cbBuffer, &cbCount, NULL) && cbCount)
+	static bool IsBinarySumFile(const CPath& path)
 	{
-		currentSize += (unsigned long long) cbCount;
-		UpdateHashes(pHashes,pbBuffer, cbCount);
-		if (bShowProgress)
-			DisplayProgress(szFileName, currentSize, fileSize, startTime, lastBlockTime);
-		if (currentSize == fileSize)
-			break;
+		bool bRet = false;
+		FILE* f = _wfopen(path.GetAbsolutPathValue().c_str(), L"rb");
+		if (f)
+		{
+			char magic[8];
+			if ((1 == fread(magic, sizeof(magic), 1, f)) && (0 == memcmp(magic, BINARY_SUM_MAGIC, 8)))
+				bRet = true;
+			fclose(f);
+		}
+		return bRet;
 	}
 
-	CloseHandle(f);
+	bool Open(const CPath& path)
+	{
+		LARGE_INTEGER fileSize;
+		Close();
 
-	if (bShowProgress)
-		ClearProgress();
+		m_hFile = CreateFileW(path.GetAbsolutPathValue().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
 
-	if (bSumMode)
-	{
-		if (bSumVerificationMode)
+		if (!GetFileSizeEx(m_hFile, &fileSize) || (fileSize.QuadPart < (LONGLONG) sizeof(BINARY_SUM_HEADER)))
 		{
-			// in verification mode we only have one hash
-			BYTE pbSumDigest[128];
-			pHashes[0]->Final(pbSumDigest);
-			if (memcmp(pbSumDigest, pbExpectedDigest, pHashes[0]->GetHashSize()))
-			{
-				g_bMismatchFound = true;
+			Close();
+			return false;
+		}
 
-				std::wstring szMsg = FormatString(L"Hash value mismatch for \"%s\"\n", szFilePath);
+		m_hMapping = CreateFileMappingW(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (m_hMapping)
+			m_pbView = (const BYTE*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (!m_pbView)
+		{
+			Close();
+			return false;
+		}
 
-				if (g_threadsCount)
-				{
-					if (!bQuiet || outputFiles[0])
-					{
-						AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, false, false, 0);
-					}
-				}
-				else
-				{
-					if (!bQuiet) ShowWarningDirect(szMsg.c_str());
-					if (outputFiles[0]) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-				}				
-			}
+		// validate the header so that all later accesses stay inside the mapped view
+		const BINARY_SUM_HEADER* h = (const BINARY_SUM_HEADER*)m_pbView;
+		ULONGLONG size = (ULONGLONG)fileSize.QuadPart;
+		ULONGLONG blocks = h->restartInterval ? ((h->entryCount + h->restartInterval - 1) / h->restartInterval) : 0;
+		if (memcmp(h->magic, BINARY_SUM_MAGIC, 8)
+			|| (h->version != BINARY_SUM_VERSION)
+			|| !Hash::IsHashSize((int)h->digestSize)
+			|| (h->restartInterval == 0)
+			|| (h->fileSize != size)
+			|| (h->entryCount > size)
+			|| (h->digestsOffset > size) || ((h->entryCount * h->digestSize) > (size - h->digestsOffset))
+			|| ((h->flags & BINARY_SUM_FLAG_METADATA) && ((h->metadataOffset > size) || ((h->entryCount * sizeof(BINARY_SUM_METADATA)) > (size - h->metadataOffset))))
+			|| (h->indexOffset > size) || (h->indexOffset % sizeof(ULONGLONG)) || ((blocks * sizeof(ULONGLONG)) > (size - h->indexOffset))
+			|| (h->stringsOffset > size) || (h->stringsSize > (size - h->stringsOffset))
+			)
+		{
+			Close();
+			return false;
 		}
-		else
+
+		m_pHeader = h;
+		m_pbDigests = m_pbView + h->digestsOffset;
+		m_pMetadata = (h->flags & BINARY_SUM_FLAG_METADATA) ? (const BINARY_SUM_METADATA*)(m_pbView + h->metadataOffset) : NULL;
+		m_pIndex = (const ULONGLONG*)(m_pbView + h->indexOffset);
+		m_pbStrings = m_pbView + h->stringsOffset;
+		m_pbStringsEnd = m_pbStrings + h->stringsSize;
+		for (ULONGLONG i = 0; i < blocks; i++)
 		{
-			BYTE pbSumDigest[128];
-			WCHAR szDigestHex[129]; // enough for 64 bytes digest
-			bool bMultiHash = pHashes.size() > 1;
-			for (size_t i = 0; i < pHashes.size(); i++)
+			if (m_pIndex[i] >= h->stringsSize)
 			{
-				
-				pHashes[i]->Final(pbSumDigest);
-
-				ToHex(pbSumDigest, pHashes[i]->GetHashSize(), szDigestHex);
-
-				std::wstring szMsg = szDigestHex;
-				szMsg += L"  ";
-				if (g_bSumRelativePath)
-				{
-					// remove the input directory from the path written to the SUM file
-					szMsg += (szFilePath + g_inputDirPathLength);
-				}
-				else
-					szMsg += szFilePath;
-				szMsg += L"\n";
-
-				wstring szConsoleMsg;
-				if (!bQuiet && bMultiHash)
-				{
-					szConsoleMsg = FormatString(L"%s: %s", pHashes[i]->GetID(), szMsg.c_str());
-				}
-				else
-				{
-					szConsoleMsg = szMsg;
-				}
-
-				if (g_threadsCount)
-				{
-					if (!bQuiet || outputFiles[i])
-					{
-						AddOutputEntry(new std::wstring(szMsg), new std::wstring(szConsoleMsg), bQuiet, false, false, i);
-					}
-				}
-				else
-				{
-					if (!bQuiet) ShowWarningDirect(szConsoleMsg.c_str());
-					if (outputFiles[i]) _ftprintf(*outputFiles[i], L"%s", szMsg.c_str());
-				}
+				Close();
+				return false;
 			}
 		}
+		m_processed.assign((size_t)((h->entryCount + 31) / 32), 0);
+		return true;
 	}
-}
 
-DWORD WINAPI OutputThreadCode(LPVOID pArg)
-{
-	HANDLE syncObjs[2] = { g_hOutputReadyEvent, g_hOutputStopEvent };
-
-	SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
-
-	while (!g_bFatalError)
+	void Close()
 	{
-		std::wstring* p = NULL;
-		std::wstring* pConsole = NULL;
-		OUTPUT_ITEM* pOutput;
-		
-		while (!g_bFatalError && (pOutput = (OUTPUT_ITEM*)InterlockedPopEntrySList(g_outputsList)))
+		if (m_pbView)
+			UnmapViewOfFile(m_pbView);
+		if (m_hMapping)
+			CloseHandle(m_hMapping);
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		m_hMapping = NULL;
+		m_pbView = NULL;
+		m_pHeader = NULL;
+		m_pbDigests = NULL;
+		m_pMetadata = NULL;
+		m_pIndex = NULL;
+		m_pbStrings = m_pbStringsEnd = NULL;
+		m_processed.clear();
+	}
+
+	ULONGLONG GetEntryCount() const { return m_pHeader ? m_pHeader->entryCount : 0; }
+	int GetDigestSize() const { return m_pHeader ? (int)m_pHeader->digestSize : 0; }
+	LPCBYTE GetDigest(ULONGLONG index) const { return m_pbDigests + index * m_pHeader->digestSize; }
+	bool IsProcessed(ULONGLONG index) const { return (InterlockedCompareExchange(&m_processed[(size_t)(index / 32)], 0, 0) & (LONG)(1U << (index % 32))) != 0; }
+	void SetProcessed(ULONGLONG index) const { InterlockedOr(&m_processed[(size_t)(index / 32)], (LONG)(1U << (index % 32))); }
+
+	void GetMetadata(ULONGLONG index, FileMetadata& metadata) const
+	{
+		metadata = FileMetadata();
+		if (m_pMetadata)
 		{
-			bool bDeleteConsole = true;
-			p = pOutput->pParam;
-			pConsole = pOutput->pConsoleParam;
-			if (!pConsole)
-			{
-				bDeleteConsole = false;
-				pConsole = p;
-			}
-			if (!pOutput->bQuiet)
-			{
-				if (pOutput->bError)
-					ShowErrorDirect(pConsole->c_str());
-				else
-					ShowWarningDirect(pConsole->c_str());
-			}
-			if (!pOutput->bSkipOutputFile && outputFiles[pOutput->nOutputFile]) {
-				FILE* fTarget = *outputFiles[pOutput->nOutputFile];
-				// write to shadow file if it is enabled
-				FILE* fShadow = outputFiles[pOutput->nOutputFile]->GetShadowFile();
-				if (fShadow) fTarget = fShadow;
-
-				_ftprintf(fTarget, L"%s", p->c_str());
-			}
-			delete p;
-			if (bDeleteConsole) delete pConsole;
-			_aligned_free(pOutput);
+			const BINARY_SUM_METADATA* pm = &m_pMetadata[index];
+			metadata.m_bValid = true;
+			metadata.m_size = pm->size;
+			metadata.m_lastWriteTime = pm->lastWriteTime;
+			metadata.m_fileIndex = pm->fileIndex;
+			metadata.m_volumeSerial = pm->volumeSerial;
 		}
+	}
 
-		if (g_bStopOutputThread || g_bFatalError)
-			break;
-		else
+	bool Find(const wstring& nativePath, ULONGLONG& index) const
+	{
+		const wstring& path = ToBinarySumPath(nativePath);
+		ULONGLONG interval = m_pHeader->restartInterval;
+		ULONGLONG blocks = (m_pHeader->entryCount + interval - 1) / interval;
+		ULONGLONG lo = 0, hi = blocks;
+		int cmp;
+
+		// look for the last block whose first entry is lower or equal to path
+		while (lo < hi)
 		{
-			WaitForMultipleObjects(2, syncObjs, FALSE, INFINITE);
+			ULONGLONG mid = lo + (hi - lo) / 2;
+			if (!CompareRestartEntry(mid, path, cmp))
+				return false;
+			if (cmp >= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-	}
 
-	return 0;
-}
+		if (lo == 0)
+			return false;
 
-DWORD WINAPI ThreadCode(LPVOID pArg)
-{
-	BYTE pbBuffer[4096];
-	HANDLE syncObjs[2] = { g_hReadyEvent, g_hStopEvent };
+		ULONGLONG block = lo - 1;
+		ULONGLONG first = block * interval;
+		ULONGLONG last = min(first + interval, m_pHeader->entryCount);
+		const BYTE* p = m_pbStrings + m_pIndex[block];
+		wstring scanPath;
+		for (ULONGLONG i = first; i < last; i++)
+		{
+			if (!DecodeEntry(p, scanPath))
+				return false;
+			cmp = path.compare(scanPath);
+			if (cmp == 0)
+			{
+				index = i;
+				return true;
+			}
+			else if (cmp < 0)
+				break;
+		}
 
-	SetThreadGroupAffinityFn SetThreadGroupAffinityPtr = (SetThreadGroupAffinityFn)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "SetThreadGroupAffinity");
-	if (SetThreadGroupAffinityPtr && pArg)
-	{
-		GROUP_AFFINITY groupAffinity = { 0 };
-		groupAffinity.Mask = ~0ULL;
-		groupAffinity.Group = *(WORD*)(pArg);
-		SetThreadGroupAffinityPtr(GetCurrentThread(), &groupAffinity, NULL);
+		return false;
 	}
 
-	while (!g_bFatalError)
+	// call fn(index, path) for every entry in file order
+	template <typename Fn> bool Enumerate(Fn fn) const
 	{
-		threadParam* p = NULL;
-
-		JOB_ITEM* pJob = (JOB_ITEM*) InterlockedPopEntrySList(g_jobsList);
-
-		if (pJob)
+		const BYTE* p = m_pbStrings;
+		wstring path;
+		for (ULONGLONG i = 0; i < GetEntryCount(); i++)
 		{
-			p = pJob->pParam;
-			// open the file handle
-			const wstring& szFilePath = p->filePath.GetPathValue();
-			const wstring& szAbsolutePath = p->filePath.GetAbsolutPathValue();
-			HANDLE f = CreateFileW(szAbsolutePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-			if (f == INVALID_HANDLE_VALUE)
-			{
-				std::wstring szMsg = FormatString (_T("Failed to open file \"%s\" for reading (error 0x%.8X)\n"), szFilePath.c_str(), GetLastError());
-				if (outputFiles[0] && (!p->bSumMode || p->bSumVerificationMode)) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-				if (g_bSkipError)
-				{
-					if (!p->bQuiet)
-					{
-						AddOutputEntry(new std::wstring(szMsg), NULL, p->bQuiet, true, true, 0);
-					}
-					
-					if (p->bSumMode) g_bMismatchFound = true;
-				}
-				else
-				{		
-					g_szLastErrorMsg = szMsg;
-				}
-			}
-			else
-			{
-				// ProcessFile will  close the file handle
-				ProcessFile(f, p->fileSize, szFilePath.c_str(), p->bQuiet, p->bShowProgress, p->bSumMode, p->bSumVerificationMode, p->pbExpectedDigest.data(), p->pHashes, pbBuffer, sizeof (pbBuffer));
-			}
-			delete p;
-			_aligned_free(pJob);
-		}
-		else if (g_bStopThreads || g_bFatalError)
-			break;
-		else
-		{			
-			WaitForMultipleObjects(2, syncObjs, FALSE, INFINITE);
+			if ((i % m_pHeader->restartInterval) == 0)
+				path.clear();
+			if (!DecodeEntry(p, path))
+				return false;
+			fn(i, FromBinarySumPath(path));
 		}
+		return true;
 	}
-	SecureZeroMemory(pbBuffer, sizeof(pbBuffer));
-	return 0;
-}
+};
 
-size_t GetCpuCount(WORD* pGroupCount)
+// Entries used for SUM verification. They come either from a text SUM file parsed in memory
+// or from a memory mapped binary SUM file.
+class CSumEntries
 {
-	size_t cpuCount = 0;
-	SYSTEM_INFO sysInfo;
-	GetActiveProcessorGroupCountFn GetActiveProcessorGroupCountPtr = (GetActiveProcessorGroupCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorGroupCount");
-	GetActiveProcessorCountFn GetActiveProcessorCountPtr = (GetActiveProcessorCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorCount");
-	if (GetActiveProcessorGroupCountPtr && GetActiveProcessorCountPtr)
+protected:
+	map<wstring, HashResultEntry> m_entries;
+	shared_ptr<CBinarySumFile> m_pBinaryFile;
+
+	bool FindBinary(const wstring& path, HashResultEntry& entry) const
 	{
-		WORD j, groupCount = GetActiveProcessorGroupCountPtr();
-		size_t totalProcessors = 0;
-		for (j = 0; j < groupCount; ++j)
+		ULONGLONG index;
+		bool bFound = m_pBinaryFile->Find(path, index);
+		if (!bFound && t_pOperation->m_inputDirPathLength && (path.length() > t_pOperation->m_inputDirPathLength) && (0 == _wcsnicmp(path.c_str(), t_pOperation->m_inputDirPath.c_str(), t_pOperation->m_inputDirPathLength)))
 		{
-			totalProcessors += (size_t)GetActiveProcessorCountPtr(j);
+			// entry is stored relative to the input directory
+			bFound = m_pBinaryFile->Find(path.substr(t_pOperation->m_inputDirPathLength), index);
 		}
-		cpuCount = totalProcessors;
-		if (pGroupCount)
-			*pGroupCount = groupCount;
-	}
-	else
-	{
-		GetSystemInfo(&sysInfo);
-		cpuCount = (size_t)sysInfo.dwNumberOfProcessors;
-		if (pGroupCount)
-			*pGroupCount = 1;
+
+		if (bFound)
+		{
+			m_pBinaryFile->SetProcessed(index);
+			entry.m_digest.assign(m_pBinaryFile->GetDigest(index), m_pBinaryFile->GetDigest(index) + m_pBinaryFile->GetDigestSize());
+			m_pBinaryFile->GetMetadata(index, entry.m_metadata);
+			entry.m_processed = true;
+		}
+		return bFound;
 	}
 
-	return cpuCount;
-}
+public:
+	CSumEntries() {}
 
-void StartThreads(bool bOutputThread)
-{
-	size_t cpuCount = 0, i = 0;
-	WORD groupCount = 1;
-	uint32 ThreadCount = 0;
+	map<wstring, HashResultEntry>& GetTextEntries() { return m_entries; }
 
-	cpuCount = GetCpuCount(&groupCount);
+	bool OpenBinary(const CPath& path)
+	{
+		m_entries.clear();
+		m_pBinaryFile.reset(new CBinarySumFile());
+		if (m_pBinaryFile->Open(path) && m_pBinaryFile->GetEntryCount())
+			return true;
+		m_pBinaryFile.reset();
+		return false;
+	}
 
-	if (cpuCount > ARRAYSIZE(g_hThreads))
-		cpuCount = ARRAYSIZE(g_hThreads);
+	bool empty() const { return m_pBinaryFile ? (m_pBinaryFile->GetEntryCount() == 0) : m_entries.empty(); }
 
-	if (cpuCount <= 1)
-		return;
+	int GetDigestSize() const
+	{
+		if (m_pBinaryFile)
+			return m_pBinaryFile->GetDigestSize();
+		else if (!m_entries.empty())
+			return (int)m_entries.begin()->second.m_digest.size();
+		else
+			return 0;
+	}
 
-	g_jobsList = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
-	g_outputsList = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
-	InitializeSListHead(g_jobsList);
-	InitializeSListHead(g_outputsList);
+	// look for the entry of the given path and mark it as processed
+	bool Find(const wstring& path, HashResultEntry& entry) const
+	{
+		if (m_pBinaryFile)
+			return FindBinary(path, entry);
 
-	g_hReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-	g_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	g_hOutputReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-	g_hOutputStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		map<wstring, HashResultEntry>::const_iterator It = m_entries.find(path);
+		if (It == m_entries.end())
+			return false;
+		It->second.m_processed = true;
+		entry = It->second;
+		return true;
+	}
 
-	for (ThreadCount = 0; ThreadCount < (uint32) cpuCount; ++ThreadCount)
+	// keep only the entry corresponding to the given path. Used when the input is a single file
+	bool KeepSingleEntry(const wstring& path)
 	{
-		WORD* pThreadArg = NULL;
-		if (groupCount > 1)
-		{
+		HashResultEntry entry;
+		if (!Find(path, entry))
+			return false;
+		entry.m_processed = false;
+		m_pBinaryFile.reset();
+		m_entries.clear();
+		m_entries[path] = entry;
+		return true;
+	}
 
-			GetActiveProcessorCountFn GetActiveProcessorCountPtr = (GetActiveProcessorCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorCount");
-			// Determine which processor group to bind the thread to.
-			if (GetActiveProcessorCountPtr)
+	void GetUnprocessedEntries(vector<wstring>& list) const
+	{
+		list.clear();
+		if (m_pBinaryFile)
+		{
+			const CBinarySumFile* pFile = m_pBinaryFile.get();
+			pFile->Enumerate([&list, pFile](ULONGLONG index, const wstring& path) {
+				if (!pFile->IsProcessed(index))
+					list.push_back(path);
+			});
+		}
+		else
+		{
+			for (map<wstring, HashResultEntry>::const_iterator It = m_entries.begin(); It != m_entries.end(); It++)
 			{
-				WORD j;
-				uint32 totalProcessors = 0U;
-				for (j = 0U; j < groupCount; j++)
-				{
-					totalProcessors += (uint32)GetActiveProcessorCountPtr(j);
-					if (totalProcessors >= ThreadCount)
-					{
-						ThreadProcessorGroups[ThreadCount] = j;
-						break;
-					}
-				}
+				if (!It->second.m_processed)
+					list.push_back(It->first);
 			}
-			else
-				ThreadProcessorGroups[ThreadCount] = 0;
-
-			pThreadArg = &ThreadProcessorGroups[ThreadCount];
 		}
+	}
+};
 
-		g_hThreads[ThreadCount] = CreateThread(NULL, 0, ThreadCode, (void*)pThreadArg, 0, NULL);
+// ---------------------------------------------
+/*
+ * Persistent cache of per-file digests used by -cache in SUM mode.
+ *
+ * Entries are keyed on the file identity (volume serial number, file index and hash algorithm) and are only
+ * reused when size, last write time and change time are all identical to the recorded ones. The cache file
+ * is a header followed by fixed-size records, each one protected by a checksum: a torn write can only lose
+ * the last records. When the same identity appears several times, the last record wins.
+ *
+ * Access from several DirHash instances is serialized using a lock on a byte beyond the end of the file:
+ * a shared lock while loading and an exclusive one while appending new records or compacting the file.
+ */
+
+#define HASH_CACHE_MAGIC				"DHCACHE1"
+#define HASH_CACHE_LOCK_OFFSET			0x7FFFFFFF
+#define HASH_CACHE_RACY_INTERVAL		20000000ULL // 2 seconds in FILETIME units, which is the coarsest timestamp granularity (FAT)
+
+#pragma pack(push, 1)
+typedef struct
+{
+	char magic[8];
+} HASH_CACHE_HEADER;
+
+typedef struct
+{
+	DWORD volumeSerial;
+	BYTE algorithm;
+	BYTE digestSize;
+	WORD reserved;
+	ULONGLONG fileIndex;
+	ULONGLONG size;
+	ULONGLONG lastWriteTime;
+	ULONGLONG changeTime;
+	BYTE digest[64];
+	DWORD checksum;
+} HASH_CACHE_RECORD;
+#pragma pack(pop)
+
+// Check that the metadata of a file queried before and after reading its content identify the same unmodified file
+// and that it was not modified too recently, so that the digest computed in between can be reused later.
+bool IsStableMetadata(const FileMetadata& metadataBefore, const FileMetadata& metadataAfter)
+{
+	FILETIME now;
+	ULONGLONG ullNow;
+
+	if (!metadataBefore.HasFileId() || !metadataBefore.m_changeTime
+		|| (metadataBefore.m_volumeSerial != metadataAfter.m_volumeSerial)
+		|| (metadataBefore.m_fileIndex != metadataAfter.m_fileIndex)
+		|| (metadataBefore.m_size != metadataAfter.m_size)
+		|| (metadataBefore.m_lastWriteTime != metadataAfter.m_lastWriteTime)
+		|| (metadataBefore.m_changeTime != metadataAfter.m_changeTime)
+		)
+	{
+		return false;
 	}
 
-	g_threadsCount = ThreadCount;
+	// a file modified within the timestamp granularity could be modified again without its timestamps changing
+	GetSystemTimeAsFileTime(&now);
+	ullNow = (((ULONGLONG)now.dwHighDateTime) << 32) | (ULONGLONG)now.dwLowDateTime;
+	if ((ullNow < metadataBefore.m_lastWriteTime + HASH_CACHE_RACY_INTERVAL) || (ullNow < metadataBefore.m_changeTime + HASH_CACHE_RACY_INTERVAL))
+		return false;
 
-	if (bOutputThread)
-		g_hOutputThread = CreateThread(NULL, 0, OutputThreadCode, NULL, 0, NULL);
+	return true;
 }
 
-void StopThreads(bool bError)
+class CHashCache
 {
-	if (g_threadsCount)
+protected:
+	typedef struct _CacheKey
 	{
-		g_bFatalError = bError;
-		g_bStopThreads = true;
-		SetEvent(g_hStopEvent);
-		
-		WaitForMultipleObjects(g_threadsCount, g_hThreads, TRUE, INFINITE);
+		DWORD volumeSerial;
+		ULONGLONG fileIndex;
+		BYTE algorithm;
 
-		for (DWORD i = 0; i < g_threadsCount; i++)
+		bool operator < (const struct _CacheKey& k) const
 		{
-			CloseHandle(g_hThreads[i]);
+			if (volumeSerial != k.volumeSerial)
+				return volumeSerial < k.volumeSerial;
+			if (fileIndex != k.fileIndex)
+				return fileIndex < k.fileIndex;
+			return algorithm < k.algorithm;
 		}
-		CloseHandle(g_hReadyEvent);
-		CloseHandle(g_hStopEvent);
+	} CacheKey;
 
-		g_bStopOutputThread = true;
-		SetEvent(g_hOutputStopEvent);
+	HANDLE m_hFile;
+	CRITICAL_SECTION m_lock;
+	map<CacheKey, HASH_CACHE_RECORD> m_entries;
+	vector<HASH_CACHE_RECORD> m_pendingRecords;
+	ULONGLONG m_fileRecordsCount;
+	volatile LONGLONG m_hits;
+	volatile LONGLONG m_misses;
 
-		WaitForSingleObject(g_hOutputThread, INFINITE);
-		CloseHandle(g_hOutputThread);
+	// forbid copying
+	CHashCache(const CHashCache&) {}
+	CHashCache& operator = (const CHashCache&) { return *this; }
 
-		CloseHandle(g_hOutputReadyEvent);
-		CloseHandle(g_hOutputStopEvent);
+	static DWORD ComputeChecksum(const HASH_CACHE_RECORD& record)
+	{
+		// FNV-1a is enough to detect torn or corrupted records
+		DWORD h = 2166136261U;
+		const BYTE* p = (const BYTE*)&record;
+		for (size_t i = 0; i < offsetof(HASH_CACHE_RECORD, checksum); i++)
+		{
+			h ^= p[i];
+			h *= 16777619U;
+		}
+		return h;
+	}
 
-		FreejobList();
-		FreeOutputList();
+	static int GetAlgorithmId(LPCTSTR szHashId)
+	{
+		std::vector<std::wstring> algos = Hash::GetSupportedHashIds();
+		for (size_t i = 0; i < algos.size(); i++)
+		{
+			if (0 == _wcsicmp(algos[i].c_str(), szHashId))
+				return (int)i;
+		}
+		return -1;
 	}
-}
 
+	static CacheKey GetKey(const HASH_CACHE_RECORD& record)
+	{
+		CacheKey key;
+		key.volumeSerial = record.volumeSerial;
+		key.fileIndex = record.fileIndex;
+		key.algorithm = record.algorithm;
+		return key;
+	}
 
-static CPath g_outputFileName;
-static CPath g_verificationFileName;
+	bool LockFile(bool bExclusive)
+	{
+		OVERLAPPED ov = { 0 };
+		ov.Offset = HASH_CACHE_LOCK_OFFSET;
+		return LockFileEx(m_hFile, bExclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &ov) ? true : false;
+	}
 
-DWORD HashFile(const CPath& filePath, vector<shared_ptr<Hash>>& pHashes, bool bIncludeNames, bool bStripNames, bool bQuiet, bool bShowProgress, bool bSumMode, const map<wstring, HashResultEntry>& digestList)
-{
-	DWORD dwError = 0;
-	HANDLE f;
-	LARGE_INTEGER fileSize;
-	LPCWSTR szFilePath = filePath.GetPathValue().c_str();
-	int pathLen = lstrlen(szFilePath);
-	map<wstring, HashResultEntry>::const_iterator It;
-	bool bSumVerificationMode = false;
-	LPCBYTE pbExpectedDigest = NULL;
-	vector<shared_ptr<Hash>> pClonedHashes;
-	vector<shared_ptr<Hash>>& pHashesToUse = pHashes;
-	wstring fileAbsolutPath = filePath.GetAbsolutPathValue();
+	void UnlockFile()
+	{
+		OVERLAPPED ov = { 0 };
+		ov.Offset = HASH_CACHE_LOCK_OFFSET;
+		UnlockFileEx(m_hFile, 0, 1, 0, &ov);
+	}
 
-	if (IsExcludedName(szFilePath, true))
-		return 0;
+	bool SetFilePosition(ULONGLONG offset)
+	{
+		LARGE_INTEGER li;
+		li.QuadPart = (LONGLONG)offset;
+		return SetFilePointerEx(m_hFile, li, NULL, FILE_BEGIN) ? true : false;
+	}
 
-	if (bSumMode)
+	bool WriteRecords(const HASH_CACHE_RECORD* pRecords, size_t count)
 	{
-		if (!digestList.empty())
+		// write in chunks to stay below the DWORD limit of WriteFile
+		const size_t maxRecords = 65536;
+		while (count)
 		{
-			// check that the current file is specified in the checksum file
-				It = digestList.find(szFilePath);
-			if (It == digestList.end())
-			{
-				std::wstring szMsg = FormatString(_T("Error: file \"%s\" not found in checksum file.\n"), szFilePath);
-				
-				if (outputFiles[0]) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-				if (g_bSkipError)
-				{					
-					if (!bQuiet)
-					{
-						if (g_threadsCount)
-							AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
-						else
-							ShowErrorDirect(szMsg.c_str());
-					}
-					g_bMismatchFound = true;
-					return 0;					
-				}
-				else
-				{		
-					g_szLastErrorMsg = szMsg;
-					return -5;
-				}
-			}
-			else
-			{
-				It->second.m_processed = true;
-				pbExpectedDigest = It->second.m_digest.data();
-				bSumVerificationMode = true;
-			}
+			size_t n = min(count, maxRecords);
+			DWORD cbWritten = 0;
+			if (!WriteFile(m_hFile, pRecords, (DWORD)(n * sizeof(HASH_CACHE_RECORD)), &cbWritten, NULL) || (cbWritten != (DWORD)(n * sizeof(HASH_CACHE_RECORD))))
+				return false;
+			pRecords += n;
+			count -= n;
 		}
-		
-		CloneHashes(pHashes, pClonedHashes);
-		pHashesToUse = pClonedHashes;
+		return true;
 	}
 
-	if (bIncludeNames)
+	// read all valid records of the cache file. Must be called with the file lock held
+	void ReadRecords()
 	{
-		LPCTSTR pNameToHash = NULL;
-		LPWSTR pCanonicalName = NULL;
-		if (pathLen > MAX_PATH)
+		HASH_CACHE_HEADER header;
+		DWORD cbRead = 0;
+
+		m_fileRecordsCount = 0;
+		if (!SetFilePosition(0))
+			return;
+
+		if (!ReadFile(m_hFile, &header, sizeof(header), &cbRead, NULL) || (cbRead != sizeof(header)) || memcmp(header.magic, HASH_CACHE_MAGIC, 8))
+			return;
+
+		ByteArray buffer(sizeof(HASH_CACHE_RECORD) * 4096);
+		while (ReadFile(m_hFile, buffer.data(), (DWORD)buffer.size(), &cbRead, NULL) && cbRead)
 		{
-			if (PathAllocCanonicalizePtr)
-			{
-				if (S_OK == PathAllocCanonicalizePtr(szFilePath, PATHCCH_ALLOW_LONG_PATHS, &pCanonicalName))
-					pNameToHash = pCanonicalName;
-				else
-					pNameToHash = szFilePath;
-			}
-			else
+			size_t count = cbRead / sizeof(HASH_CACHE_RECORD);
+			const HASH_CACHE_RECORD* pRecords = (const HASH_CACHE_RECORD*)buffer.data();
+			for (size_t i = 0; i < count; i++)
 			{
-				pNameToHash = szFilePath;
+				// stop at the first corrupted record: everything after it is unreliable
+				if ((pRecords[i].checksum != ComputeChecksum(pRecords[i])) || !Hash::IsHashSize(pRecords[i].digestSize))
+					return;
+				m_entries[GetKey(pRecords[i])] = pRecords[i];
+				m_fileRecordsCount++;
 			}
-			if (bStripNames)
-				pNameToHash = GetFileName(pNameToHash);
-		}
-		else
-		{
-			g_szCanonalizedName[MAX_PATH] = 0;
-			if (!PathCanonicalize(g_szCanonalizedName, szFilePath))
-				lstrcpy(g_szCanonalizedName, szFilePath);
 
-			if (bStripNames)
-				pNameToHash = GetFileName(g_szCanonalizedName);
-			else
-				pNameToHash = g_szCanonalizedName;
+			if (cbRead % sizeof(HASH_CACHE_RECORD))
+				return; // truncated record at the end of the file
 		}
+	}
+
+	// rewrite the cache file with only the latest record of each file identity. Must be called with the exclusive lock held
+	bool Compact()
+	{
+		vector<HASH_CACHE_RECORD> records;
+		records.reserve(m_entries.size());
+		for (map<CacheKey, HASH_CACHE_RECORD>::const_iterator It = m_entries.begin(); It != m_entries.end(); It++)
+			records.push_back(It->second);
 
-		UpdateHashes(pHashesToUse ,(LPCBYTE)pNameToHash, _tcslen(pNameToHash) * sizeof(TCHAR));
+		if (!SetFilePosition(sizeof(HASH_CACHE_HEADER)) || !WriteRecords(records.data(), records.size()) || !SetEndOfFile(m_hFile))
+			return false;
 
-		if (pCanonicalName)
-			LocalFree(pCanonicalName);
+		m_fileRecordsCount = (ULONGLONG)records.size();
+		return true;
 	}
 
-	f = CreateFileW(fileAbsolutPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
-	if (f != INVALID_HANDLE_VALUE)
+public:
+	CHashCache() : m_hFile(INVALID_HANDLE_VALUE), m_fileRecordsCount(0), m_hits(0), m_misses(0)
 	{
-		if (!GetFileSizeEx(f, &fileSize))
-		{
-			DWORD dwErr = GetLastError();
-			CloseHandle(f);
-			f = INVALID_HANDLE_VALUE;
-			SetLastError(dwErr);
-		}
-		else if (bSumMode && g_threadsCount)
-		{
-			// close handle in case of multithreaded sum computation/verification.
-			// worker threads will open the file again when processing the file
-			CloseHandle(f);
-		}
+		InitializeCriticalSection(&m_lock);
+	}
+
+	~CHashCache()
+	{
+		if (m_hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(m_hFile);
+		DeleteCriticalSection(&m_lock);
 	}
 
-	if (f != INVALID_HANDLE_VALUE)
+	bool Open(const CPath& cachePath)
 	{
-		if (bSumMode && g_threadsCount)
+		m_hFile = CreateFileW(cachePath.GetAbsolutPathValue().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		if (!LockFile(true))
+			return false;
+
+		LARGE_INTEGER fileSize;
+		bool bRet = GetFileSizeEx(m_hFile, &fileSize) ? true : false;
+		if (bRet && (fileSize.QuadPart < (LONGLONG)sizeof(HASH_CACHE_HEADER)))
 		{
-			AddHashJob(filePath, fileSize.QuadPart, bQuiet, bShowProgress, bSumMode, bSumVerificationMode, pbExpectedDigest, pHashesToUse);
+			// new or invalid cache file: (re)initialize it
+			HASH_CACHE_HEADER header;
+			DWORD cbWritten = 0;
+			memcpy(header.magic, HASH_CACHE_MAGIC, 8);
+			bRet = SetFilePosition(0) && WriteFile(m_hFile, &header, sizeof(header), &cbWritten, NULL) && (cbWritten == sizeof(header)) && SetEndOfFile(m_hFile);
 		}
-		else
-			ProcessFile(f, fileSize.QuadPart, szFilePath, bQuiet, bShowProgress, bSumMode, bSumVerificationMode, pbExpectedDigest , pHashesToUse, g_pbBuffer, sizeof (g_pbBuffer));
+
+		if (bRet)
+			ReadRecords();
+
+		UnlockFile();
+		return bRet;
 	}
-	else
+
+	// look for a cached digest of the given file. The metadata must contain the file ID and change time
+	bool Lookup(const FileMetadata& metadata, LPCTSTR szHashId, LPBYTE pbDigest, int cbDigest)
 	{
-		std::wstring szMsg = FormatString (_T("Failed to open file \"%s\" for reading (error 0x%.8X)\n"), szFilePath, GetLastError());
-		if (outputFiles[0] && (!bSumMode || bSumVerificationMode)) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-		if (g_bSkipError)
+		bool bRet = false;
+		int algorithm = GetAlgorithmId(szHashId);
+		if (!metadata.HasFileId() || !metadata.m_changeTime || (algorithm < 0))
+			return false;
+
+		CacheKey key;
+		key.volumeSerial = metadata.m_volumeSerial;
+		key.fileIndex = metadata.m_fileIndex;
+		key.algorithm = (BYTE)algorithm;
+
+		EnterCriticalSection(&m_lock);
+		map<CacheKey, HASH_CACHE_RECORD>::const_iterator It = m_entries.find(key);
+		if ((It != m_entries.end())
+			&& (It->second.digestSize == (BYTE)cbDigest)
+			&& (It->second.size == metadata.m_size)
+			&& (It->second.lastWriteTime == metadata.m_lastWriteTime)
+			&& (It->second.changeTime == metadata.m_changeTime)
+			)
 		{
-			if (!bQuiet)
-			{
-				if (g_threadsCount)
-				{
-					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
-				}
-				else
-					ShowErrorDirect(szMsg.c_str());
-			}
-			
-			if (bSumMode) g_bMismatchFound = true;
-			dwError = 0;
+			memcpy(pbDigest, It->second.digest, cbDigest);
+			bRet = true;
 		}
+		LeaveCriticalSection(&m_lock);
+		return bRet;
+	}
+
+	void AddHit() { InterlockedIncrement64(&m_hits); }
+	void AddMiss() { InterlockedIncrement64(&m_misses); }
+
+	// record the digest of a file. metadataBefore and metadataAfter are the file metadata queried before and
+	// after reading its content: if they differ, the file was modified while being hashed and nothing is stored.
+	void Store(const FileMetadata& metadataBefore, const FileMetadata& metadataAfter, LPCTSTR szHashId, LPCBYTE pbDigest, int cbDigest)
+	{
+		int algorithm = GetAlgorithmId(szHashId);
+
+		if ((algorithm < 0) || (cbDigest > 64) || !IsStableMetadata(metadataBefore, metadataAfter))
+			return;
+
+		HASH_CACHE_RECORD record;
+		memset(&record, 0, sizeof(record));
+		record.volumeSerial = metadataBefore.m_volumeSerial;
+		record.algorithm = (BYTE)algorithm;
+		record.digestSize = (BYTE)cbDigest;
+		record.fileIndex = metadataBefore.m_fileIndex;
+		record.size = metadataBefore.m_size;
+		record.lastWriteTime = metadataBefore.m_lastWriteTime;
+		record.changeTime = metadataBefore.m_changeTime;
+		memcpy(record.digest, pbDigest, cbDigest);
+		record.checksum = ComputeChecksum(record);
+
+		EnterCriticalSection(&m_lock);
+		m_entries[GetKey(record)] = record;
+		m_pendingRecords.push_back(record);
+		LeaveCriticalSection(&m_lock);
+	}
+
+	// append new records to the cache file and compact it if it contains too many superseded records
+	bool Save()
+	{
+		bool bRet = true;
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		if (m_pendingRecords.empty())
+			return true;
+
+		if (!LockFile(true))
+			return false;
+
+		// merge records appended by other instances since we loaded the cache
+		map<CacheKey, HASH_CACHE_RECORD> ownEntries;
+		for (size_t i = 0; i < m_pendingRecords.size(); i++)
+			ownEntries[GetKey(m_pendingRecords[i])] = m_pendingRecords[i];
+		m_entries.clear();
+		ReadRecords();
+		for (map<CacheKey, HASH_CACHE_RECORD>::const_iterator It = ownEntries.begin(); It != ownEntries.end(); It++)
+			m_entries[It->first] = It->second;
+
+		if ((m_fileRecordsCount + m_pendingRecords.size()) > (2 * (ULONGLONG)m_entries.size() + 1024))
+			bRet = Compact();
 		else
-		{		
-			g_szLastErrorMsg = szMsg;
-			dwError = -1;
+		{
+			LARGE_INTEGER li = { 0 };
+			bRet = SetFilePointerEx(m_hFile, li, NULL, FILE_END) && WriteRecords(m_pendingRecords.data(), m_pendingRecords.size());
+			if (bRet)
+				m_fileRecordsCount += (ULONGLONG)m_pendingRecords.size();
 		}
+
+		if (bRet)
+			FlushFileBuffers(m_hFile);
+
+		UnlockFile();
+		m_pendingRecords.clear();
+		return bRet;
 	}
 
-	return dwError;
-}
+	ULONGLONG GetHits() const { return (ULONGLONG)m_hits; }
+	ULONGLONG GetMisses() const { return (ULONGLONG)m_misses; }
+	ULONGLONG GetEntriesCount() const { return (ULONGLONG)m_entries.size(); }
+};
+
+// ---------------------------------------------
+/*
+ * State of the incremental directory digest used by -incremental (Blake3 only, not in SUM mode).
+ *
+ * The classic digest is a single BLAKE3 stream made of the content of all files (and their names when
+ * -hashnames is used). BLAKE3 is a tree of 1 KiB chunks, so the part of a file that covers complete aligned
+ * subtrees of the stream can be replaced by the chaining values of these subtrees. For every file, the state
+ * stores its identity, its offset in the stream and the chaining values of its subtrees. On the next run, an
+ * unchanged file located at the same offset is not read again except for the partial chunks at its edges.
+ * Since chunk positions are part of BLAKE3 input, any change of size or name before a file shifts it in the
+ * stream and it is hashed again.
+ *
+ * The state file is rewritten at the end of each run with the files seen during that run.
+ */
 
-DWORD HashDirectory(const CPath& dirPath, vector<shared_ptr<Hash>>& pHashes, bool bIncludeNames, bool bStripNames, bool bQuiet, bool bShowProgress, bool bSumMode, const map<wstring, HashResultEntry>& digestList)
+#define INCREMENTAL_STATE_MAGIC			"DHINCR01"
+#define INCREMENTAL_BUFFER_CHUNKS		64
+
+#pragma pack(push, 1)
+typedef struct
 {
-	wstring szDir = dirPath.GetAbsolutPathValue();
-	WIN32_FIND_DATA ffd;
-	HANDLE hFind = INVALID_HANDLE_VALUE;
-	DWORD dwError = 0;
-	list<CDirContent> dirContent;
-	LPCWSTR szDirPath = dirPath.GetPathValue().c_str();
-	bool bSumVerificationMode = (bSumMode && !digestList.empty());
+	char magic[8];
+	ULONGLONG entriesCount;
+} INCREMENTAL_STATE_HEADER;
 
-	if (IsExcludedName(szDirPath, false))
-		return 0;
+typedef struct
+{
+	DWORD volumeSerial;
+	DWORD pathLength; // number of WCHAR following this record
+	DWORD subtreesCount; // number of INCREMENTAL_SUBTREE following the path
+	ULONGLONG fileIndex;
+	ULONGLONG size;
+	ULONGLONG lastWriteTime;
+	ULONGLONG changeTime;
+	ULONGLONG streamOffset;
+} INCREMENTAL_FILE_RECORD;
 
+typedef struct
+{
+	ULONGLONG chunkCounter;
+	ULONGLONG chunksCount;
+	BYTE cvPair[2 * BLAKE3_OUT_LEN];
+} INCREMENTAL_SUBTREE;
+#pragma pack(pop)
 
-	szDir += _T("\\*");
+// part of a file in the BLAKE3 stream: an aligned subtree when chunksCount is not 0, raw data otherwise
+typedef struct
+{
+	ULONGLONG fileOffset;
+	ULONGLONG length;
+	ULONGLONG chunkCounter;
+	ULONGLONG chunksCount;
+} INCREMENTAL_SEGMENT;
 
-	// Find the first file in the directory.
+class CIncrementalEntry
+{
+public:
+	FileMetadata m_metadata;
+	ULONGLONG m_streamOffset;
+	vector<INCREMENTAL_SUBTREE> m_subtrees;
 
-	hFind = FindFirstFile(szDir.c_str(), &ffd);
+	CIncrementalEntry() : m_streamOffset(0) {}
+};
 
-	if (INVALID_HANDLE_VALUE == hFind)
+class CIncrementalState
+{
+protected:
+	map<wstring, CIncrementalEntry> m_previousEntries;
+	map<wstring, CIncrementalEntry> m_currentEntries;
+	ULONGLONG m_reusedFiles;
+	ULONGLONG m_hashedFiles;
+	ULONGLONG m_reusedBytes;
+	ByteArray m_buffer;
+
+	// forbid copying
+	CIncrementalState(const CIncrementalState&) {}
+	CIncrementalState& operator = (const CIncrementalState&) { return *this; }
+
+	static bool WriteData(HANDLE hFile, const void* pData, size_t cbData)
 	{
-		dwError = GetLastError();
-		std::wstring szMsg = FormatString (_T("FindFirstFile failed on \"%s\" with error 0x%.8X.\n"), szDirPath, dwError);	
-		if (outputFiles[0] && (!bSumMode || bSumVerificationMode)) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-		if (g_bSkipError)
-		{
-			if (!bQuiet)
-			{
-				if (g_threadsCount)
-					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
-				else
-					ShowErrorDirect(szMsg.c_str());
-			}
-			return 0;
-		}
-		else
-		{
-			g_szLastErrorMsg = szMsg;
-			return dwError;
-		}
+		DWORD cbWritten = 0;
+		return WriteFile(hFile, pData, (DWORD)cbData, &cbWritten, NULL) && (cbWritten == (DWORD)cbData);
 	}
 
-	// List all the files in the directory with some info about them.
+public:
+	CIncrementalState() : m_reusedFiles(0), m_hashedFiles(0), m_reusedBytes(0), m_buffer(INCREMENTAL_BUFFER_CHUNKS * BLAKE3_CHUNK_LEN) {}
 
-	do
+	// load the state of the previous run. A missing state file is not an error
+	bool Load(const CPath& statePath)
 	{
-		if ((ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		HANDLE hFile = CreateFileW(statePath.GetAbsolutPathValue().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return (GetLastError() == ERROR_FILE_NOT_FOUND);
+
+		LARGE_INTEGER fileSize;
+		ByteArray content;
+		bool bRet = GetFileSizeEx(hFile, &fileSize) && (fileSize.QuadPart >= (LONGLONG)sizeof(INCREMENTAL_STATE_HEADER)) && (fileSize.QuadPart < 0x80000000LL);
+		if (bRet)
 		{
-			// Skip "." and ".." directories
-			if ((_tcscmp(ffd.cFileName, _T(".")) != 0) && (_tcscmp(ffd.cFileName, _T("..")) != 0))
-			{
-				CDirContent entry(dirPath, ffd.cFileName, true);
-				if (!g_bNoFollow || !IsReparsePoint(entry.GetPath().GetAbsolutPathValue().c_str()))
-					dirContent.push_back(entry);
-			}
+			DWORD cbRead = 0;
+			content.resize((size_t)fileSize.QuadPart);
+			bRet = ReadFile(hFile, content.data(), (DWORD)content.size(), &cbRead, NULL) && (cbRead == (DWORD)content.size());
 		}
-		else
+		CloseHandle(hFile);
+
+		if (!bRet)
+			return false;
+
+		const INCREMENTAL_STATE_HEADER* pHeader = (const INCREMENTAL_STATE_HEADER*)content.data();
+		if (memcmp(pHeader->magic, INCREMENTAL_STATE_MAGIC, 8))
+			return false;
+
+		size_t pos = sizeof(INCREMENTAL_STATE_HEADER);
+		for (ULONGLONG i = 0; i < pHeader->entriesCount; i++)
 		{
-			CDirContent entry(dirPath, ffd.cFileName, false);
-			if (!g_bNoFollow || !IsReparsePoint(entry.GetPath().GetAbsolutPathValue().c_str()))
-			{
-				// skip file holding checksum
-				if (bSumMode && !g_sumFileSkipped)
-				{
-					if (!digestList.empty())
-					{
-						// verification
-						if (0 == _wcsicmp(g_verificationFileName.GetAbsolutPathValue().c_str(), entry.GetPath().GetAbsolutPathValue().c_str()))
-						{
-							g_sumFileSkipped = true;
-							continue;
-						}
-					}
-					else
-					{
-						if (g_outputFileName.GetAbsolutPathValue().empty())
-							g_sumFileSkipped = true;
-						else if (0 == _wcsicmp(g_outputFileName.GetAbsolutPathValue().c_str(), entry.GetPath().GetAbsolutPathValue().c_str()))
-						{
-							g_sumFileSkipped = true;
-							continue;
-						}
-					}
-				}
-				dirContent.push_back(entry);
-			}
+			INCREMENTAL_FILE_RECORD record;
+			if ((content.size() - pos) < sizeof(record))
+				break;
+			memcpy(&record, &content[pos], sizeof(record));
+			pos += sizeof(record);
+
+			ULONGLONG cbRemaining = (ULONGLONG)record.pathLength * sizeof(WCHAR) + (ULONGLONG)record.subtreesCount * sizeof(INCREMENTAL_SUBTREE);
+			if ((ULONGLONG)(content.size() - pos) < cbRemaining)
+				break;
+
+			wstring szPath((LPCWSTR)&content[pos], (size_t)record.pathLength);
+			pos += (size_t)record.pathLength * sizeof(WCHAR);
+
+			CIncrementalEntry& entry = m_previousEntries[szPath];
+			FILETIME lastWriteTime;
+			lastWriteTime.dwLowDateTime = (DWORD)record.lastWriteTime;
+			lastWriteTime.dwHighDateTime = (DWORD)(record.lastWriteTime >> 32);
+			entry.m_metadata.Set(record.size, lastWriteTime, record.volumeSerial, record.fileIndex);
+			entry.m_metadata.m_changeTime = record.changeTime;
+			entry.m_streamOffset = record.streamOffset;
+			entry.m_subtrees.resize(record.subtreesCount);
+			if (record.subtreesCount)
+				memcpy(entry.m_subtrees.data(), &content[pos], (size_t)record.subtreesCount * sizeof(INCREMENTAL_SUBTREE));
+			pos += (size_t)record.subtreesCount * sizeof(INCREMENTAL_SUBTREE);
 		}
+
+		return true;
 	}
-	while (FindNextFile(hFind, &ffd) != 0);
 
-	dwError = GetLastError();
-	if (dwError != ERROR_NO_MORE_FILES)
+	// replace the state file with the entries of the current run
+	bool Save(const CPath& statePath)
 	{
-		std::wstring szMsg = FormatString (TEXT("FindNextFile failed while listing \"%s\". \n Error 0x%.8X.\n"), szDirPath, dwError);
-		FindClose(hFind);
-		
-		if (outputFiles[0] && (!bSumMode || bSumVerificationMode)) _ftprintf(*outputFiles[0], L"%s", szMsg.c_str());
-		if (g_bSkipError)
+		wstring szStatePath = statePath.GetAbsolutPathValue();
+		wstring szTempPath = szStatePath + L".tmp";
+		HANDLE hFile = CreateFileW(szTempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		INCREMENTAL_STATE_HEADER header;
+		memcpy(header.magic, INCREMENTAL_STATE_MAGIC, 8);
+		header.entriesCount = (ULONGLONG)m_currentEntries.size();
+		bool bRet = WriteData(hFile, &header, sizeof(header));
+
+		for (map<wstring, CIncrementalEntry>::const_iterator It = m_currentEntries.begin(); bRet && (It != m_currentEntries.end()); It++)
 		{
-			if (!bQuiet)
-			{
-				if (g_threadsCount)
-					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
-				else
-					ShowErrorDirect(szMsg.c_str());
-			}
-			return 0;
-		}
-		else
-		{			
-			g_szLastErrorMsg = szMsg;
-			return dwError;
+			INCREMENTAL_FILE_RECORD record;
+			record.volumeSerial = It->second.m_metadata.m_volumeSerial;
+			record.pathLength = (DWORD)It->first.length();
+			record.subtreesCount = (DWORD)It->second.m_subtrees.size();
+			record.fileIndex = It->second.m_metadata.m_fileIndex;
+			record.size = It->second.m_metadata.m_size;
+			record.lastWriteTime = It->second.m_metadata.m_lastWriteTime;
+			record.changeTime = It->second.m_metadata.m_changeTime;
+			record.streamOffset = It->second.m_streamOffset;
+
+			bRet = WriteData(hFile, &record, sizeof(record))
+				&& WriteData(hFile, It->first.c_str(), It->first.length() * sizeof(WCHAR))
+				&& (It->second.m_subtrees.empty() || WriteData(hFile, It->second.m_subtrees.data(), It->second.m_subtrees.size() * sizeof(INCREMENTAL_SUBTREE)));
 		}
-	}
 
-	// Clear the error
-	dwError = 0;
+		if (bRet)
+			bRet = FlushFileBuffers(hFile) ? true : false;
+		CloseHandle(hFile);
 
-	FindClose(hFind);
+		if (bRet)
+			bRet = MoveFileExW(szTempPath.c_str(), szStatePath.c_str(), MOVEFILE_REPLACE_EXISTING) ? true : false;
 
-	// Sort all entries
-	dirContent.sort(compare_nocase);
+		if (!bRet)
+			DeleteFileW(szTempPath.c_str());
+		return bRet;
+	}
 
-	if (bIncludeNames)
+	// return the entry of the previous run if the file is unchanged and located at the same offset of the stream
+	const CIncrementalEntry* Find(const wstring& szPath, const FileMetadata& metadata, ULONGLONG streamOffset) const
 	{
-		LPCTSTR pNameToHash = NULL;
-		LPWSTR pCanonicalName = NULL;
-		if (wcslen(szDirPath) > MAX_PATH)
+		map<wstring, CIncrementalEntry>::const_iterator It = m_previousEntries.find(szPath);
+		if ((It == m_previousEntries.end())
+			|| !metadata.HasFileId() || !metadata.m_changeTime
+			|| (It->second.m_streamOffset != streamOffset)
+			|| (It->second.m_metadata.m_volumeSerial != metadata.m_volumeSerial)
+			|| (It->second.m_metadata.m_fileIndex != metadata.m_fileIndex)
+			|| (It->second.m_metadata.m_size != metadata.m_size)
+			|| (It->second.m_metadata.m_lastWriteTime != metadata.m_lastWriteTime)
+			|| (It->second.m_metadata.m_changeTime != metadata.m_changeTime)
+			)
 		{
-			if (PathAllocCanonicalizePtr)
-			{
-				if (S_OK == PathAllocCanonicalizePtr(szDirPath, PATHCCH_ALLOW_LONG_PATHS, &pCanonicalName))
-					pNameToHash = pCanonicalName;
-				else
-					pNameToHash = szDirPath;
-			}
-			else
-			{
-				pNameToHash = szDirPath;
-			}
-			if (bStripNames)
-				pNameToHash = GetFileName(pNameToHash);
+			return NULL;
 		}
-		else
-		{
-			g_szCanonalizedName[MAX_PATH] = 0;
-			if (!PathCanonicalize(g_szCanonalizedName, szDirPath))
-				lstrcpy(g_szCanonalizedName, szDirPath);
+		return &It->second;
+	}
 
-			if (bStripNames)
-				pNameToHash = GetFileName(g_szCanonalizedName);
-			else
-				pNameToHash = g_szCanonalizedName;
-		}
+	void Add(const wstring& szPath, const CIncrementalEntry& entry) { m_currentEntries[szPath] = entry; }
 
-		UpdateHashes(pHashes,(LPCBYTE)pNameToHash, _tcslen(pNameToHash) * sizeof(TCHAR));
-		if (pCanonicalName)
-			LocalFree(pCanonicalName);
-	}
+	void AddReusedFile(ULONGLONG reusedBytes) { m_reusedFiles++; m_reusedBytes += reusedBytes; }
+	void AddHashedFile() { m_hashedFiles++; }
 
-	for (list<CDirContent>::iterator it = dirContent.begin(); it != dirContent.end(); it++)
-	{
-		if (it->IsDir())
-		{
-			dwError = HashDirectory(it->GetPath(), pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, digestList);
-			if (dwError)
-				break;
-		}
-		else
+	LPBYTE GetBuffer() { return m_buffer.data(); }
+	size_t GetBufferSize() const { return m_buffer.size(); }
+
+	ULONGLONG GetReusedFiles() const { return m_reusedFiles; }
+	ULONGLONG GetHashedFiles() const { return m_hashedFiles; }
+	ULONGLONG GetReusedBytes() const { return m_reusedBytes; }
+};
+
+static CIncrementalState* g_pIncrementalState = NULL;
+
+// ---------------------------------------------
+/*
+ * Storage of the entries of the directories walked by HashDirectory.
+ *
+ * The entries of a directory are allocated with their names from an arena owned by the directory and released
+ * at once when the directory is done, instead of a list node holding the full relative and absolute paths for
+ * each entry. The path of an entry is only built when it is processed, from the path of its directory.
+ * Entries are sorted in the order of _wcsicmp, which only folds ASCII letters. Each entry has a sort key holding
+ * its folded name so that comparisons are plain ordinal ones. On POSIX, wchar_t holds UTF-32 characters: like
+ * the _wcsicmp of the platform layer, the key moves U+E000-U+FFFF after the supplementary characters so that the
+ * order is the UTF-16 one of Windows.
+ */
+
+#define ARENA_BLOCK_MIN_SIZE	4096
+#define ARENA_BLOCK_MAX_SIZE	(1024 * 1024)
+
+// bump allocator: memory is only released when the arena is destroyed
+class CArena
+{
+protected:
+	vector<LPBYTE> m_blocks;
+	size_t m_nextBlockSize;
+	size_t m_blockSize;
+	size_t m_blockUsed;
+
+	// forbid copying
+	CArena(const CArena&);
+	CArena& operator = (const CArena&);
+public:
+	CArena() : m_nextBlockSize(ARENA_BLOCK_MIN_SIZE), m_blockSize(0), m_blockUsed(0) {}
+
+	~CArena()
+	{
+		for (size_t i = 0; i < m_blocks.size(); i++)
+			delete[] m_blocks[i];
+	}
+
+	// allocations are aligned on 8 bytes
+	void* Alloc(size_t cbSize)
+	{
+		cbSize = (cbSize + 7) & ~((size_t)7);
+		if (m_blockUsed + cbSize > m_blockSize)
 		{
-			dwError = HashFile(it->GetPath(), pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, digestList);
-			if (dwError)
-				break;
+			m_blockSize = max(m_nextBlockSize, cbSize);
+			m_blocks.push_back(new BYTE[m_blockSize]);
+			m_blockUsed = 0;
+			if (m_nextBlockSize < ARENA_BLOCK_MAX_SIZE)
+				m_nextBlockSize *= 2;
 		}
+		void* p = m_blocks.back() + m_blockUsed;
+		m_blockUsed += cbSize;
+		return p;
 	}
+};
 
-	return dwError;
+typedef struct _DIR_ENTRY
+{
+	LPCWSTR szName;
+	LPCWSTR szSortKey;
+	size_t nameLength;
+	bool bIsDir;
+	DWORD dwAttributes;
+	DWORD dwReparseTag; // only with FILE_ATTRIBUTE_REPARSE_POINT
+	FileMetadata metadata; // only for files
+} DIR_ENTRY;
+
+inline WCHAR GetSortChar(WCHAR c)
+{
+	if ((c >= L'A') && (c <= L'Z'))
+		return (WCHAR)(c + (L'a' - L'A'));
+#ifndef _WIN32
+	if ((c >= 0xE000) && (c <= 0xFFFF))
+		return (WCHAR)(c + 0x200000);
+#endif
+	return c;
 }
 
-void ShowLogo()
+DIR_ENTRY* NewDirEntry(CArena& arena, const WIN32_FIND_DATA& ffd, bool bIsDir)
 {
-	if (g_bNoLogo)
-		return;
+	size_t nameLength = wcslen(ffd.cFileName);
+	DIR_ENTRY* pEntry = new (arena.Alloc(sizeof(DIR_ENTRY))) DIR_ENTRY;
+	WCHAR* szName = (WCHAR*)arena.Alloc((2 * nameLength + 1) * sizeof(WCHAR));
+	WCHAR* szSortKey = szName + nameLength + 1;
+
+	wmemcpy(szName, ffd.cFileName, nameLength + 1);
+	for (size_t i = 0; i < nameLength; i++)
+		szSortKey[i] = GetSortChar(szName[i]);
+
+	pEntry->szName = szName;
+	pEntry->szSortKey = szSortKey;
+	pEntry->nameLength = nameLength;
+	pEntry->bIsDir = bIsDir;
+	pEntry->dwAttributes = ffd.dwFileAttributes;
+	pEntry->dwReparseTag = (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ? ffd.dwReserved0 : 0;
+	if (!bIsDir)
+		pEntry->metadata.Set(ffd);
+	return pEntry;
+}
 
-	SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
-	_tprintf(_T("\nDirHash ") _T(DIRHASH_VERSION) _T(" by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2024\n\n"));
-	_tprintf(_T("Recursively compute hash of a given directory content in lexicographical order.\nIt can also compute the hash of a single file.\n\n"));
-	_tprintf(_T("Supported Algorithms :\n"));
-	std::vector<std::wstring> algos = Hash::GetSupportedHashIds();
-	for (size_t i = 0; i < algos.size(); i++)
-		_tprintf(_T(" %s"), algos[i].c_str());
-	_tprintf(_T("\n\n"));
-	SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+// Used for sorting directory content
+bool CompareDirEntries(const DIR_ENTRY* pFirst, const DIR_ENTRY* pSecond)
+{
+	int ret = wmemcmp(pFirst->szSortKey, pSecond->szSortKey, min(pFirst->nameLength, pSecond->nameLength));
+	return ret ? (ret < 0) : (pFirst->nameLength < pSecond->nameLength);
 }
 
+// ---------------------------------------------
+/*
+ * Matcher of the -exclude and -only patterns.
+ *
+ * The patterns are compiled once instead of calling PathMatchSpec for each of them on every path. A pattern is a
+ * list of wildcard specs separated by ';' that are matched case-insensitively against the whole path, '*' and '?'
+ * matching any characters including path separators, as done by PathMatchSpec. "*.ext" specs (a '*' followed by a
+ * literal suffix) are looked up in hash tables of folded suffixes indexed by their length and specs without
+ * wildcard in a hash table of folded names. The other specs are compiled into a single automaton whose states are
+ * the positions in the specs: it is simulated on the path once for all of them. The same code is used on all
+ * platforms so that the patterns have identical semantics on Windows and Linux.
+ *
+ * An -exclude pattern ending with a path separator only applies to directories: their subtree is not enumerated.
+ */
+
+#define GLOB_STATE_CHAR		0
+#define GLOB_STATE_ANY		1	// '?'
+#define GLOB_STATE_STAR		2	// '*'
+#define GLOB_STATE_ACCEPT	3	// end of a spec
 
-void ShowUsage()
+typedef struct _GLOB_STATE
 {
-	ShowLogo();
-	_tprintf(TEXT("Usage: \n")
-		TEXT("  DirHash.exe DirectoryOrFilePath [HashAlgo] [-t ResultFileName] [-mscrypto] [-sum] [-sumRelativePath] [-includeLastDir] [-verify FileName] [-threads] [-clip] [-lowercase] [-overwrite]  [-quiet] [-nowait] [-hashnames] [-stripnames] [-skipError] [-nologo] [-nofollow] [-exclude pattern1] [-exclude pattern2]  [-only pattern1] [-only pattern2]\n")
-		TEXT("  DirHash.exe -benchmark [HashAlgo | All] [-t ResultFileName] [-mscrypto] [-clip] [-overwrite]  [-quiet] [-nowait] [-nologo]\n")
-		TEXT("\n")
-		TEXT("  Possible values for HashAlgo (not case sensitive, default is Blake3):\n"));
-	   _tprintf(_T(" "));
-		std::vector<std::wstring> algos = Hash::GetSupportedHashIds();
-		for (size_t i = 0; i < algos.size(); i++)
-			_tprintf(_T(" %s"), algos[i].c_str());
-		_tprintf(_T("\n")
-		TEXT("Or any combinarion of the above values separated by comma, except when -verify is used\n")
-		TEXT("\n\n")
-		TEXT("  ResultFileName: text file where the result will be appended\n")
-		TEXT("  -benchmark: perform speed benchmark of the selected algorithm. If \"All\" is specified, then all algorithms are benchmarked.\n")
-		TEXT("  -mscrypto: use Windows native implementation of hash algorithms (Always enabled on ARM).\n")
-		TEXT("  -sum: output hash of every file processed in a format similar to shasum.\n")
-		TEXT("  -sumRelativePath (only when -sum is specified): the file paths are stored in the output file as relative to the input directory.\n")
-		TEXT("  -verify: verify hash against value(s) present on the specified file.\n")
-		TEXT("           argument must be either a checksum file or a result file.\n")
-		TEXT("  -includeLastDir (only when -sum or -verify is specified): the last directory name of the input directory is included in the SUM file entries and used in the verification process. This switch implies -sumRelativePath.\n")
-		TEXT("  -threads (only when -sum or -verify specified): multithreading will be used to accelerate hashing of files.\n")
-		TEXT("  -clip: copy the result to Windows clipboard (ignored when -sum specified)\n")
-		TEXT("  -lowercase: output hash value(s) in lower case instead of upper case\n")
-		TEXT("  -progress: Display information about the progress of hash operation\n")
-		TEXT("  -overwrite (only when -t present): output text file will be overwritten\n")
-		TEXT("  -quiet: No text is displayed or written except the hash value\n")
-		TEXT("  -nowait: avoid displaying the waiting prompt before exiting\n")
-		TEXT("  -hashnames: case sensitive path of the files/directories will be included in the hash computation\n")
-		TEXT("  -stripnames (only when -hashnames present): only last path portion of files/directories is used for hash computation\n")
-		TEXT("  -exclude (cannot be combined with -only): specifies a name pattern for files to exclude from hash computation.\n")
-		TEXT("  -only (cannot be combined with -exclude): only files matching the pattern are included in hash computation.\n")
-		TEXT("  -skipError: ignore any encountered errors and continue processing.\n")
-		TEXT("  -nologo: don't display the copyright message and version number on startup.\n")
-		TEXT("  -nofollow: don't follow symbolic links, Junction points and mount points, excluding them from hash computation.\n")
-	);
-	_tprintf(_T("\n"));
+	BYTE kind;
+	WCHAR c; // folded character for GLOB_STATE_CHAR
+} GLOB_STATE;
+
+// scratch buffers of CNameMatcher::Match, shared by all the matchers of the thread
+static thread_local wstring t_matcherName;
+static thread_local wstring t_matcherKey;
+static thread_local vector<size_t> t_globStates;
+static thread_local vector<size_t> t_globNextStates;
+static thread_local vector<DWORD> t_globStamps;
+static thread_local DWORD t_globGeneration = 0;
+
+inline WCHAR FoldSpecChar(WCHAR c)
+{
+	return (WCHAR)towlower(c);
 }
 
-void WaitForExit(bool bDontWait = false)
+class CNameMatcher
 {
-	if (!bDontWait)
+protected:
+	bool m_bEmpty;
+	bool m_bMatchAll;
+	map<size_t, unordered_set<wstring>> m_suffixes; // "*literal" specs by length of the literal
+	unordered_set<wstring> m_names; // specs without wildcard
+	vector<GLOB_STATE> m_states;
+	vector<size_t> m_starts; // first state of each spec of the automaton
+	vector<wstring> m_tails; // characters after the last '*' of each spec of the automaton: the name must end with them
+
+	static bool MatchTail(const wstring& name, const wstring& tail)
 	{
-		_tprintf(_T("\n\nPress ENTER to exit the program ..."));
-		getchar();
+		if (tail.length() > name.length())
+			return false;
+		const WCHAR* c = name.c_str() + (name.length() - tail.length());
+		for (size_t i = 0; i < tail.length(); i++)
+		{
+			if ((tail[i] != L'?') && (tail[i] != c[i]))
+				return false;
+		}
+		return true;
 	}
-}
 
-void CopyToClipboard(LPCTSTR szDigestHex)
-{
-	if (OpenClipboard(NULL))
+	// add a state to the set of the next step, with the states reachable when a '*' matches no character
+	static void AddState(const vector<GLOB_STATE>& states, size_t state, vector<size_t>& stateSet)
 	{
-		size_t cch = _tcslen(szDigestHex);
+		for (;;)
+		{
+			if (t_globStamps[state] == t_globGeneration)
+				return;
+			t_globStamps[state] = t_globGeneration;
+			stateSet.push_back(state);
+			if (states[state].kind != GLOB_STATE_STAR)
+				return;
+			state++;
+		}
+	}
 
-		HGLOBAL hglbCopy = GlobalAlloc(GMEM_MOVEABLE,
-			(cch + 1) * sizeof(TCHAR));
-		if (hglbCopy)
+	bool MatchAutomaton(const wstring& name) const
+	{
+		vector<size_t>& current = t_globStates;
+		vector<size_t>& next = t_globNextStates;
+		if (t_globStamps.size() < m_states.size())
+			t_globStamps.resize(m_states.size(), 0);
+
+		current.clear();
+		t_globGeneration++;
+		for (size_t i = 0; i < m_starts.size(); i++)
 		{
-			EmptyClipboard();
+			if (MatchTail(name, m_tails[i]))
+				AddState(m_states, m_starts[i], current);
+		}
 
-			// Lock the handle and copy the text to the buffer. 
-			LPVOID lptstrCopy = GlobalLock(hglbCopy);
-			if (lptstrCopy)
+		for (size_t pos = 0; (pos < name.length()) && !current.empty(); pos++)
+		{
+			WCHAR c = name[pos];
+			next.clear();
+			t_globGeneration++;
+			for (size_t i = 0; i < current.size(); i++)
 			{
-				memcpy(lptstrCopy, (const TCHAR*)szDigestHex,
-					(cch * sizeof(TCHAR)) + 1);
-				GlobalUnlock(hglbCopy);
-
-				// Place the handle on the clipboard. 
-#ifdef _UNICODE
-				SetClipboardData(CF_UNICODETEXT, hglbCopy);
-#else
-				SetClipboardData(CF_TEXT, hglbCopy);
-#endif
+				size_t state = current[i];
+				const GLOB_STATE& s = m_states[state];
+				if (s.kind == GLOB_STATE_STAR)
+					AddState(m_states, state, next);
+				else if ((s.kind == GLOB_STATE_ANY) || ((s.kind == GLOB_STATE_CHAR) && (s.c == c)))
+					AddState(m_states, state + 1, next);
 			}
+			current.swap(next);
 		}
 
-		CloseClipboard();
+		for (size_t i = 0; i < current.size(); i++)
+		{
+			if (m_states[current[i]].kind == GLOB_STATE_ACCEPT)
+				return true;
+		}
+		return false;
 	}
-}
-
-void BenchmarkAlgo(LPCTSTR hashAlgo, bool bQuiet, bool bCopyToClipboard, std::wstring* outputText)
-{
-#define BENCH_BUFFER_SIZE 50 * 1024 * 1024
-#define BENCH_LOOPS 50
-	unsigned char* pbData = new unsigned char[BENCH_BUFFER_SIZE];
-	unsigned char pbDigest[64];
 
-	if (pbData)
+	void AddSpec(const wstring& spec)
 	{
-		size_t i;
-		clock_t t1, t2;
-		Hash* pHash = Hash::GetHash(hashAlgo);
-
-		t1 = clock();
-		for (i = 0; i < BENCH_LOOPS; i++)
+		size_t wildcards = 0;
+		for (size_t i = 0; i < spec.length(); i++)
 		{
-			pHash->Update(pbData, BENCH_BUFFER_SIZE);
-			pHash->Final(pbDigest);
-			pHash->Init();
+			if ((spec[i] == L'*') || (spec[i] == L'?'))
+				wildcards++;
 		}
-		t2 = clock();
 
-		double speed = ((double)BENCH_BUFFER_SIZE * (double)BENCH_LOOPS) / (((double)t2 - (double)t1) / (double)CLOCKS_PER_SEC);
-		if (speed >= (double)(1024 * 1024 * 1024))
-			StringCbPrintf((TCHAR*)pbData, BENCH_BUFFER_SIZE, _T("%s speed = %f GiB/s"), hashAlgo, (speed / (double)(1024 * 1024 * 1024)));
-		else if (speed >= (double)(1024 * 1024))
-			StringCbPrintf((TCHAR*)pbData, BENCH_BUFFER_SIZE, _T("%s speed = %f MiB/s"), hashAlgo, (speed / (double)(1024 * 1024)));
-		else if (speed >= (double)(1024))
-			StringCbPrintf((TCHAR*)pbData, BENCH_BUFFER_SIZE, _T("%s speed = %f KiB/s"), hashAlgo, (speed / (double)(1024)));
+		m_bEmpty = false;
+		// "*.*" matches every name, including names without extension
+		if ((spec == L"*") || (spec == L"*.*"))
+			m_bMatchAll = true;
+		else if (!wildcards)
+			m_names.insert(spec);
+		else if ((wildcards == 1) && (spec[0] == L'*'))
+			m_suffixes[spec.length() - 1].insert(spec.substr(1));
 		else
-			StringCbPrintf((TCHAR*)pbData, BENCH_BUFFER_SIZE, _T("%s speed = %f B/s"), hashAlgo, speed);
-
-		// display hash in yellow
-		SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
-
-		if (!bQuiet) _tprintf(_T("%s\n"), (TCHAR*)pbData);
-		if (outputFiles[0]) _ftprintf(*outputFiles[0], _T("%s\n"), (TCHAR*)pbData);
-
-		if (bCopyToClipboard)
-			CopyToClipboard((TCHAR*)pbData);
-
-		if (outputText)
 		{
-			*outputText += (TCHAR*)pbData;
-			*outputText += _T("\n");
+			m_starts.push_back(m_states.size());
+			m_tails.push_back(spec.substr(spec.find_last_of(L'*') + 1));
+			for (size_t i = 0; i < spec.length(); i++)
+			{
+				GLOB_STATE state;
+				state.kind = (spec[i] == L'*') ? GLOB_STATE_STAR : ((spec[i] == L'?') ? GLOB_STATE_ANY : GLOB_STATE_CHAR);
+				state.c = spec[i];
+				// consecutive '*' are equivalent to a single one
+				if ((state.kind == GLOB_STATE_STAR) && !m_states.empty() && (m_states.size() > m_starts.back()) && (m_states.back().kind == GLOB_STATE_STAR))
+					continue;
+				m_states.push_back(state);
+			}
+			GLOB_STATE accept = { GLOB_STATE_ACCEPT, 0 };
+			m_states.push_back(accept);
 		}
+	}
+
+public:
+	CNameMatcher() : m_bEmpty(true), m_bMatchAll(false) {}
 
-		// restore normal text color
-		SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+	bool IsEmpty() const { return m_bEmpty; }
 
-		delete pHash;
-		delete[] pbData;
-	}
-	else
+	void Clear()
 	{
-		if (!bQuiet) ShowError(_T("Failed to allocate memory for %s benchmark.\n"), hashAlgo);
-		if (outputFiles[0]) _ftprintf(*outputFiles[0], _T("%s\n"), (TCHAR*)pbData);
+		m_bEmpty = true;
+		m_bMatchAll = false;
+		m_suffixes.clear();
+		m_names.clear();
+		m_states.clear();
+		m_starts.clear();
+		m_tails.clear();
 	}
-}
 
-void PerformBenchmark(const vector<shared_ptr<Hash>>& pHashes, bool bQuiet, bool bCopyToClipboard)
-{
-	std::wstring outputText = L"";
-	std::wstring* pOutputText = bCopyToClipboard ? &outputText : NULL;
-	std::vector<std::wstring> hashList;
-	if (pHashes.empty())
-		hashList = Hash::GetSupportedHashIds();
-	else
+	// add a pattern: one or more specs separated by ';', the spaces around them are ignored
+	void AddPattern(LPCWSTR szPattern)
 	{
-		for (std::vector<shared_ptr<Hash>>::const_iterator It = pHashes.begin(); It != pHashes.end(); It++)
-			hashList.push_back((*It)->GetID());
+		const WCHAR* p = szPattern;
+		while (*p)
+		{
+			while (*p == L' ')
+				p++;
+			const WCHAR* end = wcschr(p, L';');
+			if (!end)
+				end = p + wcslen(p);
+			const WCHAR* specEnd = end;
+			while ((specEnd > p) && (specEnd[-1] == L' '))
+				specEnd--;
+			if (specEnd > p)
+			{
+				wstring spec;
+				spec.reserve(specEnd - p);
+				for (const WCHAR* c = p; c < specEnd; c++)
+					spec += FoldSpecChar(*c);
+				AddSpec(spec);
+			}
+			p = *end ? end + 1 : end;
+		}
 	}
-	for (std::vector<std::wstring>::const_iterator It = hashList.begin(); It != hashList.end(); It++)
+
+	bool Match(LPCWSTR szName) const
 	{
-		BenchmarkAlgo(It->c_str(), bQuiet, false, pOutputText);
+		if (m_bMatchAll)
+			return true;
+		if (m_bEmpty)
+			return false;
+
+		wstring& name = t_matcherName;
+		name.clear();
+		for (const WCHAR* c = szName; *c; c++)
+			name += FoldSpecChar(*c);
+
+		if (!m_names.empty() && (m_names.find(name) != m_names.end()))
+			return true;
+
+		for (map<size_t, unordered_set<wstring>>::const_iterator It = m_suffixes.begin(); (It != m_suffixes.end()) && (It->first <= name.length()); It++)
+		{
+			t_matcherKey.assign(name, name.length() - It->first, It->first);
+			if (It->second.find(t_matcherKey) != It->second.end())
+				return true;
+		}
+
+		return !m_starts.empty() && MatchAutomaton(name);
 	}
+};
 
-	if (bCopyToClipboard)
-		CopyToClipboard(outputText.c_str());
+CHashOperation::CHashOperation() : m_bUseMsCrypto(false), m_bSkipError(false), m_bNoFollow(false), m_bMismatchFound(false),
+	m_bCancelRequested(false), m_threadsCount(0), m_bSumFileSkipped(false), m_bSumRelativePath(false), m_inputDirPathLength(0),
+	m_pExcludeMatcher(new CNameMatcher()), m_pExcludeDirMatcher(new CNameMatcher()), m_pOnlyMatcher(new CNameMatcher()),
+	m_pHashCache(NULL), m_pJsonOutput(NULL), m_pLinkedFiles(NULL), m_bDeferJobs(false), m_unfinishedJobs(0)
+{
+	m_hJobsDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	m_hListingDoneEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 }
 
-// structure used to hold value from DirHash.ini
-typedef struct
+CHashOperation::~CHashOperation()
 {
-	wstring hashAlgoToUse;
-	bool bQuiet;
-	bool bDontWait;
-	bool bShowProgress;
-	bool bCopyToClipboard;
-	bool bIncludeNames;
-	bool bStripNames;
-	bool bLowerCase;
-	bool bUseMsCrypto;
-	bool bSkipError;
-	bool bNoLogo;
-	bool bNoFollow;
-	bool bForceSumMode;
-	bool bUseThreads;
-	bool bSumRelativePath;
-	bool bIncludeLastDir;
-} ConfigParams;
+	delete m_pExcludeMatcher;
+	delete m_pExcludeDirMatcher;
+	delete m_pOnlyMatcher;
+	CloseHandle(m_hJobsDoneEvent);
+	CloseHandle(m_hListingDoneEvent);
+}
 
-void LoadDefaults(ConfigParams& iniParams)
+// a pattern ending with a path separator only applies to directories
+inline bool IsDirectoryPattern(const wstring& pattern)
 {
-	iniParams.hashAlgoToUse = L"Blake3";
-	iniParams.bUseMsCrypto = false;
-	iniParams.bDontWait = false;
-	iniParams.bIncludeNames = false;
-	iniParams.bStripNames = false;
-	iniParams.bQuiet = false;
-	iniParams.bCopyToClipboard = false;
-	iniParams.bShowProgress = false;
-	iniParams.bLowerCase = false;
-	iniParams.bSkipError = false;
-	iniParams.bNoLogo = false;
-	iniParams.bNoFollow = false;
-	iniParams.bForceSumMode = false;
-	iniParams.bUseThreads = false;
-	iniParams.bSumRelativePath = false;
-	iniParams.bIncludeLastDir = false;
+	size_t length = pattern.length();
+	while ((length > 0) && (pattern[length - 1] == L' '))
+		length--;
+	return (length > 0) && ((pattern[length - 1] == L'\\') || (pattern[length - 1] == L'/'));
+}
 
-	// get values from DirHash.ini fille if it exists
-	WCHAR szInitPath[1024];
-	szInitPath[0] = 0;
-	if (GetModuleFileName(NULL, szInitPath, ARRAYSIZE(szInitPath)))
+// compile the -exclude and -only patterns of the current operation
+void CompileNameFilters()
+{
+	t_pOperation->m_pExcludeMatcher->Clear();
+	t_pOperation->m_pExcludeDirMatcher->Clear();
+	t_pOperation->m_pOnlyMatcher->Clear();
+	for (list<wstring>::const_iterator It = t_pOperation->m_excludeSpecList.begin(); It != t_pOperation->m_excludeSpecList.end(); It++)
 	{
-		wchar_t* ptr = wcsrchr (szInitPath, L'\\');
-		if (ptr)
+		if (IsDirectoryPattern(*It))
 		{
-			ptr += 1;
-			*ptr = 0;
-			StringCbCatW(szInitPath, sizeof(szInitPath), L"DirHash.ini");
-
-			WCHAR szValue[128];
-			if (GetPrivateProfileStringW(L"Defaults", L"Hash", L"Blake3", szValue, ARRAYSIZE(szValue), szInitPath) && Hash::IsHashId (szValue))
-			{
-				iniParams.hashAlgoToUse = szValue;
-			}
+			wstring pattern = *It;
+			while (pattern[pattern.length() - 1] == L' ')
+				pattern.erase(pattern.length() - 1);
+			pattern.erase(pattern.length() - 1);
+			t_pOperation->m_pExcludeDirMatcher->AddPattern(pattern.c_str());
+		}
+		else
+			t_pOperation->m_pExcludeMatcher->AddPattern(It->c_str());
+	}
+	for (list<wstring>::const_iterator It = t_pOperation->m_onlySpecList.begin(); It != t_pOperation->m_onlySpecList.end(); It++)
+		t_pOperation->m_pOnlyMatcher->AddPattern(It->c_str());
+}
 
-			if (GetPrivateProfileStringW(L"Defaults", L"Quiet", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bQuiet = true;
-				else
-					iniParams.bQuiet = false;
-			}
+bool IsExcludedName(LPCTSTR szName, bool bIsFile)
+{
+	// Include check
+	if (bIsFile && !t_pOperation->m_onlySpecList.empty()) // -only applied only to files
+		return !t_pOperation->m_pOnlyMatcher->Match(szName);
 
-			if (GetPrivateProfileStringW(L"Defaults", L"NoWait", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bDontWait = true;
-				else
-					iniParams.bDontWait = false;
-			}
+	// Exclude check
+	if (t_pOperation->m_pExcludeMatcher->Match(szName))
+		return true;
+	return !bIsFile && t_pOperation->m_pExcludeDirMatcher->Match(szName);
+}
 
-			if (GetPrivateProfileStringW(L"Defaults", L"ShowProgress", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bShowProgress = true;
-				else
-					iniParams.bShowProgress = false;
-			}
+// ---------------------------------------------
+/*
+ * Directory handles used by the walker of HashDirectory.
+ *
+ * Every directory is opened relative to the handle of its parent and its files are opened relative to its own
+ * handle (openat on POSIX, NtCreateFile with a RootDirectory on Windows) so that the system doesn't resolve all
+ * the components of the full path again for each file. Full paths are still built for the output and the error
+ * messages, and they are used when a relative open fails so that errors are reported as before.
+ * Jobs keep a reference on the handle of their directory so that worker threads also open files relative to it,
+ * but only while fewer than DIR_HANDLES_MAX directory handles are opened: the jobs queue is not bounded.
+ */
 
-			if (GetPrivateProfileStringW(L"Defaults", L"hashnames", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bIncludeNames = true;
-				else
-					iniParams.bIncludeNames = false;
-			}
+#define DIR_HANDLES_MAX	256
+
+static volatile LONG g_openedDirHandles = 0;
+
+#ifdef _WIN32
+typedef NTSTATUS(NTAPI* NtCreateFileFn)(
+	PHANDLE FileHandle,
+	ACCESS_MASK DesiredAccess,
+	POBJECT_ATTRIBUTES ObjectAttributes,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PLARGE_INTEGER AllocationSize,
+	ULONG FileAttributes,
+	ULONG ShareAccess,
+	ULONG CreateDisposition,
+	ULONG CreateOptions,
+	PVOID EaBuffer,
+	ULONG EaLength
+	);
 
-			if (GetPrivateProfileStringW(L"Defaults", L"stripnames", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bStripNames = true;
-				else
-					iniParams.bStripNames = false;
-			}
-
-			if (GetPrivateProfileStringW(L"Defaults", L"clip", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bCopyToClipboard = true;
-				else
-					iniParams.bCopyToClipboard = false;
-			}
-
-			if (GetPrivateProfileStringW(L"Defaults", L"lowercase", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bLowerCase = true;
-				else
-					iniParams.bLowerCase = false;
-			}
+NtCreateFileFn NtCreateFilePtr = NULL;
+#else
+// UTF-8 path given to the system calls, invalid characters are escaped as done by the platform layer
+static string GetUtf8Path(LPCWSTR szPath)
+{
+	string path;
+	int cbPath = WideCharToMultiByte(CP_UTF8, 0, szPath, -1, NULL, 0, NULL, NULL);
+	if (cbPath > 0)
+	{
+		path.resize(cbPath);
+		WideCharToMultiByte(CP_UTF8, 0, szPath, -1, &path[0], cbPath, NULL, NULL);
+		path.resize(strlen(path.c_str()));
+	}
+	return path;
+}
+#endif
 
-			if (GetPrivateProfileStringW(L"Defaults", L"MSCrypto", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bUseMsCrypto = true;
-				else
-					iniParams.bUseMsCrypto = false;
-			}
+class CDirHandle
+{
+protected:
+#ifdef _WIN32
+	HANDLE m_hDir;
 
-			if (GetPrivateProfileStringW(L"Defaults", L"SkipError", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bSkipError = true;
-				else
-					iniParams.bSkipError = false;
-			}
+	HANDLE OpenRelative(LPCWSTR szName, ACCESS_MASK access, ULONG shareAccess, ULONG options) const
+	{
+		HANDLE h = INVALID_HANDLE_VALUE;
+		UNICODE_STRING name;
+		OBJECT_ATTRIBUTES attributes;
+		IO_STATUS_BLOCK ioStatus;
 
-			if (GetPrivateProfileStringW(L"Defaults", L"NoLogo", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bNoLogo = true;
-				else
-					iniParams.bNoLogo = false;
-			}
+		if ((m_hDir == INVALID_HANDLE_VALUE) || !NtCreateFilePtr)
+			return INVALID_HANDLE_VALUE;
 
-			if (GetPrivateProfileStringW(L"Defaults", L"NoFollow", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bNoFollow = true;
-				else
-					iniParams.bNoFollow = false;
-			}
+		name.Buffer = (PWSTR)szName;
+		name.Length = (USHORT)(wcslen(szName) * sizeof(WCHAR));
+		name.MaximumLength = name.Length;
+		InitializeObjectAttributes(&attributes, &name, OBJ_CASE_INSENSITIVE, m_hDir, NULL);
+		if (NtCreateFilePtr(&h, access | SYNCHRONIZE, &attributes, &ioStatus, NULL, 0, shareAccess, FILE_OPEN, options | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0) < 0)
+			h = INVALID_HANDLE_VALUE;
+		return h;
+	}
 
-			if (GetPrivateProfileStringW(L"Defaults", L"Sum", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bForceSumMode = true;
-				else
-					iniParams.bForceSumMode = false;
-			}
+	explicit CDirHandle(HANDLE hDir) : m_hDir(hDir)
+	{
+		InterlockedIncrement(&g_openedDirHandles);
+	}
+#else
+	int m_fd;
 
-			if (GetPrivateProfileStringW(L"Defaults", L"Threads", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bUseThreads = true;
-				else
-					iniParams.bUseThreads = false;
-			}
+	explicit CDirHandle(int fd) : m_fd(fd)
+	{
+		InterlockedIncrement(&g_openedDirHandles);
+	}
+#endif
 
-			if (GetPrivateProfileStringW(L"Defaults", L"SumRelativePath", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") == 0)
-					iniParams.bSumRelativePath = true;
-				else
-					iniParams.bSumRelativePath = false;
-			}
+	// forbid copying
+	CDirHandle(const CDirHandle&);
+	CDirHandle& operator = (const CDirHandle&);
+public:
+	~CDirHandle()
+	{
+#ifdef _WIN32
+		CloseHandle(m_hDir);
+#else
+		close(m_fd);
+#endif
+		InterlockedDecrement(&g_openedDirHandles);
+	}
 
-			if (GetPrivateProfileStringW(L"Defaults", L"IncludeLastDir", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
-			{
-				if (_wcsicmp(szValue, L"True") != 0)
-					iniParams.bIncludeLastDir = false;
-				else
-					iniParams.bIncludeLastDir = true;
-			}
-		}
+	// open the directory dirPath relative to pParent, or using its full path if pParent is NULL. NULL is returned on failure
+	static shared_ptr<CDirHandle> Open(const CDirHandle* pParent, const CPath& dirPath)
+	{
+		LPCWSTR szAbsolutPath = dirPath.GetAbsolutPathValue().c_str();
+#ifdef _WIN32
+		HANDLE hDir = pParent ? pParent->OpenRelative(GetFileName(szAbsolutPath), FILE_LIST_DIRECTORY | FILE_TRAVERSE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT) : INVALID_HANDLE_VALUE;
+		if (hDir == INVALID_HANDLE_VALUE)
+			hDir = CreateFileW(szAbsolutPath, FILE_LIST_DIRECTORY | FILE_TRAVERSE | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if (hDir == INVALID_HANDLE_VALUE)
+			return shared_ptr<CDirHandle>();
+		return shared_ptr<CDirHandle>(new CDirHandle(hDir));
+#else
+		int fd = pParent ? openat(pParent->m_fd, GetUtf8Path(GetFileName(szAbsolutPath)).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+		if (fd < 0)
+			fd = open(GetUtf8Path(szAbsolutPath).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return shared_ptr<CDirHandle>();
+		return shared_ptr<CDirHandle>(new CDirHandle(fd));
+#endif
 	}
 
-#if defined (_M_ARM64) || defined (_M_ARM)
-	// we always use Windows native crypto on ARM platform because OpenSSL is not optimized for such platforms
-	iniParams.bUseMsCrypto = true;
+	// open for reading the file of this directory having the given name. INVALID_HANDLE_VALUE is returned on failure
+	HANDLE OpenFile(LPCWSTR szName) const
+	{
+#ifdef _WIN32
+		return OpenRelative(szName, GENERIC_READ | FILE_READ_ATTRIBUTES, FILE_SHARE_READ, FILE_NON_DIRECTORY_FILE);
+#else
+		int fd = openat(m_fd, GetUtf8Path(szName).c_str(), O_RDONLY | O_CLOEXEC);
+		return (fd < 0) ? INVALID_HANDLE_VALUE : (HANDLE)_get_osfhandle(fd);
 #endif
+	}
+};
+
+// open a file for reading relative to the handle of its directory when there is one, or using its full path
+HANDLE OpenFileForReading(const CPath& filePath, const CDirHandle* pDirHandle)
+{
+	LPCWSTR szAbsolutPath = filePath.GetAbsolutPathValue().c_str();
+	HANDLE f = pDirHandle ? pDirHandle->OpenFile(GetFileName(szAbsolutPath)) : INVALID_HANDLE_VALUE;
+	if (f == INVALID_HANDLE_VALUE)
+		f = CreateFileW(szAbsolutPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	return f;
 }
 
-bool ParseResultLine(wchar_t* szLine, wstring& targetName, wstring& hashName, ByteArray& digestValue)
+// ---------------------------------------------
+/*
+ * Aggregated progress displayed by -progress.
+ *
+ * The enumeration and the hashing code only update counters: global ones with interlocked operations once per
+ * file, and a per-thread slot with plain stores for the bytes read in the current file. The slot of a thread is
+ * protected by a sequence number that is odd while the file it describes changes so that the render thread,
+ * which draws the progress line at a fixed rate, never reads a half updated name.
+ */
+
+#define PROGRESS_REFRESH_INTERVAL	500 // milliseconds
+#define PROGRESS_NAME_LENGTH		48
+
+typedef struct _PROGRESS_SLOT
 {
-	bool bRet = false;
+	volatile LONG sequence;
+	LONGLONG startTicks;
+	ULONGLONG fileSize;
+	volatile ULONGLONG currentSize;
+	WCHAR szName[PROGRESS_NAME_LENGTH];
+} PROGRESS_SLOT;
 
-	if (szLine && wcslen (szLine) >= 32 ) // minimum length of line is 32 characters
+static thread_local PROGRESS_SLOT* t_pProgressSlot = NULL;
+
+class CProgress
+{
+protected:
+	CRITICAL_SECTION m_lock;
+	vector<PROGRESS_SLOT*> m_slots;
+	volatile LONGLONG m_filesEnumerated;
+	volatile LONGLONG m_bytesEnumerated;
+	volatile LONGLONG m_filesProcessed;
+	volatile LONGLONG m_bytesProcessed;
+	volatile LONGLONG m_bytesHashed;
+	LARGE_INTEGER m_frequency;
+	LONGLONG m_startTicks;
+	LONGLONG m_lastTicks;
+	ULONGLONG m_lastBytes;
+	double m_speed;
+	HANDLE m_hThread;
+	HANDLE m_hStopEvent;
+
+	PROGRESS_SLOT& GetSlot()
 	{
-		// try first to decode as raw hash value
-		if (FromHex(szLine, digestValue))
+		if (!t_pProgressSlot)
 		{
-			bRet = Hash::IsHashSize((int)digestValue.size());
+			t_pProgressSlot = new PROGRESS_SLOT;
+			memset(t_pProgressSlot, 0, sizeof(PROGRESS_SLOT));
+			EnterCriticalSection(&m_lock);
+			m_slots.push_back(t_pProgressSlot);
+			LeaveCriticalSection(&m_lock);
 		}
-		else
-		{
-			// parse hash name, folder/file name and digest value
-			// format: hashName hash of "XXXX" (DD bytes) = XXXXXX...XX
-			wchar_t* ptr = wcschr(szLine, L' ');
-			if (ptr)
-			{
-				*ptr = 0;
-				// check that first part is a valid hash name
-				shared_ptr<Hash> pHash(Hash::GetHash(szLine));
-				if (pHash)
-				{
-					hashName = pHash->GetID();
-					ptr++;
-					if ((wcslen(ptr) > 32) && wcsstr(ptr, L"hash of \"") == ptr)
-					{
-						ptr += 9; // 9 is length of "hash of \""
-						wchar_t* delim = wcschr(ptr, L'\"');
-						if (delim)
-						{
-							*delim = 0;
-							targetName = ptr;
-
-							if (delim[1] == L' ' && delim[2] == L'(')
-							{
-								ptr = delim + 3;
-								if (wcslen(ptr) > 32 && (delim = wcschr(ptr, L' ')))
-								{
-									// get encoded digest size (always 2 characters)
-									int hashLen = 0;
-									*delim = 0;
-									if (wcslen(ptr) == 2 && (1 == swscanf(ptr, L"%2d", &hashLen)) && (hashLen == pHash->GetHashSize()))
-									{
-										ptr = delim + 1;
-										if ((wcslen(ptr) > 32) && wcsstr(ptr, L"bytes) = ") == ptr)
-										{
-											// look for digest
-											ptr += 9; // 9 is length of "bytes) = "
-
-											if (wcslen(ptr) == ((size_t) 2 * (size_t) hashLen)) // hexadecimal encoding is double the size in bytes
-											{
-												if (FromHex(ptr, digestValue))
-												{
-													bRet = true;
-												}
-											}
-										}
-									}
-								}
-							}						
-						}
-					}
-				}
-			}
+		return *t_pProgressSlot;
+	}
 
-		}
+	static LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
 	}
 
-	if (!bRet)
+	static wstring FormatSize(double size)
 	{
-		targetName = L"";
-		hashName = L"";
-		digestValue.clear();
+		if (size >= (double)(1024 * 1024 * 1024))
+			return FormatString(L"%.2f GiB", size / (double)(1024 * 1024 * 1024));
+		else if (size >= (double)(1024 * 1024))
+			return FormatString(L"%.2f MiB", size / (double)(1024 * 1024));
+		else if (size >= (double)(1024))
+			return FormatString(L"%.2f KiB", size / (double)(1024));
+		else
+			return FormatString(L"%.0f B", size);
 	}
 
-	return bRet;
-}
+	static wstring FormatDuration(ULONGLONG seconds)
+	{
+		return FormatString(L"%llu:%02llu:%02llu", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+	}
 
-bool ParseResultFile(const CPath& resultFile, map<wstring, HashResultEntry>& pathDigestList, map<int, ByteArray>& rawDigestList)
-{
-	bool bRet = false;
-	// Result files are created using UTF-8 encoding in order to support UNICODE file names
-	FILE* f = _wfopen(resultFile.GetAbsolutPathValue().c_str(), L"rt,ccs=UTF-8");
-	if (f)
+	static DWORD WINAPI RenderThreadCode(LPVOID pArg)
 	{
-		bool bFailed = false;
-		ByteArray buffer(4096 * 2);
-		wchar_t* szLine = (wchar_t*)buffer.data();
-		size_t digestLen = 0;
-		wstring targetName, hashName;
-		ByteArray digestValue;
+		CProgress* pThis = (CProgress*)pArg;
+		while (WaitForSingleObject(pThis->m_hStopEvent, PROGRESS_REFRESH_INTERVAL) == WAIT_TIMEOUT)
+			pThis->Render();
+		return 0;
+	}
 
-		pathDigestList.clear();
-		rawDigestList.clear();
+	void Render()
+	{
+		LONGLONG now = Now();
+		ULONGLONG inFlightBytes = 0, inFlightRemaining = 0;
+		PROGRESS_SLOT slowest;
+		slowest.fileSize = 0;
 
-		while (fgetws(szLine, (int)(buffer.size() / 2), f))
+		EnterCriticalSection(&m_lock);
+		for (size_t i = 0; i < m_slots.size(); i++)
 		{
-			size_t l = wcslen(szLine);
-			if (szLine[l - 1] == L'\n')
+			PROGRESS_SLOT& slot = *m_slots[i];
+			PROGRESS_SLOT copy;
+			LONG sequence;
+			do
 			{
-				szLine[l - 1] = 0;
-				l--;
-			}
-
-			if (l == 0)
+				sequence = InterlockedCompareExchange(&slot.sequence, 0, 0);
+				if (sequence & 1)
+					continue;
+				copy.startTicks = slot.startTicks;
+				copy.fileSize = slot.fileSize;
+				copy.currentSize = slot.currentSize;
+				memcpy(copy.szName, slot.szName, sizeof(copy.szName));
+			} while ((sequence & 1) || (sequence != InterlockedCompareExchange(&slot.sequence, 0, 0)));
+
+			if (!copy.szName[0])
 				continue;
-
-			if (ParseResultLine(szLine, targetName, hashName, digestValue))
-			{
-				if (targetName.length() && hashName.length())
-				{
-					pathDigestList[targetName].m_hashName = hashName;
-					pathDigestList[targetName].m_digest = digestValue;
-				}
-				else
-					rawDigestList[(int)digestValue.size()] = digestValue;
-			}
-			else
-			{
-				bFailed = true;
-				break;
-			}
+			inFlightBytes += copy.currentSize;
+			if (copy.fileSize > copy.currentSize)
+				inFlightRemaining += copy.fileSize - copy.currentSize;
+			// the file being processed for the longest time
+			if (!slowest.fileSize || (copy.startTicks < slowest.startTicks))
+				memcpy(&slowest, &copy, sizeof(copy));
 		}
-		fclose(f);
+		LeaveCriticalSection(&m_lock);
 
-		if (bFailed)
+		ULONGLONG bytesHashed = (ULONGLONG)m_bytesHashed + inFlightBytes;
+		double interval = (double)(now - m_lastTicks) / (double)m_frequency.QuadPart;
+		if (interval > 0.0)
 		{
-			pathDigestList.clear();
-			rawDigestList.clear();
+			double speed = (double)(bytesHashed >= m_lastBytes ? bytesHashed - m_lastBytes : 0) / interval;
+			// smooth the throughput over the last seconds
+			m_speed = (m_lastBytes || m_speed != 0.0) ? (0.7 * m_speed + 0.3 * speed) : speed;
 		}
-		else if (pathDigestList.size() == 0 && rawDigestList.size() == 0)
+		m_lastTicks = now;
+		m_lastBytes = bytesHashed;
+
+		// bytes of enumerated files that were not processed yet
+		LONGLONG remaining = m_bytesEnumerated - m_bytesProcessed - (LONGLONG)inFlightBytes;
+		ULONGLONG remainingBytes = max((ULONGLONG)max(remaining, (LONGLONG)0), inFlightRemaining);
+
+		wstring szLine = FormatString(L"%lld/%lld files, %s/%s, %s/s, ETA %s",
+			m_filesProcessed, m_filesEnumerated,
+			FormatSize((double)bytesHashed).c_str(), FormatSize((double)m_bytesEnumerated).c_str(),
+			FormatSize(m_speed).c_str(),
+			(m_speed >= 1.0) ? FormatDuration((ULONGLONG)((double)remainingBytes / m_speed)).c_str() : L"-");
+		if (slowest.fileSize)
 		{
+			szLine += FormatString(L", slowest: %s %.0f %% (%llu s)", slowest.szName,
+				(double)slowest.currentSize * 100.0 / (double)slowest.fileSize,
+				(ULONGLONG)((now - slowest.startTicks) / m_frequency.QuadPart));
 		}
-		else
-			bRet = true;
+
+		// the line must not wrap otherwise it can't be erased
+		size_t maxLength = (g_originalConsoleInfo.dwSize.X > 1) ? (size_t)(g_originalConsoleInfo.dwSize.X - 1) : 79;
+		if (szLine.length() > maxLength)
+			szLine.resize(maxLength);
+
+		EnterCriticalSection(&g_consoleLock);
+		_tprintf(_T("\r%s"), szLine.c_str());
+		for (size_t i = szLine.length(); i < g_progressLineLength; i++)
+			_tprintf(_T(" "));
+		_tprintf(_T("\r"));
+		g_progressLineLength = szLine.length();
+		LeaveCriticalSection(&g_consoleLock);
 	}
-	else
+
+public:
+	CProgress() : m_filesEnumerated(0), m_bytesEnumerated(0), m_filesProcessed(0), m_bytesProcessed(0), m_bytesHashed(0),
+		m_lastBytes(0), m_speed(0.0), m_hThread(NULL), m_hStopEvent(NULL)
 	{
-		_tprintf(TEXT("Failed to open file \"%s\" for reading\n"), resultFile.GetPathValue().c_str());
+		InitializeCriticalSection(&m_lock);
+		QueryPerformanceFrequency(&m_frequency);
+		m_startTicks = m_lastTicks = Now();
 	}
 
-	return bRet;
-}
+	~CProgress()
+	{
+		Stop();
+		for (size_t i = 0; i < m_slots.size(); i++)
+			delete m_slots[i];
+		DeleteCriticalSection(&m_lock);
+	}
 
-bool ParseSumFile(const CPath& sumFile, map<wstring, HashResultEntry>& digestList, vector<int>& skippedLines, bool normalizePath = true)
-{
-	bool bRet = false;	
+	void Start()
+	{
+		InitializeCriticalSection(&g_consoleLock);
+		g_bConsoleLockInitialized = true;
+		m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (m_hStopEvent)
+			m_hThread = CreateThread(NULL, 0, RenderThreadCode, this, 0, NULL);
+	}
+
+	void Stop()
+	{
+		if (m_hThread)
+		{
+			SetEvent(m_hStopEvent);
+			WaitForSingleObject(m_hThread, INFINITE);
+			CloseHandle(m_hThread);
+			m_hThread = NULL;
+		}
+		if (m_hStopEvent)
+		{
+			CloseHandle(m_hStopEvent);
+			m_hStopEvent = NULL;
+		}
+		if (g_bConsoleLockInitialized)
+		{
+			ClearProgressLine();
+			g_bConsoleLockInitialized = false;
+			DeleteCriticalSection(&g_consoleLock);
+		}
+	}
+
+	void AddEnumerated(ULONGLONG filesCount, ULONGLONG bytes)
+	{
+		InterlockedExchangeAdd64(&m_filesEnumerated, (LONGLONG)filesCount);
+		InterlockedExchangeAdd64(&m_bytesEnumerated, (LONGLONG)bytes);
+	}
+
+	// the file was hashed, skipped or failed
+	void FileProcessed(ULONGLONG fileSize)
+	{
+		InterlockedIncrement64(&m_filesProcessed);
+		InterlockedExchangeAdd64(&m_bytesProcessed, (LONGLONG)fileSize);
+	}
+
+	void BeginFile(LPCWSTR szFilePath, ULONGLONG fileSize)
+	{
+		PROGRESS_SLOT& slot = GetSlot();
+		LPCWSTR szName = GetFileName(szFilePath);
+		size_t l = wcslen(szName);
+
+		InterlockedIncrement(&slot.sequence);
+		slot.startTicks = Now();
+		slot.fileSize = fileSize;
+		slot.currentSize = 0;
+		if (l < PROGRESS_NAME_LENGTH)
+			wcscpy(slot.szName, szName);
+		else
+		{
+			// keep the end of the name which usually holds the extension
+			memcpy(slot.szName, szName, (PROGRESS_NAME_LENGTH / 2 - 2) * sizeof(WCHAR));
+			memcpy(&slot.szName[PROGRESS_NAME_LENGTH / 2 - 2], L"...", 3 * sizeof(WCHAR));
+			wcscpy(&slot.szName[PROGRESS_NAME_LENGTH / 2 + 1], szName + l - (PROGRESS_NAME_LENGTH / 2 - 2));
+		}
+		InterlockedIncrement(&slot.sequence);
+	}
+
+	void UpdateFile(ULONGLONG currentSize) { t_pProgressSlot->currentSize = currentSize; }
+
+	void EndFile()
+	{
+		PROGRESS_SLOT& slot = *t_pProgressSlot;
+		InterlockedExchangeAdd64(&m_bytesHashed, (LONGLONG)slot.currentSize);
+		InterlockedIncrement(&slot.sequence);
+		slot.szName[0] = 0;
+		slot.currentSize = 0;
+		InterlockedIncrement(&slot.sequence);
+	}
+};
+
+static CProgress* g_pProgress = NULL;
+
+// reports a file to the progress as processed when leaving the scope, unless it is passed to a worker thread
+class CProgressFileScope
+{
+protected:
+	ULONGLONG m_fileSize;
+	bool m_bDetached;
+public:
+	CProgressFileScope(ULONGLONG fileSize) : m_fileSize(fileSize), m_bDetached(false) {}
+	~CProgressFileScope()
+	{
+		if (g_pProgress && !m_bDetached)
+			g_pProgress->FileProcessed(m_fileSize);
+	}
+	void Detach() { m_bDetached = true; }
+};
+
+// ---------------------------------------------
+/*
+ * NDJSON event stream written to the standard output by -json.
+ *
+ * Records are built in UTF-8 by the thread that produced them and appended under a lock to a large buffer that is
+ * written with WriteFile when it is full, so that the stream can be consumed at hashing speed. Human-readable
+ * messages are redirected to the standard error in this mode so that the standard output only contains records.
+ */
+
+#define JSON_BUFFER_SIZE	(1024 * 1024)
+
+class CJsonRecord
+{
+protected:
+	string m_text;
+	bool m_bFirst;
+
+	void AddKey(LPCWSTR szKey)
+	{
+		if (!m_bFirst)
+			m_text += ',';
+		m_bFirst = false;
+		AppendJsonString(m_text, szKey);
+		m_text += ':';
+	}
+
+public:
+	CJsonRecord(LPCWSTR szType) : m_text("{"), m_bFirst(true)
+	{
+		AddString(L"type", szType);
+	}
+
+	void AddString(LPCWSTR szKey, LPCWSTR szValue)
+	{
+		AddKey(szKey);
+		AppendJsonString(m_text, szValue);
+	}
+
+	void AddNumber(LPCWSTR szKey, LONGLONG value)
+	{
+		char szValue[32];
+		AddKey(szKey);
+		snprintf(szValue, sizeof(szValue), "%lld", value);
+		m_text += szValue;
+	}
+
+	void AddDouble(LPCWSTR szKey, double value)
+	{
+		char szValue[64];
+		AddKey(szKey);
+		snprintf(szValue, sizeof(szValue), "%.3f", value);
+		m_text += szValue;
+	}
+
+	void AddHex(LPCWSTR szKey, LPCBYTE pbData, size_t cbData)
+	{
+		const char* szDigits = g_bLowerCase ? "0123456789abcdef" : "0123456789ABCDEF";
+		AddKey(szKey);
+		m_text += '"';
+		for (size_t i = 0; i < cbData; i++)
+		{
+			m_text += szDigits[pbData[i] >> 4];
+			m_text += szDigits[pbData[i] & 0x0F];
+		}
+		m_text += '"';
+	}
+
+	void BeginObject(LPCWSTR szKey)
+	{
+		AddKey(szKey);
+		m_text += '{';
+		m_bFirst = true;
+	}
+
+	void EndObject()
+	{
+		m_text += '}';
+		m_bFirst = false;
+	}
+
+	const string& Finish()
+	{
+		m_text += "}\n";
+		return m_text;
+	}
+};
+
+class CJsonOutput
+{
+protected:
+	CRITICAL_SECTION m_lock;
+	HANDLE m_hOutput;
+	vector<char> m_buffer;
+	size_t m_cbUsed;
+	LARGE_INTEGER m_frequency;
+	LONGLONG m_startTicks;
+	volatile LONGLONG m_files;
+	volatile LONGLONG m_bytes;
+	volatile LONGLONG m_mismatches;
+	volatile LONGLONG m_errors;
+
+	void WriteData(const char* pData, size_t cbData)
+	{
+		while (cbData)
+		{
+			DWORD cbWritten = 0;
+			if (!WriteFile(m_hOutput, pData, (DWORD)min(cbData, (size_t)JSON_BUFFER_SIZE), &cbWritten, NULL) || !cbWritten)
+				break;
+			pData += cbWritten;
+			cbData -= cbWritten;
+		}
+	}
+
+	void Write(const string& szRecord)
+	{
+		EnterCriticalSection(&m_lock);
+		if (m_cbUsed + szRecord.length() > m_buffer.size())
+		{
+			WriteData(m_buffer.data(), m_cbUsed);
+			m_cbUsed = 0;
+		}
+		if (szRecord.length() > m_buffer.size())
+			WriteData(szRecord.data(), szRecord.length());
+		else
+		{
+			memcpy(m_buffer.data() + m_cbUsed, szRecord.data(), szRecord.length());
+			m_cbUsed += szRecord.length();
+		}
+		LeaveCriticalSection(&m_lock);
+	}
+
+	double GetDurationMs(LONGLONG startTicks) const
+	{
+		return startTicks ? (double)(Now() - startTicks) * 1000.0 / (double)m_frequency.QuadPart : 0.0;
+	}
+
+public:
+	CJsonOutput(HANDLE hOutput, size_t cbBuffer = JSON_BUFFER_SIZE) : m_hOutput(hOutput), m_buffer(cbBuffer), m_cbUsed(0), m_files(0), m_bytes(0), m_mismatches(0), m_errors(0)
+	{
+		InitializeCriticalSection(&m_lock);
+		QueryPerformanceFrequency(&m_frequency);
+		m_startTicks = Now();
+	}
+
+	virtual ~CJsonOutput()
+	{
+		Flush();
+		DeleteCriticalSection(&m_lock);
+	}
+
+	static LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void Flush()
+	{
+		EnterCriticalSection(&m_lock);
+		WriteData(m_buffer.data(), m_cbUsed);
+		m_cbUsed = 0;
+		LeaveCriticalSection(&m_lock);
+	}
+
+	// pDigests holds one digest per hash of pHashes or is NULL. startTicks is 0 if the file was not read.
+	virtual void AddFile(LPCWSTR szPath, ULONGLONG size, LONGLONG startTicks, LPCWSTR szStatus, const vector<shared_ptr<Hash>>& pHashes, const vector<ByteArray>* pDigests, LPCBYTE pbExpectedDigest, LPCWSTR szDetail = NULL)
+	{
+		CJsonRecord record(L"file");
+		record.AddString(L"path", szPath);
+		record.AddNumber(L"size", (LONGLONG)size);
+		if (pDigests && !pDigests->empty())
+		{
+			record.BeginObject(L"digests");
+			for (size_t i = 0; i < pDigests->size(); i++)
+				record.AddHex(pHashes[i]->GetID(), (*pDigests)[i].data(), (*pDigests)[i].size());
+			record.EndObject();
+		}
+		if (pbExpectedDigest)
+			record.AddHex(L"expected", pbExpectedDigest, pHashes[0]->GetHashSize());
+		record.AddDouble(L"durationMs", GetDurationMs(startTicks));
+		record.AddString(L"status", szStatus);
+		if (szDetail)
+			record.AddString(L"detail", szDetail);
+		Write(record.Finish());
+
+		InterlockedIncrement64(&m_files);
+		InterlockedExchangeAdd64(&m_bytes, (LONGLONG)size);
+		if (0 == wcscmp(szStatus, L"mismatch"))
+			InterlockedIncrement64(&m_mismatches);
+	}
+
+	virtual void AddError(LPCWSTR szPath, DWORD dwError, const wstring& szMessage)
+	{
+		CJsonRecord record(L"error");
+		wstring szText = szMessage;
+		while (!szText.empty() && ((szText.back() == L'\n') || (szText.back() == L' ')))
+			szText.pop_back();
+		record.AddString(L"path", szPath);
+		record.AddNumber(L"code", (LONGLONG)dwError);
+		record.AddString(L"message", szText.c_str());
+		Write(record.Finish());
+		InterlockedIncrement64(&m_errors);
+	}
+
+	// final record. pDigests holds the directory or file digests when -sum is not specified
+	// digests of one of the inputs when several are given
+	void AddRoot(LPCWSTR szPath, const vector<shared_ptr<Hash>>& pHashes, const vector<ByteArray>& digests)
+	{
+		CJsonRecord record(L"root");
+		record.AddString(L"path", szPath);
+		record.BeginObject(L"digests");
+		for (size_t i = 0; i < digests.size(); i++)
+			record.AddHex(pHashes[i]->GetID(), digests[i].data(), digests[i].size());
+		record.EndObject();
+		Write(record.Finish());
+	}
+
+	void AddSummary(LPCWSTR szStatus, DWORD dwExitCode, const vector<shared_ptr<Hash>>& pHashes, const vector<ByteArray>& digests, const wstring& szMessage)
+	{
+		CJsonRecord record(L"summary");
+		record.AddString(L"status", szStatus);
+		record.AddNumber(L"exitCode", (LONGLONG)(int)dwExitCode);
+		record.AddNumber(L"files", m_files);
+		record.AddNumber(L"bytes", m_bytes);
+		record.AddNumber(L"mismatches", m_mismatches);
+		record.AddNumber(L"errors", m_errors);
+		record.AddDouble(L"elapsedMs", (double)(Now() - m_startTicks) * 1000.0 / (double)m_frequency.QuadPart);
+		if (!digests.empty())
+		{
+			record.BeginObject(L"digests");
+			for (size_t i = 0; i < digests.size(); i++)
+				record.AddHex(pHashes[i]->GetID(), digests[i].data(), digests[i].size());
+			record.EndObject();
+		}
+		if (!szMessage.empty())
+		{
+			wstring szText = szMessage;
+			while (!szText.empty() && ((szText.back() == L'\n') || (szText.back() == L' ')))
+				szText.pop_back();
+			record.AddString(L"message", szText.c_str());
+		}
+		Write(record.Finish());
+		Flush();
+	}
+};
+
+// ---------------------------------------------
+/*
+ * Duplicate files finder used by -duplicates.
+ *
+ * Files are collected during enumeration and grouped by size: files with a unique size can't have duplicates and
+ * are never read. The remaining candidates are first hashed partially (first and last blocks) and only the ones
+ * whose partial digest collides with another file of the same size are hashed completely. Files that are not larger
+ * than the two blocks are fully hashed by the partial step. Reads are done by the worker threads when -threads is
+ * specified.
+ */
+
+#define DUPLICATES_BLOCK_SIZE			65536
+
+class CDuplicateCandidate
+{
+public:
+	CPath m_path;
+	ULONGLONG m_size;
+	ByteArray m_partialDigest;
+	ByteArray m_fullDigest; // set by the partial step for files that are not larger than two blocks
+	DWORD m_dwError;
+
+	CDuplicateCandidate(const CPath& path, ULONGLONG size) : m_path(path), m_size(size), m_dwError(0) {}
+};
+
+static volatile LONGLONG g_duplicatesBytesRead = 0;
+
+// read the given range of a file and hash it
+static bool HashFileRange(HANDLE f, ULONGLONG offset, ULONGLONG length, Hash* pHash, LPBYTE pbBuffer, size_t cbBuffer)
+{
+	LARGE_INTEGER li;
+	li.QuadPart = (LONGLONG)offset;
+	if (!SetFilePointerEx(f, li, NULL, FILE_BEGIN))
+		return false;
+
+	while (length)
+	{
+		DWORD cbCount = 0;
+		DWORD cbToRead = (DWORD)min(length, (ULONGLONG)cbBuffer);
+		if (!ReadFile(f, pbBuffer, cbToRead, &cbCount, NULL) || (cbCount != cbToRead))
+			return false;
+		pHash->Update(pbBuffer, cbCount);
+		length -= cbCount;
+	}
+	return true;
+}
+
+// compute the partial digest (first and last blocks) or the full digest of a candidate
+void ComputeDuplicateDigest(CDuplicateCandidate& candidate, bool bPartial, Hash* pHash, LPBYTE pbBuffer, size_t cbBuffer)
+{
+	HANDLE f = CreateFileW(candidate.m_path.GetAbsolutPathValue().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+	{
+		candidate.m_dwError = GetLastError();
+		return;
+	}
+
+	bool bWholeFile = !bPartial || (candidate.m_size <= 2 * DUPLICATES_BLOCK_SIZE);
+	bool bRet;
+	if (bWholeFile)
+		bRet = HashFileRange(f, 0, candidate.m_size, pHash, pbBuffer, cbBuffer);
+	else
+	{
+		bRet = HashFileRange(f, 0, DUPLICATES_BLOCK_SIZE, pHash, pbBuffer, cbBuffer)
+			&& HashFileRange(f, candidate.m_size - DUPLICATES_BLOCK_SIZE, DUPLICATES_BLOCK_SIZE, pHash, pbBuffer, cbBuffer);
+	}
+
+	if (!bRet)
+		candidate.m_dwError = GetLastError() ? GetLastError() : ERROR_HANDLE_EOF;
+	CloseHandle(f);
+
+	if (bRet)
+	{
+		InterlockedExchangeAdd64(&g_duplicatesBytesRead, (LONGLONG)(bWholeFile ? candidate.m_size : 2 * DUPLICATES_BLOCK_SIZE));
+		ByteArray digest(pHash->GetHashSize());
+		pHash->Final(digest.data());
+		candidate.m_partialDigest = digest;
+		if (bWholeFile)
+			candidate.m_fullDigest = digest;
+	}
+}
+
+class CBlockVerification;
+
+// directory or file given as input. When several are given, their jobs are processed by the same worker threads and
+// each one has its own output files. The worker threads use the input of the job they process.
+typedef struct _INPUT_ROOT
+{
+	wstring szArg;			// as given on the command line
+	wstring path;			// without trailing separator
+	bool bIsFile;
+	size_t sumPathOffset;	// length of the input directory removed from SUM entries by -sumRelativePath
+	size_t outputBase;		// index of its first SUM file in the output files
+	vector<shared_ptr<Hash>> pHashes;
+
+	_INPUT_ROOT() : bIsFile(false), sumPathOffset(0), outputBase(0) {}
+} INPUT_ROOT;
+
+static thread_local const INPUT_ROOT* t_pInputRoot = NULL;
+
+// path of a file as written in SUM files and blocks manifests
+LPCWSTR GetSumEntryPath(LPCWSTR szFilePath)
+{
+	if (t_pInputRoot)
+		return szFilePath + t_pInputRoot->sumPathOffset;
+	return t_pOperation->m_bSumRelativePath ? (szFilePath + t_pOperation->m_inputDirPathLength) : szFilePath;
+}
+
+typedef struct _threadParam
+{
+	CPath filePath;
+	ULONGLONG fileSize;
+	bool bQuiet;
+	bool bShowProgress;
+	bool bSumMode;
+	bool bSumVerificationMode;
+	ByteArray pbExpectedDigest;
+	vector<shared_ptr<Hash>> pHashes;
+	CDuplicateCandidate* pDuplicate; // set for -duplicates jobs
+	bool bPartialHash;
+	shared_ptr<CBlockVerification> pBlockVerification; // set for the jobs verifying a single block of a file
+	size_t blockIndex;
+	const INPUT_ROOT* pInputRoot;
+	CHashOperation* pOperation;
+	shared_ptr<CDirHandle> pDirHandle; // handle of the directory of the file, used to open it
+
+	_threadParam(const CPath& fp) : filePath(fp), fileSize(0), bQuiet(false), bShowProgress(false), bSumMode(false), bSumVerificationMode(false), pDuplicate(NULL), bPartialHash(false), blockIndex(0), pInputRoot(t_pInputRoot), pOperation(t_pOperation) {}
+} threadParam;
+
+typedef struct _JOB_ITEM {
+	SLIST_ENTRY ItemEntry;
+	threadParam* pParam;
+} JOB_ITEM, * PJOB_ITEM;
+
+typedef struct _OUTPUT_ITEM {
+	SLIST_ENTRY ItemEntry;
+	std::wstring* pParam;
+	std::wstring* pConsoleParam;
+	bool bQuiet;
+	bool bError;
+	bool bSkipOutputFile;
+	size_t nOutputFile;
+} OUTPUT_ITEM, * POUTPUT_ITEM;
+
+PSLIST_HEADER g_jobsList = NULL;
+PSLIST_HEADER g_outputsList = NULL;
+
+void FreejobList()
+{
+	JOB_ITEM* pJob;
+	
+	while (pJob = (JOB_ITEM*)InterlockedPopEntrySList(g_jobsList))
+	{
+		threadParam* p = pJob->pParam;
+		delete p;
+		_aligned_free(pJob);
+	}
+
+	InterlockedFlushSList(g_jobsList);
+	_aligned_free(g_jobsList);
+	g_pendingJobs = 0;
+	t_pOperation->m_unfinishedJobs = 0;
+
+}
+
+void FreeOutputList()
+{
+	OUTPUT_ITEM* pOutput;
+
+	while ((pOutput = (OUTPUT_ITEM*)InterlockedPopEntrySList(g_outputsList)))
+	{
+		std::wstring* p = pOutput->pParam;
+		delete p;
+		_aligned_free(pOutput);
+	}
+
+	InterlockedFlushSList(g_outputsList);
+	_aligned_free(g_outputsList);
+	g_pendingOutputs = 0;
+
+}
+
+void AddHashJobEntry(threadParam* pParam)
+{
+	JOB_ITEM* pJobItem = (JOB_ITEM*)_aligned_malloc(sizeof(JOB_ITEM), MEMORY_ALLOCATION_ALIGNMENT);
+	if (NULL == pJobItem)
+		return;
+
+	pJobItem->pParam = pParam;
+	InterlockedIncrement(&t_pOperation->m_unfinishedJobs);
+	InterlockedPushEntrySList(g_jobsList, &(pJobItem->ItemEntry));
+	InterlockedIncrement(&g_pendingJobs);
+}
+
+void JobCompleted()
+{
+	if (0 == InterlockedDecrement(&t_pOperation->m_unfinishedJobs))
+		SetEvent(t_pOperation->m_hJobsDoneEvent);
+}
+
+// wait until all the queued jobs are processed without stopping the worker threads
+void WaitForJobs()
+{
+	while (t_pOperation->m_unfinishedJobs && !g_bFatalError)
+		WaitForSingleObject(t_pOperation->m_hJobsDoneEvent, INFINITE);
+}
+
+void AddOutputEntry(std::wstring* pParam, std::wstring* pConsoleParam, bool bQuiet, bool bError, bool bSkipOutputFile, size_t nOutputFile)
+{
+	OUTPUT_ITEM* pOutputItem = (OUTPUT_ITEM*)_aligned_malloc(sizeof(OUTPUT_ITEM), MEMORY_ALLOCATION_ALIGNMENT);
+	if (NULL == pOutputItem)
+		return;
+
+	pOutputItem->pParam = pParam;
+	pOutputItem->pConsoleParam = pConsoleParam;
+	pOutputItem->bQuiet = bQuiet;
+	pOutputItem->bError = bError;
+	pOutputItem->bSkipOutputFile = bSkipOutputFile;
+	pOutputItem->nOutputFile = nOutputFile;
+	InterlockedPushEntrySList(g_outputsList, &(pOutputItem->ItemEntry));
+	InterlockedIncrement(&g_pendingOutputs);
+
+	SetEvent(g_hOutputReadyEvent);
+}
+
+// ---------------------------------------------
+/*
+ * Largest-first scheduling of the file jobs used by -largestFirst.
+ *
+ * The jobs list is LIFO: a large file found at the end of the enumeration only starts when the other files are
+ * done and it then keeps a single thread busy while the others are idle. With -largestFirst, the jobs created while
+ * the inputs are enumerated are kept in the m_deferredJobs of the operation and queued by QueueDeferredJobs once
+ * the enumeration is done, which gives the size of every file before the first one is read. Files larger than
+ * SCHEDULE_SMALL_FILE_SIZE are started from the largest to the smallest (longest processing time first), the first
+ * one on every thread, and the smaller files are interleaved with them in enumeration order so that the outputs keep
+ * flowing while the large files are read. The SUM file is not affected since it is sorted at the end when -threads
+ * is used.
+ */
+
+#define SCHEDULE_SMALL_FILE_SIZE	(1024 * 1024)
+
+
+void QueueDeferredJobs()
+{
+	vector<threadParam*> largeJobs, smallJobs, scheduledJobs;
+	for (size_t i = 0; i < t_pOperation->m_deferredJobs.size(); i++)
+	{
+		if (t_pOperation->m_deferredJobs[i]->fileSize > SCHEDULE_SMALL_FILE_SIZE)
+			largeJobs.push_back(t_pOperation->m_deferredJobs[i]);
+		else
+			smallJobs.push_back(t_pOperation->m_deferredJobs[i]);
+	}
+	t_pOperation->m_deferredJobs.clear();
+
+	stable_sort(largeJobs.begin(), largeJobs.end(),
+		[](const threadParam* a, const threadParam* b) { return a->fileSize > b->fileSize; });
+
+	size_t nextLarge = 0, nextSmall = 0;
+	scheduledJobs.reserve(largeJobs.size() + smallJobs.size());
+	for (; (nextLarge < largeJobs.size()) && (nextLarge < (size_t)t_pOperation->m_threadsCount); nextLarge++)
+		scheduledJobs.push_back(largeJobs[nextLarge]);
+	while ((nextLarge < largeJobs.size()) || (nextSmall < smallJobs.size()))
+	{
+		if (nextLarge < largeJobs.size())
+			scheduledJobs.push_back(largeJobs[nextLarge++]);
+		if (nextSmall < smallJobs.size())
+			scheduledJobs.push_back(smallJobs[nextSmall++]);
+	}
+
+	// the first job to run is pushed last
+	for (size_t i = scheduledJobs.size(); i > 0; i--)
+		AddHashJobEntry(scheduledJobs[i - 1]);
+
+	SetEvent(g_hReadyEvent);
+}
+
+void AddHashJob(const CPath& filePath, ULONGLONG fileSize, bool bQuiet, bool bShowProgress, bool bSumMode, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, vector<shared_ptr<Hash>>& pHashes, const shared_ptr<CDirHandle>& pDirHandle)
+{
+	threadParam* p = new threadParam(filePath);
+	p->fileSize = fileSize;
+	p->bQuiet = bQuiet;
+	p->bShowProgress = bShowProgress;
+	p->bSumMode = bSumMode;
+	p->bSumVerificationMode = bSumVerificationMode;
+	if (bSumVerificationMode && pbExpectedDigest)
+	{
+		// In verification mode, we always have a single hash
+		p->pbExpectedDigest.resize(pHashes[0]->GetHashSize());
+		memcpy(p->pbExpectedDigest.data(), pbExpectedDigest, pHashes[0]->GetHashSize());
+	}
+	p->pHashes = pHashes;
+	if (g_openedDirHandles <= DIR_HANDLES_MAX)
+		p->pDirHandle = pDirHandle;
+
+	if (t_pOperation->m_bDeferJobs)
+	{
+		t_pOperation->m_deferredJobs.push_back(p);
+		return;
+	}
+
+	AddHashJobEntry(p);
+
+	SetEvent(g_hReadyEvent);
+}
+
+// ---------------------------------------------
+/*
+ * Parallel listing of the directories walked by HashDirectory.
+ *
+ * When worker threads are running, the subdirectories of a directory are queued when the walker enters it, and
+ * the workers list them (enumeration, -nofollow probes and sort) before taking hash jobs. The walker still visits
+ * the tree in the same order: when it reaches a subdirectory, it uses its listing, waits for it if a worker is
+ * producing it or lists it itself if no worker took it yet. Everything that depends on the order (errors, names
+ * hashed with -hashnames, progress, skipped SUM file, jobs) is done by the walker, so the jobs, the SUM files and
+ * the digests are the same as with a sequential walk.
+ * Listings are queued on a LIFO list in reverse order so that the first subdirectory, which is needed first, is
+ * listed first, and the number of listings queued or kept in advance is limited to ENUM_PREFETCH_MAX.
+ */
+
+#define ENUM_PREFETCH_MAX	1024
+
+#define LISTING_PENDING		0
+#define LISTING_RUNNING		1
+#define LISTING_DONE		2
+
+static PSLIST_HEADER g_listingsList = NULL;
+static volatile LONG g_prefetchedListings = 0; // listings queued and not released yet
+
+class CDirListing
+{
+protected:
+	volatile LONG m_state;
+	bool m_bPrefetched;
+
+	// forbid copying
+	CDirListing(const CDirListing&);
+	CDirListing& operator = (const CDirListing&);
+public:
+	CPath m_dirPath;
+	CArena m_arena;
+	vector<DIR_ENTRY*> m_entries; // sorted
+	DWORD m_dwError;
+	bool m_bFindNextFailed; // m_dwError comes from FindNextFile instead of FindFirstFile
+
+	CDirListing(const CPath& dirPath, bool bPrefetched) : m_state(LISTING_PENDING), m_bPrefetched(bPrefetched), m_dirPath(dirPath), m_dwError(0), m_bFindNextFailed(false)
+	{
+		if (m_bPrefetched)
+			InterlockedIncrement(&g_prefetchedListings);
+	}
+
+	~CDirListing()
+	{
+		if (m_bPrefetched)
+			InterlockedDecrement(&g_prefetchedListings);
+	}
+
+	// the thread that changes the state from pending to running lists the directory
+	bool Claim() { return InterlockedCompareExchange(&m_state, LISTING_RUNNING, LISTING_PENDING) == LISTING_PENDING; }
+
+	void Run();
+
+	void WaitDone()
+	{
+		while (m_state != LISTING_DONE)
+			WaitForSingleObject(t_pOperation->m_hListingDoneEvent, INFINITE);
+	}
+};
+
+typedef struct _LISTING_ITEM {
+	SLIST_ENTRY ItemEntry;
+	shared_ptr<CDirListing>* ppListing;
+	CHashOperation* pOperation;
+} LISTING_ITEM, * PLISTING_ITEM;
+
+void QueueDirListing(const shared_ptr<CDirListing>& pListing)
+{
+	LISTING_ITEM* pListingItem = (LISTING_ITEM*)_aligned_malloc(sizeof(LISTING_ITEM), MEMORY_ALLOCATION_ALIGNMENT);
+	if (NULL == pListingItem)
+		return;
+
+	pListingItem->ppListing = new shared_ptr<CDirListing>(pListing);
+	pListingItem->pOperation = t_pOperation;
+	// the operation waits for its queued listings like for its jobs
+	InterlockedIncrement(&t_pOperation->m_unfinishedJobs);
+	InterlockedPushEntrySList(g_listingsList, &(pListingItem->ItemEntry));
+
+	SetEvent(g_hReadyEvent);
+}
+
+// called by the worker threads: list the next queued directory unless the walker already took it
+bool RunQueuedDirListing()
+{
+	LISTING_ITEM* pListingItem = (LISTING_ITEM*)InterlockedPopEntrySList(g_listingsList);
+	if (!pListingItem)
+		return false;
+
+	shared_ptr<CDirListing>* ppListing = pListingItem->ppListing;
+	t_pOperation = pListingItem->pOperation;
+	_aligned_free(pListingItem);
+	if (!t_pOperation->m_bCancelRequested && (*ppListing)->Claim())
+		(*ppListing)->Run();
+	delete ppListing;
+	JobCompleted();
+	return true;
+}
+
+void FreeListingsList()
+{
+	LISTING_ITEM* pListingItem;
+
+	while ((pListingItem = (LISTING_ITEM*)InterlockedPopEntrySList(g_listingsList)))
+	{
+		delete pListingItem->ppListing;
+		_aligned_free(pListingItem);
+	}
+
+	InterlockedFlushSList(g_listingsList);
+	_aligned_free(g_listingsList);
+	g_listingsList = NULL;
+}
+
+// ---------------------------------------------
+/*
+ * Per-block digest manifests used by -blocks.
+ *
+ * When a SUM file is computed with -blocks, the files larger than the block size also get the digests of their
+ * fixed-size blocks written to "<SumFile>.blocks", one line per block:
+ *
+ *   DIGEST:B:OFFSET:LENGTH  PATH
+ *
+ * As in extended SUM lines, the block metadata is attached to the digest so that any path can follow it.
+ * The manifest placed next to the SUM file is loaded automatically by -verify. Files that have block entries are
+ * verified block by block using positioned reads (one job per block when -threads is specified) and the corrupted
+ * byte ranges are reported instead of a single mismatch. -range restricts the verification to the given byte ranges
+ * so that only the blocks reported as corrupted need to be read again.
+ */
+
+#define BLOCK_MANIFEST_EXTENSION		L".blocks"
+
+typedef struct _BLOCK_ENTRY
+{
+	ULONGLONG offset;
+	ULONGLONG length;
+	ByteArray digest;
+} BLOCK_ENTRY;
+
+typedef struct _BYTE_RANGE
+{
+	ULONGLONG start;
+	ULONGLONG end; // inclusive
+} BYTE_RANGE;
+
+static ULONGLONG g_blockSize = 0;
+static FILE* g_pBlockManifestFile = NULL;
+static CRITICAL_SECTION g_blockManifestLock;
+static CPath g_blockManifestFileName;
+static vector<BYTE_RANGE> g_verifyRanges;
+// blocks of the files verified with the manifest and the ones selected by -range, to report a partial verification
+static ULONGLONG g_manifestBlocksCount = 0;
+static ULONGLONG g_selectedBlocksCount = 0;
+
+// parse a "Start-End" byte range as given to -range and as written in corrupted ranges reports
+bool ParseByteRange(LPCWSTR szRange, BYTE_RANGE& range)
+{
+	unsigned long long start = 0, end = 0;
+	int consumed = 0;
+	if ((2 == swscanf(szRange, L"%llu-%llu%n", &start, &end, &consumed)) && (szRange[consumed] == 0) && (start <= end))
+	{
+		range.start = start;
+		range.end = end;
+		return true;
+	}
+	return false;
+}
+
+// feed the data read at the given offset of a file to the digests of the blocks it belongs to
+void UpdateBlockDigests(Hash* pHash, vector<BLOCK_ENTRY>& blocks, shared_ptr<Hash>& pBlockHash, ULONGLONG offset, LPCBYTE pbData, size_t cbData)
+{
+	while (cbData)
+	{
+		if (!pBlockHash)
+		{
+			BLOCK_ENTRY block;
+			block.offset = offset;
+			block.length = 0;
+			blocks.push_back(block);
+			pBlockHash.reset(pHash->Clone());
+		}
+
+		BLOCK_ENTRY& block = blocks.back();
+		size_t cbPart = (size_t)min((ULONGLONG)cbData, g_blockSize - block.length);
+		pBlockHash->Update(pbData, cbPart);
+		block.length += cbPart;
+		offset += cbPart;
+		pbData += cbPart;
+		cbData -= cbPart;
+
+		if (block.length == g_blockSize)
+		{
+			block.digest.resize(pBlockHash->GetHashSize());
+			pBlockHash->Final(block.digest.data());
+			pBlockHash.reset();
+		}
+	}
+}
+
+// write the block digests of a file to the manifest. Called by worker threads too.
+void OutputBlockManifestEntries(LPCTSTR szFilePath, vector<BLOCK_ENTRY>& blocks, shared_ptr<Hash>& pBlockHash)
+{
+	WCHAR szDigestHex[129]; // enough for 64 bytes digest
+
+	if (pBlockHash)
+	{
+		// last block shorter than the block size
+		blocks.back().digest.resize(pBlockHash->GetHashSize());
+		pBlockHash->Final(blocks.back().digest.data());
+		pBlockHash.reset();
+	}
+
+	EnterCriticalSection(&g_blockManifestLock);
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		ToHex(blocks[i].digest.data(), (int)blocks[i].digest.size(), szDigestHex);
+		_ftprintf(g_pBlockManifestFile, L"%s:B:%llu:%llu  %s\n", szDigestHex, blocks[i].offset, blocks[i].length, GetSumEntryPath(szFilePath));
+	}
+	LeaveCriticalSection(&g_blockManifestLock);
+}
+
+class CBlockManifest
+{
+protected:
+	map<wstring, vector<BLOCK_ENTRY>> m_entries;
+
+	// Parse one line of a blocks manifest (without its line terminator)
+	static bool ParseLine(wchar_t* szLine, wstring& entryName, BLOCK_ENTRY& block)
+	{
+		unsigned long long offset = 0, length = 0;
+		int consumed = 0;
+		// the digest and its block metadata are followed by two or one space characters
+		wchar_t* ptr = wcschr(szLine, L' ');
+		if (!ptr)
+			return false;
+
+		*ptr++ = 0;
+		while (*ptr == L' ')
+			ptr++;
+		wchar_t* szMetadata = wcschr(szLine, L':');
+		if (!szMetadata || (2 != swscanf(szMetadata, L":B:%llu:%llu%n", &offset, &length, &consumed)) || !consumed || szMetadata[consumed] || !length)
+			return false;
+		*szMetadata = 0;
+		if (!*ptr || !FromHex(szLine, block.digest))
+			return false;
+
+		block.offset = offset;
+		block.length = length;
+		entryName = ptr;
+		NormalizeSumEntryName(entryName, true);
+		return true;
+	}
+
+public:
+	// return false if the manifest doesn't exist or doesn't match the given digest size
+	bool Load(const CPath& manifestFile, size_t digestSize, size_t& skippedLines)
+	{
+		FILE* f = _wfopen(manifestFile.GetAbsolutPathValue().c_str(), L"rt,ccs=UTF-8");
+		if (!f)
+			return false;
+
+		bool bRet = true;
+		ByteArray buffer(4096 * 2);
+		wchar_t* szLine = (wchar_t*)buffer.data();
+
+		m_entries.clear();
+		skippedLines = 0;
+		while (fgetws(szLine, (int)(buffer.size() / sizeof(wchar_t)), f))
+		{
+			size_t l = wcslen(szLine);
+			if (l && szLine[l - 1] == L'\n')
+				szLine[--l] = 0;
+			// CRLF line endings of files written on Windows, read on other platforms
+			if (l && szLine[l - 1] == L'\r')
+				szLine[--l] = 0;
+			if (l == 0)
+				continue;
+
+			wstring entryName;
+			BLOCK_ENTRY block;
+			if (!ParseLine(szLine, entryName, block))
+			{
+				// lines cut by an interruption of the computation are ignored
+				skippedLines++;
+				continue;
+			}
+
+			if (block.digest.size() != digestSize)
+			{
+				bRet = false;
+				break;
+			}
+
+			vector<BLOCK_ENTRY>& blocks = m_entries[entryName];
+			// a file hashed again (e.g. after -resume or when appending to an existing SUM file) starts a new list
+			if (block.offset == 0)
+				blocks.clear();
+			blocks.push_back(block);
+		}
+		fclose(f);
+
+		if (!bRet)
+			m_entries.clear();
+		return bRet;
+	}
+
+	// return the blocks of the file if they cover it contiguously from its beginning
+	const vector<BLOCK_ENTRY>* Find(const wstring& szPath) const
+	{
+		map<wstring, vector<BLOCK_ENTRY>>::const_iterator It = m_entries.find(szPath);
+		if (It == m_entries.end())
+			return NULL;
+
+		ULONGLONG offset = 0;
+		for (size_t i = 0; i < It->second.size(); i++)
+		{
+			if (It->second[i].offset != offset)
+				return NULL;
+			offset += It->second[i].length;
+		}
+		return &It->second;
+	}
+
+	size_t GetFilesCount() const { return m_entries.size(); }
+};
+
+static CBlockManifest* g_pBlockManifest = NULL;
+
+// Verification of the blocks of a single file. Blocks may be verified by different worker threads: the last one to
+// finish reports the result.
+class CBlockVerification
+{
+protected:
+	CPath m_filePath;
+	vector<BLOCK_ENTRY> m_blocks;
+	vector<BYTE> m_corrupted;
+	vector<DWORD> m_errors;
+	shared_ptr<Hash> m_pHash;
+	bool m_bQuiet;
+	volatile LONG m_pendingBlocks;
+
+	void Output(const wstring& szMsg, bool bError)
+	{
+		if (t_pOperation->m_threadsCount)
+		{
+			if (!m_bQuiet || (t_pOperation->m_outputFiles[0] && !bError))
+				AddOutputEntry(new std::wstring(szMsg), NULL, m_bQuiet, bError, bError, 0);
+		}
+		else if (bError)
+		{
+			if (!m_bQuiet) ShowErrorDirect(szMsg.c_str());
+		}
+		else
+		{
+			if (!m_bQuiet) ShowWarningDirect(szMsg.c_str());
+			if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+		}
+	}
+
+public:
+	CBlockVerification(const CPath& filePath, const vector<BLOCK_ENTRY>& blocks, Hash* pHash, bool bQuiet)
+		: m_filePath(filePath), m_blocks(blocks), m_corrupted(blocks.size(), 0), m_errors(blocks.size(), 0), m_pHash(pHash->Clone()), m_bQuiet(bQuiet), m_pendingBlocks((LONG)blocks.size())
+	{
+	}
+
+	size_t GetBlocksCount() const { return m_blocks.size(); }
+
+	// returns false if the file could not be read and -skipError was not specified
+	bool VerifyBlock(size_t index, LPBYTE pbBuffer, size_t cbBuffer)
+	{
+		const BLOCK_ENTRY& block = m_blocks[index];
+		HANDLE f = CreateFileW(m_filePath.GetAbsolutPathValue().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (f == INVALID_HANDLE_VALUE)
+			m_errors[index] = GetLastError();
+		else
+		{
+			shared_ptr<Hash> pBlockHash(m_pHash->Clone());
+			if (HashFileRange(f, block.offset, block.length, pBlockHash.get(), pbBuffer, cbBuffer))
+			{
+				BYTE pbDigest[128];
+				pBlockHash->Final(pbDigest);
+				m_corrupted[index] = memcmp(pbDigest, block.digest.data(), block.digest.size()) ? 1 : 0;
+			}
+			else
+				m_errors[index] = GetLastError() ? GetLastError() : ERROR_HANDLE_EOF;
+			CloseHandle(f);
+		}
+
+		if (InterlockedDecrement(&m_pendingBlocks) == 0)
+			return Report();
+		return true;
+	}
+
+	bool Report()
+	{
+		for (size_t i = 0; i < m_errors.size(); i++)
+		{
+			if (m_errors[i])
+			{
+				std::wstring szMsg = FormatString(_T("Failed to read file \"%s\" (error 0x%.8X)\n"), m_filePath.GetPathValue().c_str(), m_errors[i]);
+				if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddError(m_filePath.GetPathValue().c_str(), m_errors[i], szMsg);
+				if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+				if (t_pOperation->m_bSkipError)
+				{
+					Output(szMsg, true);
+					t_pOperation->m_bMismatchFound = true;
+					return true;
+				}
+				t_pOperation->m_szLastErrorMsg = szMsg;
+				return false;
+			}
+		}
+
+		// adjacent corrupted blocks are reported as a single range
+		wstring szRanges;
+		for (size_t i = 0; i < m_blocks.size(); i++)
+		{
+			if (!m_corrupted[i])
+				continue;
+			size_t j = i;
+			while ((j + 1 < m_blocks.size()) && m_corrupted[j + 1] && (m_blocks[j + 1].offset == m_blocks[j].offset + m_blocks[j].length))
+				j++;
+			if (!szRanges.empty())
+				szRanges += L", ";
+			szRanges += FormatString(L"%llu-%llu", m_blocks[i].offset, m_blocks[j].offset + m_blocks[j].length - 1);
+			i = j;
+		}
+
+		if (!szRanges.empty())
+		{
+			t_pOperation->m_bMismatchFound = true;
+			Output(FormatString(L"Hash value mismatch for \"%s\" (corrupted byte ranges: %s)\n", m_filePath.GetPathValue().c_str(), szRanges.c_str()), false);
+		}
+
+		if (t_pOperation->m_pJsonOutput)
+		{
+			vector<shared_ptr<Hash>> pHashes(1, m_pHash);
+			ULONGLONG verifiedSize = 0;
+			for (size_t i = 0; i < m_blocks.size(); i++)
+				verifiedSize += m_blocks[i].length;
+			t_pOperation->m_pJsonOutput->AddFile(m_filePath.GetPathValue().c_str(), verifiedSize, 0, szRanges.empty() ? L"ok" : L"mismatch", pHashes, NULL, NULL,
+				szRanges.empty() ? NULL : (L"corrupted byte ranges: " + szRanges).c_str());
+		}
+		return true;
+	}
+};
+
+// Output the SUM file line of the given file digest. nOutputFile is the index of the hash algorithm
+void OutputSumEntry(LPCTSTR szFilePath, bool bQuiet, bool bMultiHash, LPCTSTR szHashId, LPCBYTE pbDigest, int cbDigest, size_t nOutputFile, const FileMetadata& metadata)
+{
+	WCHAR szDigestHex[129]; // enough for 64 bytes digest
+
+	ToHex((LPBYTE)pbDigest, cbDigest, szDigestHex);
+	if (t_pInputRoot)
+		nOutputFile += t_pInputRoot->outputBase;
+
+	// remove the input directory from the path written to the SUM file if needed
+	std::wstring szMsg = FormatSumLine(szDigestHex, GetSumEntryPath(szFilePath), metadata);
+
+	wstring szConsoleMsg;
+	if (!bQuiet && bMultiHash)
+	{
+		szConsoleMsg = FormatString(L"%s: %s", szHashId, szMsg.c_str());
+	}
+	else
+	{
+		szConsoleMsg = szMsg;
+	}
+
+	if (t_pOperation->m_threadsCount)
+	{
+		if (!bQuiet || t_pOperation->m_outputFiles[nOutputFile])
+		{
+			AddOutputEntry(new std::wstring(szMsg), new std::wstring(szConsoleMsg), bQuiet, false, false, nOutputFile);
+		}
+	}
+	else
+	{
+		CStatsScope statsScope(STATS_OUTPUT);
+		if (!bQuiet) ShowWarningDirect(szConsoleMsg.c_str());
+		if (t_pOperation->m_outputFiles[nOutputFile])
+		{
+			// -threads may run without worker threads on a single CPU: the entries still go to the shadow file, which
+			// is sorted at the end and is the one recorded by the checkpoints
+			FILE* fShadow = t_pOperation->m_outputFiles[nOutputFile]->GetShadowFile();
+			_ftprintf(fShadow ? fShadow : *t_pOperation->m_outputFiles[nOutputFile], L"%s", szMsg.c_str());
+		}
+	}
+}
+
+// report the digests of a file in SUM or verification mode. In verification mode, digests holds the digest of the
+// only hash algorithm
+void ReportFileDigests(LPCTSTR szFilePath, ULONGLONG fileSize, LONGLONG jsonStart, LPCWSTR szStatus, bool bQuiet, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, vector<shared_ptr<Hash>>& pHashes, const vector<ByteArray>& digests, const FileMetadata& metadata)
+{
+	if (bSumVerificationMode)
+	{
+		bool bMismatch = memcmp(digests[0].data(), pbExpectedDigest, digests[0].size()) ? true : false;
+		if (t_pOperation->m_pJsonOutput)
+			t_pOperation->m_pJsonOutput->AddFile(szFilePath, fileSize, jsonStart, bMismatch ? L"mismatch" : szStatus, pHashes, &digests, pbExpectedDigest);
+		if (bMismatch)
+		{
+			t_pOperation->m_bMismatchFound = true;
+
+			std::wstring szMsg = FormatString(L"Hash value mismatch for \"%s\"\n", szFilePath);
+
+			if (t_pOperation->m_threadsCount)
+			{
+				if (!bQuiet || t_pOperation->m_outputFiles[0])
+				{
+					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, false, false, 0);
+				}
+			}
+			else
+			{
+				if (!bQuiet) ShowWarningDirect(szMsg.c_str());
+				if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+			}
+		}
+	}
+	else
+	{
+		bool bMultiHash = pHashes.size() > 1;
+		FileMetadata noMetadata;
+		for (size_t i = 0; i < pHashes.size(); i++)
+			OutputSumEntry(szFilePath, bQuiet, bMultiHash, pHashes[i]->GetID(), digests[i].data(), (int)digests[i].size(), i, g_bSumExtended ? metadata : noMetadata);
+		if (t_pOperation->m_pJsonOutput)
+			t_pOperation->m_pJsonOutput->AddFile(szFilePath, fileSize, jsonStart, szStatus, pHashes, &digests, NULL);
+	}
+}
+
+// ---------------------------------------------
+/*
+ * Files having several names (hard links) in SUM and verification modes.
+ *
+ * When a file opened for hashing has more than one link, its identity (volume serial number and file ID, or
+ * device and inode on POSIX) is looked up in a table. The first name found hashes the content and the other names
+ * reuse its digests instead of reading the same data again. With worker threads, a name found while the content is
+ * still being hashed is queued on the entry and reported by the thread that hashes it. An entry is removed once all
+ * the links of the file have been seen. Not used when the names are hashed (-hashnames), since the digests differ
+ * from one name to the other, nor with -blocks and -incremental.
+ */
+
+typedef struct _LINKED_NAME
+{
+	wstring filePath;
+	bool bQuiet;
+	bool bSumVerificationMode;
+	ByteArray expectedDigest;
+	const INPUT_ROOT* pInputRoot;
+} LINKED_NAME;
+
+class CLinkedContent
+{
+public:
+	bool m_bHashed;
+	DWORD m_remainingLinks;
+	ULONGLONG m_size;
+	FileMetadata m_metadata;
+	vector<ByteArray> m_digests;
+	list<LINKED_NAME> m_waitingNames;
+
+	CLinkedContent(DWORD linksCount) : m_bHashed(false), m_remainingLinks(linksCount - 1), m_size(0) {}
+};
+
+#define LINK_NONE		0	// the file has a single name: it is hashed as usual
+#define LINK_OWNER		1	// first name of the file: it is hashed and CLinkedFiles::Complete must be called
+#define LINK_REUSED		2	// the digests of the file were copied
+#define LINK_WAITING	3	// the digests will be reported by the thread hashing the file
+
+class CLinkedFiles
+{
+protected:
+	CRITICAL_SECTION m_lock;
+	map<pair<DWORD, ULONGLONG>, shared_ptr<CLinkedContent>> m_entries;
+
+	// must be called with m_lock held
+	void Release(const pair<DWORD, ULONGLONG>& key, CLinkedContent* pContent)
+	{
+		if (pContent->m_remainingLinks == 0)
+			m_entries.erase(key);
+	}
+
+public:
+	CLinkedFiles() { InitializeCriticalSection(&m_lock); }
+	~CLinkedFiles() { DeleteCriticalSection(&m_lock); }
+
+	int Claim(HANDLE hFile, LPCTSTR szFilePath, bool bQuiet, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, int cbExpectedDigest, shared_ptr<CLinkedContent>& pContent, pair<DWORD, ULONGLONG>& key)
+	{
+		BY_HANDLE_FILE_INFORMATION info;
+		if (!GetFileInformationByHandle(hFile, &info) || (info.nNumberOfLinks <= 1))
+			return LINK_NONE;
+
+		key = make_pair(info.dwVolumeSerialNumber, (((ULONGLONG)info.nFileIndexHigh) << 32) | (ULONGLONG)info.nFileIndexLow);
+		int ret;
+		EnterCriticalSection(&m_lock);
+		map<pair<DWORD, ULONGLONG>, shared_ptr<CLinkedContent>>::iterator It = m_entries.find(key);
+		if (It == m_entries.end())
+		{
+			pContent.reset(new CLinkedContent(info.nNumberOfLinks));
+			m_entries[key] = pContent;
+			ret = LINK_OWNER;
+		}
+		else
+		{
+			pContent = It->second;
+			if (pContent->m_remainingLinks)
+				pContent->m_remainingLinks--;
+			if (pContent->m_bHashed)
+			{
+				Release(key, pContent.get());
+				ret = LINK_REUSED;
+			}
+			else
+			{
+				LINKED_NAME name;
+				name.filePath = szFilePath;
+				name.bQuiet = bQuiet;
+				name.bSumVerificationMode = bSumVerificationMode;
+				if (bSumVerificationMode)
+					name.expectedDigest.assign(pbExpectedDigest, pbExpectedDigest + cbExpectedDigest);
+				name.pInputRoot = t_pInputRoot;
+				pContent->m_waitingNames.push_back(name);
+				ret = LINK_WAITING;
+			}
+		}
+		LeaveCriticalSection(&m_lock);
+		return ret;
+	}
+
+	// record the digests computed by the owner of the content and report the names waiting for them
+	void Complete(const pair<DWORD, ULONGLONG>& key, const shared_ptr<CLinkedContent>& pContent, ULONGLONG size, const FileMetadata& metadata, const vector<ByteArray>& digests, vector<shared_ptr<Hash>>& pHashes)
+	{
+		list<LINKED_NAME> waitingNames;
+		EnterCriticalSection(&m_lock);
+		pContent->m_bHashed = true;
+		pContent->m_size = size;
+		pContent->m_metadata = metadata;
+		pContent->m_digests = digests;
+		waitingNames.swap(pContent->m_waitingNames);
+		Release(key, pContent.get());
+		LeaveCriticalSection(&m_lock);
+
+		const INPUT_ROOT* pInputRoot = t_pInputRoot;
+		for (list<LINKED_NAME>::iterator It = waitingNames.begin(); It != waitingNames.end(); It++)
+		{
+			t_pInputRoot = It->pInputRoot;
+			Report(It->filePath.c_str(), It->bQuiet, It->bSumVerificationMode, It->expectedDigest.data(), *pContent, pHashes);
+		}
+		t_pInputRoot = pInputRoot;
+	}
+
+	// the content couldn't be hashed: the entry is dropped along with the names waiting for it
+	void Abandon(const pair<DWORD, ULONGLONG>& key)
+	{
+		EnterCriticalSection(&m_lock);
+		m_entries.erase(key);
+		LeaveCriticalSection(&m_lock);
+	}
+
+	// report the digests of the content for one of its other names
+	static void Report(LPCTSTR szFilePath, bool bQuiet, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, const CLinkedContent& content, vector<shared_ptr<Hash>>& pHashes)
+	{
+		if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_SKIPPED);
+		ReportFileDigests(szFilePath, content.m_size, 0, L"linked", bQuiet, bSumVerificationMode, pbExpectedDigest, pHashes, content.m_digests, content.m_metadata);
+	}
+};
+
+void ProcessFile(HANDLE f, ULONGLONG fileSize, LPCTSTR szFilePath, bool bQuiet, bool bShowProgress, bool bSumMode, bool bSumVerificationMode, LPCBYTE pbExpectedDigest, vector<shared_ptr<Hash>>& pHashes, LPBYTE pbBuffer, size_t cbBuffer)
+{
+	bShowProgress = bShowProgress && g_pProgress; // the progress line is drawn by the render thread of g_pProgress
+	unsigned long long currentSize = 0;
+	DWORD cbCount = 0;
+	LONGLONG jsonStart = t_pOperation->m_pJsonOutput ? CJsonOutput::Now() : 0;
+	bool bUseCache = bSumMode && !bSumVerificationMode && t_pOperation->m_pHashCache;
+	bool bComputeBlocks = bSumMode && !bSumVerificationMode && g_pBlockManifestFile && (fileSize > g_blockSize);
+	vector<BLOCK_ENTRY> blocks;
+	shared_ptr<Hash> pBlockHash;
+	FileMetadata metadata, cacheMetadata;
+	shared_ptr<CLinkedContent> pLinkedContent;
+	pair<DWORD, ULONGLONG> linkKey;
+
+	if (bSumMode && t_pOperation->m_pLinkedFiles)
+	{
+		int link = t_pOperation->m_pLinkedFiles->Claim(f, szFilePath, bQuiet, bSumVerificationMode, pbExpectedDigest, pHashes[0]->GetHashSize(), pLinkedContent, linkKey);
+		if ((link == LINK_REUSED) || (link == LINK_WAITING))
+		{
+			// the content is hashed through another name of the file
+			CloseHandle(f);
+			if (link == LINK_REUSED)
+				CLinkedFiles::Report(szFilePath, bQuiet, bSumVerificationMode, pbExpectedDigest, *pLinkedContent, pHashes);
+			return;
+		}
+	}
+
+	// metadata queried before reading the file so that we can detect changes done while hashing it
+	if (bUseCache && cacheMetadata.Set(f))
+		cacheMetadata.QueryChangeTime(f);
+
+	if (bShowProgress)
+		g_pProgress->BeginFile(szFilePath, fileSize);
+
+	LONGLONG readStart = (g_pRunStats || g_pTrace) ? CRunStats::Now() : 0;
+	while (!t_pOperation->m_bCancelRequested && ReadFile(f, pbBuffer, (DWORD) cbBuffer, &cbCount, NULL) && cbCount)
+	{
+		if (readStart)
+		{
+			LONGLONG readEnd = CRunStats::Now();
+			if (g_pRunStats)
+				g_pRunStats->AddRead(cbCount, readEnd - readStart);
+			if (g_pTrace)
+				g_pTrace->AddSpan(STATS_READ, readStart, readEnd);
+		}
+		{
+			CStatsScope statsScope(STATS_HASH);
+			if (bComputeBlocks)
+				UpdateBlockDigests(pHashes[0].get(), blocks, pBlockHash, currentSize, pbBuffer, cbCount);
+			UpdateHashes(pHashes,pbBuffer, cbCount);
+		}
+		currentSize += (unsigned long long) cbCount;
+		if (bShowProgress)
+			g_pProgress->UpdateFile(currentSize);
+		if (currentSize == fileSize)
+			break;
+		if (readStart)
+			readStart = CRunStats::Now();
+	}
+
+	if (g_pRunStats)
+	{
+		g_pRunStats->Increment(STATS_FILES_HASHED);
+		for (size_t i = 0; i < pHashes.size(); i++)
+			g_pRunStats->AddHashedBytes(pHashes[i]->GetID(), currentSize);
+	}
+
+	if (t_pOperation->m_bCancelRequested)
+	{
+		// the digest of a partially read file is not reported
+		CloseHandle(f);
+		if (bShowProgress)
+			g_pProgress->EndFile();
+		if (pLinkedContent)
+			t_pOperation->m_pLinkedFiles->Abandon(linkKey);
+		return;
+	}
+
+	// collect metadata for extended SUM files and for the cache while the handle is still opened
+	if (bSumMode && !bSumVerificationMode && (g_bSumExtended || bUseCache) && metadata.Set(f) && bUseCache)
+		metadata.QueryChangeTime(f);
+
+	CloseHandle(f);
+
+	if (bShowProgress)
+		g_pProgress->EndFile();
+
+	if (bComputeBlocks && (currentSize == fileSize))
+		OutputBlockManifestEntries(szFilePath, blocks, pBlockHash);
+
+	if (bSumMode)
+	{
+		// in verification mode we only have one hash
+		vector<ByteArray> digests(bSumVerificationMode ? 1 : pHashes.size());
+		for (size_t i = 0; i < digests.size(); i++)
+		{
+			BYTE pbSumDigest[128];
+			{
+				CStatsScope statsScope(STATS_FINALIZE);
+				pHashes[i]->Final(pbSumDigest);
+			}
+			digests[i].assign(pbSumDigest, pbSumDigest + pHashes[i]->GetHashSize());
+
+			if (bUseCache)
+				t_pOperation->m_pHashCache->Store(cacheMetadata, metadata, pHashes[i]->GetID(), pbSumDigest, pHashes[i]->GetHashSize());
+		}
+
+		ReportFileDigests(szFilePath, currentSize, jsonStart, L"ok", bQuiet, bSumVerificationMode, pbExpectedDigest, pHashes, digests, metadata);
+		if (pLinkedContent)
+			t_pOperation->m_pLinkedFiles->Complete(linkKey, pLinkedContent, currentSize, metadata, digests, pHashes);
+	}
+	else if (t_pOperation->m_pJsonOutput)
+	{
+		// the file is part of the directory digest so there is no digest of its own
+		t_pOperation->m_pJsonOutput->AddFile(szFilePath, currentSize, jsonStart, L"ok", pHashes, NULL, NULL);
+	}
+}
+
+// split the range [streamOffset, streamOffset + fileSize) of the BLAKE3 stream occupied by a file into the parts fed to
+// the hasher: subtrees of at least 2 chunks aligned on their size, and raw data for everything else (partial chunks
+// at both edges and isolated chunks)
+void PlanIncrementalSegments(ULONGLONG streamOffset, ULONGLONG fileSize, vector<INCREMENTAL_SEGMENT>& segments)
+{
+	ULONGLONG firstChunk = (streamOffset + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+	ULONGLONG endChunk = (streamOffset + fileSize) / BLAKE3_CHUNK_LEN;
+	ULONGLONG chunk;
+	INCREMENTAL_SEGMENT segment;
+
+	segments.clear();
+	if (firstChunk >= endChunk)
+	{
+		// the file doesn't contain any complete chunk
+		segment.fileOffset = 0;
+		segment.length = fileSize;
+		segment.chunkCounter = 0;
+		segment.chunksCount = 0;
+		if (fileSize)
+			segments.push_back(segment);
+		return;
+	}
+
+	if (firstChunk * BLAKE3_CHUNK_LEN > streamOffset)
+	{
+		segment.fileOffset = 0;
+		segment.length = firstChunk * BLAKE3_CHUNK_LEN - streamOffset;
+		segment.chunkCounter = 0;
+		segment.chunksCount = 0;
+		segments.push_back(segment);
+	}
+
+	for (chunk = firstChunk; chunk < endChunk; chunk += segment.chunksCount ? segment.chunksCount : 1)
+	{
+		// largest power of 2 number of chunks that is aligned on its size and fits in the file
+		ULONGLONG n = 1;
+		while (((chunk & ((n << 1) - 1)) == 0) && ((chunk + (n << 1)) <= endChunk))
+			n <<= 1;
+
+		segment.fileOffset = chunk * BLAKE3_CHUNK_LEN - streamOffset;
+		segment.length = n * BLAKE3_CHUNK_LEN;
+		segment.chunkCounter = chunk;
+		segment.chunksCount = (n >= 2) ? n : 0;
+		if (!segment.chunksCount && !segments.empty() && !segments.back().chunksCount)
+			segments.back().length += segment.length; // merge consecutive raw data
+		else
+			segments.push_back(segment);
+	}
+
+	if (endChunk * BLAKE3_CHUNK_LEN < streamOffset + fileSize)
+	{
+		segment.fileOffset = endChunk * BLAKE3_CHUNK_LEN - streamOffset;
+		segment.length = streamOffset + fileSize - endChunk * BLAKE3_CHUNK_LEN;
+		segment.chunkCounter = 0;
+		segment.chunksCount = 0;
+		if (!segments.empty() && !segments.back().chunksCount)
+			segments.back().length += segment.length;
+		else
+			segments.push_back(segment);
+	}
+}
+
+// reads parts of a file for the incremental directory digest and displays the progress
+class CIncrementalFileReader
+{
+protected:
+	HANDLE m_hFile;
+	Blake3Hash* m_pHash;
+	LPBYTE m_pbBuffer;
+	size_t m_cbBuffer;
+	ULONGLONG m_fileSize;
+	ULONGLONG m_currentSize;
+	bool m_bShowProgress;
+
+	bool Read(ULONGLONG cbData)
+	{
+		DWORD cbCount = 0;
+		if (!ReadFile(m_hFile, m_pbBuffer, (DWORD)cbData, &cbCount, NULL) || (cbCount != (DWORD)cbData))
+			return false;
+		m_currentSize += cbData;
+		if (m_bShowProgress)
+			g_pProgress->UpdateFile(m_currentSize);
+		return true;
+	}
+
+	// chaining value of a complete subtree read from the current file position
+	bool ComputeSubtreeCv(ULONGLONG chunkCounter, ULONGLONG chunksCount, LPBYTE pbCv)
+	{
+		BYTE pbChunkCvs[INCREMENTAL_BUFFER_CHUNKS * BLAKE3_OUT_LEN];
+		BYTE pbStack[64][BLAKE3_OUT_LEN];
+		int depth = 0;
+		ULONGLONG doneCount = 0;
+
+		while (doneCount < chunksCount)
+		{
+			size_t n = (size_t)min(chunksCount - doneCount, (ULONGLONG)(m_cbBuffer / BLAKE3_CHUNK_LEN));
+			if (!Read((ULONGLONG)n * BLAKE3_CHUNK_LEN))
+				return false;
+			m_pHash->CompressChunks(m_pbBuffer, n, chunkCounter + doneCount, pbChunkCvs);
+			for (size_t i = 0; i < n; i++)
+			{
+				memcpy(pbStack[depth++], &pbChunkCvs[i * BLAKE3_OUT_LEN], BLAKE3_OUT_LEN);
+				doneCount++;
+				// merge completed subtrees: the stack entries are contiguous so the two top ones form a parent block
+				for (ULONGLONG c = doneCount; !(c & 1); c >>= 1)
+				{
+					m_pHash->ComputeParentCv(pbStack[depth - 2], pbStack[depth - 2]);
+					depth--;
+				}
+			}
+		}
+
+		memcpy(pbCv, pbStack[0], BLAKE3_OUT_LEN);
+		return true;
+	}
+
+public:
+	CIncrementalFileReader(HANDLE hFile, Blake3Hash* pHash, LPBYTE pbBuffer, size_t cbBuffer, ULONGLONG fileSize, bool bShowProgress)
+		: m_hFile(hFile), m_pHash(pHash), m_pbBuffer(pbBuffer), m_cbBuffer(cbBuffer), m_fileSize(fileSize), m_currentSize(0),
+		m_bShowProgress(bShowProgress)
+	{
+	}
+
+	bool Seek(ULONGLONG offset)
+	{
+		LARGE_INTEGER li;
+		li.QuadPart = (LONGLONG)offset;
+		return SetFilePointerEx(m_hFile, li, NULL, FILE_BEGIN) ? true : false;
+	}
+
+	// feed the hasher with raw file data
+	bool HashData(ULONGLONG cbData)
+	{
+		while (cbData)
+		{
+			ULONGLONG n = min(cbData, (ULONGLONG)m_cbBuffer);
+			if (!Read(n))
+				return false;
+			m_pHash->Update(m_pbBuffer, (size_t)n);
+			cbData -= n;
+		}
+		return true;
+	}
+
+	// compute the chaining values of both halves of a subtree
+	bool ComputeSubtree(ULONGLONG chunkCounter, ULONGLONG chunksCount, LPBYTE pbCvPair)
+	{
+		return ComputeSubtreeCv(chunkCounter, chunksCount / 2, pbCvPair)
+			&& ComputeSubtreeCv(chunkCounter + chunksCount / 2, chunksCount / 2, pbCvPair + BLAKE3_OUT_LEN);
+	}
+
+	void AddSkipped(ULONGLONG cbData)
+	{
+		m_currentSize += cbData;
+		if (m_bShowProgress)
+			g_pProgress->UpdateFile(m_currentSize);
+	}
+};
+
+// hash the content of a file in the classic mode using the chaining values stored by the previous run for the parts
+// of the file that didn't change. The file handle is closed by this function.
+void ProcessFileIncremental(HANDLE f, ULONGLONG fileSize, const wstring& szFilePath, bool bQuiet, bool bShowProgress, Blake3Hash* pHash)
+{
+	bShowProgress = bShowProgress && g_pProgress;
+	LONGLONG jsonStart = t_pOperation->m_pJsonOutput ? CJsonOutput::Now() : 0;
+	FileMetadata metadata, metadataAfter;
+	CIncrementalEntry newEntry;
+	vector<INCREMENTAL_SEGMENT> segments;
+	ULONGLONG streamOffset = pHash->GetStreamPosition();
+	ULONGLONG reusedBytes = 0;
+	bool bOk = true, bStore = true;
+
+	if (metadata.Set(f))
+		metadata.QueryChangeTime(f);
+
+	const CIncrementalEntry* pPreviousEntry = g_pIncrementalState->Find(szFilePath, metadata, streamOffset);
+	size_t subtreeIndex = 0;
+
+	PlanIncrementalSegments(streamOffset, fileSize, segments);
+	if (bShowProgress)
+		g_pProgress->BeginFile(szFilePath.c_str(), fileSize);
+	CIncrementalFileReader reader(f, pHash, g_pIncrementalState->GetBuffer(), g_pIncrementalState->GetBufferSize(), fileSize, bShowProgress);
+
+	for (size_t i = 0; bOk && (i < segments.size()); i++)
+	{
+		const INCREMENTAL_SEGMENT& segment = segments[i];
+		if (!segment.chunksCount)
+		{
+			bOk = reader.Seek(segment.fileOffset) && reader.HashData(segment.length);
+			continue;
+		}
+
+		INCREMENTAL_SUBTREE subtree;
+		subtree.chunkCounter = segment.chunkCounter;
+		subtree.chunksCount = segment.chunksCount;
+
+		if (pPreviousEntry
+			&& (subtreeIndex < pPreviousEntry->m_subtrees.size())
+			&& (pPreviousEntry->m_subtrees[subtreeIndex].chunkCounter == segment.chunkCounter)
+			&& (pPreviousEntry->m_subtrees[subtreeIndex].chunksCount == segment.chunksCount)
+			)
+		{
+			memcpy(subtree.cvPair, pPreviousEntry->m_subtrees[subtreeIndex].cvPair, sizeof(subtree.cvPair));
+			reader.AddSkipped(segment.length);
+			reusedBytes += segment.length;
+		}
+		else
+			bOk = reader.Seek(segment.fileOffset) && reader.ComputeSubtree(segment.chunkCounter, segment.chunksCount, subtree.cvPair);
+
+		if (bOk)
+		{
+			if (!pHash->PushSubtree(subtree.cvPair, subtree.chunksCount))
+			{
+				// can't happen since segments are aligned on chunk boundaries
+				bOk = reader.Seek(segment.fileOffset) && reader.HashData(segment.length);
+				bStore = false;
+			}
+			else
+				newEntry.m_subtrees.push_back(subtree);
+		}
+		subtreeIndex++;
+	}
+
+	// metadata queried after reading the file to detect changes done while hashing it
+	if (metadataAfter.Set(f))
+		metadataAfter.QueryChangeTime(f);
+
+	CloseHandle(f);
+
+	if (bShowProgress)
+		g_pProgress->EndFile();
+
+	if (bOk && bStore && IsStableMetadata(metadata, metadataAfter))
+	{
+		newEntry.m_metadata = metadata;
+		newEntry.m_streamOffset = streamOffset;
+		g_pIncrementalState->Add(szFilePath, newEntry);
+	}
+
+	if (pPreviousEntry && reusedBytes)
+		g_pIncrementalState->AddReusedFile(reusedBytes);
+	else
+		g_pIncrementalState->AddHashedFile();
+
+	if (t_pOperation->m_pJsonOutput)
+	{
+		vector<shared_ptr<Hash>> noHashes;
+		t_pOperation->m_pJsonOutput->AddFile(szFilePath.c_str(), fileSize, jsonStart, bOk ? L"ok" : L"error", noHashes, NULL, NULL);
+	}
+}
+
+// ---------------------------------------------
+/*
+ * Checkpoints of a SUM computation, used by -resume.
+ *
+ * While a SUM file is computed, the output files are periodically flushed to disk and their lengths are recorded
+ * in a checkpoint file stored next to the SUM file (".dirhash_checkpoint" suffix), together with the options of
+ * the run. All lines before the recorded lengths are complete. When -resume is specified, the output files are
+ * truncated to the recorded lengths and the files whose entries were written since the start of the interrupted
+ * run are skipped. The directory is enumerated again, so files added or removed in the meantime are taken into
+ * account. The checkpoint file is deleted when the computation completes.
+ */
+
+#define CHECKPOINT_MAGIC				"DHCKPT01"
+#define CHECKPOINT_INTERVAL				30000 // milliseconds
+
+class CCheckpointFile
+{
+public:
+	wstring m_fileName;
+	wstring m_shadowFileName; // empty if no shadow file is used
+	ULONGLONG m_fileLength;
+	ULONGLONG m_shadowLength;
+	ULONGLONG m_startOffset; // offset of the first entry of the run in the shadow file if any, otherwise in the SUM file
+
+	CCheckpointFile() : m_fileLength(0), m_shadowLength(0), m_startOffset(0) {}
+};
+
+class CCheckpoint
+{
+protected:
+	wstring m_checkpointPath;
+	wstring m_options;
+	vector<CCheckpointFile> m_files;
+	map<wstring, size_t> m_completedEntries;
+	ULONGLONG m_lastCheckpointTime;
+	ULONGLONG m_skippedCount;
+	CRITICAL_SECTION m_lock; // serializes the writers of the checkpoint with the control handler
+	bool m_bInterrupted;
+
+	// forbid copying
+	CCheckpoint(const CCheckpoint&) {}
+	CCheckpoint& operator = (const CCheckpoint&) { return *this; }
+
+	static bool WriteData(HANDLE hFile, const void* pData, size_t cbData)
+	{
+		DWORD cbWritten = 0;
+		return WriteFile(hFile, pData, (DWORD)cbData, &cbWritten, NULL) && (cbWritten == (DWORD)cbData);
+	}
+
+	static bool WriteString(HANDLE hFile, const wstring& str)
+	{
+		DWORD len = (DWORD)str.length();
+		return WriteData(hFile, &len, sizeof(len)) && (!len || WriteData(hFile, str.c_str(), len * sizeof(WCHAR)));
+	}
+
+	static bool ReadData(const ByteArray& content, size_t& pos, void* pData, size_t cbData)
+	{
+		if ((content.size() - pos) < cbData)
+			return false;
+		memcpy(pData, &content[pos], cbData);
+		pos += cbData;
+		return true;
+	}
+
+	static bool ReadString(const ByteArray& content, size_t& pos, wstring& str)
+	{
+		DWORD len = 0;
+		if (!ReadData(content, pos, &len, sizeof(len)) || ((content.size() - pos) / sizeof(WCHAR) < (size_t)len))
+			return false;
+		str.assign((LPCWSTR)&content[pos], (size_t)len);
+		pos += (size_t)len * sizeof(WCHAR);
+		return true;
+	}
+
+	static bool ReadFileContent(const wstring& szPath, ULONGLONG offset, ULONGLONG length, ByteArray& content)
+	{
+		HANDLE hFile = CreateFileW(szPath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER li;
+		DWORD cbRead = 0;
+		li.QuadPart = (LONGLONG)offset;
+		content.resize((size_t)length);
+		bool bRet = (length < 0x80000000ULL) && SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) && (!length || (ReadFile(hFile, content.data(), (DWORD)length, &cbRead, NULL) && (cbRead == (DWORD)length)));
+		CloseHandle(hFile);
+		return bRet;
+	}
+
+	static bool TruncateFile(const wstring& szPath, ULONGLONG length)
+	{
+		HANDLE hFile = CreateFileW(szPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize, li;
+		li.QuadPart = (LONGLONG)length;
+		// the file can't be shorter than the length recorded since it was flushed to disk
+		bool bRet = GetFileSizeEx(hFile, &fileSize) && ((ULONGLONG)fileSize.QuadPart >= length) && SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+		CloseHandle(hFile);
+		return bRet;
+	}
+
+	// flush the given output file to disk and return its length
+	static bool FlushOutputFile(FILE* f, ULONGLONG& length)
+	{
+		if (fflush(f))
+			return false;
+		FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(f)));
+		__int64 fileLength = _filelengthi64(_fileno(f));
+		if (fileLength < 0)
+			return false;
+		length = (ULONGLONG)fileLength;
+		return true;
+	}
+
+public:
+	CCheckpoint(const wstring& szCheckpointPath, const wstring& szOptions)
+		: m_checkpointPath(szCheckpointPath), m_options(szOptions), m_lastCheckpointTime(0), m_skippedCount(0), m_bInterrupted(false)
+	{
+		InitializeCriticalSection(&m_lock);
+	}
+
+	~CCheckpoint()
+	{
+		DeleteCriticalSection(&m_lock);
+	}
+
+	// load the checkpoint of an interrupted run. It is only accepted if it was created using the same options
+	bool Load()
+	{
+		ByteArray content;
+		HANDLE hFile = CreateFileW(m_checkpointPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER fileSize;
+		bool bRet = GetFileSizeEx(hFile, &fileSize) && (fileSize.QuadPart < 0x1000000LL);
+		CloseHandle(hFile);
+
+		if (!bRet || !ReadFileContent(m_checkpointPath, 0, (ULONGLONG)fileSize.QuadPart, content))
+			return false;
+
+		size_t pos = 0;
+		char magic[8];
+		wstring szOptions;
+		DWORD filesCount = 0;
+		if (!ReadData(content, pos, magic, sizeof(magic)) || memcmp(magic, CHECKPOINT_MAGIC, 8)
+			|| !ReadString(content, pos, szOptions) || (szOptions != m_options)
+			|| !ReadData(content, pos, &filesCount, sizeof(filesCount))
+			)
+		{
+			return false;
+		}
+
+		vector<CCheckpointFile> files(filesCount);
+		for (DWORD i = 0; i < filesCount; i++)
+		{
+			if (!ReadString(content, pos, files[i].m_fileName)
+				|| !ReadString(content, pos, files[i].m_shadowFileName)
+				|| !ReadData(content, pos, &files[i].m_fileLength, sizeof(ULONGLONG))
+				|| !ReadData(content, pos, &files[i].m_shadowLength, sizeof(ULONGLONG))
+				|| !ReadData(content, pos, &files[i].m_startOffset, sizeof(ULONGLONG))
+				)
+			{
+				return false;
+			}
+		}
+
+		m_files = files;
+		return true;
+	}
+
+	// drop the content written to the output files after the last checkpoint
+	bool RestoreOutputFiles()
+	{
+		for (size_t i = 0; i < m_files.size(); i++)
+		{
+			if (!TruncateFile(m_files[i].m_fileName, m_files[i].m_fileLength))
+				return false;
+			if (!m_files[i].m_shadowFileName.empty() && !TruncateFile(m_files[i].m_shadowFileName, m_files[i].m_shadowLength))
+				return false;
+		}
+		return true;
+	}
+
+	// load the entries written by the interrupted run. Must be called once the input directory is known
+	bool LoadCompletedEntries()
+	{
+		m_completedEntries.clear();
+		for (size_t i = 0; i < m_files.size(); i++)
+		{
+			const CCheckpointFile& file = m_files[i];
+			bool bShadow = !file.m_shadowFileName.empty();
+			ULONGLONG endOffset = bShadow ? file.m_shadowLength : file.m_fileLength;
+			ByteArray content;
+
+			if ((endOffset < file.m_startOffset) || !ReadFileContent(bShadow ? file.m_shadowFileName : file.m_fileName, file.m_startOffset, endOffset - file.m_startOffset, content))
+				return false;
+
+			// skip the UTF-8 BOM written at the beginning of a new file
+			size_t start = 0;
+			if ((content.size() >= 3) && (content[0] == 0xEF) && (content[1] == 0xBB) && (content[2] == 0xBF))
+				start = 3;
+			if (content.size() == start)
+				continue;
+
+			int cchText = MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)&content[start], (int)(content.size() - start), NULL, 0);
+			if (cchText <= 0)
+				return false;
+			vector<wchar_t> text((size_t)cchText + 1, 0);
+			MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)&content[start], (int)(content.size() - start), text.data(), cchText);
+
+			size_t digestLen = 0;
+			wchar_t* szLine = text.data();
+			while (*szLine)
+			{
+				wchar_t* szEnd = wcschr(szLine, L'\n');
+				wchar_t* szNext = szEnd ? szEnd + 1 : szLine + wcslen(szLine);
+				if (szEnd)
+					*szEnd = 0;
+				size_t l = wcslen(szLine);
+				if (l && (szLine[l - 1] == L'\r'))
+					szLine[--l] = 0;
+
+				wstring entryName;
+				ByteArray digest;
+				FileMetadata metadata;
+				if (l && ParseSumLine(szLine, l, digestLen, true, entryName, digest, metadata))
+					m_completedEntries[entryName]++;
+				szLine = szNext;
+			}
+		}
+		return true;
+	}
+
+	// record the initial state of the output files of a new run
+	void Start()
+	{
+		m_files.clear();
+		for (size_t i = 0; i < t_pOperation->m_outputFiles.size(); i++)
+		{
+			CCheckpointFile file;
+			if (t_pOperation->m_outputFiles[i])
+			{
+				file.m_fileName = t_pOperation->m_outputFiles[i]->GetFileName();
+				file.m_shadowFileName = t_pOperation->m_outputFiles[i]->GetShadowFileName();
+				FlushOutputFile(*t_pOperation->m_outputFiles[i], file.m_fileLength);
+				if (t_pOperation->m_outputFiles[i]->GetShadowFile())
+					FlushOutputFile(t_pOperation->m_outputFiles[i]->GetShadowFile(), file.m_shadowLength);
+				file.m_startOffset = file.m_shadowFileName.empty() ? file.m_fileLength : file.m_shadowLength;
+			}
+			m_files.push_back(file);
+		}
+		m_lastCheckpointTime = GetTickCount64();
+	}
+
+	// write a checkpoint if the interval elapsed since the last one. Must be called by the thread writing to the
+	// output files, between two entries.
+	bool Update(bool bForce)
+	{
+		EnterCriticalSection(&m_lock);
+		// the checkpoint written by the control handler is the last one of the process
+		bool bRet = m_bInterrupted || Write(bForce);
+		LeaveCriticalSection(&m_lock);
+		return bRet;
+	}
+
+	// write a checkpoint when the process is interrupted (Ctrl+C, SIGINT, console closed). Called by the control
+	// handler while the other threads may still be writing: each entry is written to an output file by a single
+	// call, so a flush never splits it, and the entries written afterwards are dropped by -resume.
+	bool Interrupt()
+	{
+		EnterCriticalSection(&m_lock);
+		bool bRet = m_bInterrupted || m_files.empty() || Write(true);
+		m_bInterrupted = true;
+		LeaveCriticalSection(&m_lock);
+		return bRet;
+	}
+
+protected:
+	bool Write(bool bForce)
+	{
+		ULONGLONG now = GetTickCount64();
+		if (!bForce && (now < m_lastCheckpointTime + CHECKPOINT_INTERVAL))
+			return true;
+		m_lastCheckpointTime = now;
+
+		if (g_pBlockManifestFile)
+		{
+			// block entries are written before the SUM entries of their file so they are complete up to this point
+			EnterCriticalSection(&g_blockManifestLock);
+			fflush(g_pBlockManifestFile);
+			LeaveCriticalSection(&g_blockManifestLock);
+		}
+
+		for (size_t i = 0; (i < m_files.size()) && (i < t_pOperation->m_outputFiles.size()); i++)
+		{
+			if (!t_pOperation->m_outputFiles[i])
+				continue;
+			if (!FlushOutputFile(*t_pOperation->m_outputFiles[i], m_files[i].m_fileLength))
+				return false;
+			if (t_pOperation->m_outputFiles[i]->GetShadowFile() && !FlushOutputFile(t_pOperation->m_outputFiles[i]->GetShadowFile(), m_files[i].m_shadowLength))
+				return false;
+		}
+
+		wstring szTempPath = m_checkpointPath + L".tmp";
+		HANDLE hFile = CreateFileW(szTempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		DWORD filesCount = (DWORD)m_files.size();
+		bool bRet = WriteData(hFile, CHECKPOINT_MAGIC, 8) && WriteString(hFile, m_options) && WriteData(hFile, &filesCount, sizeof(filesCount));
+		for (size_t i = 0; bRet && (i < m_files.size()); i++)
+		{
+			bRet = WriteString(hFile, m_files[i].m_fileName)
+				&& WriteString(hFile, m_files[i].m_shadowFileName)
+				&& WriteData(hFile, &m_files[i].m_fileLength, sizeof(ULONGLONG))
+				&& WriteData(hFile, &m_files[i].m_shadowLength, sizeof(ULONGLONG))
+				&& WriteData(hFile, &m_files[i].m_startOffset, sizeof(ULONGLONG));
+		}
+
+		if (bRet)
+			bRet = FlushFileBuffers(hFile) ? true : false;
+		CloseHandle(hFile);
+
+		if (bRet)
+			bRet = MoveFileExW(szTempPath.c_str(), m_checkpointPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? true : false;
+		if (!bRet)
+			DeleteFileW(szTempPath.c_str());
+		return bRet;
+	}
+
+public:
+	// a file is completed if its entry was written to all the output files
+	bool IsCompleted(const wstring& szPath) const
+	{
+		map<wstring, size_t>::const_iterator It = m_completedEntries.find(szPath);
+		return (It != m_completedEntries.end()) && (It->second >= m_files.size());
+	}
+
+	void AddSkipped() { m_skippedCount++; }
+	ULONGLONG GetSkippedCount() const { return m_skippedCount; }
+
+	void Remove() { DeleteFileW(m_checkpointPath.c_str()); }
+};
+
+static CCheckpoint* g_pCheckpoint = NULL;
+
+DWORD WINAPI OutputThreadCode(LPVOID pArg)
+{
+	HANDLE syncObjs[2] = { g_hOutputReadyEvent, g_hOutputStopEvent };
+
+	SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+
+	if (g_pTrace)
+		g_pTrace->SetThreadName(L"output");
+
+	while (!g_bFatalError)
+	{
+		std::wstring* p = NULL;
+		std::wstring* pConsole = NULL;
+		OUTPUT_ITEM* pOutput;
+		
+		while (!g_bFatalError && (pOutput = (OUTPUT_ITEM*)InterlockedPopEntrySList(g_outputsList)))
+		{
+			CStatsScope statsScope(STATS_OUTPUT);
+			bool bDeleteConsole = true;
+			InterlockedDecrement(&g_pendingOutputs);
+			p = pOutput->pParam;
+			pConsole = pOutput->pConsoleParam;
+			if (!pConsole)
+			{
+				bDeleteConsole = false;
+				pConsole = p;
+			}
+			if (!pOutput->bQuiet)
+			{
+				if (pOutput->bError)
+					ShowErrorDirect(pConsole->c_str());
+				else
+					ShowWarningDirect(pConsole->c_str());
+			}
+			if (!pOutput->bSkipOutputFile && t_pOperation->m_outputFiles[pOutput->nOutputFile]) {
+				FILE* fTarget = *t_pOperation->m_outputFiles[pOutput->nOutputFile];
+				// write to shadow file if it is enabled
+				FILE* fShadow = t_pOperation->m_outputFiles[pOutput->nOutputFile]->GetShadowFile();
+				if (fShadow) fTarget = fShadow;
+
+				_ftprintf(fTarget, L"%s", p->c_str());
+			}
+			delete p;
+			if (bDeleteConsole) delete pConsole;
+			_aligned_free(pOutput);
+		}
+
+		if (g_pCheckpoint && !g_bFatalError)
+			g_pCheckpoint->Update(false);
+
+		if (g_bStopOutputThread || g_bFatalError)
+			break;
+		else
+		{
+			WaitForMultipleObjects(2, syncObjs, FALSE, INFINITE);
+		}
+	}
+
+	return 0;
+}
+
+DWORD WINAPI ThreadCode(LPVOID pArg)
+{
+	BYTE pbBuffer[4096];
+	HANDLE syncObjs[2] = { g_hReadyEvent, g_hStopEvent };
+
+	SetThreadGroupAffinityFn SetThreadGroupAffinityPtr = (SetThreadGroupAffinityFn)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "SetThreadGroupAffinity");
+	if (SetThreadGroupAffinityPtr && pArg)
+	{
+		GROUP_AFFINITY groupAffinity = { 0 };
+		groupAffinity.Mask = ~0ULL;
+		groupAffinity.Group = *(WORD*)(pArg);
+		SetThreadGroupAffinityPtr(GetCurrentThread(), &groupAffinity, NULL);
+	}
+
+	if (g_pTrace)
+		g_pTrace->SetThreadName(L"worker");
+
+	while (!g_bFatalError)
+	{
+		threadParam* p = NULL;
+
+		// listings come first since the walker waits for them to queue new jobs
+		if (RunQueuedDirListing())
+			continue;
+
+		JOB_ITEM* pJob = (JOB_ITEM*) InterlockedPopEntrySList(g_jobsList);
+		// wake another thread if jobs remain: the jobs queued in a batch (blocks, -largestFirst) signal the event once
+		if (pJob && (InterlockedDecrement(&g_pendingJobs) > 0))
+			SetEvent(g_hReadyEvent);
+		// the job is processed with the settings of its operation
+		if (pJob)
+			t_pOperation = pJob->pParam->pOperation;
+
+		if (pJob && t_pOperation->m_bCancelRequested)
+		{
+			// the operation was cancelled: the remaining jobs are dropped
+			delete pJob->pParam;
+			_aligned_free(pJob);
+			JobCompleted();
+		}
+		else if (pJob && pJob->pParam->pDuplicate)
+		{
+			p = pJob->pParam;
+			ComputeDuplicateDigest(*p->pDuplicate, p->bPartialHash, p->pHashes[0].get(), pbBuffer, sizeof(pbBuffer));
+			delete p;
+			_aligned_free(pJob);
+			JobCompleted();
+		}
+		else if (pJob && pJob->pParam->pBlockVerification)
+		{
+			p = pJob->pParam;
+			p->pBlockVerification->VerifyBlock(p->blockIndex, pbBuffer, sizeof(pbBuffer));
+			delete p;
+			_aligned_free(pJob);
+			JobCompleted();
+		}
+		else if (pJob)
+		{
+			p = pJob->pParam;
+			// open the file handle
+			const wstring& szFilePath = p->filePath.GetPathValue();
+			HANDLE f;
+			{
+				CStatsScope statsScope(STATS_OPEN);
+				f = OpenFileForReading(p->filePath, p->pDirHandle.get());
+			}
+			if (f == INVALID_HANDLE_VALUE)
+			{
+				DWORD dwOpenError = GetLastError();
+				std::wstring szMsg = FormatString (_T("Failed to open file \"%s\" for reading (error 0x%.8X)\n"), szFilePath.c_str(), dwOpenError);
+				if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_FAILED);
+				if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddError(szFilePath.c_str(), dwOpenError, szMsg);
+				if (t_pOperation->m_outputFiles[0] && (!p->bSumMode || p->bSumVerificationMode)) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+				if (t_pOperation->m_bSkipError)
+				{
+					if (!p->bQuiet)
+					{
+						AddOutputEntry(new std::wstring(szMsg), NULL, p->bQuiet, true, true, 0);
+					}
+					
+					if (p->bSumMode) t_pOperation->m_bMismatchFound = true;
+				}
+				else
+				{		
+					t_pOperation->m_szLastErrorMsg = szMsg;
+				}
+			}
+			else
+			{
+				t_pInputRoot = p->pInputRoot;
+				// ProcessFile will  close the file handle
+				ProcessFile(f, p->fileSize, szFilePath.c_str(), p->bQuiet, p->bShowProgress, p->bSumMode, p->bSumVerificationMode, p->pbExpectedDigest.data(), p->pHashes, pbBuffer, sizeof (pbBuffer));
+			}
+			if (g_pProgress)
+				g_pProgress->FileProcessed(p->fileSize);
+			delete p;
+			_aligned_free(pJob);
+			JobCompleted();
+		}
+		else if (g_bStopThreads || g_bFatalError)
+			break;
+		else
+		{			
+			WaitForMultipleObjects(2, syncObjs, FALSE, INFINITE);
+		}
+	}
+	SecureZeroMemory(pbBuffer, sizeof(pbBuffer));
+	return 0;
+}
+
+static HANDLE g_hStatsSamplerThread = NULL;
+static HANDLE g_hStatsStopEvent = NULL;
+
+// record the depth of the jobs queue and of the output backlog for -stats
+DWORD WINAPI StatsSamplerThreadCode(LPVOID pArg)
+{
+	while (WaitForSingleObject(g_hStatsStopEvent, STATS_SAMPLE_INTERVAL) == WAIT_TIMEOUT)
+		g_pRunStats->AddQueueSample();
+	return 0;
+}
+
+void StartStatsSampler()
+{
+	g_hStatsStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (g_hStatsStopEvent)
+		g_hStatsSamplerThread = CreateThread(NULL, 0, StatsSamplerThreadCode, NULL, 0, NULL);
+}
+
+void StopStatsSampler()
+{
+	if (g_hStatsSamplerThread)
+	{
+		SetEvent(g_hStatsStopEvent);
+		WaitForSingleObject(g_hStatsSamplerThread, INFINITE);
+		CloseHandle(g_hStatsSamplerThread);
+		g_hStatsSamplerThread = NULL;
+	}
+	if (g_hStatsStopEvent)
+	{
+		CloseHandle(g_hStatsStopEvent);
+		g_hStatsStopEvent = NULL;
+	}
+}
+
+size_t GetCpuCount(WORD* pGroupCount)
+{
+	size_t cpuCount = 0;
+	SYSTEM_INFO sysInfo;
+	GetActiveProcessorGroupCountFn GetActiveProcessorGroupCountPtr = (GetActiveProcessorGroupCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorGroupCount");
+	GetActiveProcessorCountFn GetActiveProcessorCountPtr = (GetActiveProcessorCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorCount");
+	if (GetActiveProcessorGroupCountPtr && GetActiveProcessorCountPtr)
+	{
+		WORD j, groupCount = GetActiveProcessorGroupCountPtr();
+		size_t totalProcessors = 0;
+		for (j = 0; j < groupCount; ++j)
+		{
+			totalProcessors += (size_t)GetActiveProcessorCountPtr(j);
+		}
+		cpuCount = totalProcessors;
+		if (pGroupCount)
+			*pGroupCount = groupCount;
+	}
+	else
+	{
+		GetSystemInfo(&sysInfo);
+		cpuCount = (size_t)sysInfo.dwNumberOfProcessors;
+		if (pGroupCount)
+			*pGroupCount = 1;
+	}
+
+	return cpuCount;
+}
+
+void StartThreads(bool bOutputThread)
+{
+	size_t cpuCount = 0, i = 0;
+	WORD groupCount = 1;
+	uint32 ThreadCount = 0;
+
+	cpuCount = GetCpuCount(&groupCount);
+
+	if (cpuCount > ARRAYSIZE(g_hThreads))
+		cpuCount = ARRAYSIZE(g_hThreads);
+
+	if (cpuCount <= 1)
+		return;
+
+	// threads can be started again after StopThreads
+	g_bStopThreads = false;
+	g_bStopOutputThread = false;
+
+	g_jobsList = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
+	g_outputsList = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
+	g_listingsList = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER), MEMORY_ALLOCATION_ALIGNMENT);
+	InitializeSListHead(g_jobsList);
+	InitializeSListHead(g_outputsList);
+	InitializeSListHead(g_listingsList);
+
+	g_hReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	g_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	g_hOutputReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	g_hOutputStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	for (ThreadCount = 0; ThreadCount < (uint32) cpuCount; ++ThreadCount)
+	{
+		WORD* pThreadArg = NULL;
+		if (groupCount > 1)
+		{
+
+			GetActiveProcessorCountFn GetActiveProcessorCountPtr = (GetActiveProcessorCountFn)GetProcAddress(GetModuleHandle(L"Kernel32.dll"), "GetActiveProcessorCount");
+			// Determine which processor group to bind the thread to.
+			if (GetActiveProcessorCountPtr)
+			{
+				WORD j;
+				uint32 totalProcessors = 0U;
+				for (j = 0U; j < groupCount; j++)
+				{
+					totalProcessors += (uint32)GetActiveProcessorCountPtr(j);
+					if (totalProcessors >= ThreadCount)
+					{
+						ThreadProcessorGroups[ThreadCount] = j;
+						break;
+					}
+				}
+			}
+			else
+				ThreadProcessorGroups[ThreadCount] = 0;
+
+			pThreadArg = &ThreadProcessorGroups[ThreadCount];
+		}
+
+		g_hThreads[ThreadCount] = CreateThread(NULL, 0, ThreadCode, (void*)pThreadArg, 0, NULL);
+	}
+
+	g_threadsCount = ThreadCount;
+
+	if (bOutputThread)
+		g_hOutputThread = CreateThread(NULL, 0, OutputThreadCode, NULL, 0, NULL);
+}
+
+void StopThreads(bool bError)
+{
+	if (g_threadsCount)
+	{
+		g_bFatalError = bError;
+		g_bStopThreads = true;
+		SetEvent(g_hStopEvent);
+		
+		WaitForMultipleObjects(g_threadsCount, g_hThreads, TRUE, INFINITE);
+
+		for (DWORD i = 0; i < g_threadsCount; i++)
+		{
+			CloseHandle(g_hThreads[i]);
+		}
+		CloseHandle(g_hReadyEvent);
+		CloseHandle(g_hStopEvent);
+
+		g_bStopOutputThread = true;
+		SetEvent(g_hOutputStopEvent);
+
+		WaitForSingleObject(g_hOutputThread, INFINITE);
+		CloseHandle(g_hOutputThread);
+
+		CloseHandle(g_hOutputReadyEvent);
+		CloseHandle(g_hOutputStopEvent);
+
+		FreejobList();
+		FreeOutputList();
+		FreeListingsList();
+		g_threadsCount = 0;
+	}
+}
+
+static bool CompareDuplicateCandidates(const CDuplicateCandidate* a, const CDuplicateCandidate* b)
+{
+	if (a->m_size != b->m_size)
+		return a->m_size > b->m_size;
+	return a->m_fullDigest < b->m_fullDigest;
+}
+
+class CDuplicateFinder
+{
+protected:
+	vector<CDuplicateCandidate> m_files;
+	ULONGLONG m_candidatesCount;
+	ULONGLONG m_fullyHashedCount;
+	ULONGLONG m_candidatesBytes;
+
+	// forbid copying
+	CDuplicateFinder(const CDuplicateFinder&) {}
+	CDuplicateFinder& operator = (const CDuplicateFinder&) { return *this; }
+
+	void ComputeDigests(const vector<CDuplicateCandidate*>& candidates, bool bPartial, shared_ptr<Hash> pHash, bool bUseThreads)
+	{
+		if (bUseThreads)
+			StartThreads(false);
+
+		if (g_threadsCount)
+		{
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				threadParam* p = new threadParam(candidates[i]->m_path);
+				p->fileSize = candidates[i]->m_size;
+				p->pDuplicate = candidates[i];
+				p->bPartialHash = bPartial;
+				p->pHashes.push_back(shared_ptr<Hash>(pHash->Clone()));
+				AddHashJobEntry(p);
+				SetEvent(g_hReadyEvent);
+			}
+			// wait for all jobs to be processed
+			StopThreads(false);
+		}
+		else
+		{
+			for (size_t i = 0; i < candidates.size(); i++)
+			{
+				shared_ptr<Hash> pFileHash(pHash->Clone());
+				ComputeDuplicateDigest(*candidates[i], bPartial, pFileHash.get(), t_pbBuffer, sizeof(t_pbBuffer));
+			}
+		}
+	}
+
+	// report files that couldn't be read. Returns false if the processing must stop
+	bool CheckErrors(const vector<CDuplicateCandidate*>& candidates, bool bQuiet)
+	{
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			if (!candidates[i]->m_dwError)
+				continue;
+
+			std::wstring szMsg = FormatString(_T("Failed to read file \"%s\" (error 0x%.8X)\n"), candidates[i]->m_path.GetPathValue().c_str(), candidates[i]->m_dwError);
+			if (!t_pOperation->m_bSkipError)
+			{
+				t_pOperation->m_szLastErrorMsg = szMsg;
+				return false;
+			}
+			if (!bQuiet)
+				ShowErrorDirect(szMsg.c_str());
+			if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+		}
+		return true;
+	}
+
+public:
+	CDuplicateFinder() : m_candidatesCount(0), m_fullyHashedCount(0), m_candidatesBytes(0) {}
+
+	void AddFile(const CPath& filePath, ULONGLONG fileSize)
+	{
+		// empty files are not considered as duplicates
+		if (fileSize)
+			m_files.push_back(CDuplicateCandidate(filePath, fileSize));
+	}
+
+	DWORD Run(shared_ptr<Hash> pHash, bool bUseThreads, bool bQuiet)
+	{
+		// group by size and keep only sizes shared by at least two files
+		map<ULONGLONG, vector<CDuplicateCandidate*>> sizeGroups;
+		vector<CDuplicateCandidate*> candidates, fullCandidates;
+		for (size_t i = 0; i < m_files.size(); i++)
+			sizeGroups[m_files[i].m_size].push_back(&m_files[i]);
+		for (map<ULONGLONG, vector<CDuplicateCandidate*>>::const_iterator It = sizeGroups.begin(); It != sizeGroups.end(); It++)
+		{
+			if (It->second.size() >= 2)
+			{
+				candidates.insert(candidates.end(), It->second.begin(), It->second.end());
+				m_candidatesBytes += It->first * (ULONGLONG)It->second.size();
+			}
+		}
+		m_candidatesCount = (ULONGLONG)candidates.size();
+
+		// partial digests
+		ComputeDigests(candidates, true, pHash, bUseThreads);
+		if (!CheckErrors(candidates, bQuiet))
+			return -1;
+
+		// full digests of files that have the same size and partial digest than another file
+		map<pair<ULONGLONG, ByteArray>, vector<CDuplicateCandidate*>> partialGroups;
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			if (!candidates[i]->m_dwError && candidates[i]->m_fullDigest.empty())
+				partialGroups[make_pair(candidates[i]->m_size, candidates[i]->m_partialDigest)].push_back(candidates[i]);
+		}
+		for (map<pair<ULONGLONG, ByteArray>, vector<CDuplicateCandidate*>>::const_iterator It = partialGroups.begin(); It != partialGroups.end(); It++)
+		{
+			if (It->second.size() >= 2)
+				fullCandidates.insert(fullCandidates.end(), It->second.begin(), It->second.end());
+		}
+		m_fullyHashedCount = (ULONGLONG)fullCandidates.size();
+
+		ComputeDigests(fullCandidates, false, pHash, bUseThreads);
+		if (!CheckErrors(fullCandidates, bQuiet))
+			return -1;
+
+		return NO_ERROR;
+	}
+
+	// display the groups of identical files and the statistics of the search
+	void ShowResults(LPCTSTR szHashId, bool bQuiet)
+	{
+		map<pair<ULONGLONG, ByteArray>, vector<CDuplicateCandidate*>> groups;
+		vector<const vector<CDuplicateCandidate*>*> sortedGroups;
+		ULONGLONG duplicateFiles = 0, wastedBytes = 0;
+		WCHAR szDigestHex[129];
+
+		for (size_t i = 0; i < m_files.size(); i++)
+		{
+			if (!m_files[i].m_dwError && !m_files[i].m_fullDigest.empty())
+				groups[make_pair(m_files[i].m_size, m_files[i].m_fullDigest)].push_back(&m_files[i]);
+		}
+
+		// largest files first. Files of a group are listed in enumeration order
+		for (map<pair<ULONGLONG, ByteArray>, vector<CDuplicateCandidate*>>::const_iterator It = groups.begin(); It != groups.end(); It++)
+		{
+			if (It->second.size() >= 2)
+				sortedGroups.push_back(&It->second);
+		}
+		sort(sortedGroups.begin(), sortedGroups.end(),
+			[](const vector<CDuplicateCandidate*>* a, const vector<CDuplicateCandidate*>* b) { return CompareDuplicateCandidates((*a)[0], (*b)[0]); });
+
+		for (size_t i = 0; i < sortedGroups.size(); i++)
+		{
+			const vector<CDuplicateCandidate*>& group = *sortedGroups[i];
+			ToHex(group[0]->m_fullDigest, szDigestHex);
+			std::wstring szMsg = FormatString(L"Duplicates: %d files of %llu bytes (%s = %s)\n", (int)group.size(), group[0]->m_size, szHashId, szDigestHex);
+			for (size_t j = 0; j < group.size(); j++)
+				szMsg += FormatString(L"  %s\n", group[j]->m_path.GetPathValue().c_str());
+
+			if (!bQuiet) ShowWarningDirect(szMsg.c_str());
+			if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+
+			duplicateFiles += (ULONGLONG)group.size() - 1;
+			wastedBytes += ((ULONGLONG)group.size() - 1) * group[0]->m_size;
+		}
+
+		if (!bQuiet)
+		{
+			ULONGLONG totalBytes = 0;
+			for (size_t i = 0; i < m_files.size(); i++)
+				totalBytes += m_files[i].m_size;
+
+			_tprintf(_T("%llu groups of identical files found (%llu redundant files, %llu bytes).\n"), (ULONGLONG)sortedGroups.size(), duplicateFiles, wastedBytes);
+			_tprintf(_T("%llu files enumerated, %llu candidates after size grouping, %llu fully hashed. %llu bytes read out of %llu (%.2f %%).\n"),
+				(ULONGLONG)m_files.size(),
+				m_candidatesCount,
+				m_fullyHashedCount,
+				(ULONGLONG)g_duplicatesBytesRead,
+				totalBytes,
+				totalBytes ? ((double)g_duplicatesBytesRead * 100.0 / (double)totalBytes) : 0.0);
+		}
+	}
+};
+
+static CDuplicateFinder* g_pDuplicateFinder = NULL;
+
+
+static CPath g_outputFileName;
+static CPath g_incrementalStateFileName;
+
+// Check the metadata recorded in an extended SUM file against the one returned by directory enumeration.
+// Returns false if a size mismatch was detected, in which case the file doesn't need to be read.
+// bUnchanged is set to true if -trustMetadata is used and the file metadata didn't change.
+bool CheckSumMetadata(const CPath& filePath, const FileMetadata& expected, const FileMetadata& current, bool& bUnchanged)
+{
+	bUnchanged = false;
+	if (!expected.m_bValid || !current.m_bValid)
+		return true;
+
+	if (expected.m_size != current.m_size)
+		return false;
+
+	if (g_bTrustMetadata && (expected.m_lastWriteTime == current.m_lastWriteTime))
+	{
+		if (expected.HasFileId())
+		{
+			// file ID is not returned by FindFirstFile. We open the file without read access to get it.
+			HANDLE f = CreateFileW(filePath.GetAbsolutPathValue().c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+			if (f != INVALID_HANDLE_VALUE)
+			{
+				FileMetadata fileIdMetadata;
+				if (fileIdMetadata.Set(f)
+					&& (fileIdMetadata.m_volumeSerial == expected.m_volumeSerial)
+					&& (fileIdMetadata.m_fileIndex == expected.m_fileIndex)
+					)
+				{
+					bUnchanged = true;
+				}
+				CloseHandle(f);
+			}
+		}
+		else
+			bUnchanged = true;
+	}
+
+	return true;
+}
+
+DWORD HashFile(const CPath& filePath, vector<shared_ptr<Hash>>& pHashes, bool bIncludeNames, bool bStripNames, bool bQuiet, bool bShowProgress, bool bSumMode, const CSumEntries& digestList, const FileMetadata* pEnumMetadata, const shared_ptr<CDirHandle>& pDirHandle)
+{
+	DWORD dwError = 0;
+	HANDLE f;
+	LARGE_INTEGER fileSize;
+	LPCWSTR szFilePath = filePath.GetPathValue().c_str();
+	int pathLen = lstrlen(szFilePath);
+	HashResultEntry expectedEntry;
+	bool bSumVerificationMode = false;
+	LPCBYTE pbExpectedDigest = NULL;
+	vector<shared_ptr<Hash>> pClonedHashes;
+	vector<shared_ptr<Hash>>& pHashesToUse = pHashes;
+	CProgressFileScope progressScope(pEnumMetadata ? pEnumMetadata->m_size : 0);
+
+	if (IsExcludedName(szFilePath, true))
+	{
+		if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_SKIPPED);
+		return 0;
+	}
+
+	if (g_pDuplicateFinder)
+	{
+		// -duplicates: files are only collected during enumeration
+		g_pDuplicateFinder->AddFile(filePath, pEnumMetadata ? pEnumMetadata->m_size : 0);
+		return 0;
+	}
+
+	if (bSumMode && g_pCheckpoint && g_pCheckpoint->IsCompleted(filePath.GetPathValue()))
+	{
+		// -resume: the entry of this file was written before the interruption
+		g_pCheckpoint->AddSkipped();
+		if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_SKIPPED);
+		if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddFile(szFilePath, pEnumMetadata ? pEnumMetadata->m_size : 0, 0, L"skipped", pHashes, NULL, NULL);
+		return 0;
+	}
+
+	if (bSumMode)
+	{
+		if (!digestList.empty())
+		{
+			// check that the current file is specified in the checksum file
+			if (!digestList.Find(filePath.GetPathValue(), expectedEntry))
+			{
+				std::wstring szMsg = FormatString(_T("Error: file \"%s\" not found in checksum file.\n"), szFilePath);
+				if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddError(szFilePath, ERROR_NOT_FOUND, szMsg);
+				
+				if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+				if (t_pOperation->m_bSkipError)
+				{					
+					if (!bQuiet)
+					{
+						if (t_pOperation->m_threadsCount)
+							AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
+						else
+							ShowErrorDirect(szMsg.c_str());
+					}
+					t_pOperation->m_bMismatchFound = true;
+					return 0;					
+				}
+				else
+				{		
+					t_pOperation->m_szLastErrorMsg = szMsg;
+					return -5;
+				}
+			}
+			else
+			{
+				pbExpectedDigest = expectedEntry.m_digest.data();
+				bSumVerificationMode = true;
+
+				if (pEnumMetadata)
+				{
+					bool bUnchanged = false;
+					if (!CheckSumMetadata(filePath, expectedEntry.m_metadata, *pEnumMetadata, bUnchanged))
+					{
+						// no need to read the file since its size changed
+						t_pOperation->m_bMismatchFound = true;
+
+						std::wstring szMsg = FormatString(L"Hash value mismatch for \"%s\" (size changed from %llu to %llu bytes)\n", szFilePath, expectedEntry.m_metadata.m_size, pEnumMetadata->m_size);
+						if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddFile(szFilePath, pEnumMetadata->m_size, 0, L"mismatch", pHashes, NULL, pbExpectedDigest, L"size changed");
+
+						if (t_pOperation->m_threadsCount)
+						{
+							if (!bQuiet || t_pOperation->m_outputFiles[0])
+							{
+								AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, false, false, 0);
+							}
+						}
+						else
+						{
+							if (!bQuiet) ShowWarningDirect(szMsg.c_str());
+							if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+						}
+						return 0;
+					}
+
+					if (bUnchanged)
+					{
+						// -trustMetadata: size, modification time and file ID are unchanged
+						InterlockedIncrement(&g_trustedEntriesCount);
+						if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_SKIPPED);
+						if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddFile(szFilePath, pEnumMetadata->m_size, 0, L"trusted", pHashes, NULL, pbExpectedDigest);
+						return 0;
+					}
+				}
+			}
+		}
+		
+		CloneHashes(pHashes, pClonedHashes);
+		pHashesToUse = pClonedHashes;
+	}
+
+	if (bIncludeNames)
+	{
+		LPCTSTR pNameToHash = NULL;
+		LPWSTR pCanonicalName = NULL;
+		if (pathLen > MAX_PATH)
+		{
+			if (PathAllocCanonicalizePtr)
+			{
+				if (S_OK == PathAllocCanonicalizePtr(szFilePath, PATHCCH_ALLOW_LONG_PATHS, &pCanonicalName))
+					pNameToHash = pCanonicalName;
+				else
+					pNameToHash = szFilePath;
+			}
+			else
+			{
+				pNameToHash = szFilePath;
+			}
+			if (bStripNames)
+				pNameToHash = GetFileName(pNameToHash);
+		}
+		else
+		{
+			t_szCanonalizedName[MAX_PATH] = 0;
+			if (!PathCanonicalize(t_szCanonalizedName, szFilePath))
+				lstrcpy(t_szCanonalizedName, szFilePath);
+
+			if (bStripNames)
+				pNameToHash = GetFileName(t_szCanonalizedName);
+			else
+				pNameToHash = t_szCanonalizedName;
+		}
+
+		UpdateHashesWithName(pHashesToUse, pNameToHash);
+
+		if (pCanonicalName)
+			LocalFree(pCanonicalName);
+	}
+
+	bool bOpenDeferred = bSumMode && t_pOperation->m_threadsCount && pEnumMetadata && pEnumMetadata->m_bValid && !t_pOperation->m_pHashCache;
+	if (bOpenDeferred)
+	{
+		// the size returned by the enumeration is enough to queue the job: only the worker thread opens the file
+		// and it reports the error if the file can't be opened
+		f = NULL;
+		fileSize.QuadPart = (LONGLONG)pEnumMetadata->m_size;
+	}
+	else
+	{
+		CStatsScope statsScope(STATS_OPEN);
+		f = OpenFileForReading(filePath, pDirHandle.get());
+	}
+	if (!bOpenDeferred && (f != INVALID_HANDLE_VALUE))
+	{
+		if (!GetFileSizeEx(f, &fileSize))
+		{
+			DWORD dwErr = GetLastError();
+			CloseHandle(f);
+			f = INVALID_HANDLE_VALUE;
+			SetLastError(dwErr);
+		}
+		else if (bSumMode && !bSumVerificationMode && t_pOperation->m_pHashCache && !(g_pBlockManifestFile && ((ULONGLONG)fileSize.QuadPart > g_blockSize)))
+		{
+			// look for the digests of the file in the cache before reading it
+			FileMetadata metadata;
+			vector<ByteArray> cachedDigests(pHashesToUse.size());
+			bool bAllFound = metadata.Set(f) && metadata.QueryChangeTime(f);
+			for (size_t i = 0; bAllFound && (i < pHashesToUse.size()); i++)
+			{
+				cachedDigests[i].resize(pHashesToUse[i]->GetHashSize());
+				bAllFound = t_pOperation->m_pHashCache->Lookup(metadata, pHashesToUse[i]->GetID(), cachedDigests[i].data(), (int)cachedDigests[i].size());
+			}
+
+			if (bAllFound)
+			{
+				FileMetadata noMetadata;
+				CloseHandle(f);
+				t_pOperation->m_pHashCache->AddHit();
+				if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_SKIPPED);
+				for (size_t i = 0; i < pHashesToUse.size(); i++)
+					OutputSumEntry(szFilePath, bQuiet, pHashesToUse.size() > 1, pHashesToUse[i]->GetID(), cachedDigests[i].data(), (int)cachedDigests[i].size(), i, g_bSumExtended ? metadata : noMetadata);
+				if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddFile(szFilePath, metadata.m_size, 0, L"cached", pHashesToUse, &cachedDigests, NULL);
+				return 0;
+			}
+
+			t_pOperation->m_pHashCache->AddMiss();
+			if (t_pOperation->m_threadsCount)
+				CloseHandle(f);
+		}
+		else if (bSumMode && t_pOperation->m_threadsCount)
+		{
+			// close handle in case of multithreaded sum computation/verification.
+			// worker threads will open the file again when processing the file
+			CloseHandle(f);
+		}
+	}
+
+	const vector<BLOCK_ENTRY>* pBlocks = NULL;
+	if ((f != INVALID_HANDLE_VALUE) && bSumVerificationMode && g_pBlockManifest && (pBlocks = g_pBlockManifest->Find(filePath.GetPathValue())))
+	{
+		// verify the file block by block using the manifest
+		ULONGLONG manifestSize = pBlocks->back().offset + pBlocks->back().length;
+		vector<BLOCK_ENTRY> selectedBlocks;
+		if (!t_pOperation->m_threadsCount)
+			CloseHandle(f);
+
+		if (manifestSize != (ULONGLONG)fileSize.QuadPart)
+		{
+			t_pOperation->m_bMismatchFound = true;
+
+			std::wstring szMsg = FormatString(L"Hash value mismatch for \"%s\" (size changed from %llu to %llu bytes)\n", szFilePath, manifestSize, (ULONGLONG)fileSize.QuadPart);
+			if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddFile(szFilePath, (ULONGLONG)fileSize.QuadPart, 0, L"mismatch", pHashes, NULL, pbExpectedDigest, L"size changed");
+
+			if (t_pOperation->m_threadsCount)
+			{
+				if (!bQuiet || t_pOperation->m_outputFiles[0])
+				{
+					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, false, false, 0);
+				}
+			}
+			else
+			{
+				if (!bQuiet) ShowWarningDirect(szMsg.c_str());
+				if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+			}
+			return 0;
+		}
+
+		// -range: only the blocks intersecting the given ranges are read
+		for (size_t i = 0; i < pBlocks->size(); i++)
+		{
+			const BLOCK_ENTRY& block = (*pBlocks)[i];
+			bool bSelected = g_verifyRanges.empty();
+			for (size_t j = 0; !bSelected && (j < g_verifyRanges.size()); j++)
+				bSelected = (g_verifyRanges[j].start < block.offset + block.length) && (g_verifyRanges[j].end >= block.offset);
+			if (bSelected)
+				selectedBlocks.push_back(block);
+		}
+		g_manifestBlocksCount += pBlocks->size();
+		g_selectedBlocksCount += selectedBlocks.size();
+
+		if (selectedBlocks.empty())
+			return 0;
+
+		shared_ptr<CBlockVerification> pVerification(new CBlockVerification(filePath, selectedBlocks, pHashes[0].get(), bQuiet));
+		if (t_pOperation->m_threadsCount)
+		{
+			for (size_t i = 0; i < selectedBlocks.size(); i++)
+			{
+				threadParam* p = new threadParam(filePath);
+				p->bQuiet = bQuiet;
+				p->bSumMode = true;
+				p->bSumVerificationMode = true;
+				p->pBlockVerification = pVerification;
+				p->blockIndex = i;
+				AddHashJobEntry(p);
+			}
+			SetEvent(g_hReadyEvent);
+		}
+		else
+		{
+			for (size_t i = 0; i < selectedBlocks.size(); i++)
+			{
+				if (!pVerification->VerifyBlock(i, t_pbBuffer, sizeof(t_pbBuffer)))
+					dwError = -1;
+			}
+		}
+	}
+	else if (f != INVALID_HANDLE_VALUE)
+	{
+		if (bSumMode && t_pOperation->m_threadsCount)
+		{
+			// the worker thread reports the file as processed
+			progressScope.Detach();
+			AddHashJob(filePath, fileSize.QuadPart, bQuiet, bShowProgress, bSumMode, bSumVerificationMode, pbExpectedDigest, pHashesToUse, pDirHandle);
+		}
+		else if (!bSumMode && g_pIncrementalState)
+			ProcessFileIncremental(f, fileSize.QuadPart, filePath.GetPathValue(), bQuiet, bShowProgress, static_cast<Blake3Hash*>(pHashesToUse[0].get()));
+		else
+			ProcessFile(f, fileSize.QuadPart, szFilePath, bQuiet, bShowProgress, bSumMode, bSumVerificationMode, pbExpectedDigest , pHashesToUse, t_pbBuffer, sizeof (t_pbBuffer));
+	}
+	else
+	{
+		DWORD dwOpenError = GetLastError();
+		std::wstring szMsg = FormatString (_T("Failed to open file \"%s\" for reading (error 0x%.8X)\n"), szFilePath, dwOpenError);
+		if (g_pRunStats) g_pRunStats->Increment(STATS_FILES_FAILED);
+		if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddError(szFilePath, dwOpenError, szMsg);
+		if (t_pOperation->m_outputFiles[0] && (!bSumMode || bSumVerificationMode)) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+		if (t_pOperation->m_bSkipError)
+		{
+			if (!bQuiet)
+			{
+				if (t_pOperation->m_threadsCount)
+				{
+					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
+				}
+				else
+					ShowErrorDirect(szMsg.c_str());
+			}
+			
+			if (bSumMode) t_pOperation->m_bMismatchFound = true;
+			dwError = 0;
+		}
+		else
+		{		
+			t_pOperation->m_szLastErrorMsg = szMsg;
+			dwError = -1;
+		}
+	}
+
+	return dwError;
+}
+
+// FindNextFile accounted in the enumeration phase of -stats
+BOOL FindNextFileTimed(HANDLE hFind, WIN32_FIND_DATA* pffd)
+{
+	CStatsScope statsScope(STATS_ENUMERATE);
+	return FindNextFile(hFind, pffd);
+}
+
+// list the directory: enumeration, -nofollow probes and sort. It can run on a worker thread, everything else is done by the walker
+void CDirListing::Run()
+{
+	wstring szDir = m_dirPath.GetAbsolutPathValue() + PATH_SEPARATOR_STRING _T("*");
+	wstring szEntryPath = m_dirPath.GetAbsolutPathValue() + PATH_SEPARATOR_STRING; // absolute path of the current entry
+	size_t entryNameOffset = szEntryPath.length();
+	WIN32_FIND_DATA ffd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	LONGLONG traceStart = g_pTrace ? CTrace::Now() : 0;
+
+	// Find the first file in the directory. The short names are not needed and the entries are fetched by large
+	// batches. Windows versions older than 7 don't support these options so the plain call is used for them.
+
+	{
+		CStatsScope statsScope(STATS_ENUMERATE);
+		hFind = FindFirstFileEx(szDir.c_str(), FindExInfoBasic, &ffd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+		if ((INVALID_HANDLE_VALUE == hFind) && (GetLastError() == ERROR_INVALID_PARAMETER))
+			hFind = FindFirstFile(szDir.c_str(), &ffd);
+	}
+
+	if (INVALID_HANDLE_VALUE == hFind)
+		m_dwError = GetLastError();
+	else
+	{
+		// List all the files in the directory with some info about them.
+
+		do
+		{
+			bool bIsDir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			// Skip "." and ".." directories
+			if (bIsDir && ((_tcscmp(ffd.cFileName, _T(".")) == 0) || (_tcscmp(ffd.cFileName, _T("..")) == 0)))
+				continue;
+
+			if (t_pOperation->m_bNoFollow && (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			{
+				szEntryPath.resize(entryNameOffset);
+				szEntryPath += ffd.cFileName;
+				if (IsReparsePoint(szEntryPath.c_str(), ffd.dwFileAttributes, ffd.dwReserved0))
+					continue;
+			}
+			m_entries.push_back(NewDirEntry(m_arena, ffd, bIsDir));
+		}
+		while (FindNextFileTimed(hFind, &ffd) != 0);
+
+		m_dwError = GetLastError();
+		FindClose(hFind);
+		if (m_dwError == ERROR_NO_MORE_FILES)
+		{
+			// Clear the error
+			m_dwError = 0;
+
+			// Sort all entries. The sort is stable to keep the order of the names that differ only by case.
+			stable_sort(m_entries.begin(), m_entries.end(), CompareDirEntries);
+
+			if (g_pTrace)
+				g_pTrace->AddSpan(TRACE_DIRECTORY, traceStart, CTrace::Now(), m_dirPath.GetPathValue().c_str());
+		}
+		else
+		{
+			m_bFindNextFailed = true;
+			m_entries.clear();
+		}
+	}
+
+	InterlockedExchange(&m_state, LISTING_DONE);
+	if (m_bPrefetched)
+		SetEvent(t_pOperation->m_hListingDoneEvent);
+}
+
+// a directory being walked by HashDirectory: its listing, the next entry to process, its handle and the listings of its
+// subdirectories queued for the worker threads
+typedef struct _DIR_FRAME
+{
+	shared_ptr<CDirListing> pListing;
+	size_t next;
+	shared_ptr<CDirHandle> pHandle;
+	vector<shared_ptr<CDirListing>> subdirListings;
+	size_t nextSubdir;
+
+	_DIR_FRAME() : next(0), nextSubdir(0) {}
+} DIR_FRAME;
+
+// enter the directory of pListing: get its entries, listing it if needed, report listing errors, remove the files
+// that must not be hashed and add its name to the hashes when names are included. The frame stays empty
+// if the directory can't be listed and -skipError is specified
+DWORD ListDirectory(const shared_ptr<CDirListing>& pListing, const CDirHandle* pParentHandle, vector<shared_ptr<Hash>>& pHashes, bool bIncludeNames, bool bStripNames, bool bQuiet, bool bSumMode, const CSumEntries& digestList, DIR_FRAME& frame)
+{
+	const CPath& dirPath = pListing->m_dirPath;
+	LPCWSTR szDirPath = dirPath.GetPathValue().c_str();
+	bool bSumVerificationMode = (bSumMode && !digestList.empty());
+
+	if (g_pRunStats) g_pRunStats->Increment(STATS_DIRECTORIES);
+
+	if (pListing->Claim())
+		pListing->Run();
+	else
+		pListing->WaitDone();
+
+	if (pListing->m_dwError)
+	{
+		DWORD dwError = pListing->m_dwError;
+		std::wstring szMsg = pListing->m_bFindNextFailed ? FormatString (TEXT("FindNextFile failed while listing \"%s\". \n Error 0x%.8X.\n"), szDirPath, dwError)
+			: FormatString (_T("FindFirstFile failed on \"%s\" with error 0x%.8X.\n"), szDirPath, dwError);
+		if (t_pOperation->m_pJsonOutput) t_pOperation->m_pJsonOutput->AddError(szDirPath, dwError, szMsg);
+		if (t_pOperation->m_outputFiles[0] && (!bSumMode || bSumVerificationMode)) _ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szMsg.c_str());
+		if (t_pOperation->m_bSkipError)
+		{
+			if (!bQuiet)
+			{
+				if (t_pOperation->m_threadsCount)
+					AddOutputEntry(new std::wstring(szMsg), NULL, bQuiet, true, true, 0);
+				else
+					ShowErrorDirect(szMsg.c_str());
+			}
+			return 0;
+		}
+		else
+		{
+			t_pOperation->m_szLastErrorMsg = szMsg;
+			return dwError;
+		}
+	}
+
+	frame.pListing = pListing;
+	vector<DIR_ENTRY*>& entries = pListing->m_entries;
+
+	// skip the files written or read by this run. The SUM file is only looked for until it is found.
+	if ((bSumMode && !t_pOperation->m_bSumFileSkipped) || t_pOperation->m_pHashCache || g_pBlockManifestFile || g_pBlockManifest || g_pIncrementalState)
+	{
+		wstring szEntryPath = dirPath.GetAbsolutPathValue() + PATH_SEPARATOR_STRING; // absolute path of the current entry
+		size_t entryNameOffset = szEntryPath.length();
+		size_t count = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (!entries[i]->bIsDir)
+			{
+				szEntryPath.resize(entryNameOffset);
+				szEntryPath += entries[i]->szName;
+				// skip file holding checksum
+				if (bSumMode && !t_pOperation->m_bSumFileSkipped)
+				{
+					if (!digestList.empty())
+					{
+						// verification
+						if (0 == _wcsicmp(t_pOperation->m_verificationFileName.GetAbsolutPathValue().c_str(), szEntryPath.c_str()))
+						{
+							t_pOperation->m_bSumFileSkipped = true;
+							continue;
+						}
+					}
+					else
+					{
+						if (g_outputFileName.GetAbsolutPathValue().empty())
+							t_pOperation->m_bSumFileSkipped = true;
+						else if (0 == _wcsicmp(g_outputFileName.GetAbsolutPathValue().c_str(), szEntryPath.c_str()))
+						{
+							t_pOperation->m_bSumFileSkipped = true;
+							continue;
+						}
+					}
+				}
+				// skip the hash cache file
+				if (t_pOperation->m_pHashCache && (0 == _wcsicmp(t_pOperation->m_cacheFileName.GetAbsolutPathValue().c_str(), szEntryPath.c_str())))
+					continue;
+				// skip the blocks manifest
+				if ((g_pBlockManifestFile || g_pBlockManifest) && (0 == _wcsicmp(g_blockManifestFileName.GetAbsolutPathValue().c_str(), szEntryPath.c_str())))
+					continue;
+				// skip the incremental state file
+				if (g_pIncrementalState && (0 == _wcsicmp(g_incrementalStateFileName.GetAbsolutPathValue().c_str(), szEntryPath.c_str())))
+					continue;
+			}
+			entries[count++] = entries[i];
+		}
+		entries.resize(count);
+	}
+
+	if (g_pProgress)
+	{
+		ULONGLONG filesCount = 0, filesSize = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (!entries[i]->bIsDir)
+			{
+				filesCount++;
+				filesSize += entries[i]->metadata.m_size;
+			}
+		}
+		g_pProgress->AddEnumerated(filesCount, filesSize);
+	}
+
+	if (bIncludeNames)
+	{
+		LPCTSTR pNameToHash = NULL;
+		LPWSTR pCanonicalName = NULL;
+		if (wcslen(szDirPath) > MAX_PATH)
+		{
+			if (PathAllocCanonicalizePtr)
+			{
+				if (S_OK == PathAllocCanonicalizePtr(szDirPath, PATHCCH_ALLOW_LONG_PATHS, &pCanonicalName))
+					pNameToHash = pCanonicalName;
+				else
+					pNameToHash = szDirPath;
+			}
+			else
+			{
+				pNameToHash = szDirPath;
+			}
+			if (bStripNames)
+				pNameToHash = GetFileName(pNameToHash);
+		}
+		else
+		{
+			t_szCanonalizedName[MAX_PATH] = 0;
+			if (!PathCanonicalize(t_szCanonalizedName, szDirPath))
+				lstrcpy(t_szCanonalizedName, szDirPath);
+
+			if (bStripNames)
+				pNameToHash = GetFileName(t_szCanonalizedName);
+			else
+				pNameToHash = t_szCanonalizedName;
+		}
+
+		UpdateHashesWithName(pHashes, pNameToHash);
+		if (pCanonicalName)
+			LocalFree(pCanonicalName);
+	}
+
+	// the files and the subdirectories of the directory are opened relative to its handle
+	if (!entries.empty())
+	{
+		CStatsScope statsScope(STATS_ENUMERATE);
+		frame.pHandle = CDirHandle::Open(pParentHandle, dirPath);
+	}
+
+	// let the worker threads list the subdirectories in advance
+	if (t_pOperation->m_threadsCount && g_listingsList)
+	{
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (entries[i]->bIsDir)
+			{
+				CPath subdirPath(dirPath);
+				subdirPath.AppendName(entries[i]->szName);
+				if ((g_prefetchedListings >= ENUM_PREFETCH_MAX) || IsExcludedName(subdirPath.GetPathValue().c_str(), false))
+					frame.subdirListings.push_back(shared_ptr<CDirListing>());
+				else
+					frame.subdirListings.push_back(shared_ptr<CDirListing>(new CDirListing(subdirPath, true)));
+			}
+		}
+
+		for (size_t i = frame.subdirListings.size(); i > 0; i--)
+		{
+			if (frame.subdirListings[i - 1])
+				QueueDirListing(frame.subdirListings[i - 1]);
+		}
+	}
+
+	return 0;
+}
+
+DWORD HashDirectory(const CPath& dirPath, vector<shared_ptr<Hash>>& pHashes, bool bIncludeNames, bool bStripNames, bool bQuiet, bool bShowProgress, bool bSumMode, const CSumEntries& digestList)
+{
+	if (IsExcludedName(dirPath.GetPathValue().c_str(), false))
+		return 0;
+
+	// the directories being walked, from dirPath to the current one. The tree is walked using this explicit stack
+	// instead of recursive calls so that its depth is not limited by the stack of the thread.
+	list<DIR_FRAME> stack(1);
+	DWORD dwError = ListDirectory(shared_ptr<CDirListing>(new CDirListing(dirPath, false)), NULL, pHashes, bIncludeNames, bStripNames, bQuiet, bSumMode, digestList, stack.back());
+
+	while (!dwError && !stack.empty())
+	{
+		DIR_FRAME& frame = stack.back();
+		if (!frame.pListing || (frame.next == frame.pListing->m_entries.size()))
+		{
+			// the directory is done: its handle is closed unless jobs still use it
+			stack.pop_back();
+			continue;
+		}
+
+		if (t_pOperation->m_bCancelRequested)
+		{
+			dwError = ERROR_CANCELLED;
+			break;
+		}
+
+		const DIR_ENTRY* pEntry = frame.pListing->m_entries[frame.next++];
+		if (pEntry->bIsDir)
+		{
+			// the listing queued for this subdirectory, if any
+			shared_ptr<CDirListing> pListing;
+			if (frame.nextSubdir < frame.subdirListings.size())
+				pListing.swap(frame.subdirListings[frame.nextSubdir++]);
+
+			if (!pListing)
+			{
+				CPath entryPath(frame.pListing->m_dirPath);
+				entryPath.AppendName(pEntry->szName);
+				if (IsExcludedName(entryPath.GetPathValue().c_str(), false))
+					continue;
+				pListing.reset(new CDirListing(entryPath, false));
+			}
+
+			stack.emplace_back();
+			dwError = ListDirectory(pListing, frame.pHandle.get(), pHashes, bIncludeNames, bStripNames, bQuiet, bSumMode, digestList, stack.back());
+		}
+		else
+		{
+			CPath entryPath(frame.pListing->m_dirPath);
+			entryPath.AppendName(pEntry->szName);
+			dwError = HashFile(entryPath, pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, digestList, &pEntry->metadata, frame.pHandle);
+			// without threads, the output files are written by this thread
+			if (!dwError && g_pCheckpoint && !t_pOperation->m_threadsCount)
+				g_pCheckpoint->Update(false);
+		}
+	}
+
+	return dwError;
+}
+
+// read the inputs listed in the file given to -roots: one path per line. Empty lines and lines starting with '#' are ignored
+bool LoadRootsList(const CPath& listFile, vector<wstring>& roots)
+{
+	FILE* f = _wfopen(listFile.GetAbsolutPathValue().c_str(), L"rt,ccs=UTF-8");
+	if (!f)
+		return false;
+
+	ByteArray buffer(4096 * 2);
+	wchar_t* szLine = (wchar_t*)buffer.data();
+	while (fgetws(szLine, (int)(buffer.size() / sizeof(wchar_t)), f))
+	{
+		size_t l = wcslen(szLine);
+		while (l && ((szLine[l - 1] == L'\n') || (szLine[l - 1] == L'\r')))
+			szLine[--l] = 0;
+		if (l && (szLine[0] != L'#'))
+			roots.push_back(szLine);
+	}
+	fclose(f);
+	return true;
+}
+
+void ShowLogo()
+{
+	if (g_bNoLogo)
+		return;
+
+	SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+	_tprintf(_T("\nDirHash ") _T(DIRHASH_VERSION) _T(" by Mounir IDRASSI (mounir@idrix.fr) Copyright 2010-2024\n\n"));
+	_tprintf(_T("Recursively compute hash of a given directory content in lexicographical order.\nIt can also compute the hash of a single file.\n\n"));
+	_tprintf(_T("Supported Algorithms :\n"));
+	std::vector<std::wstring> algos = Hash::GetSupportedHashIds();
+	for (size_t i = 0; i < algos.size(); i++)
+		_tprintf(_T(" %s"), algos[i].c_str());
+	_tprintf(_T("\n\n"));
+	SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+}
+
+
+void ShowUsage()
+{
+	ShowLogo();
+	_tprintf(TEXT("Usage: \n")
+		TEXT("  DirHash.exe DirectoryOrFilePath [HashAlgo] [-t ResultFileName] [-mscrypto] [-sum] [-sumRelativePath] [-includeLastDir] [-verify FileName] [-threads] [-largestFirst] [-clip] [-lowercase] [-overwrite]  [-quiet] [-nowait] [-hashnames] [-stripnames] [-skipError] [-nologo] [-nofollow] [-sumExtended] [-trustMetadata] [-cache CacheFile] [-incremental StateFile] [-resume] [-duplicates] [-blocks SizeMiB] [-range Start-End] [-stats] [-statsJson File] [-json] [-trace File] [-exclude pattern1] [-exclude pattern2]  [-only pattern1] [-only pattern2]\n")
+		TEXT("  DirHash.exe DirectoryOrFilePath1 DirectoryOrFilePath2 [...] [HashAlgo] [switches]\n")
+		TEXT("  DirHash.exe -roots ListFile [HashAlgo] [switches]\n")
+		TEXT("  DirHash.exe -benchmark [HashAlgo | All] [-sweep] [-scaling] [-format json|csv] [-t ResultFileName] [-mscrypto] [-clip] [-overwrite]  [-quiet] [-nowait] [-nologo]\n")
+		TEXT("  DirHash.exe -benchmark-fs WorkDirectory [HashAlgo] [-files Count] [-depth Levels] [-fanout Count] [-sizes small|mixed|large] [-seed Value] [-cold] [-clean] [-format json|csv] [-t ResultFileName] [-clip] [-overwrite] [-quiet] [-nowait] [-nologo]\n")
+		TEXT("  DirHash.exe -convertSum InputSumFile OutputSumFile [-lowercase] [-quiet] [-nowait] [-nologo]\n")
+		TEXT("  DirHash.exe -daemon Endpoint [-cache CacheFile] [-lowercase] [-quiet] [-nologo]\n")
+		TEXT("  DirHash.exe -client Endpoint DirectoryOrFilePath [HashAlgo] [-sum] [-verify FileName] [-threads] [-largestFirst] [-hashnames] [-stripnames] [-nofollow] [-skipError] [-mscrypto] [-exclude pattern] [-only pattern] [-priority N]\n")
+		TEXT("\n")
+		TEXT("  Possible values for HashAlgo (not case sensitive, default is Blake3):\n"));
+	   _tprintf(_T(" "));
+		std::vector<std::wstring> algos = Hash::GetSupportedHashIds();
+		for (size_t i = 0; i < algos.size(); i++)
+			_tprintf(_T(" %s"), algos[i].c_str());
+		_tprintf(_T("\n")
+		TEXT("Or any combinarion of the above values separated by comma, except when -verify is used\n")
+		TEXT("\n\n")
+		TEXT("  ResultFileName: text file where the result will be appended\n")
+		TEXT("  -benchmark: perform speed benchmark of the selected algorithm. If \"All\" is specified, then all algorithms are benchmarked. Each implementation is measured separately and the median speed is displayed with the 10th and 90th percentiles. -sweep measures input sizes from 64 bytes to 1 GiB, -scaling measures the speed of 1 to N threads and -format json|csv writes machine-readable results.\n")
+		TEXT("  -benchmark-fs: measure enumeration, digest, -sum, -sum -threads and -verify on a reproducible synthetic tree generated in the given work directory. -cold adds runs with an empty system file cache (requires administrator rights).\n")
+		TEXT("  -mscrypto: use Windows native implementation of hash algorithms (Always enabled on ARM).\n")
+		TEXT("  -sum: output hash of every file processed in a format similar to shasum.\n")
+		TEXT("  -sumRelativePath (only when -sum is specified): the file paths are stored in the output file as relative to the input directory.\n")
+		TEXT("  -verify: verify hash against value(s) present on the specified file.\n")
+		TEXT("           argument must be either a checksum file (text or binary) or a result file.\n")
+		TEXT("  -convertSum: convert a text SUM file to a binary SUM file or a binary SUM file to a text SUM file.\n")
+		TEXT("  -includeLastDir (only when -sum or -verify is specified): the last directory name of the input directory is included in the SUM file entries and used in the verification process. This switch implies -sumRelativePath.\n")
+		TEXT("  -threads (only when -sum or -verify specified): multithreading will be used to accelerate hashing of files.\n")
+		TEXT("  -largestFirst (only with -threads): files are hashed once the inputs are enumerated, from the largest to the smallest with the small files interleaved, so that a large file doesn't delay the end of the run.\n")
+		TEXT("  -clip: copy the result to Windows clipboard (ignored when -sum specified)\n")
+		TEXT("  -lowercase: output hash value(s) in lower case instead of upper case\n")
+		TEXT("  -progress: Display the overall progress (files and data processed, throughput, remaining time and slowest file), also with -threads\n")
+		TEXT("  -overwrite (only when -t present): output text file will be overwritten\n")
+		TEXT("  -quiet: No text is displayed or written except the hash value\n")
+		TEXT("  -nowait: avoid displaying the waiting prompt before exiting\n")
+		TEXT("  -hashnames: case sensitive path of the files/directories will be included in the hash computation\n")
+		TEXT("  -stripnames (only when -hashnames present): only last path portion of files/directories is used for hash computation\n")
+		TEXT("  -exclude (cannot be combined with -only): specifies a name pattern for files to exclude from hash computation. A pattern ending with a path separator only applies to directories and skips their subtree.\n")
+		TEXT("  -only (cannot be combined with -exclude): only files matching the pattern are included in hash computation.\n")
+		TEXT("  -skipError: ignore any encountered errors and continue processing.\n")
+		TEXT("  -nologo: don't display the copyright message and version number on startup.\n")
+		TEXT("  -nofollow: don't follow symbolic links, Junction points and mount points, excluding them from hash computation.\n")
+		TEXT("  -sumExtended (only when -sum is specified): record size, modification time and file ID of each file in the SUM file.\n")
+		TEXT("  -trustMetadata (only when -verify is specified): don't rehash files whose size, modification time and file ID match the ones recorded in an extended SUM file.\n")
+		TEXT("  -cache (only when -sum is specified): reuse digests stored in the given cache file for files whose identity, size, modification time and change time didn't change.\n")
+		TEXT("  -incremental (only when -sum is not specified, Blake3 only): store per-file BLAKE3 subtree chaining values in the given state file and reuse them on the next run for files that are unchanged and at the same position in the hashed stream.\n")
+		TEXT("  -resume (only when -sum and -t are specified): continue a SUM computation that was interrupted, using the checkpoint written periodically next to the SUM file. Files already processed are not hashed again.\n")
+		TEXT("  -duplicates (can not be combined with -sum, -verify or -incremental): list the groups of identical files of the input directory. Files are grouped by size, then by the digest of their first and last 64 KiB, and only the remaining candidates are fully hashed.\n")
+		TEXT("  -blocks (only with -sum and -t): also write the digests of the blocks of the given size in MiB of large files to a manifest named after the SUM file with the .blocks extension. -verify uses this manifest when present to verify these files block by block and report the corrupted byte ranges.\n")
+		TEXT("  -range (only with -verify, can be repeated): only verify the blocks of the manifest intersecting the given byte range (e.g. -range 268435456-536870911).\n")
+		TEXT("  -stats: display at the end statistics about the time spent enumerating, opening, reading, hashing, finalizing digests and writing output, the open and read latencies, the bytes hashed per algorithm, the queues depth and the skipped or failed files.\n")
+		TEXT("  -statsJson (implies -stats): also write these statistics to the given file in JSON format.\n")
+		TEXT("  -json (implies -quiet and -nowait): write to the standard output one NDJSON record per file (path, size, digests, duration, status) and per error, followed by a summary record. Messages are written to the standard error.\n")
+		TEXT("  -trace: write to the given file a timeline of the spans of each thread (directory listing, open, read, hash, finalize, output) in Chrome Trace Event format.\n")
+		TEXT("  -roots: hash all the inputs listed in the given UTF-8 file (one path per line, '#' for comments), like several inputs given on the command line. The inputs share the worker threads and each one gets its own digest or its own SUM file (ResultFileName.1, ResultFileName.2, ...). Can't be combined with -verify, -duplicates, -resume, -blocks or -incremental.\n")
+		TEXT("  -daemon: serve requests sent with -client on the given named pipe (Windows) or Unix domain socket path. Requests are run one at a time, highest -priority first, reusing the worker threads, the hash objects and the -cache file between requests. Responses are -json records. The request \"-shutdown\" stops the daemon.\n")
+		TEXT("  -client: send a request to the daemon listening on the given endpoint, write its -json records to the standard output and exit with its exit code.\n")
+	);
+	_tprintf(_T("\n"));
+}
+
+#ifdef _WIN32
+#define DEFAULT_DONT_WAIT	false
+#else
+// the console window doesn't close when the program exits on POSIX, so don't wait for ENTER by default
+#define DEFAULT_DONT_WAIT	true
+#endif
+
+void WaitForExit(bool bDontWait = DEFAULT_DONT_WAIT)
+{
+	if (!bDontWait)
+	{
+		_tprintf(_T("\n\nPress ENTER to exit the program ..."));
+		getchar();
+	}
+}
+
+void CopyToClipboard(LPCTSTR szDigestHex)
+{
+#ifndef _WIN32
+	// a console program has no system clipboard on POSIX
+	ShowWarning(_T("Copying to the clipboard is not supported on this platform.\n"));
+#else
+	if (OpenClipboard(NULL))
+	{
+		size_t cch = _tcslen(szDigestHex);
+
+		HGLOBAL hglbCopy = GlobalAlloc(GMEM_MOVEABLE,
+			(cch + 1) * sizeof(TCHAR));
+		if (hglbCopy)
+		{
+			EmptyClipboard();
+
+			// Lock the handle and copy the text to the buffer. 
+			LPVOID lptstrCopy = GlobalLock(hglbCopy);
+			if (lptstrCopy)
+			{
+				memcpy(lptstrCopy, (const TCHAR*)szDigestHex,
+					(cch * sizeof(TCHAR)) + 1);
+				GlobalUnlock(hglbCopy);
+
+				// Place the handle on the clipboard. 
+#ifdef _UNICODE
+				SetClipboardData(CF_UNICODETEXT, hglbCopy);
+#else
+				SetClipboardData(CF_TEXT, hglbCopy);
+#endif
+			}
+		}
+
+		CloseClipboard();
+	}
+#endif
+}
+
+// ---------------------------------------------
+/*
+ * Hash speed benchmark used by -benchmark.
+ *
+ * Every available implementation of an algorithm is measured separately: OpenSSL and CNG (on Windows) for MD5 and
+ * SHA*, and each SIMD level supported by the CPU for Blake3. Buffers are filled with pseudo-random data and time is
+ * measured with QueryPerformanceCounter (wall time). For each input size, the number of iterations of a sample is
+ * calibrated so that it lasts at least BENCH_MIN_SAMPLE_TIME, the first samples are discarded as warm-up and the
+ * median of the remaining ones is reported along with the 10th and 90th percentiles.
+ *
+ * -sweep measures input sizes from 64 B to 1 GiB and -scaling measures the aggregated throughput of 1 to N threads
+ * hashing concurrently. -format json|csv writes machine-readable results to the -t file (or to the console if -t is
+ * not specified) so that they can be compared across releases.
+ */
+
+#define BENCH_DEFAULT_SIZE		(16 * 1024 * 1024)
+#define BENCH_MIN_SAMPLE_TIME	0.02 // seconds
+#define BENCH_WARMUP_SAMPLES	2
+#define BENCH_SAMPLES			15
+#define BENCH_LARGE_SIZE		(64 * 1024 * 1024)
+#define BENCH_LARGE_SAMPLES		5
+#define BENCH_SCALING_SIZE		(16 * 1024 * 1024)
+#define BENCH_SCALING_TIME		0.5 // seconds per thread count
+#define BENCH_SCALING_RUNS		3
+
+enum BenchFormat
+{
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_JSON,
+	BENCH_FORMAT_CSV
+};
+
+typedef struct
+{
+	wstring algorithm;
+	wstring implementation;
+	bool bUseMsCrypto;
+	uint32_t blake3Features; // mask applied to the CPU features detected by BLAKE3
+} BenchImplementation;
+
+typedef struct
+{
+	const BenchImplementation* pImpl;
+	ULONGLONG size;
+	ULONGLONG iterations;
+	size_t samples;
+	double median, p10, p90, minimum, maximum; // bytes per second
+} BenchResult;
+
+typedef struct
+{
+	const BenchImplementation* pImpl;
+	DWORD threads;
+	double throughput; // bytes per second for all threads
+	double speedup;
+} BenchScalingResult;
+
+double GetBenchTime()
+{
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+wstring FormatBenchSize(ULONGLONG size)
+{
+	if (size >= 1024 * 1024 * 1024 && !(size % (1024 * 1024 * 1024)))
+		return FormatString(L"%llu GiB", size / (1024 * 1024 * 1024));
+	if (size >= 1024 * 1024 && !(size % (1024 * 1024)))
+		return FormatString(L"%llu MiB", size / (1024 * 1024));
+	if (size >= 1024 && !(size % 1024))
+		return FormatString(L"%llu KiB", size / 1024);
+	return FormatString(L"%llu B", size);
+}
+
+wstring FormatBenchSpeed(double speed)
+{
+	if (speed >= (double)(1024 * 1024 * 1024))
+		return FormatString(L"%.2f GiB/s", speed / (double)(1024 * 1024 * 1024));
+	else if (speed >= (double)(1024 * 1024))
+		return FormatString(L"%.2f MiB/s", speed / (double)(1024 * 1024));
+	else if (speed >= (double)(1024))
+		return FormatString(L"%.2f KiB/s", speed / (double)(1024));
+	else
+		return FormatString(L"%.2f B/s", speed);
+}
+
+void GetBenchImplementations(LPCTSTR hashAlgo, vector<BenchImplementation>& impls)
+{
+	BenchImplementation impl;
+	impl.algorithm = hashAlgo;
+	impl.bUseMsCrypto = false;
+	impl.blake3Features = ~(uint32_t)0;
+
+	if ((_tcsicmp(hashAlgo, _T("MD5")) == 0) || (_tcsnicmp(hashAlgo, _T("SHA"), 3) == 0))
+	{
+#if !defined (_M_ARM64) && !defined (_M_ARM)
+		impl.implementation = L"OpenSSL";
+		impls.push_back(impl);
+#endif
+#ifdef _WIN32
+		impl.implementation = L"CNG";
+		impl.bUseMsCrypto = true;
+		impls.push_back(impl);
+#endif
+	}
+	else if ((_tcsicmp(hashAlgo, _T("Blake3")) == 0) && blake3_cpu_features())
+	{
+		uint32_t features = blake3_cpu_features();
+		uint32_t sse41 = BLAKE3_FEATURE_SSE2 | BLAKE3_FEATURE_SSSE3 | BLAKE3_FEATURE_SSE41;
+		uint32_t avx2 = sse41 | BLAKE3_FEATURE_AVX | BLAKE3_FEATURE_AVX2;
+		uint32_t avx512 = avx2 | BLAKE3_FEATURE_AVX512F | BLAKE3_FEATURE_AVX512VL;
+
+		impl.implementation = L"Portable";
+		impl.blake3Features = 0;
+		impls.push_back(impl);
+		if (features & BLAKE3_FEATURE_SSE2)
+		{
+			impl.implementation = L"SSE2";
+			impl.blake3Features = BLAKE3_FEATURE_SSE2;
+			impls.push_back(impl);
+		}
+		if (features & BLAKE3_FEATURE_SSE41)
+		{
+			impl.implementation = L"SSE4.1";
+			impl.blake3Features = sse41;
+			impls.push_back(impl);
+		}
+		if (features & BLAKE3_FEATURE_AVX2)
+		{
+			impl.implementation = L"AVX2";
+			impl.blake3Features = avx2;
+			impls.push_back(impl);
+		}
+		if ((features & (BLAKE3_FEATURE_AVX512F | BLAKE3_FEATURE_AVX512VL)) == (BLAKE3_FEATURE_AVX512F | BLAKE3_FEATURE_AVX512VL))
+		{
+			impl.implementation = L"AVX-512";
+			impl.blake3Features = avx512;
+			impls.push_back(impl);
+		}
+	}
+	else
+	{
+		impl.implementation = L"Default";
+		impls.push_back(impl);
+	}
+}
+
+Hash* CreateBenchHash(const BenchImplementation& impl)
+{
+	bool bUseMsCrypto = t_pOperation->m_bUseMsCrypto;
+	t_pOperation->m_bUseMsCrypto = impl.bUseMsCrypto;
+	Hash* pHash = Hash::GetHash(impl.algorithm.c_str());
+	t_pOperation->m_bUseMsCrypto = bUseMsCrypto;
+	return pHash;
+}
+
+// return the duration in seconds of the given number of digest computations
+double RunBenchIterations(Hash* pHash, LPCBYTE pbData, ULONGLONG size, ULONGLONG iterations)
+{
+	BYTE pbDigest[64];
+	double t1 = GetBenchTime();
+	for (ULONGLONG i = 0; i < iterations; i++)
+	{
+		pHash->Update(pbData, (size_t)size);
+		pHash->Final(pbDigest);
+		pHash->Init();
+	}
+	return GetBenchTime() - t1;
+}
+
+// linear interpolation between the closest ranks of the sorted values
+double GetPercentile(const vector<double>& sortedValues, double percentile)
+{
+	double rank = percentile * (double)(sortedValues.size() - 1) / 100.0;
+	size_t index = (size_t)rank;
+	if (index + 1 >= sortedValues.size())
+		return sortedValues.back();
+	return sortedValues[index] + (rank - (double)index) * (sortedValues[index + 1] - sortedValues[index]);
+}
+
+bool BenchmarkImplementation(const BenchImplementation& impl, LPCBYTE pbData, ULONGLONG size, BenchResult& result)
+{
+	Hash* pHash = CreateBenchHash(impl);
+	if (!pHash)
+		return false;
+
+	blake3_set_cpu_features_mask(impl.blake3Features);
+
+	// calibration: the number of iterations is increased until a sample lasts long enough to be measured accurately
+	ULONGLONG iterations = 1;
+	double duration;
+	while (((duration = RunBenchIterations(pHash, pbData, size, iterations)) < BENCH_MIN_SAMPLE_TIME) && (iterations < (1ULL << 40)))
+	{
+		if (duration > 0.0)
+			iterations = max(iterations * 2, (ULONGLONG)((double)iterations * BENCH_MIN_SAMPLE_TIME * 1.2 / duration));
+		else
+			iterations *= 16;
+	}
+
+	size_t samplesCount = (size >= BENCH_LARGE_SIZE) ? BENCH_LARGE_SAMPLES : BENCH_SAMPLES;
+	vector<double> speeds;
+	for (size_t i = 0; i < BENCH_WARMUP_SAMPLES + samplesCount; i++)
+	{
+		duration = RunBenchIterations(pHash, pbData, size, iterations);
+		if (i >= BENCH_WARMUP_SAMPLES)
+			speeds.push_back((double)size * (double)iterations / max(duration, 1e-9));
+	}
+
+	blake3_set_cpu_features_mask(~(uint32_t)0);
+	delete pHash;
+
+	std::sort(speeds.begin(), speeds.end());
+	result.pImpl = &impl;
+	result.size = size;
+	result.iterations = iterations;
+	result.samples = speeds.size();
+	result.median = GetPercentile(speeds, 50.0);
+	result.p10 = GetPercentile(speeds, 10.0);
+	result.p90 = GetPercentile(speeds, 90.0);
+	result.minimum = speeds.front();
+	result.maximum = speeds.back();
+	return true;
+}
+
+typedef struct
+{
+	Hash* pHash;
+	LPCBYTE pbData;
+	ULONGLONG size;
+	ULONGLONG iterations;
+	HANDLE hStartEvent;
+} BenchThreadParam;
+
+DWORD WINAPI BenchThreadCode(LPVOID pArg)
+{
+	BenchThreadParam* p = (BenchThreadParam*)pArg;
+	WaitForSingleObject(p->hStartEvent, INFINITE);
+	RunBenchIterations(p->pHash, p->pbData, p->size, p->iterations);
+	return 0;
+}
+
+// aggregated throughput of the given number of threads hashing the same buffer concurrently
+double RunBenchThreads(const BenchImplementation& impl, LPCBYTE pbData, ULONGLONG size, ULONGLONG iterations, DWORD threadsCount)
+{
+	vector<BenchThreadParam> params(threadsCount);
+	vector<HANDLE> threads;
+	HANDLE hStartEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	double duration = 0.0;
+
+	if (!hStartEvent)
+		return 0.0;
+
+	for (DWORD i = 0; i < threadsCount; i++)
+	{
+		params[i].pHash = CreateBenchHash(impl);
+		params[i].pbData = pbData;
+		params[i].size = size;
+		params[i].iterations = iterations;
+		params[i].hStartEvent = hStartEvent;
+		HANDLE hThread = params[i].pHash ? CreateThread(NULL, 0, BenchThreadCode, &params[i], 0, NULL) : NULL;
+		if (hThread)
+			threads.push_back(hThread);
+	}
+
+	if (threads.size() == threadsCount)
+	{
+		double t1 = GetBenchTime();
+		SetEvent(hStartEvent);
+		for (size_t i = 0; i < threads.size(); i++)
+			WaitForSingleObject(threads[i], INFINITE);
+		duration = GetBenchTime() - t1;
+	}
+	else
+	{
+		// let the threads that were created terminate
+		SetEvent(hStartEvent);
+		for (size_t i = 0; i < threads.size(); i++)
+			WaitForSingleObject(threads[i], INFINITE);
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+		CloseHandle(threads[i]);
+	for (DWORD i = 0; i < threadsCount; i++)
+		delete params[i].pHash;
+	CloseHandle(hStartEvent);
+
+	if (duration <= 0.0)
+		return 0.0;
+	return (double)size * (double)iterations * (double)threadsCount / duration;
+}
+
+void BenchmarkScaling(const BenchImplementation& impl, LPCBYTE pbData, double singleThreadSpeed, vector<BenchScalingResult>& results)
+{
+	WORD groupCount = 0;
+	DWORD cpuCount = (DWORD)min(GetCpuCount(&groupCount), (size_t)256);
+	ULONGLONG iterations = max((ULONGLONG)1, (ULONGLONG)(singleThreadSpeed * BENCH_SCALING_TIME / (double)BENCH_SCALING_SIZE));
+	double baseThroughput = 0.0;
+
+	blake3_set_cpu_features_mask(impl.blake3Features);
+	for (DWORD threadsCount = 1; threadsCount <= cpuCount; threadsCount = (threadsCount < cpuCount && threadsCount * 2 > cpuCount) ? cpuCount : threadsCount * 2)
+	{
+		vector<double> throughputs;
+		for (int i = 0; i < BENCH_SCALING_RUNS; i++)
+			throughputs.push_back(RunBenchThreads(impl, pbData, BENCH_SCALING_SIZE, iterations, threadsCount));
+		std::sort(throughputs.begin(), throughputs.end());
+
+		BenchScalingResult result;
+		result.pImpl = &impl;
+		result.threads = threadsCount;
+		result.throughput = GetPercentile(throughputs, 50.0);
+		if (threadsCount == 1)
+			baseThroughput = result.throughput;
+		result.speedup = (baseThroughput > 0.0) ? (result.throughput / baseThroughput) : 0.0;
+		results.push_back(result);
+
+		if (threadsCount == cpuCount)
+			break;
+	}
+	blake3_set_cpu_features_mask(~(uint32_t)0);
+}
+
+void OutputBenchLine(const wstring& szLine, bool bQuiet, bool bWriteFile, std::wstring* outputText)
+{
+	// display results in yellow
+	SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+	if (!bQuiet) _tprintf(_T("%s\n"), szLine.c_str());
+	if (bWriteFile && t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], _T("%s\n"), szLine.c_str());
+	// restore normal text color
+	SetConsoleTextAttribute(g_hConsole, g_wCurrentAttributes);
+
+	if (outputText)
+	{
+		*outputText += szLine;
+		*outputText += _T("\n");
+	}
+}
+
+wstring FormatBenchResults(const vector<BenchResult>& results, const vector<BenchScalingResult>& scalingResults, BenchFormat format)
+{
+	wstring szOutput;
+	if (format == BENCH_FORMAT_CSV)
+	{
+		szOutput = L"type,algorithm,implementation,size,threads,iterations,samples,median_bps,p10_bps,p90_bps,min_bps,max_bps,speedup\n";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const BenchResult& r = results[i];
+			szOutput += FormatString(L"single,%s,%s,%llu,1,%llu,%llu,%.0f,%.0f,%.0f,%.0f,%.0f,\n",
+				r.pImpl->algorithm.c_str(), r.pImpl->implementation.c_str(), r.size, r.iterations, (ULONGLONG)r.samples,
+				r.median, r.p10, r.p90, r.minimum, r.maximum);
+		}
+		for (size_t i = 0; i < scalingResults.size(); i++)
+		{
+			const BenchScalingResult& r = scalingResults[i];
+			szOutput += FormatString(L"scaling,%s,%s,%llu,%lu,,%d,%.0f,,,,,%.3f\n",
+				r.pImpl->algorithm.c_str(), r.pImpl->implementation.c_str(), (ULONGLONG)BENCH_SCALING_SIZE, r.threads, BENCH_SCALING_RUNS,
+				r.throughput, r.speedup);
+		}
+	}
+	else
+	{
+		WORD groupCount = 0;
+		szOutput = FormatString(L"{\n  \"version\": \"%s\",\n  \"cpuCount\": %llu,\n  \"results\": [", _T(DIRHASH_VERSION), (ULONGLONG)GetCpuCount(&groupCount));
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const BenchResult& r = results[i];
+			szOutput += FormatString(L"%s\n    { \"algorithm\": \"%s\", \"implementation\": \"%s\", \"size\": %llu, \"iterations\": %llu, \"samples\": %llu, \"median\": %.0f, \"p10\": %.0f, \"p90\": %.0f, \"min\": %.0f, \"max\": %.0f }",
+				i ? L"," : L"", r.pImpl->algorithm.c_str(), r.pImpl->implementation.c_str(), r.size, r.iterations, (ULONGLONG)r.samples,
+				r.median, r.p10, r.p90, r.minimum, r.maximum);
+		}
+		szOutput += L"\n  ],\n  \"scaling\": [";
+		for (size_t i = 0; i < scalingResults.size(); i++)
+		{
+			const BenchScalingResult& r = scalingResults[i];
+			szOutput += FormatString(L"%s\n    { \"algorithm\": \"%s\", \"implementation\": \"%s\", \"size\": %llu, \"threads\": %lu, \"throughput\": %.0f, \"speedup\": %.3f }",
+				i ? L"," : L"", r.pImpl->algorithm.c_str(), r.pImpl->implementation.c_str(), (ULONGLONG)BENCH_SCALING_SIZE, r.threads,
+				r.throughput, r.speedup);
+		}
+		szOutput += L"\n  ]\n}\n";
+	}
+	return szOutput;
+}
+
+void PerformBenchmark(const vector<shared_ptr<Hash>>& pHashes, bool bQuiet, bool bCopyToClipboard, bool bSweep, bool bScaling, BenchFormat format)
+{
+	std::wstring outputText = L"";
+	std::wstring* pOutputText = bCopyToClipboard ? &outputText : NULL;
+	std::vector<std::wstring> hashList;
+	vector<ULONGLONG> sizes;
+	vector<BenchImplementation> impls;
+	vector<BenchResult> results;
+	vector<BenchScalingResult> scalingResults;
+	bool bMachineOutput = (format != BENCH_FORMAT_TEXT);
+	// human readable lines are not written to the file holding machine readable results, nor to the console when
+	// these results are written to it
+	bool bQuietText = bQuiet || (bMachineOutput && !t_pOperation->m_outputFiles[0]);
+	unsigned char* pbData = NULL;
+
+	if (pHashes.empty())
+		hashList = Hash::GetSupportedHashIds();
+	else
+	{
+		for (std::vector<shared_ptr<Hash>>::const_iterator It = pHashes.begin(); It != pHashes.end(); It++)
+			hashList.push_back((*It)->GetID());
+	}
+
+	if (bSweep)
+	{
+		// 64 B to 1 GiB
+		for (ULONGLONG size = 64; size <= 1024 * 1024 * 1024; size *= 16)
+			sizes.push_back(size);
+	}
+	else
+		sizes.push_back(BENCH_DEFAULT_SIZE);
+
+	// the largest sizes are skipped if there is not enough memory
+	while (!sizes.empty())
+	{
+		ULONGLONG bufferSize = max(sizes.back(), (ULONGLONG)(bScaling ? BENCH_SCALING_SIZE : 0));
+		pbData = new (std::nothrow) unsigned char[(size_t)bufferSize];
+		if (pbData)
+		{
+			// pseudo-random content (xorshift64)
+			ULONGLONG state = 0x9E3779B97F4A7C15ULL;
+			for (size_t i = 0; i + 8 <= (size_t)bufferSize; i += 8)
+			{
+				state ^= state << 13;
+				state ^= state >> 7;
+				state ^= state << 17;
+				memcpy(pbData + i, &state, 8);
+			}
+			break;
+		}
+		if (!bQuiet) ShowWarning(_T("Warning: Failed to allocate memory for %s inputs. This size will be skipped.\n"), FormatBenchSize(sizes.back()).c_str());
+		sizes.pop_back();
+	}
+
+	if (!pbData)
+	{
+		if (!bQuiet) ShowError(_T("Failed to allocate memory for benchmark.\n"));
+		return;
+	}
+
+	for (std::vector<std::wstring>::const_iterator It = hashList.begin(); It != hashList.end(); It++)
+		GetBenchImplementations(It->c_str(), impls);
+
+	for (size_t i = 0; i < impls.size(); i++)
+	{
+		for (size_t j = 0; j < sizes.size(); j++)
+		{
+			BenchResult result;
+			if (!BenchmarkImplementation(impls[i], pbData, sizes[j], result))
+			{
+				if (!bQuiet) ShowError(_T("Failed to initialize %s (%s) for benchmark.\n"), impls[i].algorithm.c_str(), impls[i].implementation.c_str());
+				break;
+			}
+			results.push_back(result);
+
+			OutputBenchLine(FormatString(L"%s (%s) %s speed = %s (p10 %s, p90 %s)",
+				impls[i].algorithm.c_str(), impls[i].implementation.c_str(), FormatBenchSize(sizes[j]).c_str(),
+				FormatBenchSpeed(result.median).c_str(), FormatBenchSpeed(result.p10).c_str(), FormatBenchSpeed(result.p90).c_str()),
+				bQuietText, !bMachineOutput, pOutputText);
+		}
+	}
+
+	if (bScaling)
+	{
+		// thread scaling is measured for the fastest implementation of each algorithm
+		for (std::vector<std::wstring>::const_iterator It = hashList.begin(); It != hashList.end(); It++)
+		{
+			const BenchImplementation* pBest = NULL;
+			double bestSpeed = 0.0;
+			for (size_t i = 0; i < results.size(); i++)
+			{
+				if ((results[i].pImpl->algorithm == *It) && (results[i].median > bestSpeed))
+				{
+					pBest = results[i].pImpl;
+					bestSpeed = results[i].median;
+				}
+			}
+			if (!pBest)
+				continue;
+
+			size_t first = scalingResults.size();
+			BenchmarkScaling(*pBest, pbData, bestSpeed, scalingResults);
+			for (size_t i = first; i < scalingResults.size(); i++)
+			{
+				OutputBenchLine(FormatString(L"%s (%s) %lu thread(s) speed = %s (x%.2f)",
+					pBest->algorithm.c_str(), pBest->implementation.c_str(), scalingResults[i].threads,
+					FormatBenchSpeed(scalingResults[i].throughput).c_str(), scalingResults[i].speedup),
+					bQuietText, !bMachineOutput, pOutputText);
+			}
+		}
+	}
+
+	if (bMachineOutput)
+	{
+		wstring szOutput = FormatBenchResults(results, scalingResults, format);
+		if (t_pOperation->m_outputFiles[0])
+			_ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szOutput.c_str());
+		else
+			_tprintf(_T("%s"), szOutput.c_str());
+	}
+
+	delete[] pbData;
+
+	if (bCopyToClipboard)
+		CopyToClipboard(outputText.c_str());
+}
+
+// ---------------------------------------------
+/*
+ * End-to-end filesystem benchmark used by -benchmark-fs.
+ *
+ * A synthetic tree is generated in the given work directory from a seed so that the same parameters always produce
+ * the same files (same sizes and content). It is kept between runs and regenerated only when the parameters change.
+ * Enumeration alone is measured in-process while the other phases run DirHash itself as a child process so that
+ * process startup, enumeration, opens and reads are all included. Each phase is run once to warm the file cache
+ * before the measured runs. With -cold, additional runs are done after emptying the system file cache, which
+ * requires administrator rights.
+ */
+
+#define FSBENCH_TREE_NAME		L"dirhash_bench_tree"
+#define FSBENCH_SUM_NAME		L"dirhash_bench.sum"
+#define FSBENCH_RUNS			3
+#define FSBENCH_WRITE_BUFFER	(1024 * 1024)
+
+typedef NTSTATUS(WINAPI* NtSetSystemInformationFn)(
+	INT SystemInformationClass,
+	PVOID SystemInformation,
+	ULONG SystemInformationLength);
+
+typedef struct
+{
+	DWORD filesCount;
+	DWORD depth;
+	DWORD fanout;
+	wstring sizeProfile; // small, mixed or large
+	ULONGLONG seed;
+	bool bCold;
+	bool bClean;
+} FsBenchParams;
+
+typedef struct
+{
+	wstring phase;
+	bool bCold;
+	double seconds; // median of the runs
+	double filesPerSecond;
+	double bytesPerSecond;
+} FsBenchResult;
+
+static inline ULONGLONG FsBenchRandom(ULONGLONG& state)
+{
+	// xorshift64
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+// file sizes are roughly log-uniform inside the range of the profile
+ULONGLONG GetFsBenchFileSize(const wstring& sizeProfile, ULONGLONG& state)
+{
+	ULONGLONG minSize = 0, maxSize = 64 * 1024;
+	if (sizeProfile == L"large")
+	{
+		minSize = 1024 * 1024;
+		maxSize = 256 * 1024 * 1024;
+	}
+	else if ((sizeProfile == L"mixed") && ((FsBenchRandom(state) % 10) == 0))
+	{
+		minSize = 64 * 1024;
+		maxSize = 64 * 1024 * 1024;
+	}
+
+	// pick a power of 2 between the bounds, then a uniform size below it
+	int minBits = 0, maxBits = 0;
+	while ((1ULL << minBits) <= minSize)
+		minBits++;
+	while ((1ULL << maxBits) < maxSize)
+		maxBits++;
+	int bits = minBits + (int)(FsBenchRandom(state) % (ULONGLONG)(maxBits - minBits + 1));
+	return max(minSize, min(maxSize, (ULONGLONG)(FsBenchRandom(state) % (1ULL << bits))));
+}
+
+bool DeleteFsBenchTree(const wstring& szPath)
+{
+	WIN32_FIND_DATAW ffd;
+	HANDLE hFind = FindFirstFileW((szPath + PATH_SEPARATOR_STRING L"*").c_str(), &ffd);
+	if (hFind != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			wstring szChild = szPath + PATH_SEPARATOR_STRING + ffd.cFileName;
+			if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			{
+				if (wcscmp(ffd.cFileName, L".") && wcscmp(ffd.cFileName, L".."))
+					DeleteFsBenchTree(szChild);
+			}
+			else
+				DeleteFileW(szChild.c_str());
+		} while (FindNextFileW(hFind, &ffd));
+		FindClose(hFind);
+	}
+	return RemoveDirectoryW(szPath.c_str()) ? true : false;
+}
+
+bool GenerateFsBenchTree(const wstring& szTreePath, const FsBenchParams& params, ULONGLONG& totalBytes, DWORD& dirsCount)
+{
+	vector<wstring> dirs;
+	vector<BYTE> buffer(FSBENCH_WRITE_BUFFER);
+	ULONGLONG state = params.seed ? params.seed : 1;
+
+	totalBytes = 0;
+	if (!CreateDirectoryW(szTreePath.c_str(), NULL))
+		return false;
+
+	// directories are created level by level, each one having "fanout" sub-directories
+	dirs.push_back(szTreePath);
+	for (size_t first = 0, level = 0; level < params.depth; level++)
+	{
+		size_t last = dirs.size();
+		for (size_t i = first; i < last; i++)
+		{
+			for (DWORD j = 0; j < params.fanout; j++)
+			{
+				wstring szDir = dirs[i] + FormatString(PATH_SEPARATOR_STRING L"d%u", j);
+				if (!CreateDirectoryW(szDir.c_str(), NULL))
+					return false;
+				dirs.push_back(szDir);
+			}
+		}
+		first = last;
+	}
+	dirsCount = (DWORD)dirs.size();
+
+	for (DWORD i = 0; i < params.filesCount; i++)
+	{
+		ULONGLONG fileSize = GetFsBenchFileSize(params.sizeProfile, state);
+		wstring szFile = dirs[(size_t)(FsBenchRandom(state) % dirs.size())] + FormatString(PATH_SEPARATOR_STRING L"f%.7u.bin", i);
+		HANDLE f = CreateFileW(szFile.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (f == INVALID_HANDLE_VALUE)
+			return false;
+
+		// the content of each file only depends on the seed and on its index
+		ULONGLONG contentState = (state ^ ((ULONGLONG)i * 0x9E3779B97F4A7C15ULL)) | 1;
+		ULONGLONG remaining = fileSize;
+		bool bRet = true;
+		while (bRet && remaining)
+		{
+			DWORD cbToWrite = (DWORD)min(remaining, (ULONGLONG)buffer.size()), cbWritten = 0;
+			for (DWORD j = 0; j < cbToWrite; j += 8)
+			{
+				ULONGLONG value = FsBenchRandom(contentState);
+				memcpy(&buffer[j], &value, min((DWORD)8, cbToWrite - j));
+			}
+			bRet = WriteFile(f, buffer.data(), cbToWrite, &cbWritten, NULL) && (cbWritten == cbToWrite);
+			remaining -= cbToWrite;
+		}
+		CloseHandle(f);
+		if (!bRet)
+			return false;
+		totalBytes += fileSize;
+	}
+
+	return true;
+}
+
+// enumeration only, using the same API as HashDirectory
+void EnumerateFsBenchTree(const wstring& szPath, ULONGLONG& filesCount)
+{
+	WIN32_FIND_DATAW ffd;
+	HANDLE hFind = FindFirstFileW((szPath + PATH_SEPARATOR_STRING L"*").c_str(), &ffd);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			if (wcscmp(ffd.cFileName, L".") && wcscmp(ffd.cFileName, L".."))
+				EnumerateFsBenchTree(szPath + PATH_SEPARATOR_STRING + ffd.cFileName, filesCount);
+		}
+		else
+			filesCount++;
+	} while (FindNextFileW(hFind, &ffd));
+	FindClose(hFind);
+}
+
+// empty the standby list of the memory manager, which holds the file cache. Requires administrator rights.
+bool PurgeFileCache()
+{
+#ifndef _WIN32
+	// write back dirty pages, then drop the page cache, dentries and inodes. Requires root.
+	sync();
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	bool bRet = (write(fd, "3", 1) == 1);
+	close(fd);
+	return bRet;
+#else
+	HANDLE hToken = NULL;
+	TOKEN_PRIVILEGES tp;
+	bool bRet = false;
+	NtSetSystemInformationFn NtSetSystemInformationPtr = (NtSetSystemInformationFn)GetProcAddress(GetModuleHandle(L"ntdll.dll"), "NtSetSystemInformation");
+
+	if (!NtSetSystemInformationPtr || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+		return false;
+
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	if (LookupPrivilegeValue(NULL, SE_PROF_SINGLE_PROCESS_NAME, &tp.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(hToken, FALSE, &tp, 0, NULL, NULL)
+		&& (GetLastError() != ERROR_NOT_ALL_ASSIGNED))
+	{
+		INT command = 3; // MemoryFlushModifiedList: write pending data first
+		NtSetSystemInformationPtr(80 /* SystemMemoryListInformation */, &command, sizeof(command));
+		command = 4; // MemoryPurgeStandbyList
+		bRet = NtSetSystemInformationPtr(80 /* SystemMemoryListInformation */, &command, sizeof(command)) >= 0;
+	}
+	CloseHandle(hToken);
+	return bRet;
+#endif
+}
+
+// run DirHash with the given arguments and return its duration in seconds, or a negative value if it failed
+double RunFsBenchCommand(const wstring& szArgs)
+{
+	WCHAR szExePath[1024];
+	STARTUPINFOW si = { 0 };
+	PROCESS_INFORMATION pi = { 0 };
+	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	DWORD dwExitCode = 1;
+	double duration = -1.0;
+
+	if (!GetModuleFileNameW(NULL, szExePath, ARRAYSIZE(szExePath)))
+		return -1.0;
+
+	wstring szCommand = FormatString(L"\"%s\" %s -nowait -nologo -quiet", szExePath, szArgs.c_str());
+	vector<WCHAR> commandLine(szCommand.begin(), szCommand.end());
+	commandLine.push_back(0);
+
+	// the output of the child is discarded
+	HANDLE hNull = CreateFileW(L"NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+	si.cb = sizeof(si);
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = NULL;
+	si.hStdOutput = hNull;
+	si.hStdError = hNull;
+
+	double t1 = GetBenchTime();
+	if (CreateProcessW(NULL, commandLine.data(), NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+	{
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		duration = GetBenchTime() - t1;
+		if (!GetExitCodeProcess(pi.hProcess, &dwExitCode) || dwExitCode)
+			duration = -1.0;
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+	}
+
+	if (hNull != INVALID_HANDLE_VALUE)
+		CloseHandle(hNull);
+	return duration;
+}
+
+wstring FormatFsBenchResults(const vector<FsBenchResult>& results, const FsBenchParams& params, DWORD dirsCount, ULONGLONG totalBytes, BenchFormat format)
+{
+	wstring szOutput;
+	if (format == BENCH_FORMAT_CSV)
+	{
+		szOutput = L"phase,cache,files,directories,bytes,seconds,files_per_second,bytes_per_second\n";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			szOutput += FormatString(L"%s,%s,%lu,%lu,%llu,%.6f,%.1f,%.0f\n", results[i].phase.c_str(), results[i].bCold ? L"cold" : L"warm",
+				params.filesCount, dirsCount, totalBytes, results[i].seconds, results[i].filesPerSecond, results[i].bytesPerSecond);
+		}
+	}
+	else
+	{
+		szOutput = FormatString(L"{\n  \"version\": \"%s\",\n  \"files\": %lu,\n  \"directories\": %lu,\n  \"bytes\": %llu,\n  \"sizeProfile\": \"%s\",\n  \"seed\": %llu,\n  \"results\": [",
+			_T(DIRHASH_VERSION), params.filesCount, dirsCount, totalBytes, params.sizeProfile.c_str(), params.seed);
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			szOutput += FormatString(L"%s\n    { \"phase\": \"%s\", \"cache\": \"%s\", \"seconds\": %.6f, \"filesPerSecond\": %.1f, \"bytesPerSecond\": %.0f }",
+				i ? L"," : L"", results[i].phase.c_str(), results[i].bCold ? L"cold" : L"warm", results[i].seconds, results[i].filesPerSecond, results[i].bytesPerSecond);
+		}
+		szOutput += L"\n  ]\n}\n";
+	}
+	return szOutput;
+}
+
+DWORD PerformFsBenchmark(const CPath& workDir, const wstring& hashAlgo, const FsBenchParams& params, bool bQuiet, bool bCopyToClipboard, BenchFormat format)
+{
+	std::wstring outputText = L"";
+	std::wstring* pOutputText = bCopyToClipboard ? &outputText : NULL;
+	bool bMachineOutput = (format != BENCH_FORMAT_TEXT);
+	bool bQuietText = bQuiet || (bMachineOutput && !t_pOperation->m_outputFiles[0]);
+	wstring szWorkDir = workDir.GetAbsolutPathValue();
+	wstring szTreePath = szWorkDir + PATH_SEPARATOR_STRING FSBENCH_TREE_NAME;
+	wstring szSumPath = szWorkDir + PATH_SEPARATOR_STRING FSBENCH_SUM_NAME;
+	wstring szMarkerPath = szTreePath + L".txt";
+	wstring szDescription = FormatString(L"files=%lu depth=%lu fanout=%lu sizes=%s seed=%llu", params.filesCount, params.depth, params.fanout, params.sizeProfile.c_str(), params.seed);
+	vector<FsBenchResult> results;
+	ULONGLONG totalBytes = 0;
+	DWORD dirsCount = 0;
+
+	CreateDirectoryW(szWorkDir.c_str(), NULL);
+
+	// reuse the tree generated by a previous run with the same parameters. The marker holds the parameters
+	// followed by the number of directories and the total size.
+	FILE* fMarker = _wfopen(szMarkerPath.c_str(), L"rt,ccs=UTF-8");
+	if (fMarker)
+	{
+		WCHAR szLine[256] = { 0 };
+		unsigned long dirs = 0;
+		unsigned long long bytes = 0;
+		if (fgetws(szLine, ARRAYSIZE(szLine), fMarker) && (szDescription + L"\n" == szLine)
+			&& (2 == fwscanf(fMarker, L"%lu %llu", &dirs, &bytes)))
+		{
+			dirsCount = dirs;
+			totalBytes = bytes;
+		}
+		fclose(fMarker);
+	}
+
+	if (!dirsCount)
+	{
+		if (!bQuiet)
+			_tprintf(_T("Generating synthetic tree (%s) in \"%s\" ...\n"), szDescription.c_str(), szTreePath.c_str());
+		DeleteFileW(szMarkerPath.c_str());
+		DeleteFsBenchTree(szTreePath);
+		if (!GenerateFsBenchTree(szTreePath, params, totalBytes, dirsCount))
+		{
+			if (!bQuiet) ShowError(_T("Error: Failed to generate the synthetic tree in \"%s\" (error 0x%.8X).\n"), szTreePath.c_str(), GetLastError());
+			return -1;
+		}
+		fMarker = _wfopen(szMarkerPath.c_str(), L"wt,ccs=UTF-8");
+		if (fMarker)
+		{
+			_ftprintf(fMarker, L"%s\n%lu %llu\n", szDescription.c_str(), dirsCount, totalBytes);
+			fclose(fMarker);
+		}
+	}
+
+	if (!bQuietText)
+		_tprintf(_T("Tree: %lu files, %lu directories, %llu bytes\n"), params.filesCount, dirsCount, totalBytes);
+
+	for (int cache = 0; cache < (params.bCold ? 2 : 1); cache++)
+	{
+		bool bCold = (cache == 1);
+		if (bCold && !PurgeFileCache())
+		{
+			if (!bQuiet) ShowWarning(_T("Warning: Failed to empty the system file cache (administrator rights are required). Cold cache runs are skipped.\n"));
+			break;
+		}
+
+		// the SUM file is created by the -sum phases and used by the -verify phase
+		const wchar_t* phases[5] = { L"enumeration", L"digest", L"sum", L"sum-threads", L"verify" };
+		wstring args[5] = {
+			L"",
+			FormatString(L"\"%s\" %s", szTreePath.c_str(), hashAlgo.c_str()),
+			FormatString(L"\"%s\" %s -sum -t \"%s\" -overwrite", szTreePath.c_str(), hashAlgo.c_str(), szSumPath.c_str()),
+			FormatString(L"\"%s\" %s -sum -threads -t \"%s\" -overwrite", szTreePath.c_str(), hashAlgo.c_str(), szSumPath.c_str()),
+			FormatString(L"\"%s\" %s -verify \"%s\"", szTreePath.c_str(), hashAlgo.c_str(), szSumPath.c_str())
+		};
+
+		for (int phase = 0; phase < 5; phase++)
+		{
+			vector<double> durations;
+			bool bFailed = false;
+			// in warm mode, the first run only fills the file cache
+			for (int run = bCold ? 1 : 0; !bFailed && (run <= FSBENCH_RUNS); run++)
+			{
+				double duration;
+				if (bCold && !PurgeFileCache())
+				{
+					bFailed = true;
+					break;
+				}
+
+				if (phase == 0)
+				{
+					ULONGLONG filesCount = 0;
+					double t1 = GetBenchTime();
+					EnumerateFsBenchTree(szTreePath, filesCount);
+					duration = GetBenchTime() - t1;
+				}
+				else
+					duration = RunFsBenchCommand(args[phase]);
+
+				if (duration < 0.0)
+					bFailed = true;
+				else if (run)
+					durations.push_back(duration);
+			}
+
+			if (bFailed)
+			{
+				if (!bQuiet) ShowError(_T("Error: The %s phase failed.\n"), phases[phase]);
+				continue;
+			}
+
+			std::sort(durations.begin(), durations.end());
+			FsBenchResult result;
+			result.phase = phases[phase];
+			result.bCold = bCold;
+			result.seconds = max(GetPercentile(durations, 50.0), 1e-9);
+			result.filesPerSecond = (double)params.filesCount / result.seconds;
+			result.bytesPerSecond = (phase == 0) ? 0.0 : (double)totalBytes / result.seconds;
+			results.push_back(result);
+
+			OutputBenchLine(FormatString(L"%s (%s cache): %.3f s, %.0f files/s%s%s", phases[phase], bCold ? L"cold" : L"warm", result.seconds, result.filesPerSecond,
+				phase ? L", " : L"", phase ? FormatBenchSpeed(result.bytesPerSecond).c_str() : L""),
+				bQuietText, !bMachineOutput, pOutputText);
+		}
+	}
+
+	if (bMachineOutput)
+	{
+		wstring szOutput = FormatFsBenchResults(results, params, dirsCount, totalBytes, format);
+		if (t_pOperation->m_outputFiles[0])
+			_ftprintf(*t_pOperation->m_outputFiles[0], L"%s", szOutput.c_str());
+		else
+			_tprintf(_T("%s"), szOutput.c_str());
+	}
+
+	DeleteFileW(szSumPath.c_str());
+	if (params.bClean)
+	{
+		DeleteFileW(szMarkerPath.c_str());
+		DeleteFsBenchTree(szTreePath);
+	}
+
+	if (bCopyToClipboard)
+		CopyToClipboard(outputText.c_str());
+
+	return 0;
+}
+
+// structure used to hold value from DirHash.ini
+typedef struct
+{
+	wstring hashAlgoToUse;
+	bool bQuiet;
+	bool bDontWait;
+	bool bShowProgress;
+	bool bCopyToClipboard;
+	bool bIncludeNames;
+	bool bStripNames;
+	bool bLowerCase;
+	bool bUseMsCrypto;
+	bool bSkipError;
+	bool bNoLogo;
+	bool bNoFollow;
+	bool bForceSumMode;
+	bool bUseThreads;
+	bool bSumRelativePath;
+	bool bIncludeLastDir;
+	bool bSumExtended;
+} ConfigParams;
+
+void LoadDefaults(ConfigParams& iniParams)
+{
+	iniParams.hashAlgoToUse = L"Blake3";
+	iniParams.bUseMsCrypto = false;
+	iniParams.bDontWait = DEFAULT_DONT_WAIT;
+	iniParams.bIncludeNames = false;
+	iniParams.bStripNames = false;
+	iniParams.bQuiet = false;
+	iniParams.bCopyToClipboard = false;
+	iniParams.bShowProgress = false;
+	iniParams.bLowerCase = false;
+	iniParams.bSkipError = false;
+	iniParams.bNoLogo = false;
+	iniParams.bNoFollow = false;
+	iniParams.bForceSumMode = false;
+	iniParams.bUseThreads = false;
+	iniParams.bSumRelativePath = false;
+	iniParams.bIncludeLastDir = false;
+	iniParams.bSumExtended = false;
+
+	// get values from DirHash.ini fille if it exists
+	WCHAR szInitPath[1024];
+	szInitPath[0] = 0;
+	if (GetModuleFileName(NULL, szInitPath, ARRAYSIZE(szInitPath)))
+	{
+		wchar_t* ptr = wcsrchr (szInitPath, PATH_SEPARATOR);
+		if (ptr)
+		{
+			ptr += 1;
+			*ptr = 0;
+			StringCbCatW(szInitPath, sizeof(szInitPath), L"DirHash.ini");
+
+			WCHAR szValue[128];
+			if (GetPrivateProfileStringW(L"Defaults", L"Hash", L"Blake3", szValue, ARRAYSIZE(szValue), szInitPath) && Hash::IsHashId (szValue))
+			{
+				iniParams.hashAlgoToUse = szValue;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"Quiet", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bQuiet = true;
+				else
+					iniParams.bQuiet = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"NoWait", DEFAULT_DONT_WAIT ? L"True" : L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bDontWait = true;
+				else
+					iniParams.bDontWait = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"ShowProgress", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bShowProgress = true;
+				else
+					iniParams.bShowProgress = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"hashnames", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bIncludeNames = true;
+				else
+					iniParams.bIncludeNames = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"stripnames", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bStripNames = true;
+				else
+					iniParams.bStripNames = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"clip", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bCopyToClipboard = true;
+				else
+					iniParams.bCopyToClipboard = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"lowercase", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bLowerCase = true;
+				else
+					iniParams.bLowerCase = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"MSCrypto", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bUseMsCrypto = true;
+				else
+					iniParams.bUseMsCrypto = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"SkipError", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bSkipError = true;
+				else
+					iniParams.bSkipError = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"NoLogo", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bNoLogo = true;
+				else
+					iniParams.bNoLogo = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"NoFollow", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bNoFollow = true;
+				else
+					iniParams.bNoFollow = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"Sum", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bForceSumMode = true;
+				else
+					iniParams.bForceSumMode = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"Threads", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bUseThreads = true;
+				else
+					iniParams.bUseThreads = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"SumRelativePath", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bSumRelativePath = true;
+				else
+					iniParams.bSumRelativePath = false;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"IncludeLastDir", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") != 0)
+					iniParams.bIncludeLastDir = false;
+				else
+					iniParams.bIncludeLastDir = true;
+			}
+
+			if (GetPrivateProfileStringW(L"Defaults", L"SumExtended", L"False", szValue, ARRAYSIZE(szValue), szInitPath))
+			{
+				if (_wcsicmp(szValue, L"True") == 0)
+					iniParams.bSumExtended = true;
+				else
+					iniParams.bSumExtended = false;
+			}
+		}
+	}
+
+#if defined (_M_ARM64) || defined (_M_ARM)
+	// we always use Windows native crypto on ARM platform because OpenSSL is not optimized for such platforms
+	iniParams.bUseMsCrypto = true;
+#endif
+}
+
+bool ParseResultLine(wchar_t* szLine, wstring& targetName, wstring& hashName, ByteArray& digestValue)
+{
+	bool bRet = false;
+
+	if (szLine && wcslen (szLine) >= 32 ) // minimum length of line is 32 characters
+	{
+		// try first to decode as raw hash value
+		if (FromHex(szLine, digestValue))
+		{
+			bRet = Hash::IsHashSize((int)digestValue.size());
+		}
+		else
+		{
+			// parse hash name, folder/file name and digest value
+			// format: hashName hash of "XXXX" (DD bytes) = XXXXXX...XX
+			wchar_t* ptr = wcschr(szLine, L' ');
+			if (ptr)
+			{
+				*ptr = 0;
+				// check that first part is a valid hash name
+				shared_ptr<Hash> pHash(Hash::GetHash(szLine));
+				if (pHash)
+				{
+					hashName = pHash->GetID();
+					ptr++;
+					if ((wcslen(ptr) > 32) && wcsstr(ptr, L"hash of \"") == ptr)
+					{
+						ptr += 9; // 9 is length of "hash of \""
+						wchar_t* delim = wcschr(ptr, L'\"');
+						if (delim)
+						{
+							*delim = 0;
+							targetName = ptr;
+
+							if (delim[1] == L' ' && delim[2] == L'(')
+							{
+								ptr = delim + 3;
+								if (wcslen(ptr) > 32 && (delim = wcschr(ptr, L' ')))
+								{
+									// get encoded digest size (always 2 characters)
+									int hashLen = 0;
+									*delim = 0;
+									if (wcslen(ptr) == 2 && (1 == swscanf(ptr, L"%2d", &hashLen)) && (hashLen == pHash->GetHashSize()))
+									{
+										ptr = delim + 1;
+										if ((wcslen(ptr) > 32) && wcsstr(ptr, L"bytes) = ") == ptr)
+										{
+											// look for digest
+											ptr += 9; // 9 is length of "bytes) = "
+
+											if (wcslen(ptr) == ((size_t) 2 * (size_t) hashLen)) // hexadecimal encoding is double the size in bytes
+											{
+												if (FromHex(ptr, digestValue))
+												{
+													bRet = true;
+												}
+											}
+										}
+									}
+								}
+							}						
+						}
+					}
+				}
+			}
+
+		}
+	}
+
+	if (!bRet)
+	{
+		targetName = L"";
+		hashName = L"";
+		digestValue.clear();
+	}
+
+	return bRet;
+}
+
+bool ParseResultFile(const CPath& resultFile, map<wstring, HashResultEntry>& pathDigestList, map<int, ByteArray>& rawDigestList)
+{
+	bool bRet = false;
+	// Result files are created using UTF-8 encoding in order to support UNICODE file names
+	FILE* f = _wfopen(resultFile.GetAbsolutPathValue().c_str(), L"rt,ccs=UTF-8");
+	if (f)
+	{
+		bool bFailed = false;
+		ByteArray buffer(4096 * 2);
+		wchar_t* szLine = (wchar_t*)buffer.data();
+		size_t digestLen = 0;
+		wstring targetName, hashName;
+		ByteArray digestValue;
+
+		pathDigestList.clear();
+		rawDigestList.clear();
+
+		while (fgetws(szLine, (int)(buffer.size() / sizeof(wchar_t)), f))
+		{
+			size_t l = wcslen(szLine);
+			if (szLine[l - 1] == L'\n')
+			{
+				szLine[l - 1] = 0;
+				l--;
+			}
+			// CRLF line endings of files written on Windows, read on other platforms
+			if (l && szLine[l - 1] == L'\r')
+			{
+				szLine[l - 1] = 0;
+				l--;
+			}
+
+			if (l == 0)
+				continue;
+
+			if (ParseResultLine(szLine, targetName, hashName, digestValue))
+			{
+				if (targetName.length() && hashName.length())
+				{
+					pathDigestList[targetName].m_hashName = hashName;
+					pathDigestList[targetName].m_digest = digestValue;
+				}
+				else
+					rawDigestList[(int)digestValue.size()] = digestValue;
+			}
+			else
+			{
+				bFailed = true;
+				break;
+			}
+		}
+		fclose(f);
+
+		if (bFailed)
+		{
+			pathDigestList.clear();
+			rawDigestList.clear();
+		}
+		else if (pathDigestList.size() == 0 && rawDigestList.size() == 0)
+		{
+		}
+		else
+			bRet = true;
+	}
+	else
+	{
+		_tprintf(TEXT("Failed to open file \"%s\" for reading\n"), resultFile.GetPathValue().c_str());
+	}
+
+	return bRet;
+}
+
+bool ParseSumFile(const CPath& sumFile, map<wstring, HashResultEntry>& digestList, vector<int>& skippedLines, bool normalizePath = true)
+{
+	bool bRet = false;	
 	// SUM files are created using UTF-8 encoding in order to support UNICODE file names
 	FILE* f = _wfopen(sumFile.GetAbsolutPathValue().c_str(), L"rt,ccs=UTF-8");
 	if (f)
 	{
-		bool bFailed = false;
-		ByteArray buffer(4096 * 2);
-		wchar_t* szLine = (wchar_t*)buffer.data();
-		size_t digestLen = 0;
-		int lineNumber = 0;
-		
-		digestList.clear();
-		skippedLines.clear();
+		bool bFailed = false;
+		ByteArray buffer(4096 * 2);
+		wchar_t* szLine = (wchar_t*)buffer.data();
+		size_t digestLen = 0;
+		int lineNumber = 0;
+		
+		digestList.clear();
+		skippedLines.clear();
+
+		while (fgetws(szLine, (int)(buffer.size() / sizeof(wchar_t)), f))
+		{
+			size_t l = wcslen(szLine);
+			if (szLine[l - 1] == L'\n')
+			{
+				szLine[l - 1] = 0;
+				l--;
+			}
+			// CRLF line endings of files written on Windows, read on other platforms
+			if (l && szLine[l - 1] == L'\r')
+			{
+				szLine[l - 1] = 0;
+				l--;
+			}
+
+			lineNumber++;
+
+			if (l == 0)
+				continue;
+
+			wstring entryName;
+			ByteArray digest;
+			FileMetadata metadata;
+			bFailed = !ParseSumLine(szLine, l, digestLen, normalizePath, entryName, digest, metadata);
+			if (!bFailed)
+			{
+				digestList[entryName].m_digest = digest;
+				digestList[entryName].m_metadata = metadata;
+			}
+
+			if (bFailed)
+			{
+				if (lineNumber > 1)
+				{
+					skippedLines.push_back(lineNumber);
+					bFailed = false;
+				}
+				else
+					break;
+			}
+		}
+		fclose(f);
+
+		if (bFailed)
+		{
+			digestList.clear();
+		}
+		else if (digestList.size() == 0)
+		{
+		}
+		else
+			bRet = true;
+	}
+	else
+	{
+	_tprintf(TEXT("Failed to open file \"%s\" for reading\n"), sumFile.GetPathValue().c_str());
+	}
+
+	return bRet;
+}
+
+// Helper function to count the depth of directories in a path
+long long countPathDepth(const wstring& path) {
+	return std::count(path.begin(), path.end(), PATH_SEPARATOR);
+}
+
+bool SortSumFile(const CPath& sumFile, FILE* fTarget)
+{
+	map<wstring, HashResultEntry> digestList;
+	vector<int> skippedLines;
+	bool bRet = false;
+
+	// Parse the existing SHASUM file
+	if (ParseSumFile(sumFile, digestList, skippedLines, false))
+	{
+		// Convert map to vector for sorting
+		vector<pair<wstring, HashResultEntry>> sortedEntries(digestList.begin(), digestList.end());
+
+		// Sort the entries by directory depth first, then lexicographically
+		sort(sortedEntries.begin(), sortedEntries.end(),
+			[](const auto& a, const auto& b) {
+				long long depthA = countPathDepth(a.first);
+				long long depthB = countPathDepth(b.first);
+				if (depthA != depthB) {
+					return depthA > depthB; // // Entries with more directories come first
+				}
+				return _wcsicmp(a.first.c_str(), b.first.c_str()) < 0; // Lexicographical order as secondary criterion
+			});
+
+		// Write the sorted entries to the file
+		bool openedNewFile = false;
+		if (!fTarget)
+		{
+			fTarget = _wfopen(sumFile.GetAbsolutPathValue().c_str(), L"wt,ccs=UTF-8");
+			openedNewFile = true;
+		}
+
+		if (fTarget)
+		{
+			WCHAR szDigestHex[129]; // Enough for 64 bytes digest
+			for (const auto& entry : sortedEntries)
+			{
+				ToHex(entry.second.m_digest, szDigestHex);
+				wstring szLine = FormatSumLine(szDigestHex, entry.first.c_str(), entry.second.m_metadata);
+				_ftprintf(fTarget, L"%s", szLine.c_str());
+			}
+
+			if (openedNewFile)
+				fclose(fTarget);
+
+			bRet = true;
+		}
+	}
+
+	return bRet;
+}
+
+static void AppendVarint(ByteArray& buffer, ULONGLONG value)
+{
+	while (value >= 0x80)
+	{
+		buffer.push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+	buffer.push_back((unsigned char)value);
+}
+
+// Write the given entries (sorted by the map in ordinal order) to a binary SUM file
+bool WriteBinarySumFile(const map<wstring, HashResultEntry>& nativeEntries, const CPath& targetFile)
+{
+#ifdef _WIN32
+	const map<wstring, HashResultEntry>& entries = nativeEntries;
+#else
+	// entries must be sorted on their stored representation
+	map<wstring, HashResultEntry> entries;
+	for (map<wstring, HashResultEntry>::const_iterator It = nativeEntries.begin(); It != nativeEntries.end(); It++)
+		entries[ToBinarySumPath(It->first)] = It->second;
+#endif
+	bool bRet = false;
+	BINARY_SUM_HEADER header;
+	ByteArray digests, strings;
+	vector<BINARY_SUM_METADATA> metadata;
+	vector<ULONGLONG> index;
+	bool bHasMetadata = false;
+	const wstring* pPrevious = NULL;
+	ULONGLONG i = 0;
+
+	if (entries.empty())
+		return false;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_SUM_MAGIC, 8);
+	header.version = BINARY_SUM_VERSION;
+	header.digestSize = (DWORD)entries.begin()->second.m_digest.size();
+	header.entryCount = (ULONGLONG)entries.size();
+	header.restartInterval = BINARY_SUM_RESTART_INTERVAL;
+
+	for (map<wstring, HashResultEntry>::const_iterator It = entries.begin(); It != entries.end(); It++, i++)
+	{
+		const wstring& path = It->first;
+		const FileMetadata& md = It->second.m_metadata;
+		BINARY_SUM_METADATA record = { 0 };
+		size_t shared = 0;
+
+		if (It->second.m_digest.size() != header.digestSize)
+			return false;
+		digests.insert(digests.end(), It->second.m_digest.begin(), It->second.m_digest.end());
+
+		if (md.m_bValid)
+		{
+			bHasMetadata = true;
+			record.size = md.m_size;
+			record.lastWriteTime = md.m_lastWriteTime;
+			record.fileIndex = md.m_fileIndex;
+			record.volumeSerial = md.m_volumeSerial;
+		}
+		metadata.push_back(record);
+
+		if ((i % BINARY_SUM_RESTART_INTERVAL) == 0)
+			index.push_back((ULONGLONG)strings.size());
+		else
+		{
+			size_t maxShared = min(pPrevious->length(), path.length());
+			while ((shared < maxShared) && ((*pPrevious)[shared] == path[shared]))
+				shared++;
+		}
+
+		AppendVarint(strings, (ULONGLONG)shared);
+		AppendVarint(strings, (ULONGLONG)(path.length() - shared));
+		for (size_t j = shared; j < path.length(); j++)
+		{
+			strings.push_back((unsigned char)(path[j] & 0xFF));
+			strings.push_back((unsigned char)((path[j] >> 8) & 0xFF));
+		}
+
+		pPrevious = &path;
+	}
+
+	// layout: header, digests, metadata, index (8-byte aligned), strings
+	ULONGLONG offset = sizeof(BINARY_SUM_HEADER);
+	header.digestsOffset = offset;
+	offset += (ULONGLONG)digests.size();
+	if (bHasMetadata)
+	{
+		header.flags |= BINARY_SUM_FLAG_METADATA;
+		header.metadataOffset = offset;
+		offset += (ULONGLONG)(metadata.size() * sizeof(BINARY_SUM_METADATA));
+	}
+	size_t padding = (size_t)((sizeof(ULONGLONG) - (offset % sizeof(ULONGLONG))) % sizeof(ULONGLONG));
+	offset += padding;
+	header.indexOffset = offset;
+	offset += (ULONGLONG)(index.size() * sizeof(ULONGLONG));
+	header.stringsOffset = offset;
+	header.stringsSize = (ULONGLONG)strings.size();
+	header.fileSize = offset + header.stringsSize;
+
+	FILE* f = _wfopen(targetFile.GetAbsolutPathValue().c_str(), L"wb");
+	if (f)
+	{
+		const unsigned char zeros[sizeof(ULONGLONG)] = { 0 };
+		bRet = (1 == fwrite(&header, sizeof(header), 1, f))
+			&& (1 == fwrite(digests.data(), digests.size(), 1, f))
+			&& (!bHasMetadata || (1 == fwrite(metadata.data(), metadata.size() * sizeof(BINARY_SUM_METADATA), 1, f)))
+			&& (!padding || (1 == fwrite(zeros, padding, 1, f)))
+			&& (1 == fwrite(index.data(), index.size() * sizeof(ULONGLONG), 1, f))
+			&& (1 == fwrite(strings.data(), strings.size(), 1, f));
+		if (fclose(f))
+			bRet = false;
+		if (!bRet)
+			DeleteFile(targetFile.GetAbsolutPathValue().c_str());
+	}
+
+	return bRet;
+}
+
+// Convert a text SUM file to a binary one or a binary SUM file to a text one, depending on the input format
+int ConvertSumFile(const CPath& inputFile, const CPath& outputFile, bool bQuiet)
+{
+	if (CBinarySumFile::IsBinarySumFile(inputFile))
+	{
+		CBinarySumFile binaryFile;
+		if (!binaryFile.Open(inputFile))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to open binary SUM file \"%s\". Please check that it is not corrupted.\n"), inputFile.GetPathValue().c_str());
+			return -3;
+		}
+
+		FILE* f = _wfopen(outputFile.GetAbsolutPathValue().c_str(), L"wt,ccs=UTF-8");
+		if (!f)
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to open file \"%s\" for writing\n"), outputFile.GetPathValue().c_str());
+			return -3;
+		}
+
+		WCHAR szDigestHex[129]; // enough for 64 bytes digest
+		bool bOk = binaryFile.Enumerate([&binaryFile, f, &szDigestHex](ULONGLONG index, const wstring& path) {
+			FileMetadata metadata;
+			binaryFile.GetMetadata(index, metadata);
+			ToHex((LPBYTE)binaryFile.GetDigest(index), binaryFile.GetDigestSize(), szDigestHex);
+			_ftprintf(f, L"%s", FormatSumLine(szDigestHex, path.c_str(), metadata).c_str());
+		});
+		fclose(f);
+
+		if (!bOk)
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: binary SUM file \"%s\" is corrupted\n"), inputFile.GetPathValue().c_str());
+			return -3;
+		}
+
+		if (!bQuiet)
+			ShowWarning(TEXT("%llu entries converted from binary SUM file \"%s\" to \"%s\".\n"), binaryFile.GetEntryCount(), inputFile.GetPathValue().c_str(), outputFile.GetPathValue().c_str());
+	}
+	else
+	{
+		map<wstring, HashResultEntry> entries;
+		vector<int> skippedLines;
+		if (!ParseSumFile(inputFile, entries, skippedLines, false))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to parse SUM file \"%s\"\n"), inputFile.GetPathValue().c_str());
+			return -3;
+		}
+
+		if (!WriteBinarySumFile(entries, outputFile))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to write binary SUM file \"%s\"\n"), outputFile.GetPathValue().c_str());
+			return -3;
+		}
+
+		if (!bQuiet)
+		{
+			ShowWarning(TEXT("%llu entries converted from SUM file \"%s\" to binary SUM file \"%s\".\n"), (ULONGLONG)entries.size(), inputFile.GetPathValue().c_str(), outputFile.GetPathValue().c_str());
+			if (!skippedLines.empty())
+				ShowWarning(TEXT("%d line(s) were skipped because they are corrupted.\n"), (int)skippedLines.size());
+		}
+	}
+
+	return 0;
+}
+
+
+BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
+{
+	switch (fdwCtrlType)
+	{
+		// Handle the CTRL-C signal.
+	case CTRL_C_EVENT:
+	case CTRL_CLOSE_EVENT:
+	case CTRL_BREAK_EVENT:
+		// record the entries already written so that the computation can be resumed. This is done before stopping the
+		// walker so that the checkpoint isn't deleted by the main thread in the meantime.
+		if (g_pCheckpoint)
+			g_pCheckpoint->Interrupt();
+		// stop the walker, notify threads to stop but don't wait for them
+		t_pOperation->m_bCancelRequested = true;
+		if (g_threadsCount)
+		{
+			g_bFatalError = true;
+			g_bStopThreads = true;
+			g_bStopOutputThread = true;
+			SetEvent(g_hStopEvent);
+			SetEvent(g_hOutputStopEvent);
+
+			FreejobList(); // we close all already opened handles to avoid leaving too many opened handle
+			FreeOutputList();
+		}
+		// restore orginal console attributes
+		g_wCurrentAttributes = g_wAttributes;
+		SetConsoleTextAttribute(g_hConsole, g_wAttributes);
+		return FALSE;
+
+	default:
+		return FALSE;
+	}
+}
+
+bool GetPathType(LPCWSTR szPath, bool& bIsFile)
+{
+	struct _stat64 buf;
+	std::wstring drivePath;
+	bIsFile = false;
+
+	if ((0 == _wstat64(szPath, &buf)) && (buf.st_mode & (_S_IFDIR | _S_IFREG)))
+	{
+		bIsFile = (buf.st_mode & _S_IFREG) ? true : false;
+		return true;
+	}
+	else
+		return false;
+}
+
+wstring GetCurDir()
+{
+	wstring ret;
+	DWORD cchCurDir;
+	LPWSTR wszCurDir = NULL;
+	cchCurDir = GetCurrentDirectoryW(0, NULL);
+	wszCurDir = new WCHAR[cchCurDir];
+	GetCurrentDirectoryW(cchCurDir, wszCurDir);
+	ret = wszCurDir;
+	if (ret.empty() || ret[ret.length() - 1] != PATH_SEPARATOR)
+		ret += PATH_SEPARATOR_STRING;
+	delete[] wszCurDir;
+	return ret;
+}
+
+#ifdef _WIN32
+bool IsWindowsLongPathNamesEnabled()
+{
+	// Registry key HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\FileSystem\LongPathsEnabled (Type: REG_DWORD) 
+	// must exist and be set to 1.
+	bool bRet = false;
+	HKEY hKey;
+	LSTATUS lRet = RegOpenKeyExW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Control\\FileSystem", 0, KEY_READ, &hKey);
+	if (ERROR_SUCCESS == lRet)
+	{
+		DWORD dwType, dwValue, cbLen = sizeof(DWORD);
+		lRet = RegQueryValueExW(hKey, L"LongPathsEnabled", NULL, &dwType, (LPBYTE) &dwValue, &cbLen);
+		if (ERROR_SUCCESS == lRet)
+		{
+			bRet = (dwValue == 1);
+		}
+		RegCloseKey(hKey);
+	}
+	return bRet;
+
+}
+#endif
+
+bool ValidateHashesVector(vector<shared_ptr<Hash>>& pHashes)
+{
+	bool bRet = true;
+	for (auto it = pHashes.begin(); it != pHashes.end(); it++)
+	{
+		if (!(*it)->IsValid())
+		{
+			bRet = false;
+			break;
+		}
+	}
+	return bRet;
+}
+
+// load the long path functions of Windows 10 when they are available
+void InitializePathFunctions()
+{
+#ifdef _WIN32
+	OSVERSIONINFOW versionInfo;
+	// used by the directory walker to open files relative to the handle of their directory
+	NtCreateFilePtr = (NtCreateFileFn)GetProcAddress(GetModuleHandle(L"ntdll.dll"), "NtCreateFile");
+	if (GetWindowsVersion(&versionInfo) && (versionInfo.dwMajorVersion >= 10))
+	{
+		PathAllocCanonicalizePtr = (PathAllocCanonicalizeFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathAllocCanonicalize");
+		PathAllocCombinePtr = (PathAllocCombineFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathAllocCombine");
+		PathCchSkipRootPtr = (PathCchSkipRootFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathCchSkipRoot");
+
+		// Long path names support is available starting from Windows 10 version 1607 (Build 14393)
+		if (versionInfo.dwBuildNumber >= 14393)
+		{
+			g_bLongPathNamesEnabled = IsWindowsLongPathNamesEnabled();
+		}
+	}
+#else
+	PathAllocCanonicalizePtr = PathAllocCanonicalize;
+	PathAllocCombinePtr = PathAllocCombine;
+	PathCchSkipRootPtr = PathCchSkipRoot;
+	g_bLongPathNamesEnabled = true;
+#endif
+}
+
+// ---------------------------------------------
+/*
+ * libdirhash: implementation of the interface declared in DirHashLib.h.
+ *
+ * Each context owns the CHashOperation made current by DirHashCompute, so that the operations of different contexts
+ * run at the same time and share the worker threads, while the calls using the same context are serialized.
+ * Per-file results and errors are received through the notifications used by -json: CCallbackOutput replaces
+ * CJsonOutput and forwards them to the callbacks of the caller. The worker threads started for DIRHASH_FLAG_THREADS
+ * are kept between operations: the end of an operation waits for its jobs instead of stopping the threads.
+ */
+
+struct _DIRHASH_CONTEXT
+{
+	wstring hashAlgo;
+	bool bUseMsCrypto;
+	vector<shared_ptr<Hash>> pHashes;
+	CHashCache* pHashCache;
+	CPath cacheFileName;
+	CHashOperation operation;
+	CRITICAL_SECTION lock; // serializes the calls using the context
+	bool bRunning; // protected by g_libraryLocks.m_cancel
+
+	_DIRHASH_CONTEXT() : bUseMsCrypto(false), pHashCache(NULL), bRunning(false) { InitializeCriticalSection(&lock); }
+	~_DIRHASH_CONTEXT() { delete pHashCache; DeleteCriticalSection(&lock); }
+};
+
+class CCallbackOutput : public CJsonOutput
+{
+protected:
+	DIRHASH_FILE_CALLBACK m_pfnFileCallback;
+	DIRHASH_ERROR_CALLBACK m_pfnErrorCallback;
+	void* m_pUserData;
+
+public:
+	CCallbackOutput(DIRHASH_FILE_CALLBACK pfnFileCallback, DIRHASH_ERROR_CALLBACK pfnErrorCallback, void* pUserData)
+		: CJsonOutput(NULL, 0), m_pfnFileCallback(pfnFileCallback), m_pfnErrorCallback(pfnErrorCallback), m_pUserData(pUserData)
+	{
+	}
 
-		while (fgetws(szLine, (int)(buffer.size() / 2), f))
+	virtual void AddFile(LPCWSTR szPath, ULONGLONG size, LONGLONG startTicks, LPCWSTR szStatus, const vector<shared_ptr<Hash>>& pHashes, const vector<ByteArray>* pDigests, LPCBYTE pbExpectedDigest, LPCWSTR szDetail = NULL)
+	{
+		DIRHASH_FILE_RESULT result;
+		vector<LPCWSTR> hashIds;
+		vector<const unsigned char*> digests;
+		vector<int> digestSizes;
+
+		if (!m_pfnFileCallback)
+			return;
+
+		if (pDigests)
 		{
-			size_t l = wcslen(szLine);
-			if (szLine[l - 1] == L'\n')
+			for (size_t i = 0; i < pDigests->size(); i++)
 			{
-				szLine[l - 1] = 0;
-				l--;
+				hashIds.push_back(pHashes[i]->GetID());
+				digests.push_back((*pDigests)[i].data());
+				digestSizes.push_back((int)(*pDigests)[i].size());
 			}
+		}
 
-			lineNumber++;
+		result.szPath = szPath;
+		result.size = size;
+		result.szStatus = szStatus;
+		result.durationMs = GetDurationMs(startTicks);
+		result.digestsCount = digests.size();
+		result.pszHashIds = hashIds.data();
+		result.pbDigests = digests.data();
+		result.pcbDigests = digestSizes.data();
+		result.pbExpectedDigest = pbExpectedDigest;
+		result.cbExpectedDigest = pbExpectedDigest ? pHashes[0]->GetHashSize() : 0;
 
-			if (l == 0)
-				continue;
+		EnterCriticalSection(&m_lock);
+		m_pfnFileCallback(m_pUserData, &result);
+		LeaveCriticalSection(&m_lock);
+	}
 
-			bFailed = true;
+	virtual void AddError(LPCWSTR szPath, DWORD dwError, const wstring& szMessage)
+	{
+		wstring szText = szMessage;
 
-			// extract hash which is followed by two or one space characters
-			wchar_t* ptr = wcschr(szLine, L' ');
-			if (ptr)
-			{
-				*ptr = 0;
-				ptr++;
-				// look for begining of file path
-				while (ptr != &szLine[l - 1] && *ptr == L' ')
-					ptr++;
-				// remove '*' if present (this is for unix checksum compatibility)
-				if (ptr != &szLine[l - 1] && *ptr == L'*')
-					ptr++;
-				if (ptr != &szLine[l - 1])
-				{
-					// hash length must be one of the supported ones (16, 20, 32, 48, 64)
-					ByteArray digest;
-					if (FromHex(szLine, digest))
-					{
-						if ((digestLen != 0 && digestLen == digest.size())
-							|| (digestLen == 0 && Hash::IsHashSize ((int) digest.size()))
-							)
-						{
-							wstring entryName = ptr;
-							// replace '/' by '\' for compatibility with checksum format on *nix platforms
-							std::replace(entryName.begin(), entryName.end(), L'/', L'\\');
-
-							// check that entreName starts by the input directory value. Otherwise add it.
-							if ( normalizePath && g_inputDirPathLength && ((entryName.length() < g_inputDirPathLength)
-								||	(_wcsicmp(g_inputDirPath.c_str(), entryName.substr(0, g_inputDirPathLength).c_str())))
-								)
-							{
-								entryName = g_inputDirPath + entryName;
-							}
+		if (!m_pfnErrorCallback)
+			return;
 
-							digestLen = digest.size();
-							digestList[entryName].m_digest = digest;
-							bFailed = false;
-						}
-					}
-				}
-			}
+		while (!szText.empty() && ((szText.back() == L'\n') || (szText.back() == L' ')))
+			szText.pop_back();
 
-			if (bFailed)
+		EnterCriticalSection(&m_lock);
+		m_pfnErrorCallback(m_pUserData, szPath, dwError, szText.c_str());
+		LeaveCriticalSection(&m_lock);
+	}
+};
+
+class CLibraryLocks
+{
+public:
+	CRITICAL_SECTION m_threads; // protects the start and the stop of the worker threads and g_contextsCount
+	CRITICAL_SECTION m_cancel; // protects the bRunning flag of the contexts
+
+	CLibraryLocks()
+	{
+		InitializeCriticalSection(&m_threads);
+		InitializeCriticalSection(&m_cancel);
+	}
+
+	~CLibraryLocks()
+	{
+		DeleteCriticalSection(&m_threads);
+		DeleteCriticalSection(&m_cancel);
+	}
+};
+
+static CLibraryLocks g_libraryLocks;
+static size_t g_contextsCount = 0;
+
+DIRHASH_CONTEXT DirHashCreateContext(void)
+{
+	DIRHASH_CONTEXT hContext = new (std::nothrow) _DIRHASH_CONTEXT();
+	if (!hContext)
+		return NULL;
+
+	EnterCriticalSection(&g_libraryLocks.m_threads);
+	// relative paths are resolved against the current directory of the first context creation
+	if (0 == g_contextsCount++)
+	{
+		InitializePathFunctions();
+		if (g_currentDirectory.empty())
+			g_currentDirectory = GetCurDir();
+	}
+	LeaveCriticalSection(&g_libraryLocks.m_threads);
+
+	return hContext;
+}
+
+void DirHashDestroyContext(DIRHASH_CONTEXT hContext)
+{
+	if (!hContext)
+		return;
+
+	EnterCriticalSection(&g_libraryLocks.m_threads);
+	// the worker threads are shared by all contexts
+	if (0 == --g_contextsCount)
+		StopThreads(false);
+	LeaveCriticalSection(&g_libraryLocks.m_threads);
+
+	delete hContext;
+}
+
+void DirHashCancel(DIRHASH_CONTEXT hContext)
+{
+	EnterCriticalSection(&g_libraryLocks.m_cancel);
+	if (hContext && hContext->bRunning)
+		hContext->operation.m_bCancelRequested = true;
+	LeaveCriticalSection(&g_libraryLocks.m_cancel);
+}
+
+unsigned int DirHashCompute(DIRHASH_CONTEXT hContext, const wchar_t* szPath, const DIRHASH_OPTIONS* pOptions,
+	DIRHASH_FILE_CALLBACK pfnFileCallback, DIRHASH_ERROR_CALLBACK pfnErrorCallback, void* pUserData,
+	unsigned char* pbDigest, size_t* pcbDigest)
+{
+	DIRHASH_OPTIONS defaultOptions = { 0 };
+	DWORD dwError = NO_ERROR;
+	bool bIsFile = false;
+	size_t cbDigests = 0;
+	CSumEntries sumEntries;
+
+	if (!pOptions)
+		pOptions = &defaultOptions;
+
+	bool bVerifyMode = (pOptions->szVerifyFile && pOptions->szVerifyFile[0]);
+	bool bSumMode = bVerifyMode || (pOptions->flags & DIRHASH_FLAG_SUM);
+	bool bUseThreads = bSumMode && (pOptions->flags & DIRHASH_FLAG_THREADS);
+	bool bIncludeNames = (pOptions->flags & DIRHASH_FLAG_HASHNAMES) ? true : false;
+	bool bStripNames = bIncludeNames && (pOptions->flags & DIRHASH_FLAG_STRIPNAMES);
+	bool bUseMsCrypto = (pOptions->flags & DIRHASH_FLAG_MSCRYPTO) ? true : false;
+	wstring hashAlgo = pOptions->szHashAlgo ? pOptions->szHashAlgo : L"Blake3";
+
+	if (!hContext || !szPath || !szPath[0] || (!bSumMode && (!pbDigest || !pcbDigest)))
+		return DIRHASH_ERROR_INVALID_PARAMETER;
+
+	// directory patterns are only supported by -exclude
+	for (size_t i = 0; i < pOptions->onlyCount; i++)
+	{
+		if (IsDirectoryPattern(pOptions->pszOnly[i]))
+			return DIRHASH_ERROR_INVALID_PARAMETER;
+	}
+
+	// cache entries are identified by the file ID and can't hold digests that depend on the file name
+	if (bIncludeNames && pOptions->szCacheFile && pOptions->szCacheFile[0])
+		return DIRHASH_ERROR_INVALID_PARAMETER;
+
+	// the engine uses the operation of the context: the other contexts can hash at the same time
+	EnterCriticalSection(&hContext->lock);
+	CHashOperation* pPreviousOperation = t_pOperation;
+	t_pOperation = &hContext->operation;
+
+	// hash objects are created again only when the algorithms change
+	if (hContext->pHashes.empty() || (hContext->hashAlgo != hashAlgo) || (hContext->bUseMsCrypto != bUseMsCrypto))
+	{
+		t_pOperation->m_bUseMsCrypto = bUseMsCrypto;
+		hContext->pHashes = Hash::GetHashes(hashAlgo.c_str());
+		hContext->hashAlgo = hashAlgo;
+		hContext->bUseMsCrypto = bUseMsCrypto;
+		if (hContext->pHashes.empty() || !ValidateHashesVector(hContext->pHashes))
+		{
+			hContext->pHashes.clear();
+			t_pOperation = pPreviousOperation;
+	LeaveCriticalSection(&hContext->lock);
+			return DIRHASH_ERROR_INVALID_PARAMETER;
+		}
+	}
+
+	vector<shared_ptr<Hash>>& pHashes = hContext->pHashes;
+	for (size_t i = 0; i < pHashes.size(); i++)
+	{
+		pHashes[i]->Init();
+		cbDigests += (size_t)pHashes[i]->GetHashSize();
+	}
+
+	if (!bSumMode && (*pcbDigest < cbDigests))
+	{
+		*pcbDigest = cbDigests;
+		t_pOperation = pPreviousOperation;
+	LeaveCriticalSection(&hContext->lock);
+		return DIRHASH_ERROR_INSUFFICIENT_BUFFER;
+	}
+
+	// we don't support multiple hash algorithms in verify mode
+	if (bVerifyMode && (pHashes.size() > 1))
+	{
+		t_pOperation = pPreviousOperation;
+	LeaveCriticalSection(&hContext->lock);
+		return DIRHASH_ERROR_INVALID_PARAMETER;
+	}
+
+	wstring inputArg = szPath;
+	NormalizePathSeparators(inputArg);
+	if ((inputArg.length() > 1) && (inputArg[inputArg.length() - 1] == PATH_SEPARATOR))
+		inputArg.erase(inputArg.length() - 1, 1);
+
+	// settings of the previous operation of the context are replaced
+	t_pOperation->m_bUseMsCrypto = bUseMsCrypto;
+	t_pOperation->m_bSkipError = (pOptions->flags & DIRHASH_FLAG_SKIPERROR) ? true : false;
+	t_pOperation->m_bNoFollow = (pOptions->flags & DIRHASH_FLAG_NOFOLLOW) ? true : false;
+	t_pOperation->m_bMismatchFound = false;
+	t_pOperation->m_szLastErrorMsg.clear();
+	t_pOperation->m_bSumFileSkipped = false;
+	t_pOperation->m_bSumRelativePath = false;
+	t_pOperation->m_inputDirPath.clear();
+	t_pOperation->m_inputDirPathLength = 0;
+	t_pOperation->m_verificationFileName = L"";
+	t_pOperation->m_excludeSpecList.clear();
+	t_pOperation->m_onlySpecList.clear();
+	for (size_t i = 0; i < pOptions->excludeCount; i++)
+		t_pOperation->m_excludeSpecList.push_back(pOptions->pszExclude[i]);
+	for (size_t i = 0; i < pOptions->onlyCount; i++)
+		t_pOperation->m_onlySpecList.push_back(pOptions->pszOnly[i]);
+	CompileNameFilters();
+	// no output file is written but they are indexed by algorithm
+	t_pOperation->m_outputFiles.assign(pHashes.size(), shared_ptr<CFilePtr>());
+
+	CPath inputPath(inputArg.c_str());
+	if (!GetPathType(inputPath.GetAbsolutPathValue().c_str(), bIsFile))
+		dwError = DIRHASH_ERROR_FILE_NOT_FOUND;
+	else if (t_pOperation->m_bNoFollow && IsReparsePoint(inputPath.GetAbsolutPathValue().c_str()))
+		dwError = DIRHASH_ERROR_INVALID_PARAMETER;
+
+	if ((dwError == NO_ERROR) && bVerifyMode)
+	{
+		vector<int> skippedLines;
+		// relative entries of the SUM file are resolved against the input directory
+		if (!bIsFile)
+		{
+			t_pOperation->m_inputDirPath = inputArg;
+			if (t_pOperation->m_inputDirPath[t_pOperation->m_inputDirPath.length() - 1] != PATH_SEPARATOR)
+				t_pOperation->m_inputDirPath += PATH_SEPARATOR_STRING;
+			t_pOperation->m_inputDirPathLength = t_pOperation->m_inputDirPath.length();
+		}
+		t_pOperation->m_verificationFileName = pOptions->szVerifyFile;
+
+		if (CBinarySumFile::IsBinarySumFile(t_pOperation->m_verificationFileName) ? !sumEntries.OpenBinary(t_pOperation->m_verificationFileName) : !ParseSumFile(t_pOperation->m_verificationFileName, sumEntries.GetTextEntries(), skippedLines))
+			dwError = DIRHASH_ERROR_INVALID_DATA;
+		else if (sumEntries.GetDigestSize() != pHashes[0]->GetHashSize())
+			dwError = DIRHASH_ERROR_INVALID_DATA;
+		else if (bIsFile && !sumEntries.KeepSingleEntry(inputPath.GetPathValue()))
+			dwError = DIRHASH_ERROR_MISMATCH;
+	}
+
+	if ((dwError == NO_ERROR) && bSumMode && !bVerifyMode && pOptions->szCacheFile && pOptions->szCacheFile[0])
+	{
+		// the cache stays opened as long as the same file is used
+		CPath cacheFileName(pOptions->szCacheFile);
+		if (!hContext->pHashCache || _wcsicmp(hContext->cacheFileName.GetAbsolutPathValue().c_str(), cacheFileName.GetAbsolutPathValue().c_str()))
+		{
+			delete hContext->pHashCache;
+			hContext->pHashCache = new CHashCache();
+			hContext->cacheFileName = cacheFileName;
+			if (!hContext->pHashCache->Open(cacheFileName))
 			{
-				if (lineNumber > 1)
-				{
-					skippedLines.push_back(lineNumber);
-					bFailed = false;
-				}
-				else
-					break;
+				delete hContext->pHashCache;
+				hContext->pHashCache = NULL;
+				dwError = DIRHASH_ERROR_INVALID_PARAMETER;
 			}
 		}
-		fclose(f);
+		t_pOperation->m_pHashCache = hContext->pHashCache;
+		t_pOperation->m_cacheFileName = hContext->cacheFileName;
+	}
 
-		if (bFailed)
+	if (dwError != NO_ERROR)
+	{
+		t_pOperation->m_verificationFileName = L"";
+		t_pOperation->m_pHashCache = NULL;
+		t_pOperation = pPreviousOperation;
+	LeaveCriticalSection(&hContext->lock);
+		return dwError;
+	}
+
+	EnterCriticalSection(&g_libraryLocks.m_cancel);
+	hContext->bRunning = true;
+	t_pOperation->m_bCancelRequested = false;
+	LeaveCriticalSection(&g_libraryLocks.m_cancel);
+
+	t_pOperation->m_pJsonOutput = new CCallbackOutput(pfnFileCallback, pfnErrorCallback, pUserData);
+
+	// the worker threads are started once, shared by the contexts and idle during the operations that don't use them
+	t_pOperation->m_threadsCount = 0;
+	if (bUseThreads)
+	{
+		EnterCriticalSection(&g_libraryLocks.m_threads);
+		if (!g_threadsCount)
+			StartThreads(false);
+		t_pOperation->m_threadsCount = g_threadsCount;
+		LeaveCriticalSection(&g_libraryLocks.m_threads);
+	}
+
+	if (bSumMode && !bIncludeNames)
+		t_pOperation->m_pLinkedFiles = new CLinkedFiles();
+
+	t_pOperation->m_bDeferJobs = (pOptions->flags & DIRHASH_FLAG_LARGESTFIRST) && (t_pOperation->m_threadsCount != 0);
+
+	if (bIsFile)
+		dwError = HashFile(inputPath, pHashes, bIncludeNames, bStripNames, true, false, bSumMode, sumEntries, NULL, shared_ptr<CDirHandle>());
+	else
+		dwError = HashDirectory(inputPath, pHashes, bIncludeNames, bStripNames, true, false, bSumMode, sumEntries);
+
+	if (t_pOperation->m_bDeferJobs)
+	{
+		t_pOperation->m_bDeferJobs = false;
+		QueueDeferredJobs();
+	}
+	if (t_pOperation->m_threadsCount)
+		WaitForJobs();
+	t_pOperation->m_threadsCount = 0;
+
+	if (t_pOperation->m_pLinkedFiles)
+	{
+		delete t_pOperation->m_pLinkedFiles;
+		t_pOperation->m_pLinkedFiles = NULL;
+	}
+
+	EnterCriticalSection(&g_libraryLocks.m_cancel);
+	if (t_pOperation->m_bCancelRequested)
+		dwError = DIRHASH_ERROR_CANCELLED;
+	t_pOperation->m_bCancelRequested = false;
+	hContext->bRunning = false;
+	LeaveCriticalSection(&g_libraryLocks.m_cancel);
+
+	// the worker threads only report their errors in m_szLastErrorMsg
+	if ((dwError == NO_ERROR) && !t_pOperation->m_szLastErrorMsg.empty())
+		dwError = DIRHASH_ERROR_FILE;
+
+	if (t_pOperation->m_pHashCache)
+	{
+		// digests computed before an error are valid so we save them in all cases
+		t_pOperation->m_pHashCache->Save();
+		t_pOperation->m_pHashCache = NULL;
+	}
+
+	if (bVerifyMode && (dwError == NO_ERROR))
+	{
+		// entries of the SUM file that were not found are reported as errors
+		vector<wstring> unprocessedEntries;
+		sumEntries.GetUnprocessedEntries(unprocessedEntries);
+		for (size_t i = 0; i < unprocessedEntries.size(); i++)
+			t_pOperation->m_pJsonOutput->AddError(unprocessedEntries[i].c_str(), ERROR_FILE_NOT_FOUND, FormatString(L"Entry \"%s\" of the SUM file was not found", unprocessedEntries[i].c_str()));
+		if (t_pOperation->m_bMismatchFound || !unprocessedEntries.empty())
+			dwError = DIRHASH_ERROR_MISMATCH;
+	}
+	t_pOperation->m_verificationFileName = L"";
+
+	delete t_pOperation->m_pJsonOutput;
+	t_pOperation->m_pJsonOutput = NULL;
+
+	if (!bSumMode && (dwError == NO_ERROR))
+	{
+		size_t offset = 0;
+		for (size_t i = 0; i < pHashes.size(); i++)
+		{
+			pHashes[i]->Final(pbDigest + offset);
+			offset += (size_t)pHashes[i]->GetHashSize();
+		}
+		*pcbDigest = offset;
+	}
+
+	t_pOperation = pPreviousOperation;
+	LeaveCriticalSection(&hContext->lock);
+	return dwError;
+}
+
+#ifndef DIRHASH_LIBRARY
+
+// ---------------------------------------------
+/*
+ * Daemon mode used by -daemon.
+ *
+ * DirHash listens on a named pipe (Windows) or on a Unix domain socket and runs the requests of its clients through
+ * the library interface, so that the worker threads, the hash objects and the -cache file stay warm between requests.
+ * Each connection is served by its own thread that reads one request per line, written with the command line syntax:
+ *
+ *   DirectoryOrFilePath [HashAlgo] [-sum] [-verify SumFile] [-threads] [-largestFirst] [-hashnames] [-stripnames]
+ *   [-nofollow] [-skipError] [-mscrypto] [-exclude pattern] [-only pattern] [-priority N]
+ *
+ * Requests of all clients are queued and run by DAEMON_RUNNERS_COUNT runner threads, highest -priority first and
+ * then in arrival order. Each runner has its own libdirhash context so that a long request doesn't delay the requests
+ * of the other clients, and the runners share the worker threads and the -cache file. The response is the stream of NDJSON records of -json: "file" and "error" records followed by a
+ * "summary" record, after which the client can send its next request. The request "-shutdown" stops the daemon.
+ */
+
+#define DAEMON_PIPE_PREFIX		L"\\\\.\\pipe\\"
+#define DAEMON_BUFFER_SIZE		65536
+#define DAEMON_CONNECT_TIMEOUT	5000 // milliseconds
+#define DAEMON_SUMMARY_PREFIX	"{\"type\":\"summary\","
+#define DAEMON_RUNNERS_COUNT	4 // requests run at the same time
+
+class CDaemonEndpoint
+{
+protected:
+	wstring m_name;
+#ifdef _WIN32
+	HANDLE m_hPipe; // instance waiting for the next client
+#else
+	int m_socket;
+	string m_path;
+#endif
+
+	static wstring GetName(LPCWSTR szEndpoint)
+	{
+#ifdef _WIN32
+		if (_wcsnicmp(szEndpoint, DAEMON_PIPE_PREFIX, wcslen(DAEMON_PIPE_PREFIX)))
+			return wstring(DAEMON_PIPE_PREFIX) + szEndpoint;
+#endif
+		return szEndpoint;
+	}
+
+#ifdef _WIN32
+	HANDLE CreateInstance()
+	{
+		return CreateNamedPipeW(m_name.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, DAEMON_BUFFER_SIZE, DAEMON_BUFFER_SIZE, 0, NULL);
+	}
+#else
+	static bool GetSocketAddress(const string& path, struct sockaddr_un& address)
+	{
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.empty() || (path.length() >= sizeof(address.sun_path)))
+			return false;
+		memcpy(address.sun_path, path.c_str(), path.length());
+		return true;
+	}
+
+	static string ToSocketPath(const wstring& name)
+	{
+		int cbPath = WideCharToMultiByte(CP_UTF8, 0, name.c_str(), -1, NULL, 0, NULL, NULL);
+		vector<char> path(cbPath > 0 ? cbPath : 1, 0);
+		if (cbPath > 0)
+			WideCharToMultiByte(CP_UTF8, 0, name.c_str(), -1, path.data(), cbPath, NULL, NULL);
+		return path.data();
+	}
+#endif
+
+public:
+	CDaemonEndpoint(LPCWSTR szEndpoint) : m_name(GetName(szEndpoint))
+#ifdef _WIN32
+		, m_hPipe(INVALID_HANDLE_VALUE)
+#else
+		, m_socket(-1), m_path(ToSocketPath(m_name))
+#endif
+	{
+	}
+
+	const wstring& GetName() const { return m_name; }
+
+	bool Listen()
+	{
+#ifdef _WIN32
+		m_hPipe = CreateInstance();
+		return (m_hPipe != INVALID_HANDLE_VALUE);
+#else
+		struct sockaddr_un address;
+		if (!GetSocketAddress(m_path, address))
+		{
+			SetLastError(ERROR_FILENAME_EXCED_RANGE);
+			return false;
+		}
+
+		// a client can't write to a closed connection without killing the daemon
+		signal(SIGPIPE, SIG_IGN);
+
+		m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (m_socket < 0)
+			return false;
+
+		// remove the socket left by a daemon that was not stopped with -shutdown
+		unlink(m_path.c_str());
+		mode_t oldMask = umask(0077);
+		bool bRet = (0 == bind(m_socket, (struct sockaddr*)&address, sizeof(address))) && (0 == listen(m_socket, SOMAXCONN));
+		umask(oldMask);
+		if (!bRet)
+		{
+			close(m_socket);
+			m_socket = -1;
+		}
+		return bRet;
+#endif
+	}
+
+	// wait for the next client. The connection is used with ReadFile, WriteFile and Disconnect
+	HANDLE Accept()
+	{
+#ifdef _WIN32
+		while (m_hPipe != INVALID_HANDLE_VALUE)
+		{
+			HANDLE hConnection = m_hPipe;
+			BOOL bConnected = ConnectNamedPipe(hConnection, NULL) || (GetLastError() == ERROR_PIPE_CONNECTED);
+			m_hPipe = CreateInstance();
+			if (bConnected)
+				return hConnection;
+			CloseHandle(hConnection);
+		}
+		return INVALID_HANDLE_VALUE;
+#else
+		int fd;
+		do
+		{
+			fd = accept4(m_socket, NULL, NULL, SOCK_CLOEXEC);
+		} while ((fd < 0) && ((errno == EINTR) || (errno == ECONNABORTED)));
+		return (fd < 0) ? INVALID_HANDLE_VALUE : (HANDLE)_get_osfhandle(fd);
+#endif
+	}
+
+	// stop accepting connections
+	void Stop()
+	{
+#ifndef _WIN32
+		if (m_socket >= 0)
+		{
+			unlink(m_path.c_str());
+			shutdown(m_socket, SHUT_RDWR);
+		}
+#endif
+	}
+
+	static HANDLE Connect(LPCWSTR szEndpoint)
+	{
+		wstring name = GetName(szEndpoint);
+#ifdef _WIN32
+		for (;;)
+		{
+			HANDLE hConnection = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+			if ((hConnection != INVALID_HANDLE_VALUE) || (GetLastError() != ERROR_PIPE_BUSY))
+				return hConnection;
+			// all the instances are used: wait for the daemon to create a new one
+			if (!WaitNamedPipeW(name.c_str(), DAEMON_CONNECT_TIMEOUT))
+				return INVALID_HANDLE_VALUE;
+		}
+#else
+		struct sockaddr_un address;
+		if (!GetSocketAddress(ToSocketPath(name), address))
+		{
+			SetLastError(ERROR_FILENAME_EXCED_RANGE);
+			return INVALID_HANDLE_VALUE;
+		}
+
+		signal(SIGPIPE, SIG_IGN);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return INVALID_HANDLE_VALUE;
+		if (connect(fd, (struct sockaddr*)&address, sizeof(address)))
+		{
+			SetLastError((errno == ENOENT) ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED);
+			close(fd);
+			return INVALID_HANDLE_VALUE;
+		}
+		return (HANDLE)_get_osfhandle(fd);
+#endif
+	}
+
+	static void Disconnect(HANDLE hConnection)
+	{
+#ifdef _WIN32
+		FlushFileBuffers(hConnection);
+		DisconnectNamedPipe(hConnection);
+#endif
+		CloseHandle(hConnection);
+	}
+};
+
+bool WriteConnection(HANDLE hConnection, const string& szData)
+{
+	size_t cbDone = 0;
+	while (cbDone < szData.length())
+	{
+		DWORD cbWritten = 0;
+		if (!WriteFile(hConnection, szData.data() + cbDone, (DWORD)min(szData.length() - cbDone, (size_t)DAEMON_BUFFER_SIZE), &cbWritten, NULL) || !cbWritten)
+			return false;
+		cbDone += cbWritten;
+	}
+	return true;
+}
+
+// split a request line like a command line: arguments are separated by spaces and can be enclosed in double quotes
+vector<wstring> SplitRequestLine(const wstring& szLine)
+{
+	vector<wstring> args;
+	size_t i = 0;
+	while (i < szLine.length())
+	{
+		wstring arg;
+		bool bQuoted = false;
+		while ((i < szLine.length()) && iswspace(szLine[i]))
+			i++;
+		if (i == szLine.length())
+			break;
+		while ((i < szLine.length()) && (bQuoted || !iswspace(szLine[i])))
 		{
-			digestList.clear();
+			if (szLine[i] == L'"')
+				bQuoted = !bQuoted;
+			else
+				arg += szLine[i];
+			i++;
 		}
-		else if (digestList.size() == 0)
+		args.push_back(arg);
+	}
+	return args;
+}
+
+class CDaemonRequest
+{
+public:
+	HANDLE m_hConnection;
+	wstring m_szLine;
+	vector<wstring> m_args;
+	int m_priority;
+	ULONGLONG m_sequence;
+	bool m_bConnected; // false if the response could not be written
+	HANDLE m_hDoneEvent;
+
+	CDaemonRequest(HANDLE hConnection, const wstring& szLine) : m_hConnection(hConnection), m_szLine(szLine), m_priority(0), m_sequence(0), m_bConnected(true)
+	{
+		m_args = SplitRequestLine(szLine);
+		for (size_t i = 0; i + 1 < m_args.size(); i++)
 		{
+			if (0 == _wcsicmp(m_args[i].c_str(), L"-priority"))
+			{
+				m_priority = _wtoi(m_args[i + 1].c_str());
+				m_args.erase(m_args.begin() + i, m_args.begin() + i + 2);
+				break;
+			}
 		}
-		else
-			bRet = true;
+		m_hDoneEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	}
-	else
+
+	~CDaemonRequest()
 	{
-	_tprintf(TEXT("Failed to open file \"%s\" for reading\n"), sumFile.GetPathValue().c_str());
+		CloseHandle(m_hDoneEvent);
 	}
+};
 
-	return bRet;
-}
+// highest priority first, then arrival order
+struct CompareDaemonRequests
+{
+	bool operator()(const CDaemonRequest* a, const CDaemonRequest* b) const
+	{
+		if (a->m_priority != b->m_priority)
+			return a->m_priority < b->m_priority;
+		return a->m_sequence > b->m_sequence;
+	}
+};
 
-// Helper function to count the depth of directories in a path
-long long countPathDepth(const wstring& path) {
-	return std::count(path.begin(), path.end(), L'\\');
-}
+static CRITICAL_SECTION g_daemonQueueLock;
+static HANDLE g_hDaemonQueueEvent = NULL;
+static priority_queue<CDaemonRequest*, vector<CDaemonRequest*>, CompareDaemonRequests> g_daemonQueue;
+static ULONGLONG g_daemonSequence = 0;
+static volatile bool g_bDaemonStop = false;
 
-bool SortSumFile(const CPath& sumFile, FILE* fTarget)
+typedef struct _DAEMON_RESPONSE
 {
-	map<wstring, HashResultEntry> digestList;
-	vector<int> skippedLines;
-	bool bRet = false;
+	DIRHASH_CONTEXT hContext;
+	CDaemonRequest* pRequest;
+	LONGLONG files;
+	LONGLONG bytes;
+	LONGLONG mismatches;
+	LONGLONG errors;
+} DAEMON_RESPONSE;
+
+void WriteDaemonRecord(DAEMON_RESPONSE* pResponse, CJsonRecord& record)
+{
+	if (pResponse->pRequest->m_bConnected && !WriteConnection(pResponse->pRequest->m_hConnection, record.Finish()))
+	{
+		// nobody reads the result anymore
+		pResponse->pRequest->m_bConnected = false;
+		DirHashCancel(pResponse->hContext);
+	}
+}
 
-	// Parse the existing SHASUM file
-	if (ParseSumFile(sumFile, digestList, skippedLines, false))
+void DaemonFileCallback(void* pUserData, const DIRHASH_FILE_RESULT* pResult)
+{
+	DAEMON_RESPONSE* pResponse = (DAEMON_RESPONSE*)pUserData;
+	CJsonRecord record(L"file");
+	record.AddString(L"path", pResult->szPath);
+	record.AddNumber(L"size", (LONGLONG)pResult->size);
+	if (pResult->digestsCount)
 	{
-		// Convert map to vector for sorting
-		vector<pair<wstring, HashResultEntry>> sortedEntries(digestList.begin(), digestList.end());
+		record.BeginObject(L"digests");
+		for (size_t i = 0; i < pResult->digestsCount; i++)
+			record.AddHex(pResult->pszHashIds[i], pResult->pbDigests[i], pResult->pcbDigests[i]);
+		record.EndObject();
+	}
+	if (pResult->pbExpectedDigest)
+		record.AddHex(L"expected", pResult->pbExpectedDigest, pResult->cbExpectedDigest);
+	record.AddDouble(L"durationMs", pResult->durationMs);
+	record.AddString(L"status", pResult->szStatus);
+	WriteDaemonRecord(pResponse, record);
+
+	pResponse->files++;
+	pResponse->bytes += (LONGLONG)pResult->size;
+	if (0 == wcscmp(pResult->szStatus, L"mismatch"))
+		pResponse->mismatches++;
+}
 
-		// Sort the entries by directory depth first, then lexicographically
-		sort(sortedEntries.begin(), sortedEntries.end(),
-			[](const auto& a, const auto& b) {
-				long long depthA = countPathDepth(a.first);
-				long long depthB = countPathDepth(b.first);
-				if (depthA != depthB) {
-					return depthA > depthB; // // Entries with more directories come first
-				}
-				return _wcsicmp(a.first.c_str(), b.first.c_str()) < 0; // Lexicographical order as secondary criterion
-			});
+void DaemonErrorCallback(void* pUserData, const wchar_t* szPath, unsigned int errorCode, const wchar_t* szMessage)
+{
+	DAEMON_RESPONSE* pResponse = (DAEMON_RESPONSE*)pUserData;
+	CJsonRecord record(L"error");
+	record.AddString(L"path", szPath);
+	record.AddNumber(L"code", (LONGLONG)errorCode);
+	record.AddString(L"message", szMessage);
+	WriteDaemonRecord(pResponse, record);
+	pResponse->errors++;
+}
 
-		// Write the sorted entries to the file
-		bool openedNewFile = false;
-		if (!fTarget)
+// parse the request and run it. Returns the exit code written in the summary record
+DWORD ExecuteDaemonRequest(DIRHASH_CONTEXT hContext, CDaemonRequest* pRequest, const CPath& cacheFileName)
+{
+	DAEMON_RESPONSE response = { hContext, pRequest, 0, 0, 0, 0 };
+	DIRHASH_OPTIONS options = { 0 };
+	vector<LPCWSTR> excludeSpecs, onlySpecs;
+	vector<unsigned char> digests(1024);
+	size_t cbDigests = digests.size();
+	vector<wstring>& args = pRequest->m_args;
+	wstring szMessage;
+	DWORD dwError = NO_ERROR;
+	LONGLONG startTicks = CJsonOutput::Now();
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency(&frequency);
+
+	if (args.empty() || ((args[0][0] == L'-') && _wcsicmp(args[0].c_str(), L"-shutdown")))
+		szMessage = L"Missing input path";
+	else if (0 == _wcsicmp(args[0].c_str(), L"-shutdown"))
+		g_bDaemonStop = true;
+	else
+	{
+		size_t i = 1;
+		if ((i < args.size()) && (args[i][0] != L'-'))
+			options.szHashAlgo = args[i++].c_str();
+		for (; szMessage.empty() && (i < args.size()); i++)
 		{
-			fTarget = _wfopen(sumFile.GetAbsolutPathValue().c_str(), L"wt,ccs=UTF-8");
-			openedNewFile = true;
+			LPCWSTR szSwitch = args[i].c_str();
+			bool bHasValue = (i + 1) < args.size();
+			if (0 == _wcsicmp(szSwitch, L"-sum"))
+				options.flags |= DIRHASH_FLAG_SUM;
+			else if (0 == _wcsicmp(szSwitch, L"-threads"))
+				options.flags |= DIRHASH_FLAG_THREADS;
+			else if (0 == _wcsicmp(szSwitch, L"-largestFirst"))
+				options.flags |= DIRHASH_FLAG_LARGESTFIRST;
+			else if (0 == _wcsicmp(szSwitch, L"-hashnames"))
+				options.flags |= DIRHASH_FLAG_HASHNAMES;
+			else if (0 == _wcsicmp(szSwitch, L"-stripnames"))
+				options.flags |= DIRHASH_FLAG_STRIPNAMES;
+			else if (0 == _wcsicmp(szSwitch, L"-nofollow"))
+				options.flags |= DIRHASH_FLAG_NOFOLLOW;
+			else if (0 == _wcsicmp(szSwitch, L"-skipError"))
+				options.flags |= DIRHASH_FLAG_SKIPERROR;
+			else if (0 == _wcsicmp(szSwitch, L"-mscrypto"))
+				options.flags |= DIRHASH_FLAG_MSCRYPTO;
+			else if ((0 == _wcsicmp(szSwitch, L"-verify")) && bHasValue)
+				options.szVerifyFile = args[++i].c_str();
+			else if ((0 == _wcsicmp(szSwitch, L"-exclude")) && bHasValue)
+				excludeSpecs.push_back(args[++i].c_str());
+			else if ((0 == _wcsicmp(szSwitch, L"-only")) && bHasValue)
+				onlySpecs.push_back(args[++i].c_str());
+			else
+				szMessage = FormatString(L"Invalid or incomplete switch \"%s\"", szSwitch);
 		}
 
-		if (fTarget)
-		{
-			WCHAR szDigestHex[129]; // Enough for 64 bytes digest
-			for (const auto& entry : sortedEntries)
-			{
-				wstring szLine;
-				ToHex(entry.second.m_digest, szDigestHex);
-				szLine = szDigestHex;
-				szLine += L"  ";
-				szLine += entry.first;
-				szLine += L"\n";
-				_ftprintf(fTarget, L"%s", szLine.c_str());
-			}
+		if (szMessage.empty() && !excludeSpecs.empty() && !onlySpecs.empty())
+			szMessage = L"-exclude and -only can not be combined";
 
-			if (openedNewFile)
-				fclose(fTarget);
+		// the digests of -hashnames depend on the file names so they are never taken from the cache
+		if (!cacheFileName.GetPathValue().empty() && !(options.flags & DIRHASH_FLAG_HASHNAMES))
+			options.szCacheFile = cacheFileName.GetAbsolutPathValue().c_str();
+	}
 
-			bRet = true;
+	if (!szMessage.empty())
+		dwError = DIRHASH_ERROR_INVALID_PARAMETER;
+	else if (!g_bDaemonStop)
+	{
+		options.pszExclude = excludeSpecs.data();
+		options.excludeCount = excludeSpecs.size();
+		options.pszOnly = onlySpecs.data();
+		options.onlyCount = onlySpecs.size();
+		dwError = DirHashCompute(hContext, args[0].c_str(), &options, DaemonFileCallback, DaemonErrorCallback, &response, digests.data(), &cbDigests);
+		if (dwError == DIRHASH_ERROR_FILE_NOT_FOUND)
+			szMessage = L"The given input file doesn't exist";
+		else if (dwError == DIRHASH_ERROR_INVALID_PARAMETER)
+			szMessage = L"Invalid hash algorithm or options";
+		else if (dwError == DIRHASH_ERROR_INVALID_DATA)
+			szMessage = FormatString(L"Failed to parse file \"%s\" or its digests length is different from the one of the hash algorithm", options.szVerifyFile);
+		else if (dwError == DIRHASH_ERROR_CANCELLED)
+			szMessage = L"The request was cancelled";
+	}
+
+	CJsonRecord record(L"summary");
+	if (dwError == NO_ERROR)
+		record.AddString(L"status", L"ok");
+	else if (dwError == DIRHASH_ERROR_MISMATCH)
+		record.AddString(L"status", L"mismatch");
+	else if (dwError == DIRHASH_ERROR_CANCELLED)
+		record.AddString(L"status", L"cancelled");
+	else
+		record.AddString(L"status", L"error");
+	record.AddNumber(L"exitCode", (LONGLONG)(int)dwError);
+	record.AddNumber(L"files", response.files);
+	record.AddNumber(L"bytes", response.bytes);
+	record.AddNumber(L"mismatches", response.mismatches);
+	record.AddNumber(L"errors", response.errors);
+	record.AddDouble(L"elapsedMs", (double)(CJsonOutput::Now() - startTicks) * 1000.0 / (double)frequency.QuadPart);
+	if ((dwError == NO_ERROR) && !g_bDaemonStop && !(options.flags & DIRHASH_FLAG_SUM) && !options.szVerifyFile)
+	{
+		// the context holds the hash objects used by the request
+		vector<shared_ptr<Hash>>& pHashes = hContext->pHashes;
+		size_t offset = 0;
+		record.BeginObject(L"digests");
+		for (size_t i = 0; i < pHashes.size(); i++)
+		{
+			record.AddHex(pHashes[i]->GetID(), digests.data() + offset, pHashes[i]->GetHashSize());
+			offset += (size_t)pHashes[i]->GetHashSize();
 		}
+		record.EndObject();
 	}
+	if (!szMessage.empty())
+		record.AddString(L"message", szMessage.c_str());
+	WriteDaemonRecord(&response, record);
 
-	return bRet;
+	return dwError;
 }
 
-
-BOOL WINAPI CtrlHandler(DWORD fdwCtrlType)
+DWORD WINAPI DaemonConnectionThreadCode(LPVOID pArg)
 {
-	switch (fdwCtrlType)
+	HANDLE hConnection = (HANDLE)pArg;
+	vector<char> buffer(DAEMON_BUFFER_SIZE);
+	string szPending;
+	DWORD cbRead = 0;
+	bool bConnected = true;
+
+	while (bConnected && !g_bDaemonStop && ReadFile(hConnection, buffer.data(), (DWORD)buffer.size(), &cbRead, NULL) && cbRead)
 	{
-		// Handle the CTRL-C signal.
-	case CTRL_C_EVENT:
-	case CTRL_CLOSE_EVENT:
-	case CTRL_BREAK_EVENT:
-		// notify thread to stop but don't wait for them
-		if (g_threadsCount)
+		size_t pos;
+		szPending.append(buffer.data(), cbRead);
+		while (bConnected && !g_bDaemonStop && ((pos = szPending.find('\n')) != string::npos))
 		{
-			g_bFatalError = true;
-			g_bStopThreads = true;
-			g_bStopOutputThread = true;
-			SetEvent(g_hStopEvent);
-			SetEvent(g_hOutputStopEvent);
+			string szLine = szPending.substr(0, pos);
+			szPending.erase(0, pos + 1);
+			if (!szLine.empty() && (szLine[szLine.length() - 1] == '\r'))
+				szLine.erase(szLine.length() - 1);
+			if (szLine.empty())
+				continue;
 
-			FreejobList(); // we close all already opened handles to avoid leaving too many opened handle
-			FreeOutputList();
+			int cchLine = MultiByteToWideChar(CP_UTF8, 0, szLine.c_str(), (int)szLine.length(), NULL, 0);
+			vector<WCHAR> line(cchLine > 0 ? cchLine : 0);
+			if (cchLine > 0)
+				MultiByteToWideChar(CP_UTF8, 0, szLine.c_str(), (int)szLine.length(), line.data(), cchLine);
+
+			CDaemonRequest* pRequest = new CDaemonRequest(hConnection, wstring(line.begin(), line.end()));
+			EnterCriticalSection(&g_daemonQueueLock);
+			pRequest->m_sequence = g_daemonSequence++;
+			g_daemonQueue.push(pRequest);
+			LeaveCriticalSection(&g_daemonQueueLock);
+			SetEvent(g_hDaemonQueueEvent);
+
+			// the response is written by a runner thread before the next request of this client is read
+			WaitForSingleObject(pRequest->m_hDoneEvent, INFINITE);
+			bConnected = pRequest->m_bConnected;
+			delete pRequest;
 		}
-		// restore orginal console attributes
-		g_wCurrentAttributes = g_wAttributes;
-		SetConsoleTextAttribute(g_hConsole, g_wAttributes);
-		return FALSE;
-
-	default:
-		return FALSE;
 	}
+
+	CDaemonEndpoint::Disconnect(hConnection);
+	return 0;
 }
 
-bool GetPathType(LPCWSTR szPath, bool& bIsFile)
+DWORD WINAPI DaemonListenerThreadCode(LPVOID pArg)
 {
-	struct _stat64 buf;
-	std::wstring drivePath;
-	bIsFile = false;
+	CDaemonEndpoint* pEndpoint = (CDaemonEndpoint*)pArg;
+	HANDLE hConnection;
 
-	if ((0 == _wstat64(szPath, &buf)) && (buf.st_mode & (_S_IFDIR | _S_IFREG)))
+	while (!g_bDaemonStop && ((hConnection = pEndpoint->Accept()) != INVALID_HANDLE_VALUE))
 	{
-		bIsFile = (buf.st_mode & _S_IFREG) ? true : false;
-		return true;
+		HANDLE hThread = CreateThread(NULL, 0, DaemonConnectionThreadCode, (LPVOID)hConnection, 0, NULL);
+		if (hThread)
+			CloseHandle(hThread);
+		else
+			CDaemonEndpoint::Disconnect(hConnection);
 	}
-	else
-		return false;
+	return 0;
 }
 
-wstring GetCurDir()
+typedef struct _DAEMON_RUNNER
 {
-	wstring ret;
-	DWORD cchCurDir;
-	LPWSTR wszCurDir = NULL;
-	cchCurDir = GetCurrentDirectoryW(0, NULL);
-	wszCurDir = new WCHAR[cchCurDir];
-	GetCurrentDirectoryW(cchCurDir, wszCurDir);
-	ret = wszCurDir;
-	ret += L"\\";
-	delete[] wszCurDir;
-	return ret;
+	DIRHASH_CONTEXT hContext;
+	const CPath* pCacheFileName;
+	bool bQuiet;
+} DAEMON_RUNNER;
+
+// run the queued requests with the context of the runner until the daemon stops
+DWORD WINAPI DaemonRunnerThreadCode(LPVOID pArg)
+{
+	DAEMON_RUNNER* pRunner = (DAEMON_RUNNER*)pArg;
+
+	while (!g_bDaemonStop)
+	{
+		CDaemonRequest* pRequest = NULL;
+		EnterCriticalSection(&g_daemonQueueLock);
+		if (!g_daemonQueue.empty())
+		{
+			pRequest = g_daemonQueue.top();
+			g_daemonQueue.pop();
+			// the event wakes a single runner: wake another one if requests remain
+			if (!g_daemonQueue.empty())
+				SetEvent(g_hDaemonQueueEvent);
+		}
+		LeaveCriticalSection(&g_daemonQueueLock);
+
+		if (!pRequest)
+		{
+			WaitForSingleObject(g_hDaemonQueueEvent, INFINITE);
+			continue;
+		}
+
+		DWORD dwError = ExecuteDaemonRequest(pRunner->hContext, pRequest, *pRunner->pCacheFileName);
+		if (!pRunner->bQuiet)
+			_tprintf(_T("%s (priority %d): %s\n"), pRequest->m_szLine.c_str(), pRequest->m_priority, (dwError == NO_ERROR) ? _T("ok") : FormatString(_T("error 0x%.8X"), dwError).c_str());
+		SetEvent(pRequest->m_hDoneEvent);
+	}
+
+	// wake the next waiting runner so that all of them stop
+	SetEvent(g_hDaemonQueueEvent);
+	return 0;
 }
 
-bool IsWindowsLongPathNamesEnabled()
+int RunDaemon(LPCWSTR szEndpoint, const CPath& cacheFileName, bool bQuiet)
 {
-	// Registry key HKEY_LOCAL_MACHINE\SYSTEM\CurrentControlSet\Control\FileSystem\LongPathsEnabled (Type: REG_DWORD) 
-	// must exist and be set to 1.
-	bool bRet = false;
-	HKEY hKey;
-	LSTATUS lRet = RegOpenKeyExW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Control\\FileSystem", 0, KEY_READ, &hKey);
-	if (ERROR_SUCCESS == lRet)
+	// the listener thread uses the endpoint until the process exits
+	CDaemonEndpoint* pEndpoint = new CDaemonEndpoint(szEndpoint);
+	DAEMON_RUNNER runners[DAEMON_RUNNERS_COUNT];
+	HANDLE hRunnerThreads[DAEMON_RUNNERS_COUNT];
+	DWORD runnersCount = 0;
+	bool bStarted;
+
+	if (!pEndpoint->Listen())
 	{
-		DWORD dwType, dwValue, cbLen = sizeof(DWORD);
-		lRet = RegQueryValueExW(hKey, L"LongPathsEnabled", NULL, &dwType, (LPBYTE) &dwValue, &cbLen);
-		if (ERROR_SUCCESS == lRet)
+		ShowError(TEXT("Error: Failed to listen on \"%s\" (error 0x%.8X)\n"), pEndpoint->GetName().c_str(), GetLastError());
+		return 1;
+	}
+
+	InitializeCriticalSection(&g_daemonQueueLock);
+	g_hDaemonQueueEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	bStarted = (g_hDaemonQueueEvent != NULL);
+	for (DWORD i = 0; bStarted && (i < DAEMON_RUNNERS_COUNT); i++)
+	{
+		runners[i].hContext = DirHashCreateContext();
+		runners[i].pCacheFileName = &cacheFileName;
+		runners[i].bQuiet = bQuiet;
+		hRunnerThreads[i] = runners[i].hContext ? CreateThread(NULL, 0, DaemonRunnerThreadCode, &runners[i], 0, NULL) : NULL;
+		if (hRunnerThreads[i])
+			runnersCount++;
+		else
 		{
-			bRet = (dwValue == 1);
+			DirHashDestroyContext(runners[i].hContext);
+			bStarted = false;
 		}
-		RegCloseKey(hKey);
 	}
-	return bRet;
+	HANDLE hListenerThread = bStarted ? CreateThread(NULL, 0, DaemonListenerThreadCode, pEndpoint, 0, NULL) : NULL;
+	if (!hListenerThread)
+	{
+		ShowError(TEXT("Error: Failed to start the daemon (error 0x%.8X)\n"), GetLastError());
+		pEndpoint->Stop();
+		if (runnersCount)
+		{
+			g_bDaemonStop = true;
+			SetEvent(g_hDaemonQueueEvent);
+			WaitForMultipleObjects(runnersCount, hRunnerThreads, TRUE, INFINITE);
+		}
+		for (DWORD i = 0; i < runnersCount; i++)
+		{
+			CloseHandle(hRunnerThreads[i]);
+			DirHashDestroyContext(runners[i].hContext);
+		}
+		return 1;
+	}
+	CloseHandle(hListenerThread);
+
+	if (!bQuiet)
+		_tprintf(_T("DirHash daemon listening on \"%s\". Send the request \"-shutdown\" to stop it.\n"), pEndpoint->GetName().c_str());
 
+	// the runners stop after the "-shutdown" request once their running requests are completed
+	WaitForMultipleObjects(runnersCount, hRunnerThreads, TRUE, INFINITE);
+
+	// the requests still queued are rejected
+	pEndpoint->Stop();
+	EnterCriticalSection(&g_daemonQueueLock);
+	while (!g_daemonQueue.empty())
+	{
+		CDaemonRequest* pRequest = g_daemonQueue.top();
+		CJsonRecord record(L"summary");
+		g_daemonQueue.pop();
+		record.AddString(L"status", L"cancelled");
+		record.AddNumber(L"exitCode", (LONGLONG)DIRHASH_ERROR_CANCELLED);
+		record.AddString(L"message", L"The daemon is stopping");
+		WriteConnection(pRequest->m_hConnection, record.Finish());
+		SetEvent(pRequest->m_hDoneEvent);
+	}
+	LeaveCriticalSection(&g_daemonQueueLock);
+
+	for (DWORD i = 0; i < runnersCount; i++)
+	{
+		CloseHandle(hRunnerThreads[i]);
+		DirHashDestroyContext(runners[i].hContext);
+	}
+	return 0;
 }
 
-bool ValidateHashesVector(vector<shared_ptr<Hash>>& pHashes)
+// send a request to a daemon and display its response. The exit code is the one of the summary record
+int RunDaemonClient(LPCWSTR szEndpoint, int argc, _TCHAR* argv[])
 {
-	bool bRet = true;
-	for (auto it = pHashes.begin(); it != pHashes.end(); it++)
+	HANDLE hConnection = CDaemonEndpoint::Connect(szEndpoint);
+	vector<char> buffer(DAEMON_BUFFER_SIZE);
+	wstring szRequest;
+	string szPending;
+	DWORD cbRead = 0;
+	int exitCode = 1;
+	bool bSummary = false;
+
+	if (hConnection == INVALID_HANDLE_VALUE)
 	{
-		if (!(*it)->IsValid())
+		ShowError(TEXT("Error: Failed to connect to DirHash daemon on \"%s\" (error 0x%.8X)\n"), szEndpoint, GetLastError());
+		return 1;
+	}
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (i)
+			szRequest += L" ";
+		if (!argv[i][0] || wcspbrk(argv[i], L" \t"))
+			szRequest += FormatString(L"\"%s\"", argv[i]);
+		else
+			szRequest += argv[i];
+	}
+	szRequest += L"\n";
+
+	int cbRequest = WideCharToMultiByte(CP_UTF8, 0, szRequest.c_str(), (int)szRequest.length(), NULL, 0, NULL, NULL);
+	string request(cbRequest > 0 ? cbRequest : 0, '\0');
+	if (cbRequest > 0)
+		WideCharToMultiByte(CP_UTF8, 0, szRequest.c_str(), (int)szRequest.length(), &request[0], cbRequest, NULL, NULL);
+
+	if (!WriteConnection(hConnection, request))
+	{
+		ShowError(TEXT("Error: Failed to send the request to DirHash daemon (error 0x%.8X)\n"), GetLastError());
+		CloseHandle(hConnection);
+		return 1;
+	}
+
+	// records are written as received until the summary one
+	while (!bSummary && ReadFile(hConnection, buffer.data(), (DWORD)buffer.size(), &cbRead, NULL) && cbRead)
+	{
+		size_t pos;
+		szPending.append(buffer.data(), cbRead);
+		while ((pos = szPending.find('\n')) != string::npos)
 		{
-			bRet = false;
-			break;
+			string szRecord = szPending.substr(0, pos + 1);
+			szPending.erase(0, pos + 1);
+			fwrite(szRecord.data(), 1, szRecord.length(), stdout);
+			if (0 == szRecord.compare(0, strlen(DAEMON_SUMMARY_PREFIX), DAEMON_SUMMARY_PREFIX))
+			{
+				size_t codePos = szRecord.find("\"exitCode\":");
+				if (codePos != string::npos)
+					exitCode = atoi(szRecord.c_str() + codePos + 11);
+				bSummary = true;
+			}
 		}
 	}
-	return bRet;
+	fflush(stdout);
+	CloseHandle(hConnection);
+
+	if (!bSummary)
+	{
+		ShowError(TEXT("Error: The connection to DirHash daemon was closed before the end of the response\n"));
+		return 1;
+	}
+	return exitCode;
 }
 
 int _tmain(int argc, _TCHAR* argv[])
@@ -3014,34 +10202,43 @@ int _tmain(int argc, _TCHAR* argv[])
 	bool bVerifyMode = false;
 	wstring hashAlgoToUse = L"Blake3";
 	bool bBenchmarkOp = false;
+	bool bBenchmarkFsOp = false;
+	FsBenchParams fsBenchParams;
+	bool bConvertOp = false;
+	bool bResume = false;
+	bool bResumed = false;
+	bool bDuplicatesMode = false;
+	bool bShowStats = false;
+	CPath statsJsonFileName;
+	bool bJsonOutput = false;
+	CPath traceFileName;
+	vector<ByteArray> jsonDigests;
 	map < wstring, HashResultEntry> digestsList;
+	CSumEntries sumEntries;
 	map < int, ByteArray> rawDigestsList;
 	vector < int > skippedLines;
 	ByteArray verifyDigest;
 	bool bBenchmarkAllAlgos = false;
+	bool bBenchmarkSweep = false;
+	bool bBenchmarkScaling = false;
+	BenchFormat benchmarkFormat = BENCH_FORMAT_TEXT;
 	CConsoleUnicodeOutputInitializer conUnicode;
 	bool bUseThreads = false;
+	bool bLargestFirst = false;
 	bool bIsFile = false;
 	bool bForceSumMode = false;
 	bool onlySpecified = false;
 	bool excludeSpecified = false;
-	OSVERSIONINFOW versionInfo;
 	wstring inputArg;
 	ConfigParams iniParams;
 	CPath inputPath;
+	vector<wstring> inputArgs;
+	vector<INPUT_ROOT> inputRoots;
+	LPCTSTR szInputArg = NULL;
+	CPath rootsListFileName;
+	bool bRootsListOp = false;
 
-	if (GetWindowsVersion(&versionInfo) && (versionInfo.dwMajorVersion >= 10))
-	{
-		PathAllocCanonicalizePtr = (PathAllocCanonicalizeFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathAllocCanonicalize");
-		PathAllocCombinePtr = (PathAllocCombineFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathAllocCombine");
-		PathCchSkipRootPtr = (PathCchSkipRootFn)GetProcAddress(GetModuleHandle(L"KernelBase.dll"), "PathCchSkipRoot");
-
-		// Long path names support is available starting from Windows 10 version 1607 (Build 14393)
-		if (versionInfo.dwBuildNumber >= 14393)
-		{
-			g_bLongPathNamesEnabled = IsWindowsLongPathNamesEnabled();
-		}
-	}
+	InitializePathFunctions();
 
 	g_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
 
@@ -3076,21 +10273,107 @@ int _tmain(int argc, _TCHAR* argv[])
 	bIncludeNames = iniParams.bIncludeNames;
 	bStripNames = iniParams.bStripNames;
 	g_bLowerCase = iniParams.bLowerCase;
-	g_bUseMsCrypto = iniParams.bUseMsCrypto;
-	g_bSkipError = iniParams.bSkipError;
+	t_pOperation->m_bUseMsCrypto = iniParams.bUseMsCrypto;
+	t_pOperation->m_bSkipError = iniParams.bSkipError;
 	g_bNoLogo = iniParams.bNoLogo;
-	g_bNoFollow = iniParams.bNoFollow;
+	t_pOperation->m_bNoFollow = iniParams.bNoFollow;
 	bForceSumMode =  iniParams.bForceSumMode;
 	bUseThreads = iniParams.bUseThreads;
-	g_bSumRelativePath = iniParams.bSumRelativePath;
+	t_pOperation->m_bSumRelativePath = iniParams.bSumRelativePath;
 	g_bIncludeLastDir = iniParams.bIncludeLastDir;
+	g_bSumExtended = iniParams.bSumExtended;
+
+	if (_tcscmp(argv[1], _T("-benchmark")) == 0)
+		bBenchmarkOp = true;
+	else if (_tcsicmp(argv[1], _T("-benchmark-fs")) == 0)
+	{
+		if (argc < 3)
+		{
+			ShowUsage();
+			ShowError(_T("Error: Missing work directory for switch -benchmark-fs\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		bBenchmarkFsOp = true;
+		fsBenchParams.filesCount = 10000;
+		fsBenchParams.depth = 3;
+		fsBenchParams.fanout = 8;
+		fsBenchParams.sizeProfile = L"mixed";
+		fsBenchParams.seed = 1;
+		fsBenchParams.bCold = false;
+		fsBenchParams.bClean = false;
+	}
+	else if (_tcsicmp(argv[1], _T("-convertSum")) == 0)
+	{
+		if (argc < 4)
+		{
+			ShowUsage();
+			ShowError(_T("Error: Missing argument for switch -convertSum\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		bConvertOp = true;
+	}
+	else if (_tcsicmp(argv[1], _T("-roots")) == 0)
+	{
+		if (argc < 3)
+		{
+			ShowUsage();
+			ShowError(_T("Error: Missing argument for switch -roots\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		rootsListFileName = argv[2];
+		bRootsListOp = true;
+	}
+	else if (_tcsicmp(argv[1], _T("-client")) == 0)
+	{
+		if (argc < 4)
+		{
+			ShowUsage();
+			ShowError(_T("Error: Missing argument for switch -client\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+		return RunDaemonClient(argv[2], argc - 3, argv + 3);
+	}
+	else if (_tcsicmp(argv[1], _T("-daemon")) == 0)
+	{
+		CPath cacheFileName;
+		if (argc < 3)
+		{
+			ShowUsage();
+			ShowError(_T("Error: Missing endpoint for switch -daemon\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		for (int i = 3; i < argc; i++)
+		{
+			if ((_tcscmp(argv[i], _T("-cache")) == 0) && ((i + 1) < argc))
+				cacheFileName = argv[++i];
+			else if (_tcscmp(argv[i], _T("-quiet")) == 0)
+				bQuiet = true;
+			else if (_tcscmp(argv[i], _T("-nologo")) == 0)
+				g_bNoLogo = true;
+			else if (_tcscmp(argv[i], _T("-lowercase")) == 0)
+				g_bLowerCase = true;
+			else
+			{
+				ShowUsage();
+				ShowError(_T("Error: Invalid or incomplete switch \"%s\" for -daemon\n"), argv[i]);
+				return 1;
+			}
+		}
 
-	if (_tcscmp(argv[1], _T("-benchmark")) == 0)
-		bBenchmarkOp = true;
+		if (!bQuiet)
+			ShowLogo();
+		return RunDaemon(argv[2], cacheFileName, bQuiet);
+	}
 
 	if (argc >= 3)
 	{
-		for (int i = 2; i < argc; i++)
+		for (int i = bConvertOp ? 4 : ((bBenchmarkFsOp || bRootsListOp) ? 3 : 2); i < argc; i++)
 		{
 			if (_tcscmp(argv[i], _T("-t")) == 0)
 			{
@@ -3190,7 +10473,7 @@ int _tmain(int argc, _TCHAR* argv[])
 
 				bVerifyMode = true;
 
-				g_verificationFileName = argv[i + 1];
+				t_pOperation->m_verificationFileName = argv[i + 1];
 				i++;
 			}
 			else if (_tcscmp(argv[i], _T("-exclude")) == 0)
@@ -3218,7 +10501,7 @@ int _tmain(int argc, _TCHAR* argv[])
 				}
 
 				excludeSpecified = true;
-				excludeSpecList.push_back(argv[i + 1]);
+				t_pOperation->m_excludeSpecList.push_back(argv[i + 1]);
 
 				i++;
 			}
@@ -3243,9 +10526,15 @@ int _tmain(int argc, _TCHAR* argv[])
 					WaitForExit(bDontWait);
 					return 1;
 				}
+				if (IsDirectoryPattern(argv[i + 1])) {
+					ShowUsage();
+					ShowError(_T("Error: -only patterns can't end with a path separator, directory patterns are only supported by -exclude\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
 
 				onlySpecified = true;
-				onlySpecList.push_back(argv[i + 1]);
+				t_pOperation->m_onlySpecList.push_back(argv[i + 1]);
 				i++;
 			}
 			else if (_tcscmp(argv[i], _T("-clip")) == 0)
@@ -3276,7 +10565,7 @@ int _tmain(int argc, _TCHAR* argv[])
 			}
 			else if (_tcscmp(argv[i], _T("-mscrypto")) == 0)
 			{
-				g_bUseMsCrypto = true;
+				t_pOperation->m_bUseMsCrypto = true;
 			}
 			else if (_tcsicmp(argv[i], _T("-skipError")) == 0)
 			{
@@ -3287,7 +10576,7 @@ int _tmain(int argc, _TCHAR* argv[])
 					WaitForExit(bDontWait);
 					return 1;
 				}
-				g_bSkipError = true;
+				t_pOperation->m_bSkipError = true;
 			}
 			else if (_tcsicmp(argv[i], _T("-nologo")) == 0)
 			{
@@ -3295,7 +10584,7 @@ int _tmain(int argc, _TCHAR* argv[])
 			}
 			else if (_tcsicmp(argv[i], _T("-nofollow")) == 0)
 			{
-				g_bNoFollow = true;
+				t_pOperation->m_bNoFollow = true;
 			}
 			else if (Hash::IsHashIdCombination(argv[i]))
 			{
@@ -3305,18 +10594,243 @@ int _tmain(int argc, _TCHAR* argv[])
 			{
 				bBenchmarkAllAlgos = true;
 			}
+			else if (bBenchmarkOp && (_tcsicmp(argv[i], _T("-sweep")) == 0))
+			{
+				bBenchmarkSweep = true;
+			}
+			else if (bBenchmarkOp && (_tcsicmp(argv[i], _T("-scaling")) == 0))
+			{
+				bBenchmarkScaling = true;
+			}
+			else if (bBenchmarkFsOp && ((_tcsicmp(argv[i], _T("-files")) == 0) || (_tcsicmp(argv[i], _T("-depth")) == 0) || (_tcsicmp(argv[i], _T("-fanout")) == 0) || (_tcsicmp(argv[i], _T("-seed")) == 0)))
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing value argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch %s\n"), argv[i]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				int value = _wtoi(argv[i + 1]);
+				bool bIsDepth = (_tcsicmp(argv[i], _T("-depth")) == 0);
+				if ((value < 0) || (!value && !bIsDepth) || (bIsDepth && (value > 16)))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid value \"%s\" for switch %s\n"), argv[i + 1], argv[i]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i], _T("-files")) == 0)
+					fsBenchParams.filesCount = (DWORD)value;
+				else if (bIsDepth)
+					fsBenchParams.depth = (DWORD)value;
+				else if (_tcsicmp(argv[i], _T("-fanout")) == 0)
+					fsBenchParams.fanout = (DWORD)value;
+				else
+					fsBenchParams.seed = (ULONGLONG)value;
+				i++;
+			}
+			else if (bBenchmarkFsOp && (_tcsicmp(argv[i], _T("-sizes")) == 0))
+			{
+				if (((i + 1) >= argc) || ((_tcsicmp(argv[i + 1], _T("small")) != 0) && (_tcsicmp(argv[i + 1], _T("mixed")) != 0) && (_tcsicmp(argv[i + 1], _T("large")) != 0)))
+				{
+					ShowUsage();
+					ShowError(_T("Error: -sizes must be followed by small, mixed or large\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i + 1], _T("small")) == 0)
+					fsBenchParams.sizeProfile = L"small";
+				else if (_tcsicmp(argv[i + 1], _T("large")) == 0)
+					fsBenchParams.sizeProfile = L"large";
+				else
+					fsBenchParams.sizeProfile = L"mixed";
+				i++;
+			}
+			else if (bBenchmarkFsOp && (_tcsicmp(argv[i], _T("-cold")) == 0))
+			{
+				fsBenchParams.bCold = true;
+			}
+			else if (bBenchmarkFsOp && (_tcsicmp(argv[i], _T("-clean")) == 0))
+			{
+				fsBenchParams.bClean = true;
+			}
+			else if ((bBenchmarkOp || bBenchmarkFsOp) && (_tcsicmp(argv[i], _T("-format")) == 0))
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing format argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -format\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (_tcsicmp(argv[i + 1], _T("json")) == 0)
+					benchmarkFormat = BENCH_FORMAT_JSON;
+				else if (_tcsicmp(argv[i + 1], _T("csv")) == 0)
+					benchmarkFormat = BENCH_FORMAT_CSV;
+				else
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid format \"%s\" for switch -format. Supported values are json and csv.\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+				i++;
+			}
 			else if (_tcsicmp(argv[i], _T("-threads")) == 0)
 			{
 				bUseThreads = true;
 			}
+			else if (_tcsicmp(argv[i], _T("-largestFirst")) == 0)
+			{
+				bLargestFirst = true;
+			}
 			else if (_tcsicmp(argv[i], _T("-sumRelativePath")) == 0)
 			{
-				g_bSumRelativePath = true;
+				t_pOperation->m_bSumRelativePath = true;
 			}
 			else if (_tcsicmp(argv[i], _T("-includeLastDir")) == 0)
 			{
 				g_bIncludeLastDir = true;
-				g_bSumRelativePath = true;
+				t_pOperation->m_bSumRelativePath = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-sumExtended")) == 0)
+			{
+				g_bSumExtended = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-trustMetadata")) == 0)
+			{
+				g_bTrustMetadata = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-cache")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -cache\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				t_pOperation->m_cacheFileName = argv[i + 1];
+				i++;
+			}
+			else if (_tcsicmp(argv[i], _T("-incremental")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -incremental\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_incrementalStateFileName = argv[i + 1];
+				i++;
+			}
+			else if (_tcsicmp(argv[i], _T("-resume")) == 0)
+			{
+				bResume = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-duplicates")) == 0)
+			{
+				bDuplicatesMode = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-blocks")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing size argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -blocks\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				int blockSizeMiB = _wtoi(argv[i + 1]);
+				if (blockSizeMiB <= 0)
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid block size \"%s\" for switch -blocks\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_blockSize = (ULONGLONG)blockSizeMiB * 1024 * 1024;
+				i++;
+			}
+			else if (_tcsicmp(argv[i], _T("-range")) == 0)
+			{
+				BYTE_RANGE range;
+				if ((i + 1) >= argc)
+				{
+					// missing range argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -range\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				if (!ParseByteRange(argv[i + 1], range))
+				{
+					ShowUsage();
+					ShowError(_T("Error: Invalid byte range \"%s\" for switch -range\n"), argv[i + 1]);
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				g_verifyRanges.push_back(range);
+				i++;
+			}
+			else if (_tcsicmp(argv[i], _T("-stats")) == 0)
+			{
+				bShowStats = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-statsJson")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -statsJson\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				bShowStats = true;
+				statsJsonFileName = argv[i + 1];
+				i++;
+			}
+			else if (_tcsicmp(argv[i], _T("-json")) == 0)
+			{
+				bJsonOutput = true;
+			}
+			else if (_tcsicmp(argv[i], _T("-trace")) == 0)
+			{
+				if ((i + 1) >= argc)
+				{
+					// missing file argument
+					ShowUsage();
+					ShowError(_T("Error: Missing argument for switch -trace\n"));
+					WaitForExit(bDontWait);
+					return 1;
+				}
+
+				traceFileName = argv[i + 1];
+				i++;
+			}
+			else if ((argv[i][0] != _T('-')) && !bBenchmarkOp && !bBenchmarkFsOp && !bConvertOp)
+			{
+				// additional input directory or file
+				inputArgs.push_back(argv[i]);
 			}
 			else
 			{
@@ -3328,6 +10842,21 @@ int _tmain(int argc, _TCHAR* argv[])
 		}
 	}
 
+	if (bJsonOutput)
+	{
+		if (bBenchmarkOp || bBenchmarkFsOp || bConvertOp || bDuplicatesMode)
+		{
+			ShowError(TEXT("Error: -json can not be combined with -benchmark, -benchmark-fs, -convertSum or -duplicates\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		// the standard output is reserved to the records
+		bQuiet = true;
+		bDontWait = true;
+		g_bJsonOutput = true;
+	}
+
 	if (!bBenchmarkAllAlgos)
 	{
 		pHashes = Hash::GetHashes(hashAlgoToUse.c_str());
@@ -3342,150 +10871,405 @@ int _tmain(int argc, _TCHAR* argv[])
 	if (!bQuiet)
 		ShowLogo();
 
+	if (bConvertOp)
+	{
+		CPath inputSumPath(argv[2]), outputSumPath(argv[3]);
+		dwError = ConvertSumFile(inputSumPath, outputSumPath, bQuiet);
+		WaitForExit(bDontWait);
+		return dwError;
+	}
+
 	// in case "-verify" was not specified, set SUM mode if it was specied in DirHash.ini
-	if (!bVerifyMode && bForceSumMode)
+	if (!bVerifyMode && bForceSumMode && !bDuplicatesMode)
 		bSumMode = true;
 
-	// we don't support multiple hash algorithms in verify mode
-	if (bVerifyMode && pHashes.size() > 1)
+	if (!bBenchmarkOp && !bBenchmarkFsOp)
+	{
+		if (!bRootsListOp)
+			inputArgs.insert(inputArgs.begin(), argv[1]);
+		else
+		{
+			vector<wstring> listedArgs;
+			if (!LoadRootsList(rootsListFileName, listedArgs))
+			{
+				if (!bQuiet)
+					ShowError(TEXT("Error: Failed to read the list of inputs \"%s\"\n"), rootsListFileName.GetPathValue().c_str());
+				WaitForExit(bDontWait);
+				return 1;
+			}
+			inputArgs.insert(inputArgs.begin(), listedArgs.begin(), listedArgs.end());
+		}
+
+		if (inputArgs.empty())
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: The list of inputs \"%s\" is empty\n"), rootsListFileName.GetPathValue().c_str());
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		if ((inputArgs.size() > 1) && (bVerifyMode || bDuplicatesMode || bResume || g_blockSize || !g_incrementalStateFileName.GetPathValue().empty()))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Several inputs can not be combined with -verify, -duplicates, -resume, -blocks or -incremental\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+	}
+
+	CompileNameFilters();
+
+	if (g_bTrustMetadata && !bVerifyMode)
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -trustMetadata can only be used with -verify\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (!t_pOperation->m_cacheFileName.GetPathValue().empty())
+	{
+		if (!bSumMode || bVerifyMode)
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: -cache can only be used with -sum\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		if (bIncludeNames)
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: -cache can not be combined with -hashnames\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		t_pOperation->m_pHashCache = new CHashCache();
+		if (!t_pOperation->m_pHashCache->Open(t_pOperation->m_cacheFileName))
+		{
+			if (!bQuiet)
+				ShowWarning(TEXT("Warning: Failed to open cache file \"%s\" (error 0x%.8X). All files will be hashed.\n"), t_pOperation->m_cacheFileName.GetPathValue().c_str(), GetLastError());
+			delete t_pOperation->m_pHashCache;
+			t_pOperation->m_pHashCache = NULL;
+		}
+	}
+
+	if (bDuplicatesMode && (bSumMode || bVerifyMode || !g_incrementalStateFileName.GetPathValue().empty()))
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -duplicates can not be combined with -sum, -verify or -incremental\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (bDuplicatesMode && pHashes.size() > 1)
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -duplicates can not be combined with multiple hash algorithms\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (!g_incrementalStateFileName.GetPathValue().empty() && bSumMode)
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -incremental can not be combined with -sum\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	// we don't support multiple hash algorithms in verify mode
+	if (bVerifyMode && pHashes.size() > 1)
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -verify can not be combined with multiple hash algorithms\n"));
+		WaitForExit(bDontWait);
+		return (-10);
+	}
+
+	if (bResume && (!bSumMode || bVerifyMode || g_outputFileName.GetPathValue().empty()))
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -resume can only be used with -sum and -t\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (g_blockSize && (!bSumMode || bVerifyMode || g_outputFileName.GetPathValue().empty()))
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -blocks can only be used with -sum and -t\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (g_blockSize && pHashes.size() > 1)
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: -blocks can not be combined with multiple hash algorithms\n"));
+		WaitForExit(bDontWait);
+		return 1;
+	}
+
+	if (!g_verifyRanges.empty() && !bVerifyMode)
 	{
 		if (!bQuiet)
-			ShowError(TEXT("Error: -verify can not be combined with multiple hash algorithms\n"));
+			ShowError(TEXT("Error: -range can only be used with -verify\n"));
 		WaitForExit(bDontWait);
-		return (-10);
+		return 1;
+	}
+
+	if (bSumMode && !bVerifyMode && !g_outputFileName.GetPathValue().empty() && !bBenchmarkOp && (inputArgs.size() == 1))
+	{
+		// checkpoints are written during the computation so that it can be resumed if it is interrupted.
+		// The options that change the content of the output files must be identical when resuming.
+		wstring szOptions = CPath(inputArgs[0].c_str()).GetAbsolutPathValue();
+		for (size_t i = 0; i < pHashes.size(); i++)
+		{
+			szOptions += L"|";
+			szOptions += pHashes[i]->GetID();
+		}
+		szOptions += FormatString(L"|%d%d%d%d%d%d%d%d", t_pOperation->m_bSumRelativePath, g_bIncludeLastDir, g_bSumExtended, bIncludeNames, bStripNames, bUseThreads, bOverwrite, t_pOperation->m_bNoFollow);
+		szOptions += FormatString(L"|%llu", g_blockSize);
+		for (list<wstring>::const_iterator It = t_pOperation->m_excludeSpecList.begin(); It != t_pOperation->m_excludeSpecList.end(); It++)
+			szOptions += L"|-" + *It;
+		for (list<wstring>::const_iterator It = t_pOperation->m_onlySpecList.begin(); It != t_pOperation->m_onlySpecList.end(); It++)
+			szOptions += L"|+" + *It;
+
+		g_pCheckpoint = new CCheckpoint(g_outputFileName.GetAbsolutPathValue() + L".dirhash_checkpoint", szOptions);
+		if (bResume)
+		{
+			if (!g_pCheckpoint->Load())
+			{
+				if (!bQuiet)
+					ShowWarning(TEXT("Warning: No valid checkpoint matching the given options was found for \"%s\". Starting from the beginning.\n"), g_outputFileName.GetPathValue().c_str());
+			}
+			else if (!g_pCheckpoint->RestoreOutputFiles())
+			{
+				if (!bQuiet)
+					ShowError(TEXT("Error: Failed to restore the output files to their state at the last checkpoint.\n"));
+				delete g_pCheckpoint;
+				g_pCheckpoint = NULL;
+				WaitForExit(bDontWait);
+				return 1;
+			}
+			else
+				bResumed = true;
+		}
 	}
 
 	if (!g_outputFileName.GetPathValue().empty())
 	{
 		// in case of sum mode and if there are multiple hash algorithms specified, we need to create a separate file for each hash algorithm
 		// the file name will be the same as the output file name, but with the hash algorithm appended		
+		// with several inputs, each one has its own SUM files whose names end with the input index
 		bool bMultiHashMode = bSumMode && pHashes.size() > 1;
 		bool bSumComputation = bSumMode && !bVerifyMode;
-		for (size_t i = 0; i < pHashes.size(); i++)
+		size_t sumInputsCount = bSumMode ? max(inputArgs.size(), (size_t)1) : 1;
+		for (size_t r = 0; r < sumInputsCount; r++)
 		{
-			// create a new file name by appending the hash algorithm name
-			std::wstring newFileName = g_outputFileName.GetAbsolutPathValue();
-			std::wstring shadowFileName;
-			if (bMultiHashMode)
-			{
-				newFileName += _T(".");
-				newFileName += pHashes[i]->GetID();
-			}
-			// open the file
-			FILE* newFile = _tfopen(newFileName.c_str(), bOverwrite ? _T("wt,ccs=UTF-8") : _T("a+t,ccs=UTF-8"));
-			if (!newFile)
+			for (size_t i = 0; i < pHashes.size(); i++)
 			{
-				if (!bQuiet)
+				// create a new file name by appending the hash algorithm name
+				std::wstring newFileName = g_outputFileName.GetAbsolutPathValue();
+				std::wstring shadowFileName;
+				if (sumInputsCount > 1)
+					newFileName += FormatString(L".%d", (int)(r + 1));
+				if (bMultiHashMode)
 				{
-					ShowError(_T("!!!Failed to open the %s SUM file for writing!!!\n"), pHashes[i]->GetID());
+					newFileName += _T(".");
+					newFileName += pHashes[i]->GetID();
+				}
+				// open the file
+				// when resuming, the file was already created by the interrupted run
+				FILE* newFile = _tfopen(newFileName.c_str(), (bOverwrite && !bResumed) ? _T("wt,ccs=UTF-8") : _T("a+t,ccs=UTF-8"));
+				if (!newFile)
+				{
+					if (!bQuiet)
+					{
+						ShowError(_T("!!!Failed to open the %s SUM file for writing!!!\n"), pHashes[i]->GetID());
+					}
+				}
+				else if (!bOverwrite && !bResumed)
+				{
+					// add a new Line to the file to avoid issues with existing content
+					__int64 fileLength = _filelengthi64(_fileno(newFile));
+					if (fileLength > 3) // ignore UTF-8 BOM bytes which are always written by fopen when "ccs=UTF-8" specified
+						_ftprintf(newFile, L"\n");
 				}
-			}
-			else if (!bOverwrite)
-			{
-				// add a new Line to the file to avoid issues with existing content
-				__int64 fileLength = _filelengthi64(_fileno(newFile));
-				if (fileLength > 3) // ignore UTF-8 BOM bytes which are always written by fopen when "ccs=UTF-8" specified
-					_ftprintf(newFile, L"\n");
-			}
 
-			FILE* shadowFile = NULL;
-			if (bSumComputation && bUseThreads && !bOverwrite)
-			{
-				// create a shadow file for the current sum file. This file will be used to store the hash values.
-				// when all computations are done, we will first sort the hash values and then write the sorted values to the target sum file
-				// this is done to avoid issues with the order of hash values in the sum file when using threads
-				shadowFileName = newFileName + L".dirhash_shadow";
-				shadowFile = _tfopen(shadowFileName.c_str(), _T("wt,ccs=UTF-8"));
-			}
+				FILE* shadowFile = NULL;
+				if (bSumComputation && bUseThreads && !bOverwrite)
+				{
+					// create a shadow file for the current sum file. This file will be used to store the hash values.
+					// when all computations are done, we will first sort the hash values and then write the sorted values to the target sum file
+					// this is done to avoid issues with the order of hash values in the sum file when using threads
+					shadowFileName = newFileName + L".dirhash_shadow";
+					shadowFile = _tfopen(shadowFileName.c_str(), bResumed ? _T("a+t,ccs=UTF-8") : _T("wt,ccs=UTF-8"));
+				}
 
-			if (newFile)
-				// add the file to the list of output files
-				outputFiles.push_back(shared_ptr<CFilePtr>(new CFilePtr(newFile, newFileName, shadowFile, shadowFileName)));
-			else
-				outputFiles.push_back(NULL);
-			
-			if (!bSumMode)
-				break;
+				if (newFile)
+					// add the file to the list of output files
+					t_pOperation->m_outputFiles.push_back(shared_ptr<CFilePtr>(new CFilePtr(newFile, newFileName, shadowFile, shadowFileName)));
+				else
+					t_pOperation->m_outputFiles.push_back(NULL);
+				
+				if (!bSumMode)
+					break;
+			}
 		}
 	}
 	else
 	{
-		// no output file specified, add NULL to the list of output files
-		outputFiles.push_back(NULL);
+		// no output file specified, add NULL to the list of output files for each SUM file
+		size_t outputsCount = bSumMode ? max(inputArgs.size(), (size_t)1) * pHashes.size() : 1;
+		for (size_t i = 0; i < outputsCount; i++)
+			t_pOperation->m_outputFiles.push_back(NULL);
 	}
 
-	if (bBenchmarkOp)
+	if (g_blockSize && t_pOperation->m_outputFiles[0])
 	{
-		PerformBenchmark(pHashes, bQuiet, bCopyToClipboard);
-
-		WaitForExit(bDontWait);
-		return dwError;
+		// the block digests are written next to the SUM file
+		g_blockManifestFileName = (g_outputFileName.GetAbsolutPathValue() + BLOCK_MANIFEST_EXTENSION).c_str();
+		g_pBlockManifestFile = _tfopen(g_blockManifestFileName.GetAbsolutPathValue().c_str(), (bOverwrite && !bResumed) ? _T("wt,ccs=UTF-8") : _T("a+t,ccs=UTF-8"));
+		if (g_pBlockManifestFile)
+			InitializeCriticalSection(&g_blockManifestLock);
+		else if (!bQuiet)
+			ShowWarning(TEXT("Warning: Failed to open blocks manifest \"%s\" for writing. Block digests will not be computed.\n"), g_blockManifestFileName.GetPathValue().c_str());
+	}
+	else if (bSumMode && !bVerifyMode && bOverwrite && !bResumed && t_pOperation->m_outputFiles[0])
+	{
+		// a manifest left by a previous computation would not match the new SUM file
+		DeleteFileW((g_outputFileName.GetAbsolutPathValue() + BLOCK_MANIFEST_EXTENSION).c_str());
 	}
 
-	inputArg = argv[1];
-	std::replace(inputArg.begin(), inputArg.end(), L'/', L'\\');
-	// remove any trailing backslash to harmonize directory names in case they are included
-	// in hash computations
-	size_t inputArgLen = wcslen(inputArg.c_str());
-	if (inputArg[inputArgLen - 1] == L'\\')
-		inputArg.erase(inputArgLen - 1, 1);
-	inputPath = inputArg.c_str();
+	if (g_pCheckpoint && !bResumed)
+		g_pCheckpoint->Start();
 
-	if (!GetPathType(inputPath.GetAbsolutPathValue().c_str(), bIsFile))
+	if (bBenchmarkFsOp)
 	{
-		if (!bQuiet)
-			ShowError(TEXT("Error: The given input file doesn't exist\n"));
+		dwError = PerformFsBenchmark(CPath(argv[2]), hashAlgoToUse, fsBenchParams, bQuiet, bCopyToClipboard, benchmarkFormat);
+
 		WaitForExit(bDontWait);
-		return (-2);
+		return dwError;
 	}
 
-	if (g_bNoFollow && IsReparsePoint(argv[1]))
+	if (bBenchmarkOp)
 	{
-		if (!bQuiet)
-			ShowError(TEXT("Error: -nofollow specified but the given input file or directoty is Symbolic Link, Junction Point or Mount Point.\n"));
+		PerformBenchmark(pHashes, bQuiet, bCopyToClipboard, bBenchmarkSweep, bBenchmarkScaling, benchmarkFormat);
+
 		WaitForExit(bDontWait);
-		return (-9);
+		return dwError;
 	}
 
-	if (!bQuiet)
+	inputRoots.resize(inputArgs.size());
+	for (size_t r = 0; r < inputArgs.size(); r++)
 	{
-		_tprintf(_T("Using %s to %s %s of \"%s\" ...\n"),
-			hashAlgoToUse.c_str(),
-			bVerifyMode? _T("verify") : _T("compute"),
-			bSumMode ? _T("checksum") : _T("hash"),
-			bStripNames ? GetFileName(argv[1]) : argv[1]);
-		fflush(stdout);
-	}
+		INPUT_ROOT& root = inputRoots[r];
+		root.szArg = inputArgs[r];
+		root.path = inputArgs[r];
+		NormalizePathSeparators(root.path);
+		// remove any trailing backslash to harmonize directory names in case they are included
+		// in hash computations. The root directory "/" is kept as is.
+		size_t inputArgLen = root.path.length();
+		if ((inputArgLen > 1) && (root.path[inputArgLen - 1] == PATH_SEPARATOR))
+			root.path.erase(inputArgLen - 1, 1);
+
+		if (!GetPathType(CPath(root.path.c_str()).GetAbsolutPathValue().c_str(), root.bIsFile))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: The given input file \"%s\" doesn't exist\n"), root.szArg.c_str());
+			WaitForExit(bDontWait);
+			return (-2);
+		}
 
-	if (!bIsFile)
-	{
+		if (t_pOperation->m_bNoFollow && IsReparsePoint(root.szArg.c_str()))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: -nofollow specified but the given input file or directoty \"%s\" is Symbolic Link, Junction Point or Mount Point.\n"), root.szArg.c_str());
+			WaitForExit(bDontWait);
+			return (-9);
+		}
 
-		if (bSumMode || bVerifyMode)
+		// if input is a file, -sumRelativePath is irrelevant
+		if (!root.bIsFile && (bSumMode || bVerifyMode))
 		{
 			// we store the input directory when -sum or -verify are specified
-			g_inputDirPath = inputArg;
+			wstring inputDirPath = root.path;
 			if (g_bIncludeLastDir)
 			{
 				// remove the last directory name so that it is present in the output
-				size_t pos = g_inputDirPath.find_last_of(L"\\");
+				size_t pos = inputDirPath.find_last_of(PATH_SEPARATOR);
 				if (pos != std::wstring::npos)
-					g_inputDirPath.erase(pos + 1);
+					inputDirPath.erase(pos + 1);
 				else
-					g_inputDirPath.clear();
+					inputDirPath.clear();
 			}
-			else
-				g_inputDirPath += L"\\";
-			g_inputDirPathLength = wcslen(g_inputDirPath.c_str());
+			else if (inputDirPath[inputDirPath.length() - 1] != PATH_SEPARATOR)
+				inputDirPath += PATH_SEPARATOR_STRING;
+
+			if (r == 0)
+			{
+				t_pOperation->m_inputDirPath = inputDirPath;
+				t_pOperation->m_inputDirPathLength = wcslen(t_pOperation->m_inputDirPath.c_str());
+			}
+			if (t_pOperation->m_bSumRelativePath)
+				root.sumPathOffset = inputDirPath.length();
 		}
+
+		// the digest of each input is computed with its own hash objects
+		root.outputBase = bSumMode ? (r * pHashes.size()) : 0;
+		if (r == 0)
+			root.pHashes = pHashes;
+		else
+			CloneHashes(pHashes, root.pHashes);
+	}
+
+	// -verify, -duplicates and -incremental use a single input
+	szInputArg = inputRoots[0].szArg.c_str();
+	inputArg = inputRoots[0].path;
+	inputPath = inputArg.c_str();
+	bIsFile = inputRoots[0].bIsFile;
+	t_pInputRoot = &inputRoots[0];
+
+	if (!bQuiet && (inputRoots.size() == 1))
+	{
+		if (bDuplicatesMode)
+			_tprintf(_T("Using %s to find duplicate files in \"%s\" ...\n"), hashAlgoToUse.c_str(), szInputArg);
+		else
+			_tprintf(_T("Using %s to %s %s of \"%s\" ...\n"),
+				hashAlgoToUse.c_str(),
+				bVerifyMode? _T("verify") : _T("compute"),
+				bSumMode ? _T("checksum") : _T("hash"),
+				bStripNames ? GetFileName(szInputArg) : szInputArg);
+		fflush(stdout);
+	}
+
+	if (bResumed && !g_pCheckpoint->LoadCompletedEntries())
+	{
+		if (!bQuiet)
+			ShowError(TEXT("Error: Failed to read the entries written before the last checkpoint.\n"));
+		WaitForExit(bDontWait);
+		return 1;
 	}
 
 	if (bVerifyMode)
 	{
 
-		if (ParseSumFile(g_verificationFileName, digestsList, skippedLines))
+		bool bBinarySumFile = CBinarySumFile::IsBinarySumFile(t_pOperation->m_verificationFileName);
+		if (bBinarySumFile && !sumEntries.OpenBinary(t_pOperation->m_verificationFileName))
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: Failed to open binary SUM file \"%s\". Please check that it is not corrupted.\n"), t_pOperation->m_verificationFileName.GetPathValue().c_str());
+			WaitForExit(bDontWait);
+			return (-3);
+		}
+
+		if (bBinarySumFile || ParseSumFile(t_pOperation->m_verificationFileName, sumEntries.GetTextEntries(), skippedLines))
 		{
 			// check that hash length used in the checksum file is the same as the one specified by the user
-			int sumFileHashLen = (int)digestsList.begin()->second.m_digest.size();
+			int sumFileHashLen = sumEntries.GetDigestSize();
 			if (sumFileHashLen != pHashes[0]->GetHashSize())
 			{
 				if (!bQuiet)
@@ -3495,19 +11279,11 @@ int _tmain(int argc, _TCHAR* argv[])
 			}
 			if (bIsFile)
 			{
-				// if input is a file, we need to remove all entries from digestsList except the one corresponding to the input file
+				// if input is a file, we need to remove all entries from sumEntries except the one corresponding to the input file
 				// this is because we only want to verify the hash of the input file, not all files in the sum file
 				// keep only the entry corresponding to the input file
 				wstring inputFileName = inputPath.GetPathValue();
-				auto it = digestsList.find(inputFileName);
-				if (it != digestsList.end())
-				{
-					// found the entry, keep it and remove all other entries
-					HashResultEntry entry = it->second;
-					digestsList.clear();
-					digestsList[inputFileName] = entry;
-				}
-				else
+				if (!sumEntries.KeepSingleEntry(inputFileName))
 				{
 					// entry not found, this is an error
 					if (!bQuiet)
@@ -3516,12 +11292,27 @@ int _tmain(int argc, _TCHAR* argv[])
 					return -5;
 				}
 			}
+
+			// load the block digests written by -blocks if they are present next to the SUM file
+			size_t skippedBlockLines = 0;
+			g_blockManifestFileName = (t_pOperation->m_verificationFileName.GetAbsolutPathValue() + BLOCK_MANIFEST_EXTENSION).c_str();
+			g_pBlockManifest = new CBlockManifest();
+			if (!g_pBlockManifest->Load(g_blockManifestFileName, pHashes[0]->GetHashSize(), skippedBlockLines) || !g_pBlockManifest->GetFilesCount())
+			{
+				delete g_pBlockManifest;
+				g_pBlockManifest = NULL;
+			}
+			else if (skippedBlockLines && !bQuiet)
+				ShowWarning(TEXT("Warning: %d invalid lines were skipped in blocks manifest \"%s\".\n"), (int)skippedBlockLines, g_blockManifestFileName.GetPathValue().c_str());
+
+			if (!g_verifyRanges.empty() && !g_pBlockManifest && !bQuiet)
+				ShowWarning(TEXT("Warning: No blocks manifest found for \"%s\". -range is ignored and files are verified entirely.\n"), t_pOperation->m_verificationFileName.GetPathValue().c_str());
 			bSumMode = true;
 		}
-		else if (ParseResultFile(g_verificationFileName, digestsList, rawDigestsList))
+		else if (ParseResultFile(t_pOperation->m_verificationFileName, digestsList, rawDigestsList))
 		{
 			// 
-			std::wstring entryName = GetFileName(argv[1]);
+			std::wstring entryName = GetFileName(szInputArg);
 			map < wstring, HashResultEntry>::iterator It = digestsList.find(entryName);
 			if (It == digestsList.end())
 			{
@@ -3550,12 +11341,74 @@ int _tmain(int argc, _TCHAR* argv[])
 		else
 		{
 			if (!bQuiet)
-				ShowError(TEXT("Error: Failed to parse file \"%s\". Please check that it exists and that its content is valid (either checksum file or result file).\n"), g_verificationFileName.GetPathValue().c_str());
+				ShowError(TEXT("Error: Failed to parse file \"%s\". Please check that it exists and that its content is valid (either checksum file or result file).\n"), t_pOperation->m_verificationFileName.GetPathValue().c_str());
 			WaitForExit(bDontWait);
 			return (-3);
 		}
 	}
 
+	if (!g_incrementalStateFileName.GetPathValue().empty() && !bSumMode)
+	{
+		// only BLAKE3 has a tree structure that allows reusing the state of unchanged files
+		if ((pHashes.size() != 1) || !dynamic_cast<Blake3Hash*>(pHashes[0].get()))
+		{
+			if (!bQuiet)
+				ShowWarning(TEXT("Warning: -incremental is only supported with Blake3 alone. All files will be hashed.\n"));
+		}
+		else
+		{
+			g_pIncrementalState = new CIncrementalState();
+			if (!g_pIncrementalState->Load(g_incrementalStateFileName) && !bQuiet)
+				ShowWarning(TEXT("Warning: Failed to load incremental state file \"%s\". All files will be hashed.\n"), g_incrementalStateFileName.GetPathValue().c_str());
+		}
+	}
+
+	if (bDuplicatesMode)
+	{
+		if (bIsFile)
+		{
+			if (!bQuiet)
+				ShowError(TEXT("Error: -duplicates requires a directory as input\n"));
+			WaitForExit(bDontWait);
+			return 1;
+		}
+
+		// enumerate the files first, then look for identical ones
+		g_pDuplicateFinder = new CDuplicateFinder();
+		CPath dirPath(inputArg.c_str());
+		dwError = HashDirectory(dirPath, pHashes, false, false, bQuiet, bShowProgress, false, sumEntries);
+		if (dwError == NO_ERROR)
+			dwError = g_pDuplicateFinder->Run(pHashes[0], bUseThreads, bQuiet);
+
+		if (dwError == NO_ERROR)
+			g_pDuplicateFinder->ShowResults(pHashes[0]->GetID(), bQuiet);
+		else if (wcslen(t_pOperation->m_szLastErrorMsg.c_str()))
+			ShowErrorDirect(t_pOperation->m_szLastErrorMsg.c_str());
+
+		delete g_pDuplicateFinder;
+		g_pDuplicateFinder = NULL;
+		WaitForExit(bDontWait);
+		return dwError;
+	}
+
+	if (bShowStats)
+		g_pRunStats = new CRunStats();
+
+	if (bJsonOutput)
+		t_pOperation->m_pJsonOutput = new CJsonOutput(GetStdHandle(STD_OUTPUT_HANDLE));
+
+	if (!traceFileName.GetPathValue().empty())
+	{
+		g_pTrace = new CTrace();
+		g_pTrace->SetThreadName(L"main");
+	}
+
+	if (bShowProgress && !bQuiet)
+	{
+		g_pProgress = new CProgress();
+		g_pProgress->Start();
+	}
+
 	if (bSumMode)
 	{
 		// set default text color to yellow
@@ -3566,62 +11419,191 @@ int _tmain(int argc, _TCHAR* argv[])
 		{
 			bool bOutfileValid = false;
 			// check that at least one of the output files is valid
-			for (size_t i = 0; i < outputFiles.size(); i++)
+			for (size_t i = 0; i < t_pOperation->m_outputFiles.size(); i++)
 			{
-				if (outputFiles[i])
+				if (t_pOperation->m_outputFiles[i])
 				{
 					bOutfileValid = true;
 					break;
 				}
 			}
 			StartThreads(!bQuiet || bOutfileValid);
+			t_pOperation->m_threadsCount = g_threadsCount;
+			if (g_pRunStats && g_threadsCount)
+				StartStatsSampler();
 		}
 	}
 
-	if (!bIsFile)
-	{
-		CPath dirPath(inputArg.c_str());
-		dwError = HashDirectory(dirPath, pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, digestsList);
-	}
-	else
+	// the content of files having several names is hashed once, unless the digest depends on the name
+	if (bSumMode && !bIncludeNames && !g_pBlockManifestFile && !g_pBlockManifest)
+		t_pOperation->m_pLinkedFiles = new CLinkedFiles();
+
+	// with -largestFirst, the files are only hashed once all the inputs are enumerated
+	t_pOperation->m_bDeferJobs = bSumMode && bLargestFirst && (t_pOperation->m_threadsCount != 0);
+
+	dwError = NO_ERROR;
+	for (size_t r = 0; (r < inputRoots.size()) && (dwError == NO_ERROR); r++)
 	{
-		CPath filePath(inputArg.c_str());
-		dwError = NO_ERROR;
-		if (bSumMode)
+		INPUT_ROOT& root = inputRoots[r];
+
+		// the worker threads can still process the files of the previous inputs while this one is enumerated
+		t_pInputRoot = &root;
+		if (!bQuiet && (inputRoots.size() > 1))
 		{
-			// if input is a file, -sumRelativePath is irrelevant
-			g_bSumRelativePath = false;
-			if (!digestsList.empty())
+			_tprintf(_T("Using %s to compute %s of \"%s\" ...\n"),
+				hashAlgoToUse.c_str(),
+				bSumMode ? _T("checksum") : _T("hash"),
+				bStripNames ? GetFileName(root.szArg.c_str()) : root.szArg.c_str());
+			fflush(stdout);
+		}
+
+		if (!root.bIsFile)
+		{
+			CPath dirPath(root.path.c_str());
+			dwError = HashDirectory(dirPath, root.pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, sumEntries);
+		}
+		else
+		{
+			CPath filePath(root.path.c_str());
+			if (bSumMode)
 			{
-				// verification
-				if (0 == _wcsicmp(g_verificationFileName.GetAbsolutPathValue().c_str(), filePath.GetAbsolutPathValue().c_str()))
+				if (!sumEntries.empty())
 				{
-					ShowError(L"Input file is the same as SUM verification file. Aborting!");
-					dwError = ERROR_INVALID_PARAMETER;
+					// verification
+					if (0 == _wcsicmp(t_pOperation->m_verificationFileName.GetAbsolutPathValue().c_str(), filePath.GetAbsolutPathValue().c_str()))
+					{
+						ShowError(L"Input file is the same as SUM verification file. Aborting!");
+						dwError = ERROR_INVALID_PARAMETER;
+					}
 				}
-			}
-			else
-			{
-				if (!g_outputFileName.GetAbsolutPathValue().empty() && (0 == _wcsicmp(g_outputFileName.GetAbsolutPathValue().c_str(), filePath.GetAbsolutPathValue().c_str())))
+				else
 				{
-					ShowError(L"Input file is the same as SUM result file. Aborting!");
-					dwError = ERROR_INVALID_PARAMETER;
+					if (!g_outputFileName.GetAbsolutPathValue().empty() && (0 == _wcsicmp(g_outputFileName.GetAbsolutPathValue().c_str(), filePath.GetAbsolutPathValue().c_str())))
+					{
+						ShowError(L"Input file is the same as SUM result file. Aborting!");
+						dwError = ERROR_INVALID_PARAMETER;
+					}
 				}
-			}
-		};
+			};
 
-		if (dwError == NO_ERROR)
-			dwError = HashFile(filePath, pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, digestsList);
+			if (dwError == NO_ERROR)
+				dwError = HashFile(filePath, root.pHashes, bIncludeNames, bStripNames, bQuiet, bShowProgress, bSumMode, sumEntries, NULL, shared_ptr<CDirHandle>());
+		}
+	}
+
+	if (t_pOperation->m_bDeferJobs)
+	{
+		t_pOperation->m_bDeferJobs = false;
+		QueueDeferredJobs();
 	}
 
 	if (bSumMode)
 	{
 		if (bUseThreads)
+		{
 			StopThreads(dwError != NO_ERROR);
+			t_pOperation->m_threadsCount = 0;
+			StopStatsSampler();
+			// the worker threads only report their errors in m_szLastErrorMsg
+			if ((dwError == NO_ERROR) && !t_pOperation->m_szLastErrorMsg.empty())
+				dwError = -1;
+		}
+		if (t_pOperation->m_pLinkedFiles)
+		{
+			delete t_pOperation->m_pLinkedFiles;
+			t_pOperation->m_pLinkedFiles = NULL;
+		}
+		// record the progress of a failed computation so that it can be resumed
+		if (g_pCheckpoint && (dwError != NO_ERROR))
+			g_pCheckpoint->Update(true);
 		g_wCurrentAttributes = g_wAttributes;
 		SetConsoleTextAttribute(g_hConsole, g_wAttributes);
 	}
 
+	if (g_pProgress)
+	{
+		// all files are processed: the render thread is stopped and the progress line erased
+		delete g_pProgress;
+		g_pProgress = NULL;
+	}
+
+	if (g_pBlockManifestFile)
+	{
+		fclose(g_pBlockManifestFile);
+		g_pBlockManifestFile = NULL;
+		DeleteCriticalSection(&g_blockManifestLock);
+	}
+
+	if (g_pBlockManifest)
+	{
+		delete g_pBlockManifest;
+		g_pBlockManifest = NULL;
+	}
+
+	if (t_pOperation->m_pHashCache)
+	{
+		// digests computed before an error are valid so we save them in all cases
+		if (!t_pOperation->m_pHashCache->Save() && !bQuiet)
+			ShowWarning(TEXT("Warning: Failed to update cache file \"%s\".\n"), t_pOperation->m_cacheFileName.GetPathValue().c_str());
+
+		if (!bQuiet)
+		{
+			ULONGLONG lookups = t_pOperation->m_pHashCache->GetHits() + t_pOperation->m_pHashCache->GetMisses();
+			_tprintf(_T("Cache statistics: %llu hits, %llu misses (hit rate %.2f %%), %llu entries in cache.\n"),
+				t_pOperation->m_pHashCache->GetHits(),
+				t_pOperation->m_pHashCache->GetMisses(),
+				lookups ? ((double)t_pOperation->m_pHashCache->GetHits() * 100.0 / (double)lookups) : 0.0,
+				t_pOperation->m_pHashCache->GetEntriesCount());
+		}
+
+		delete t_pOperation->m_pHashCache;
+		t_pOperation->m_pHashCache = NULL;
+	}
+
+	if (g_pIncrementalState)
+	{
+		// the state is only valid for a complete run
+		if (dwError == NO_ERROR)
+		{
+			if (!g_pIncrementalState->Save(g_incrementalStateFileName) && !bQuiet)
+				ShowWarning(TEXT("Warning: Failed to update incremental state file \"%s\".\n"), g_incrementalStateFileName.GetPathValue().c_str());
+
+			if (!bQuiet)
+			{
+				_tprintf(_T("Incremental statistics: %llu files reused (%llu bytes not read), %llu files hashed.\n"),
+					g_pIncrementalState->GetReusedFiles(),
+					g_pIncrementalState->GetReusedBytes(),
+					g_pIncrementalState->GetHashedFiles());
+			}
+		}
+
+		delete g_pIncrementalState;
+		g_pIncrementalState = NULL;
+	}
+
+	if (g_pRunStats)
+	{
+		// worker threads are stopped so their statistics can be aggregated
+		g_pRunStats->Stop();
+		if (!bQuiet)
+			_tprintf(_T("%s"), g_pRunStats->FormatSummary().c_str());
+
+		if (!statsJsonFileName.GetPathValue().empty() && !WriteUtf8File(statsJsonFileName.GetAbsolutPathValue().c_str(), g_pRunStats->FormatJson()) && !bQuiet)
+			ShowWarning(TEXT("Warning: Failed to write statistics file \"%s\".\n"), statsJsonFileName.GetPathValue().c_str());
+
+		delete g_pRunStats;
+		g_pRunStats = NULL;
+	}
+
+	if (g_pTrace)
+	{
+		if (!g_pTrace->Save(traceFileName.GetAbsolutPathValue().c_str()) && !bQuiet)
+			ShowWarning(TEXT("Warning: Failed to write trace file \"%s\".\n"), traceFileName.GetPathValue().c_str());
+
+		delete g_pTrace;
+		g_pTrace = NULL;
+	}
+
 	if (dwError == NO_ERROR)
 	{
 		if (bSumMode)
@@ -3629,97 +11611,117 @@ int _tmain(int argc, _TCHAR* argv[])
 			if (bVerifyMode)
 			{
 				// check if some entries in SUM files where not processed
-				size_t skippedEntries = 0;
-				for (std::map<wstring, HashResultEntry>::iterator It = digestsList.begin(); It != digestsList.end(); It++)
-				{
-					if (!It->second.m_processed)
-						skippedEntries++;
-				}
+				vector<wstring> unprocessedEntries;
+				sumEntries.GetUnprocessedEntries(unprocessedEntries);
+				size_t skippedEntries = unprocessedEntries.size();
 
 				if (skippedEntries)
 				{
 					if (!bQuiet)
 					{
 						if (skippedEntries == 1)
-							ShowWarning(_T("1 entry in \"%s\" was not found:\n"), g_verificationFileName.GetPathValue().c_str());
+							ShowWarning(_T("1 entry in \"%s\" was not found:\n"), t_pOperation->m_verificationFileName.GetPathValue().c_str());
 						else
-							ShowWarning(_T("%lu entries in \"%s\" where not found:\n"), (unsigned long)skippedEntries, g_verificationFileName.GetPathValue().c_str());
+							ShowWarning(_T("%lu entries in \"%s\" where not found:\n"), (unsigned long)skippedEntries, t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
-					if (outputFiles[0])
+					if (t_pOperation->m_outputFiles[0])
 					{
 						if (skippedEntries == 1)
-							_ftprintf(*outputFiles[0], _T("1 entry in \"%s\" was not found:\n"), g_verificationFileName.GetPathValue().c_str());
+							_ftprintf(*t_pOperation->m_outputFiles[0], _T("1 entry in \"%s\" was not found:\n"), t_pOperation->m_verificationFileName.GetPathValue().c_str());
 						else
-							_ftprintf(*outputFiles[0], _T("%lu entries in \"%s\" where not found:\n"), (unsigned long)skippedEntries, g_verificationFileName.GetPathValue().c_str());
+							_ftprintf(*t_pOperation->m_outputFiles[0], _T("%lu entries in \"%s\" where not found:\n"), (unsigned long)skippedEntries, t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
 
 					unsigned long counter = 1;
-					for (std::map<wstring, HashResultEntry>::iterator It = digestsList.begin(); It != digestsList.end(); It++)
+					for (vector<wstring>::iterator It = unprocessedEntries.begin(); It != unprocessedEntries.end(); It++)
 					{
-						if (!It->second.m_processed)
-						{
-							if (!bQuiet)
-								ShowWarning(_T(" %lu - %s\n"), counter, It->first.c_str());
-							if (outputFiles[0])
-								_ftprintf(*outputFiles[0], _T(" %lu - %s\n"), counter, It->first.c_str());
-							counter++;
-						}
+						if (!bQuiet)
+							ShowWarning(_T(" %lu - %s\n"), counter, It->c_str());
+						if (t_pOperation->m_outputFiles[0])
+							_ftprintf(*t_pOperation->m_outputFiles[0], _T(" %lu - %s\n"), counter, It->c_str());
+						counter++;
 					}
 
 					if (!bQuiet)
 						_tprintf(_T("\n"));
-					if (outputFiles[0])
-						_ftprintf(*outputFiles[0], _T("\n"));
+					if (t_pOperation->m_outputFiles[0])
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("\n"));
 
 					// report error
-					g_bMismatchFound = true;
+					t_pOperation->m_bMismatchFound = true;
 						
 				}
 
-				if (g_bMismatchFound)
+				if (g_trustedEntriesCount)
+				{
+					if (!bQuiet)
+						ShowWarning(_T("%lu entries were not rehashed because their size, modification time and file ID didn't change.\n"), (unsigned long)g_trustedEntriesCount);
+					if (t_pOperation->m_outputFiles[0])
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("%lu entries were not rehashed because their size, modification time and file ID didn't change.\n"), (unsigned long)g_trustedEntriesCount);
+				}
+
+				if (t_pOperation->m_bMismatchFound)
 				{
 					if (!bQuiet)
 					{
 						ShowError(_T("Verification of \"%s\" against \"%s\" failed!\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
-					if (outputFiles[0])
+					if (t_pOperation->m_outputFiles[0])
 					{
-						_ftprintf(*outputFiles[0], _T("Verification of \"%s\" against \"%s\" failed!\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("Verification of \"%s\" against \"%s\" failed!\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
 					dwError = -7;
 				}
+				else if (g_selectedBlocksCount < g_manifestBlocksCount)
+				{
+					// blocks outside of the -range values were not read
+					if (!bQuiet)
+					{
+						ShowWarning(_T("Partial verification of \"%s\" against \"%s\" succeeded: %llu of %llu blocks verified.\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str(),
+							g_selectedBlocksCount, g_manifestBlocksCount);
+					}
+					if (t_pOperation->m_outputFiles[0])
+					{
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("Partial verification of \"%s\" against \"%s\" succeeded: %llu of %llu blocks verified.\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str(),
+							g_selectedBlocksCount, g_manifestBlocksCount);
+					}
+				}
 				else
 				{
 					if (!bQuiet)
 					{
 						ShowWarning(_T("Verification of \"%s\" against \"%s\" succeeded.\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
-					if (outputFiles[0])
+					if (t_pOperation->m_outputFiles[0])
 					{
-						_ftprintf(*outputFiles[0], _T("Verification of \"%s\" against \"%s\" succeeded.\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("Verification of \"%s\" against \"%s\" succeeded.\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
 				}
 
 				if (!skippedLines.empty())
 				{
 					if (!bQuiet)
-						ShowWarning(_T("\n%d line(s) were skipped in \"%s\" because they are corrupted.\nSkipped lines numbers are: "), (int)skippedLines.size(), g_verificationFileName.GetPathValue().c_str());						
-					if (*outputFiles[0])
-						_tprintf(_T("\n%d line(s) were skipped in \"%s\" because they are corrupted.\nSkipped lines numbers are: "), (int)skippedLines.size(), g_verificationFileName.GetPathValue().c_str());
+						ShowWarning(_T("\n%d line(s) were skipped in \"%s\" because they are corrupted.\nSkipped lines numbers are: "), (int)skippedLines.size(), t_pOperation->m_verificationFileName.GetPathValue().c_str());						
+					if (*t_pOperation->m_outputFiles[0])
+						_tprintf(_T("\n%d line(s) were skipped in \"%s\" because they are corrupted.\nSkipped lines numbers are: "), (int)skippedLines.size(), t_pOperation->m_verificationFileName.GetPathValue().c_str());
 						
-					for (size_t i = 0; i < min(skippedLines.size(), 9); i++)
+					for (size_t i = 0; i < min(skippedLines.size(), (size_t)9); i++)
 					{
 						if (!bQuiet)
 							ShowWarning(_T("%d "), skippedLines[i]);							
-						if (*outputFiles[0])
+						if (*t_pOperation->m_outputFiles[0])
 							_tprintf(_T("%d "), skippedLines[i]);							
 					}
 
@@ -3727,7 +11729,7 @@ int _tmain(int argc, _TCHAR* argv[])
 					{
 						if (!bQuiet)
 							ShowWarning(_T("... %d\n"), skippedLines[skippedLines.size() - 1]);							
-						if (*outputFiles[0])
+						if (*t_pOperation->m_outputFiles[0])
 							_tprintf(_T("... %d\n"), skippedLines[skippedLines.size() - 1]);
 					}
 				}
@@ -3736,21 +11738,21 @@ int _tmain(int argc, _TCHAR* argv[])
 			else
 			{
 				// Sort the entries of each sum file in case of multithreaded mode
-				// for this, we loop over outputFiles elements and for each non NULL element, we sort it by calling SortSumFile
+				// for this, we loop over m_outputFiles elements and for each non NULL element, we sort it by calling SortSumFile
 				if (bUseThreads)
 				{
-					for (size_t i = 0; i < outputFiles.size(); i++)
+					for (size_t i = 0; i < t_pOperation->m_outputFiles.size(); i++)
 					{
-						if (outputFiles[i])
+						if (t_pOperation->m_outputFiles[i])
 						{
-							FILE* pShadowFile = outputFiles[i]->GetShadowFile();
+							FILE* pShadowFile = t_pOperation->m_outputFiles[i]->GetShadowFile();
 							if (pShadowFile)
 							{
 								// close the shadow file
-								outputFiles[i]->CloseShadowFile();
+								t_pOperation->m_outputFiles[i]->CloseShadowFile();
 								// sort its content and write it to the target file
-								CPath shadowFilePath(outputFiles[i]->GetShadowFileName().c_str());
-								FILE* pFile = *outputFiles[i];
+								CPath shadowFilePath(t_pOperation->m_outputFiles[i]->GetShadowFileName().c_str());
+								FILE* pFile = *t_pOperation->m_outputFiles[i];
 								if (!SortSumFile(shadowFilePath, pFile))
 								{
 									if (!bQuiet)
@@ -3767,9 +11769,9 @@ int _tmain(int argc, _TCHAR* argv[])
 							else
 							{
 								// close the file
-								outputFiles[i]->Close();
+								t_pOperation->m_outputFiles[i]->Close();
 								// sort its content and overwrite it with the sorted content
-								CPath filePath(outputFiles[i]->GetFileName().c_str());
+								CPath filePath(t_pOperation->m_outputFiles[i]->GetFileName().c_str());
 								if (!SortSumFile(filePath, NULL))
 								{
 									if (!bQuiet)
@@ -3794,14 +11796,14 @@ int _tmain(int argc, _TCHAR* argv[])
 					if (!bQuiet)
 					{
 						ShowError(_T("Verification of \"%s\" against \"%s\" failed!\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
-					if (outputFiles[0])
+					if (t_pOperation->m_outputFiles[0])
 					{
-						_ftprintf(*outputFiles[0], _T("Verification of \"%s\" against \"%s\" failed!\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("Verification of \"%s\" against \"%s\" failed!\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
 					dwError = -7;
 				}
@@ -3810,62 +11812,86 @@ int _tmain(int argc, _TCHAR* argv[])
 					if (!bQuiet)
 					{
 						ShowWarning(_T("Verification of \"%s\" against \"%s\" succeeded.\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
-					if (outputFiles[0])
+					if (t_pOperation->m_outputFiles[0])
 					{
-						_ftprintf(*outputFiles[0], _T("Verification of \"%s\" against \"%s\" succeeded.\n"),
-							argv[1],
-							g_verificationFileName.GetPathValue().c_str());
+						_ftprintf(*t_pOperation->m_outputFiles[0], _T("Verification of \"%s\" against \"%s\" succeeded.\n"),
+							szInputArg,
+							t_pOperation->m_verificationFileName.GetPathValue().c_str());
 					}
 				}
 			}
 			else
 			{
 				TCHAR szDigestHex[129]; 
-				// call Final method for each hash in  the pHashes vector and display the result
-				for (size_t i = 0; i < pHashes.size(); i++)
+				for (size_t r = 0; r < inputRoots.size(); r++)
 				{
-					pHashes[i]->Final(pbDigest);
-					if (!bQuiet)
+					vector<shared_ptr<Hash>>& pRootHashes = inputRoots[r].pHashes;
+					LPCTSTR szRootArg = inputRoots[r].szArg.c_str();
+					if (r)
 					{
-						if (outputFiles[0])
+						if (!t_pOperation->m_pJsonOutput) _tprintf(_T("\n"));
+						if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], _T("\n"));
+					}
+
+					// call Final method for each hash in  the pHashes vector and display the result
+					for (size_t i = 0; i < pRootHashes.size(); i++)
+					{
+						pRootHashes[i]->Final(pbDigest);
+						if (!bQuiet)
 						{
-							_ftprintf(*outputFiles[0], __T("%s hash of \"%s\" (%d bytes) = "),
-								pHashes[i]->GetID(),
-								GetFileName(argv[1]),
-								pHashes[i]->GetHashSize());
+							if (t_pOperation->m_outputFiles[0])
+							{
+								_ftprintf(*t_pOperation->m_outputFiles[0], __T("%s hash of \"%s\" (%d bytes) = "),
+									pRootHashes[i]->GetID(),
+									GetFileName(szRootArg),
+									pRootHashes[i]->GetHashSize());
+							}
+							if (inputRoots.size() > 1)
+								_tprintf(_T("%s of \"%s\" (%d bytes) = "), pRootHashes[i]->GetID(), szRootArg, pRootHashes[i]->GetHashSize());
+							else
+								_tprintf(_T("%s (%d bytes) = "), pRootHashes[i]->GetID(), pRootHashes[i]->GetHashSize());
 						}
-						_tprintf(_T("%s (%d bytes) = "), pHashes[i]->GetID(), pHashes[i]->GetHashSize());
-					}
 
-					// display hash in yellow
-					SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
+						// display hash in yellow
+						SetConsoleTextAttribute(g_hConsole, FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY);
 
-					ToHex(pbDigest, pHashes[i]->GetHashSize(), szDigestHex);
+						ToHex(pbDigest, pRootHashes[i]->GetHashSize(), szDigestHex);
 
-					_tprintf(szDigestHex);
-					if (outputFiles[0]) _ftprintf(*outputFiles[0], szDigestHex);
+						if (t_pOperation->m_pJsonOutput)
+							jsonDigests.push_back(ByteArray(pbDigest, pbDigest + pRootHashes[i]->GetHashSize()));
+						else
+							_tprintf(szDigestHex);
+						if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], szDigestHex);
+
+						if (bCopyToClipboard)
+							CopyToClipboard(szDigestHex);
 
-					if (bCopyToClipboard)
-						CopyToClipboard(szDigestHex);
+						// restore normal text color
+						SetConsoleTextAttribute(g_hConsole, g_wAttributes);
 
-					// restore normal text color
-					SetConsoleTextAttribute(g_hConsole, g_wAttributes);
+						if (i < (pRootHashes.size() - 1))
+						{
+							if (!t_pOperation->m_pJsonOutput) _tprintf(_T("\n"));
+							if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], _T("\n"));
+						}
+					}
 
-					if (i < (pHashes.size() - 1))
+					// with several inputs, the digests of each one have their own record
+					if (t_pOperation->m_pJsonOutput && (inputRoots.size() > 1))
 					{
-						_tprintf(_T("\n"));
-						if (outputFiles[0]) _ftprintf(*outputFiles[0], _T("\n"));
+						t_pOperation->m_pJsonOutput->AddRoot(szRootArg, pRootHashes, jsonDigests);
+						jsonDigests.clear();
 					}
 				}
 
 				SecureZeroMemory(szDigestHex, sizeof(szDigestHex));
 			}
 
-			_tprintf(_T("\n"));
-			if (outputFiles[0]) _ftprintf(*outputFiles[0], _T("\n"));
+			if (!t_pOperation->m_pJsonOutput) _tprintf(_T("\n"));
+			if (t_pOperation->m_outputFiles[0]) _ftprintf(*t_pOperation->m_outputFiles[0], _T("\n"));
 
 			SecureZeroMemory(pbDigest, sizeof(pbDigest));
 		}
@@ -3873,13 +11899,34 @@ int _tmain(int argc, _TCHAR* argv[])
 	}
 	else
 	{
-		if (wcslen(g_szLastErrorMsg.c_str()))
-			ShowErrorDirect(g_szLastErrorMsg.c_str());
+		if (wcslen(t_pOperation->m_szLastErrorMsg.c_str()))
+			ShowErrorDirect(t_pOperation->m_szLastErrorMsg.c_str());
+	}
+
+	if (t_pOperation->m_pJsonOutput)
+	{
+		LPCWSTR szStatus = (dwError == NO_ERROR) ? (t_pOperation->m_bMismatchFound ? L"mismatch" : L"ok") : ((dwError == (DWORD)-7) ? L"mismatch" : L"error");
+		t_pOperation->m_pJsonOutput->AddSummary(szStatus, dwError, pHashes, jsonDigests, (dwError == NO_ERROR) ? wstring() : t_pOperation->m_szLastErrorMsg);
+		delete t_pOperation->m_pJsonOutput;
+		t_pOperation->m_pJsonOutput = NULL;
+	}
+
+	if (g_pCheckpoint)
+	{
+		if (dwError == NO_ERROR)
+		{
+			if (bResumed && !bQuiet)
+				_tprintf(_T("%llu files already processed before the interruption were skipped.\n"), g_pCheckpoint->GetSkippedCount());
+			g_pCheckpoint->Remove();
+		}
+		delete g_pCheckpoint;
+		g_pCheckpoint = NULL;
 	}
 
-	SecureZeroMemory(g_pbBuffer, sizeof(g_pbBuffer));
+	SecureZeroMemory(t_pbBuffer, sizeof(t_pbBuffer));
 
 
 	WaitForExit(bDontWait);
 	return dwError;
 }
+#endif
@@ -0,0 +1,102 @@
+/*
+* libdirhash: C interface to the DirHash hashing engine so that it can be embedded
+* in other programs without paying the start-up cost of DirHash for each request.
+*
+* Copyright (c) 2010-2024 Mounir IDRASSI <mounir.idrassi@idrix.fr>. All rights reserved.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+*
+*/
+
+#ifndef DIRHASH_LIB_H
+#define DIRHASH_LIB_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* values returned by DirHashCompute. Other values are the system error code of the failed operation */
+#define DIRHASH_OK							0
+#define DIRHASH_ERROR_FILE_NOT_FOUND		2		/* the input doesn't exist or is neither a file nor a directory */
+#define DIRHASH_ERROR_INVALID_DATA			13		/* the SUM file to verify against is invalid or uses another digest size */
+#define DIRHASH_ERROR_INVALID_PARAMETER		87		/* invalid argument or unsupported hash algorithm */
+#define DIRHASH_ERROR_INSUFFICIENT_BUFFER	122		/* the digest buffer is too small, *pcbDigest holds the needed size */
+#define DIRHASH_ERROR_CANCELLED				1223	/* the operation was stopped by DirHashCancel */
+#define DIRHASH_ERROR_MISMATCH				0xFFFFFFF9	/* verification failed: a digest is different or a SUM entry was not found */
+#define DIRHASH_ERROR_FILE					0xFFFFFFFF	/* a file couldn't be read, see the error callback */
+
+/* flags of DIRHASH_OPTIONS, equivalent to the command line switches of DirHash */
+#define DIRHASH_FLAG_SUM				0x00000001	/* -sum: report the digests of each file instead of computing a global digest */
+#define DIRHASH_FLAG_THREADS			0x00000002	/* -threads: hash files using the worker threads of the library (only with DIRHASH_FLAG_SUM) */
+#define DIRHASH_FLAG_HASHNAMES			0x00000004	/* -hashnames */
+#define DIRHASH_FLAG_STRIPNAMES			0x00000008	/* -stripnames */
+#define DIRHASH_FLAG_NOFOLLOW			0x00000010	/* -nofollow */
+#define DIRHASH_FLAG_SKIPERROR			0x00000020	/* -skipError */
+#define DIRHASH_FLAG_MSCRYPTO			0x00000040	/* -mscrypto */
+#define DIRHASH_FLAG_LARGESTFIRST		0x00000080	/* -largestFirst (only with DIRHASH_FLAG_THREADS) */
+
+typedef struct _DIRHASH_OPTIONS
+{
+	const wchar_t* szHashAlgo;			/* "SHA256", "Blake3,SHA256", ... NULL means Blake3 */
+	unsigned int flags;					/* DIRHASH_FLAG_* */
+	const wchar_t* const* pszExclude;	/* -exclude patterns */
+	size_t excludeCount;
+	const wchar_t* const* pszOnly;		/* -only patterns */
+	size_t onlyCount;
+	const wchar_t* szVerifyFile;		/* -verify: SUM file (text or binary) to verify against, implies DIRHASH_FLAG_SUM */
+	const wchar_t* szCacheFile;			/* -cache: digests cache file, used with DIRHASH_FLAG_SUM. It stays opened by the context.
+										   DIRHASH_ERROR_INVALID_PARAMETER is returned if it is combined with DIRHASH_FLAG_HASHNAMES */
+} DIRHASH_OPTIONS;
+
+typedef struct _DIRHASH_FILE_RESULT
+{
+	const wchar_t* szPath;
+	unsigned long long size;
+	const wchar_t* szStatus;			/* "ok", "mismatch", "cached", ... same values as the "status" of -json */
+	double durationMs;
+	size_t digestsCount;				/* one digest per algorithm with DIRHASH_FLAG_SUM, 0 otherwise */
+	const wchar_t* const* pszHashIds;
+	const unsigned char* const* pbDigests;
+	const int* pcbDigests;
+	const unsigned char* pbExpectedDigest;	/* digest read from the SUM file when verifying, NULL otherwise */
+	int cbExpectedDigest;
+} DIRHASH_FILE_RESULT;
+
+/* the callbacks of an operation are never called concurrently, but they can be called from the worker threads */
+typedef void (*DIRHASH_FILE_CALLBACK)(void* pUserData, const DIRHASH_FILE_RESULT* pResult);
+typedef void (*DIRHASH_ERROR_CALLBACK)(void* pUserData, const wchar_t* szPath, unsigned int errorCode, const wchar_t* szMessage);
+
+typedef struct _DIRHASH_CONTEXT* DIRHASH_CONTEXT;
+
+/*
+ * A context keeps the hash objects of the last algorithms used and the cache file between calls. The
+ * worker threads are shared by all contexts: they are started by the first call using DIRHASH_FLAG_THREADS
+ * and stopped when the last context is destroyed. Different contexts can be used by several threads at the same time,
+ * while the calls using the same context are serialized. Relative paths are resolved against the current directory
+ * of the process when the first context is created.
+ */
+DIRHASH_CONTEXT DirHashCreateContext(void);
+void DirHashDestroyContext(DIRHASH_CONTEXT hContext);
+
+/*
+ * Hash the file or the directory szPath. Without DIRHASH_FLAG_SUM, the digests of all algorithms are
+ * concatenated in pbDigest: *pcbDigest holds the size of the buffer on input and the size of the digests
+ * on output. pbDigest and pcbDigest can be NULL with DIRHASH_FLAG_SUM.
+ */
+unsigned int DirHashCompute(DIRHASH_CONTEXT hContext, const wchar_t* szPath, const DIRHASH_OPTIONS* pOptions,
+	DIRHASH_FILE_CALLBACK pfnFileCallback, DIRHASH_ERROR_CALLBACK pfnErrorCallback, void* pUserData,
+	unsigned char* pbDigest, size_t* pcbDigest);
+
+/* stop the operation running with hContext. It can be called from any thread, including from a callback */
+void DirHashCancel(DIRHASH_CONTEXT hContext);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
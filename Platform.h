@@ -0,0 +1,653 @@
+/*
+* Platform layer used to build DirHash on POSIX systems (Linux).
+*
+* It provides the subset of the Win32 API and of the Microsoft C runtime that DirHash.cpp relies on,
+* implemented natively in PlatformPosix.cpp on top of POSIX (openat/fstatat/getdents64, pread, pthreads).
+* Strings stay wchar_t based: file names are converted from/to UTF-8 at the system call boundary.
+*
+* Copyright (c) 2010-2024 Mounir IDRASSI <mounir.idrassi@idrix.fr>. All rights reserved.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+*
+*/
+
+#ifndef DIRHASH_PLATFORM_H
+#define DIRHASH_PLATFORM_H
+
+#ifdef _WIN32
+#error "Platform.h is only used for non-Windows builds"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <mm_malloc.h>
+#endif
+
+/* calling conventions and annotations */
+#define WINAPI
+#define CALLBACK
+#define _In_
+#define _In_opt_
+#define _Outptr_
+
+#define __int64 long long
+#define UNREFERENCED_PARAMETER(P)	(void)(P)
+
+/* the ARM code paths of DirHash.cpp are selected using the MSVC architecture macros */
+#if defined(__aarch64__) && !defined(_M_ARM64)
+#define _M_ARM64 1
+#elif defined(__arm__) && !defined(_M_ARM)
+#define _M_ARM 1
+#endif
+
+/* basic types, with the sizes they have on Windows */
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef unsigned int UINT;
+typedef int INT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint16_t USHORT;
+typedef uint8_t UCHAR;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef uint64_t DWORD64;
+typedef uintptr_t ULONG_PTR;
+typedef uintptr_t DWORD_PTR;
+typedef intptr_t LONG_PTR;
+typedef size_t SIZE_T;
+typedef uint64_t KAFFINITY;
+typedef int32_t NTSTATUS;
+typedef int32_t HRESULT;
+typedef int32_t LSTATUS;
+
+typedef BOOL* PBOOL;
+typedef BYTE* PBYTE;
+typedef BYTE* LPBYTE;
+typedef const BYTE* LPCBYTE;
+typedef UCHAR* PUCHAR;
+typedef WORD* PWORD;
+typedef DWORD* PDWORD;
+typedef DWORD* LPDWORD;
+typedef ULONG* PULONG;
+typedef LONG* PLONG;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+
+typedef void* HANDLE;
+typedef HANDLE* PHANDLE;
+typedef void* HMODULE;
+typedef void* FARPROC;
+typedef void* BCRYPT_ALG_HANDLE;
+typedef void* BCRYPT_HASH_HANDLE;
+
+typedef char CHAR;
+typedef char* LPSTR;
+typedef const char* LPCSTR;
+typedef wchar_t WCHAR;
+typedef wchar_t TCHAR;
+typedef wchar_t _TCHAR;
+typedef WCHAR* PWSTR;
+typedef WCHAR* LPWSTR;
+typedef const WCHAR* PCWSTR;
+typedef const WCHAR* LPCWSTR;
+typedef LPWSTR LPTSTR;
+typedef LPCWSTR LPCTSTR;
+
+typedef union
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union
+{
+	struct
+	{
+		DWORD LowPart;
+		DWORD HighPart;
+	};
+	ULONGLONG QuadPart;
+} ULARGE_INTEGER, *PULARGE_INTEGER;
+
+typedef struct
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME, *PFILETIME, *LPFILETIME;
+
+/* constants */
+#define TRUE	1
+#define FALSE	0
+#define MAX_PATH	260
+#define INFINITE	0xFFFFFFFF
+#define INVALID_HANDLE_VALUE	((HANDLE)(LONG_PTR)-1)
+#define INVALID_FILE_ATTRIBUTES	((DWORD)-1)
+#define MEMORY_ALLOCATION_ALIGNMENT	16
+
+#define __T(x)	L##x
+#define _T(x)	__T(x)
+#define TEXT(x)	__T(x)
+#define ARRAYSIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#define _countof(a)	ARRAYSIZE(a)
+
+#define S_OK			((HRESULT)0)
+#define E_INVALIDARG	((HRESULT)0x80070057)
+#define E_OUTOFMEMORY	((HRESULT)0x8007000E)
+#define STRSAFE_E_INSUFFICIENT_BUFFER	((HRESULT)0x8007007A)
+#define STATUS_SUCCESS	((NTSTATUS)0)
+#define STATUS_NOT_SUPPORTED	((NTSTATUS)0xC00000BB)
+
+#define NO_ERROR						0L
+#define ERROR_SUCCESS					0L
+#define ERROR_FILE_NOT_FOUND			2L
+#define ERROR_PATH_NOT_FOUND			3L
+#define ERROR_TOO_MANY_OPEN_FILES		4L
+#define ERROR_ACCESS_DENIED				5L
+#define ERROR_INVALID_HANDLE			6L
+#define ERROR_NOT_ENOUGH_MEMORY			8L
+#define ERROR_INVALID_DATA				13L
+#define ERROR_NO_MORE_FILES				18L
+#define ERROR_WRITE_FAULT				29L
+#define ERROR_READ_FAULT				30L
+#define ERROR_SHARING_VIOLATION			32L
+#define ERROR_LOCK_VIOLATION			33L
+#define ERROR_HANDLE_EOF				38L
+#define ERROR_NOT_SUPPORTED				50L
+#define ERROR_FILE_EXISTS				80L
+#define ERROR_INVALID_PARAMETER			87L
+#define ERROR_BROKEN_PIPE				109L
+#define ERROR_DISK_FULL					112L
+#define ERROR_INSUFFICIENT_BUFFER		122L
+#define ERROR_MOD_NOT_FOUND				126L
+#define ERROR_PROC_NOT_FOUND			127L
+#define ERROR_DIR_NOT_EMPTY				145L
+#define ERROR_BUSY						170L
+#define ERROR_ALREADY_EXISTS			183L
+#define ERROR_FILENAME_EXCED_RANGE		206L
+#define ERROR_DIRECTORY					267L
+#define ERROR_NO_UNICODE_TRANSLATION	1113L
+#define ERROR_NOT_FOUND					1168L
+#define ERROR_CANCELLED					1223L
+#define ERROR_CANT_RESOLVE_FILENAME		1921L
+/* errno values without a Win32 equivalent are reported with the customer bit set */
+#define ERROR_POSIX_BASE				0x20000000L
+
+#define WAIT_OBJECT_0	0
+#define WAIT_TIMEOUT	258
+#define WAIT_FAILED		((DWORD)0xFFFFFFFF)
+
+#define FOREGROUND_BLUE			0x0001
+#define FOREGROUND_GREEN		0x0002
+#define FOREGROUND_RED			0x0004
+#define FOREGROUND_INTENSITY	0x0008
+
+#define GENERIC_READ	0x80000000
+#define GENERIC_WRITE	0x40000000
+#define FILE_READ_EA			0x0008
+#define FILE_READ_ATTRIBUTES	0x0080
+
+#define FILE_SHARE_READ		0x00000001
+#define FILE_SHARE_WRITE	0x00000002
+#define FILE_SHARE_DELETE	0x00000004
+
+#define CREATE_NEW			1
+#define CREATE_ALWAYS		2
+#define OPEN_EXISTING		3
+#define OPEN_ALWAYS			4
+#define TRUNCATE_EXISTING	5
+
+#define FILE_ATTRIBUTE_READONLY			0x00000001
+#define FILE_ATTRIBUTE_DIRECTORY		0x00000010
+#define FILE_ATTRIBUTE_ARCHIVE			0x00000020
+#define FILE_ATTRIBUTE_NORMAL			0x00000080
+#define FILE_ATTRIBUTE_REPARSE_POINT	0x00000400
+
+/* reparse tags returned in dwReserved0 by the enumeration. Only symbolic links exist on POSIX */
+#define IO_REPARSE_TAG_MOUNT_POINT		0xA0000003L
+#define IO_REPARSE_TAG_SYMLINK			0xA000000CL
+
+#define FIND_FIRST_EX_LARGE_FETCH		0x00000002
+
+#define FILE_FLAG_WRITE_THROUGH			0x80000000
+#define FILE_FLAG_NO_BUFFERING			0x20000000
+#define FILE_FLAG_RANDOM_ACCESS			0x10000000
+#define FILE_FLAG_SEQUENTIAL_SCAN		0x08000000
+#define FILE_FLAG_BACKUP_SEMANTICS		0x02000000
+#define FILE_FLAG_OPEN_REPARSE_POINT	0x00200000
+
+#define FILE_BEGIN		0
+#define FILE_CURRENT	1
+#define FILE_END		2
+
+#define LOCKFILE_FAIL_IMMEDIATELY	0x00000001
+#define LOCKFILE_EXCLUSIVE_LOCK		0x00000002
+
+#define MOVEFILE_REPLACE_EXISTING	0x00000001
+#define MOVEFILE_WRITE_THROUGH		0x00000008
+
+#define PAGE_READONLY	0x02
+#define FILE_MAP_READ	0x0004
+
+#define CP_ACP		0
+#define CP_UTF8		65001
+
+#define STD_INPUT_HANDLE	((DWORD)-10)
+#define STD_OUTPUT_HANDLE	((DWORD)-11)
+#define STD_ERROR_HANDLE	((DWORD)-12)
+
+#define CTRL_C_EVENT		0
+#define CTRL_BREAK_EVENT	1
+#define CTRL_CLOSE_EVENT	2
+
+#define STARTF_USESTDHANDLES	0x00000100
+
+#define PATHCCH_ALLOW_LONG_PATHS	0x00000001
+
+#define MS_PRIMITIVE_PROVIDER	L"Microsoft Primitive Provider"
+#define BCRYPT_OBJECT_LENGTH	L"ObjectLength"
+#define BCRYPT_MD5_ALGORITHM	L"MD5"
+#define BCRYPT_SHA1_ALGORITHM	L"SHA1"
+#define BCRYPT_SHA256_ALGORITHM	L"SHA256"
+#define BCRYPT_SHA384_ALGORITHM	L"SHA384"
+#define BCRYPT_SHA512_ALGORITHM	L"SHA512"
+#define ALG_CLASS_HASH	(4 << 13)
+#define ALG_TYPE_ANY	0
+
+#define _O_U8TEXT	0x40000
+#define _S_IFDIR	0x4000
+#define _S_IFREG	0x8000
+
+/* structures */
+typedef struct
+{
+	DWORD nLength;
+	LPVOID lpSecurityDescriptor;
+	BOOL bInheritHandle;
+} SECURITY_ATTRIBUTES, *PSECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+typedef struct
+{
+	ULONG_PTR Internal;
+	ULONG_PTR InternalHigh;
+	union
+	{
+		struct
+		{
+			DWORD Offset;
+			DWORD OffsetHigh;
+		};
+		PVOID Pointer;
+	};
+	HANDLE hEvent;
+} OVERLAPPED, *LPOVERLAPPED;
+
+typedef struct
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	DWORD dwReserved0;
+	DWORD dwReserved1;
+	WCHAR cFileName[MAX_PATH];
+	WCHAR cAlternateFileName[14];
+} WIN32_FIND_DATAW, *PWIN32_FIND_DATAW, *LPWIN32_FIND_DATAW;
+typedef WIN32_FIND_DATAW WIN32_FIND_DATA;
+typedef LPWIN32_FIND_DATAW LPWIN32_FIND_DATA;
+
+typedef enum
+{
+	FindExInfoStandard = 0,
+	FindExInfoBasic = 1
+} FINDEX_INFO_LEVELS;
+
+typedef enum
+{
+	FindExSearchNameMatch = 0
+} FINDEX_SEARCH_OPS;
+
+typedef struct
+{
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD dwVolumeSerialNumber;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+	DWORD nNumberOfLinks;
+	DWORD nFileIndexHigh;
+	DWORD nFileIndexLow;
+} BY_HANDLE_FILE_INFORMATION, *LPBY_HANDLE_FILE_INFORMATION;
+
+typedef enum
+{
+	FileBasicInfo = 0
+} FILE_INFO_BY_HANDLE_CLASS;
+
+typedef struct
+{
+	LARGE_INTEGER CreationTime;
+	LARGE_INTEGER LastAccessTime;
+	LARGE_INTEGER LastWriteTime;
+	LARGE_INTEGER ChangeTime;
+	DWORD FileAttributes;
+} FILE_BASIC_INFO;
+
+typedef struct
+{
+	WORD X;
+	WORD Y;
+} COORD;
+
+typedef struct
+{
+	short Left;
+	short Top;
+	short Right;
+	short Bottom;
+} SMALL_RECT;
+
+typedef struct
+{
+	COORD dwSize;
+	COORD dwCursorPosition;
+	WORD wAttributes;
+	SMALL_RECT srWindow;
+	COORD dwMaximumWindowSize;
+} CONSOLE_SCREEN_BUFFER_INFO;
+
+typedef struct
+{
+	KAFFINITY Mask;
+	WORD Group;
+	WORD Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+typedef struct
+{
+	DWORD dwPageSize;
+	DWORD dwNumberOfProcessors;
+	DWORD dwAllocationGranularity;
+} SYSTEM_INFO, *LPSYSTEM_INFO;
+
+typedef struct
+{
+	DWORD cb;
+	LPWSTR lpReserved;
+	LPWSTR lpDesktop;
+	LPWSTR lpTitle;
+	DWORD dwX;
+	DWORD dwY;
+	DWORD dwXSize;
+	DWORD dwYSize;
+	DWORD dwXCountChars;
+	DWORD dwYCountChars;
+	DWORD dwFillAttribute;
+	DWORD dwFlags;
+	WORD wShowWindow;
+	WORD cbReserved2;
+	LPBYTE lpReserved2;
+	HANDLE hStdInput;
+	HANDLE hStdOutput;
+	HANDLE hStdError;
+} STARTUPINFOW, *LPSTARTUPINFOW;
+
+typedef struct
+{
+	HANDLE hProcess;
+	HANDLE hThread;
+	DWORD dwProcessId;
+	DWORD dwThreadId;
+} PROCESS_INFORMATION, *LPPROCESS_INFORMATION;
+
+/* recursive mutex, like a Windows critical section */
+typedef struct
+{
+	pthread_mutex_t mutex;
+} CRITICAL_SECTION, *LPCRITICAL_SECTION;
+
+/* interlocked singly linked list. Push and pop are LIFO, like on Windows */
+typedef struct _SLIST_ENTRY
+{
+	struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct
+{
+	PSLIST_ENTRY Next;
+	volatile int Lock;
+	USHORT Depth;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+struct _stat64
+{
+	unsigned short st_mode; /* _S_IFDIR or _S_IFREG */
+	long long st_size;
+};
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpThreadParameter);
+typedef BOOL (WINAPI *PHANDLER_ROUTINE)(DWORD dwCtrlType);
+
+/* errors */
+DWORD GetLastError();
+void SetLastError(DWORD dwErrCode);
+DWORD ErrorFromErrno(int err);
+
+/* handles, files and directories */
+BOOL CloseHandle(HANDLE hObject);
+HANDLE CreateFileW(LPCWSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile);
+BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped);
+BOOL WriteFile(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite, LPDWORD lpNumberOfBytesWritten, LPOVERLAPPED lpOverlapped);
+BOOL FlushFileBuffers(HANDLE hFile);
+BOOL GetFileSizeEx(HANDLE hFile, PLARGE_INTEGER lpFileSize);
+BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER liDistanceToMove, PLARGE_INTEGER lpNewFilePointer, DWORD dwMoveMethod);
+BOOL SetEndOfFile(HANDLE hFile);
+BOOL GetFileInformationByHandle(HANDLE hFile, LPBY_HANDLE_FILE_INFORMATION lpFileInformation);
+BOOL GetFileInformationByHandleEx(HANDLE hFile, FILE_INFO_BY_HANDLE_CLASS FileInformationClass, LPVOID lpFileInformation, DWORD dwBufferSize);
+BOOL LockFileEx(HANDLE hFile, DWORD dwFlags, DWORD dwReserved, DWORD nNumberOfBytesToLockLow, DWORD nNumberOfBytesToLockHigh, LPOVERLAPPED lpOverlapped);
+BOOL UnlockFileEx(HANDLE hFile, DWORD dwReserved, DWORD nNumberOfBytesToUnlockLow, DWORD nNumberOfBytesToUnlockHigh, LPOVERLAPPED lpOverlapped);
+HANDLE CreateFileMappingW(HANDLE hFile, LPSECURITY_ATTRIBUTES lpFileMappingAttributes, DWORD flProtect, DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCWSTR lpName);
+LPVOID MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap);
+BOOL UnmapViewOfFile(LPCVOID lpBaseAddress);
+HANDLE FindFirstFileW(LPCWSTR lpFileName, LPWIN32_FIND_DATAW lpFindFileData);
+HANDLE FindFirstFileExW(LPCWSTR lpFileName, FINDEX_INFO_LEVELS fInfoLevelId, LPVOID lpFindFileData, FINDEX_SEARCH_OPS fSearchOp, LPVOID lpSearchFilter, DWORD dwAdditionalFlags);
+BOOL FindNextFileW(HANDLE hFindFile, LPWIN32_FIND_DATAW lpFindFileData);
+BOOL FindClose(HANDLE hFindFile);
+DWORD GetFileAttributesW(LPCWSTR lpFileName);
+BOOL DeleteFileW(LPCWSTR lpFileName);
+BOOL MoveFileExW(LPCWSTR lpExistingFileName, LPCWSTR lpNewFileName, DWORD dwFlags);
+BOOL CreateDirectoryW(LPCWSTR lpPathName, LPSECURITY_ATTRIBUTES lpSecurityAttributes);
+BOOL RemoveDirectoryW(LPCWSTR lpPathName);
+DWORD GetCurrentDirectoryW(DWORD nBufferLength, LPWSTR lpBuffer);
+DWORD GetModuleFileNameW(HMODULE hModule, LPWSTR lpFilename, DWORD nSize);
+
+#define CreateFile			CreateFileW
+#define FindFirstFile		FindFirstFileW
+#define FindFirstFileEx		FindFirstFileExW
+#define FindNextFile		FindNextFileW
+#define DeleteFile			DeleteFileW
+#define GetModuleFileName	GetModuleFileNameW
+
+/* there is no dynamic loading of system DLLs: callers fall back to the portable code path */
+HMODULE GetModuleHandleW(LPCWSTR lpModuleName);
+FARPROC GetProcAddress(HMODULE hModule, LPCSTR lpProcName);
+#define GetModuleHandle		GetModuleHandleW
+
+/* processes and threads */
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes, SIZE_T dwStackSize, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter, DWORD dwCreationFlags, LPDWORD lpThreadId);
+HANDLE GetCurrentThread();
+DWORD GetCurrentThreadId();
+BOOL CreateProcessW(LPCWSTR lpApplicationName, LPWSTR lpCommandLine, LPSECURITY_ATTRIBUTES lpProcessAttributes, LPSECURITY_ATTRIBUTES lpThreadAttributes, BOOL bInheritHandles, DWORD dwCreationFlags, LPVOID lpEnvironment, LPCWSTR lpCurrentDirectory, LPSTARTUPINFOW lpStartupInfo, LPPROCESS_INFORMATION lpProcessInformation);
+BOOL GetExitCodeProcess(HANDLE hProcess, LPDWORD lpExitCode);
+void GetSystemInfo(LPSYSTEM_INFO lpSystemInfo);
+void Sleep(DWORD dwMilliseconds);
+
+/* synchronization */
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset, BOOL bInitialState, LPCWSTR lpName);
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, DWORD dwMilliseconds);
+#define CreateEvent		CreateEventW
+
+void InitializeCriticalSection(LPCRITICAL_SECTION lpCriticalSection);
+void DeleteCriticalSection(LPCRITICAL_SECTION lpCriticalSection);
+
+inline void EnterCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	pthread_mutex_lock(&lpCriticalSection->mutex);
+}
+
+inline void LeaveCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	pthread_mutex_unlock(&lpCriticalSection->mutex);
+}
+
+inline LONG InterlockedIncrement(volatile LONG* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(volatile LONG* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchange(volatile LONG* Target, LONG Value) { return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchangeAdd(volatile LONG* Addend, LONG Value) { return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedOr(volatile LONG* Destination, LONG Value) { return __atomic_fetch_or(Destination, Value, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedCompareExchange(volatile LONG* Destination, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+inline LONGLONG InterlockedIncrement64(volatile LONGLONG* Addend) { return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+inline LONGLONG InterlockedDecrement64(volatile LONGLONG* Addend) { return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST); }
+inline LONGLONG InterlockedExchangeAdd64(volatile LONGLONG* Addend, LONGLONG Value) { return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST); }
+inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG* Destination, LONGLONG Exchange, LONGLONG Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+void InitializeSListHead(PSLIST_HEADER ListHead);
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY ListEntry);
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER ListHead);
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER ListHead);
+USHORT QueryDepthSList(PSLIST_HEADER ListHead);
+
+/* time */
+BOOL QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency);
+ULONGLONG GetTickCount64();
+void GetSystemTimeAsFileTime(LPFILETIME lpSystemTimeAsFileTime);
+
+/* console: attributes are rendered with ANSI escape sequences when the output is a terminal */
+HANDLE GetStdHandle(DWORD nStdHandle);
+BOOL GetConsoleScreenBufferInfo(HANDLE hConsoleOutput, CONSOLE_SCREEN_BUFFER_INFO* lpConsoleScreenBufferInfo);
+BOOL SetConsoleTextAttribute(HANDLE hConsoleOutput, WORD wAttributes);
+BOOL SetConsoleTitleW(LPCWSTR lpConsoleTitle);
+UINT GetConsoleOutputCP();
+BOOL SetConsoleOutputCP(UINT wCodePageID);
+BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE HandlerRoutine, BOOL Add);
+#define SetConsoleTitle		SetConsoleTitleW
+
+/* configuration */
+DWORD GetPrivateProfileStringW(LPCWSTR lpAppName, LPCWSTR lpKeyName, LPCWSTR lpDefault, LPWSTR lpReturnedString, DWORD nSize, LPCWSTR lpFileName);
+
+/* paths */
+BOOL PathIsRelativeW(LPCWSTR pszPath);
+BOOL PathCanonicalizeW(LPWSTR pszBuf, LPCWSTR pszPath);
+LPWSTR PathCombineW(LPWSTR pszDest, LPCWSTR pszDir, LPCWSTR pszFile);
+BOOL PathMatchSpecW(LPCWSTR pszFile, LPCWSTR pszSpec);
+HRESULT PathAllocCanonicalize(PCWSTR pszPathIn, ULONG dwFlags, PWSTR* ppszPathOut);
+HRESULT PathAllocCombine(PCWSTR pszPathIn, PCWSTR pszMore, ULONG dwFlags, PWSTR* ppszPathOut);
+HRESULT PathCchSkipRoot(PCWSTR pszPath, PCWSTR* ppszRootEnd);
+#define PathCanonicalize	PathCanonicalizeW
+#define PathMatchSpec		PathMatchSpecW
+
+/* memory and strings */
+void* LocalFree(void* hMem);
+int MultiByteToWideChar(UINT CodePage, DWORD dwFlags, LPCSTR lpMultiByteStr, int cbMultiByte, LPWSTR lpWideCharStr, int cchWideChar);
+int WideCharToMultiByte(UINT CodePage, DWORD dwFlags, LPCWSTR lpWideCharStr, int cchWideChar, LPSTR lpMultiByteStr, int cbMultiByte, LPCSTR lpDefaultChar, PBOOL lpUsedDefaultChar);
+HRESULT StringCchCopyW(LPWSTR pszDest, size_t cchDest, LPCWSTR pszSrc);
+HRESULT StringCbCatW(LPWSTR pszDest, size_t cbDest, LPCWSTR pszSrc);
+
+inline void SecureZeroMemory(void* ptr, size_t cnt)
+{
+	volatile BYTE* p = (volatile BYTE*)ptr;
+	while (cnt--)
+		*p++ = 0;
+}
+
+inline int lstrlen(LPCWSTR lpString) { return lpString ? (int)wcslen(lpString) : 0; }
+inline LPWSTR lstrcpy(LPWSTR lpString1, LPCWSTR lpString2) { return wcscpy(lpString1, lpString2); }
+
+/* CNG hash primitives, backed by OpenSSL */
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE* phAlgorithm, LPCWSTR pszAlgId, LPCWSTR pszImplementation, ULONG dwFlags);
+NTSTATUS BCryptCloseAlgorithmProvider(BCRYPT_ALG_HANDLE hAlgorithm, ULONG dwFlags);
+NTSTATUS BCryptGetProperty(BCRYPT_ALG_HANDLE hObject, LPCWSTR pszProperty, PUCHAR pbOutput, ULONG cbOutput, ULONG* pcbResult, ULONG dwFlags);
+NTSTATUS BCryptCreateHash(BCRYPT_ALG_HANDLE hAlgorithm, BCRYPT_HASH_HANDLE* phHash, PUCHAR pbHashObject, ULONG cbHashObject, PUCHAR pbSecret, ULONG cbSecret, ULONG dwFlags);
+NTSTATUS BCryptHashData(BCRYPT_HASH_HANDLE hHash, PUCHAR pbInput, ULONG cbInput, ULONG dwFlags);
+NTSTATUS BCryptFinishHash(BCRYPT_HASH_HANDLE hHash, PUCHAR pbOutput, ULONG cbOutput, ULONG dwFlags);
+NTSTATUS BCryptDestroyHash(BCRYPT_HASH_HANDLE hHash);
+
+/* Microsoft C runtime */
+#define _tmain	wmain
+int wmain(int argc, wchar_t* argv[]);
+
+int _wcsicmp(const wchar_t* string1, const wchar_t* string2);
+int _wcsnicmp(const wchar_t* string1, const wchar_t* string2, size_t count);
+#define _tcsicmp	_wcsicmp
+#define _tcsnicmp	_wcsnicmp
+#define _tcscmp		wcscmp
+#define _tcslen		wcslen
+#define _wcsdup		wcsdup
+
+inline int _wtoi(const wchar_t* str) { return (int)wcstol(str, NULL, 10); }
+
+/* formatting functions take Microsoft format strings: %s and %c are wide, %S and %hs are narrow, %l is 32-bit */
+int _vscwprintf(const wchar_t* format, va_list argptr);
+int _vsnwprintf(wchar_t* buffer, size_t count, const wchar_t* format, va_list argptr);
+int _vftprintf(FILE* stream, const wchar_t* format, va_list argptr);
+int _ftprintf(FILE* stream, const wchar_t* format, ...);
+int _vtprintf(const wchar_t* format, va_list argptr);
+int _tprintf(const wchar_t* format, ...);
+
+/* text files are UTF-8 with "\n" line endings. A UTF-8 BOM is skipped when reading with "ccs=UTF-8" */
+FILE* _wfopen(const wchar_t* filename, const wchar_t* mode);
+#define _tfopen		_wfopen
+int _fileno(FILE* stream);
+intptr_t _get_osfhandle(int fd);
+long long _filelengthi64(int fd);
+int _setmode(int fd, int mode);
+int _wstat64(const wchar_t* path, struct _stat64* buffer);
+
+inline void* _aligned_malloc(size_t size, size_t alignment)
+{
+	void* p = NULL;
+	return (0 == posix_memalign(&p, (alignment < sizeof(void*)) ? sizeof(void*) : alignment, size)) ? p : NULL;
+}
+
+inline void _aligned_free(void* memblock) { free(memblock); }
+
+#if !defined(__x86_64__) && !defined(__i386__)
+inline void* _mm_malloc(size_t size, size_t alignment) { return _aligned_malloc(size, alignment); }
+inline void _mm_free(void* p) { _aligned_free(p); }
+#endif
+
+#endif /* DIRHASH_PLATFORM_H */
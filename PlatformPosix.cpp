@@ -0,0 +1,2165 @@
+/*
+* POSIX implementation of the platform layer declared in Platform.h.
+*
+* File names are wchar_t strings converted to UTF-8 at the system call boundary. Bytes that are not valid
+* UTF-8 are mapped to U+DC80..U+DCFF and back so that any file name can be enumerated and opened.
+*
+* Copyright (c) 2010-2024 Mounir IDRASSI <mounir.idrassi@idrix.fr>. All rights reserved.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+*
+*/
+
+#include "Platform.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+extern char** environ;
+
+// ---------------------------------------------
+// errors
+
+static thread_local DWORD t_lastError = 0;
+
+DWORD GetLastError()
+{
+	return t_lastError;
+}
+
+void SetLastError(DWORD dwErrCode)
+{
+	t_lastError = dwErrCode;
+}
+
+DWORD ErrorFromErrno(int err)
+{
+	switch (err)
+	{
+	case 0: return ERROR_SUCCESS;
+	case ENOENT: return ERROR_FILE_NOT_FOUND;
+	case EACCES:
+	case EPERM: return ERROR_ACCESS_DENIED;
+	case ENOTDIR: return ERROR_DIRECTORY;
+	case EEXIST: return ERROR_ALREADY_EXISTS;
+	case ENOMEM: return ERROR_NOT_ENOUGH_MEMORY;
+	case EINVAL: return ERROR_INVALID_PARAMETER;
+	case EBADF: return ERROR_INVALID_HANDLE;
+	case ENOSPC: return ERROR_DISK_FULL;
+	case EIO: return ERROR_READ_FAULT;
+	case EAGAIN: return ERROR_LOCK_VIOLATION;
+	case EMFILE:
+	case ENFILE: return ERROR_TOO_MANY_OPEN_FILES;
+	case ENAMETOOLONG: return ERROR_FILENAME_EXCED_RANGE;
+	case ENOTEMPTY: return ERROR_DIR_NOT_EMPTY;
+	case EBUSY: return ERROR_BUSY;
+	case ELOOP: return ERROR_CANT_RESOLVE_FILENAME;
+	case EPIPE: return ERROR_BROKEN_PIPE;
+	case EILSEQ: return ERROR_NO_UNICODE_TRANSLATION;
+	case ENOTSUP: return ERROR_NOT_SUPPORTED;
+	default: return ERROR_POSIX_BASE | (DWORD)err;
+	}
+}
+
+static BOOL FailWithErrno()
+{
+	SetLastError(ErrorFromErrno(errno));
+	return FALSE;
+}
+
+// ---------------------------------------------
+// UTF-8 conversions
+
+static void AppendUtf8(string& out, unsigned int c, bool bEscapeBytes)
+{
+	if (bEscapeBytes && (c >= 0xDC80) && (c <= 0xDCFF))
+		out += (char)(c - 0xDC00);
+	else if (c < 0x80)
+		out += (char)c;
+	else if (c < 0x800)
+	{
+		out += (char)(0xC0 | (c >> 6));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else if (c < 0x10000)
+	{
+		out += (char)(0xE0 | (c >> 12));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else
+	{
+		out += (char)(0xF0 | ((c >> 18) & 0x07));
+		out += (char)(0x80 | ((c >> 12) & 0x3F));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+}
+
+static string ToUtf8(const wchar_t* str, size_t len, bool bEscapeBytes)
+{
+	string out;
+	out.reserve(len);
+	for (size_t i = 0; i < len; i++)
+		AppendUtf8(out, (unsigned int)str[i], bEscapeBytes);
+	return out;
+}
+
+// invalid sequences are mapped to U+DC80..U+DCFF when bEscapeBytes is set, to U+FFFD otherwise
+static wstring FromUtf8(const char* str, size_t len, bool bEscapeBytes)
+{
+	wstring out;
+	out.reserve(len);
+	const unsigned char* p = (const unsigned char*)str;
+	const unsigned char* end = p + len;
+	while (p < end)
+	{
+		unsigned int c = *p;
+		size_t n = 0;
+		unsigned int minValue = 0;
+		if (c < 0x80)
+		{
+			out += (wchar_t)c;
+			p++;
+			continue;
+		}
+		else if ((c & 0xE0) == 0xC0) { n = 1; c &= 0x1F; minValue = 0x80; }
+		else if ((c & 0xF0) == 0xE0) { n = 2; c &= 0x0F; minValue = 0x800; }
+		else if ((c & 0xF8) == 0xF0) { n = 3; c &= 0x07; minValue = 0x10000; }
+
+		bool bValid = (n != 0) && ((size_t)(end - p) > n);
+		for (size_t i = 1; bValid && (i <= n); i++)
+		{
+			if ((p[i] & 0xC0) != 0x80)
+				bValid = false;
+			else
+				c = (c << 6) | (p[i] & 0x3F);
+		}
+		if (bValid && ((c < minValue) || (c > 0x10FFFF) || ((c >= 0xD800) && (c < 0xE000))))
+			bValid = false;
+
+		if (bValid)
+		{
+			out += (wchar_t)c;
+			p += n + 1;
+		}
+		else
+		{
+			out += bEscapeBytes ? (wchar_t)(0xDC00 + *p) : (wchar_t)0xFFFD;
+			p++;
+		}
+	}
+	return out;
+}
+
+static string PathToUtf8(LPCWSTR szPath)
+{
+	string path = ToUtf8(szPath, wcslen(szPath), true);
+	// "NUL" is the null device on Windows
+	if (path == "NUL")
+		path = "/dev/null";
+	return path;
+}
+
+int MultiByteToWideChar(UINT CodePage, DWORD dwFlags, LPCSTR lpMultiByteStr, int cbMultiByte, LPWSTR lpWideCharStr, int cchWideChar)
+{
+	UNREFERENCED_PARAMETER(CodePage);
+	UNREFERENCED_PARAMETER(dwFlags);
+	if (!lpMultiByteStr || (cchWideChar < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	size_t len = (cbMultiByte < 0) ? (strlen(lpMultiByteStr) + 1) : (size_t)cbMultiByte;
+	wstring out = FromUtf8(lpMultiByteStr, len, false);
+	if (!cchWideChar)
+		return (int)out.length();
+	if (out.length() > (size_t)cchWideChar)
+	{
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return 0;
+	}
+	memcpy(lpWideCharStr, out.data(), out.length() * sizeof(wchar_t));
+	return (int)out.length();
+}
+
+int WideCharToMultiByte(UINT CodePage, DWORD dwFlags, LPCWSTR lpWideCharStr, int cchWideChar, LPSTR lpMultiByteStr, int cbMultiByte, LPCSTR lpDefaultChar, PBOOL lpUsedDefaultChar)
+{
+	UNREFERENCED_PARAMETER(CodePage);
+	UNREFERENCED_PARAMETER(dwFlags);
+	UNREFERENCED_PARAMETER(lpDefaultChar);
+	if (lpUsedDefaultChar)
+		*lpUsedDefaultChar = FALSE;
+	if (!lpWideCharStr || (cbMultiByte < 0))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	size_t len = (cchWideChar < 0) ? (wcslen(lpWideCharStr) + 1) : (size_t)cchWideChar;
+	string out = ToUtf8(lpWideCharStr, len, true);
+	if (!cbMultiByte)
+		return (int)out.length();
+	if (out.length() > (size_t)cbMultiByte)
+	{
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return 0;
+	}
+	memcpy(lpMultiByteStr, out.data(), out.length());
+	return (int)out.length();
+}
+
+// ---------------------------------------------
+// handles
+//
+// File handles are file descriptors tagged with the lowest bit so that INVALID_HANDLE_VALUE (-1) decodes
+// to the invalid descriptor -1. Other handles point to a CHandleObject.
+
+enum HandleKind
+{
+	HANDLE_KIND_FIND,
+	HANDLE_KIND_EVENT,
+	HANDLE_KIND_THREAD,
+	HANDLE_KIND_PROCESS,
+	HANDLE_KIND_MAPPING
+};
+
+class CHandleObject
+{
+public:
+	HandleKind m_kind;
+	explicit CHandleObject(HandleKind kind) : m_kind(kind) {}
+	virtual ~CHandleObject() {}
+};
+
+static inline HANDLE FdToHandle(int fd)
+{
+	return (HANDLE)(((intptr_t)fd << 1) | 1);
+}
+
+static inline bool IsFdHandle(HANDLE h)
+{
+	return ((intptr_t)h & 1) != 0;
+}
+
+static inline int HandleToFd(HANDLE h)
+{
+	return IsFdHandle(h) ? (int)((intptr_t)h >> 1) : -1;
+}
+
+template <typename T> static T* HandleToObject(HANDLE h, HandleKind kind)
+{
+	if (!h || IsFdHandle(h) || (((CHandleObject*)h)->m_kind != kind))
+		return NULL;
+	return (T*)h;
+}
+
+// events, threads and processes share a single lock and condition variable: every state change is broadcast
+static pthread_mutex_t g_syncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_syncCond = PTHREAD_COND_INITIALIZER;
+
+class CEvent : public CHandleObject
+{
+public:
+	bool m_bManualReset;
+	bool m_bSignaled;
+	CEvent(bool bManualReset, bool bSignaled) : CHandleObject(HANDLE_KIND_EVENT), m_bManualReset(bManualReset), m_bSignaled(bSignaled) {}
+};
+
+class CThread : public CHandleObject
+{
+public:
+	pthread_t m_thread;
+	LPTHREAD_START_ROUTINE m_pRoutine;
+	LPVOID m_pParameter;
+	bool m_bFinished;
+	DWORD m_exitCode;
+	int m_refCount; // the handle and the running thread
+	CThread(LPTHREAD_START_ROUTINE pRoutine, LPVOID pParameter) : CHandleObject(HANDLE_KIND_THREAD), m_thread(), m_pRoutine(pRoutine), m_pParameter(pParameter), m_bFinished(false), m_exitCode(0), m_refCount(2) {}
+};
+
+class CProcess : public CHandleObject
+{
+public:
+	pid_t m_pid;
+	bool m_bFinished;
+	DWORD m_exitCode;
+	explicit CProcess(pid_t pid) : CHandleObject(HANDLE_KIND_PROCESS), m_pid(pid), m_bFinished(false), m_exitCode(0) {}
+};
+
+class CFind : public CHandleObject
+{
+public:
+	int m_fd;
+	vector<char> m_buffer;
+	size_t m_pos;
+	size_t m_len;
+	CFind(size_t cbBuffer) : CHandleObject(HANDLE_KIND_FIND), m_fd(-1), m_buffer(cbBuffer), m_pos(0), m_len(0) {}
+	~CFind() { if (m_fd >= 0) close(m_fd); }
+};
+
+class CMapping : public CHandleObject
+{
+public:
+	int m_fd;
+	ULONGLONG m_size;
+	CMapping(int fd, ULONGLONG size) : CHandleObject(HANDLE_KIND_MAPPING), m_fd(fd), m_size(size) {}
+};
+
+static void ReleaseThread(CThread* pThread)
+{
+	pthread_mutex_lock(&g_syncMutex);
+	bool bDelete = (--pThread->m_refCount == 0);
+	pthread_mutex_unlock(&g_syncMutex);
+	if (bDelete)
+		delete pThread;
+}
+
+BOOL CloseHandle(HANDLE hObject)
+{
+	if (!hObject || (hObject == INVALID_HANDLE_VALUE))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	if (IsFdHandle(hObject))
+	{
+		if (close(HandleToFd(hObject)) && (errno != EINTR))
+			return FailWithErrno();
+		return TRUE;
+	}
+
+	CHandleObject* pObject = (CHandleObject*)hObject;
+	if (pObject->m_kind == HANDLE_KIND_THREAD)
+		ReleaseThread((CThread*)pObject);
+	else
+		delete pObject;
+	return TRUE;
+}
+
+// ---------------------------------------------
+// files
+
+static inline ULONGLONG TimespecToFileTime(const struct timespec& ts)
+{
+	// FILETIME counts 100-nanosecond intervals since January 1, 1601 UTC
+	return (ULONGLONG)ts.tv_sec * 10000000ULL + (ULONGLONG)ts.tv_nsec / 100 + 116444736000000000ULL;
+}
+
+static inline void SetFileTime(FILETIME& ft, const struct timespec& ts)
+{
+	ULONGLONG value = TimespecToFileTime(ts);
+	ft.dwLowDateTime = (DWORD)value;
+	ft.dwHighDateTime = (DWORD)(value >> 32);
+}
+
+static inline DWORD AttributesFromMode(mode_t mode)
+{
+	return S_ISDIR(mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+}
+
+HANDLE CreateFileW(LPCWSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
+{
+	UNREFERENCED_PARAMETER(dwShareMode);
+	UNREFERENCED_PARAMETER(lpSecurityAttributes);
+	UNREFERENCED_PARAMETER(hTemplateFile);
+
+	int flags = O_CLOEXEC;
+	if ((dwDesiredAccess & GENERIC_READ) && (dwDesiredAccess & GENERIC_WRITE))
+		flags |= O_RDWR;
+	else if (dwDesiredAccess & GENERIC_WRITE)
+		flags |= O_WRONLY;
+	else if (dwDesiredAccess & GENERIC_READ)
+		flags |= O_RDONLY;
+	else
+		flags |= O_PATH; // attributes only: no read permission is needed
+
+	switch (dwCreationDisposition)
+	{
+	case CREATE_NEW: flags |= O_CREAT | O_EXCL; break;
+	case CREATE_ALWAYS: flags |= O_CREAT | O_TRUNC; break;
+	case OPEN_ALWAYS: flags |= O_CREAT; break;
+	case TRUNCATE_EXISTING: flags |= O_TRUNC; break;
+	default: break;
+	}
+
+	if (dwFlagsAndAttributes & FILE_FLAG_OPEN_REPARSE_POINT)
+		flags |= O_NOFOLLOW;
+
+	string path = PathToUtf8(lpFileName);
+	int fd;
+	do
+	{
+		fd = open(path.c_str(), flags, 0666);
+	} while ((fd < 0) && (errno == EINTR));
+
+	if (fd < 0)
+	{
+		SetLastError(((errno == EEXIST) && (dwCreationDisposition == CREATE_NEW)) ? ERROR_FILE_EXISTS : ErrorFromErrno(errno));
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (dwFlagsAndAttributes & FILE_FLAG_SEQUENTIAL_SCAN)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	else if (dwFlagsAndAttributes & FILE_FLAG_RANDOM_ACCESS)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+	SetLastError(ERROR_SUCCESS);
+	return FdToHandle(fd);
+}
+
+BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped)
+{
+	int fd = HandleToFd(hFile);
+	ssize_t cbRead;
+	do
+	{
+		if (lpOverlapped)
+			cbRead = pread(fd, lpBuffer, nNumberOfBytesToRead, (off_t)(((ULONGLONG)lpOverlapped->OffsetHigh << 32) | lpOverlapped->Offset));
+		else
+			cbRead = read(fd, lpBuffer, nNumberOfBytesToRead);
+	} while ((cbRead < 0) && (errno == EINTR));
+
+	if (lpNumberOfBytesRead)
+		*lpNumberOfBytesRead = (cbRead > 0) ? (DWORD)cbRead : 0;
+	if (cbRead < 0)
+		return FailWithErrno();
+	return TRUE;
+}
+
+BOOL WriteFile(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite, LPDWORD lpNumberOfBytesWritten, LPOVERLAPPED lpOverlapped)
+{
+	int fd = HandleToFd(hFile);
+	const BYTE* pbData = (const BYTE*)lpBuffer;
+	off_t offset = lpOverlapped ? (off_t)(((ULONGLONG)lpOverlapped->OffsetHigh << 32) | lpOverlapped->Offset) : 0;
+	DWORD cbWritten = 0;
+
+	while (cbWritten < nNumberOfBytesToWrite)
+	{
+		ssize_t cb;
+		if (lpOverlapped)
+			cb = pwrite(fd, pbData + cbWritten, nNumberOfBytesToWrite - cbWritten, offset + cbWritten);
+		else
+			cb = write(fd, pbData + cbWritten, nNumberOfBytesToWrite - cbWritten);
+		if (cb < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (lpNumberOfBytesWritten)
+				*lpNumberOfBytesWritten = cbWritten;
+			return FailWithErrno();
+		}
+		cbWritten += (DWORD)cb;
+	}
+
+	if (lpNumberOfBytesWritten)
+		*lpNumberOfBytesWritten = cbWritten;
+	return TRUE;
+}
+
+BOOL FlushFileBuffers(HANDLE hFile)
+{
+	if (fsync(HandleToFd(hFile)))
+		return FailWithErrno();
+	return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE hFile, PLARGE_INTEGER lpFileSize)
+{
+	struct stat st;
+	if (fstat(HandleToFd(hFile), &st))
+		return FailWithErrno();
+	lpFileSize->QuadPart = (LONGLONG)st.st_size;
+	return TRUE;
+}
+
+BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER liDistanceToMove, PLARGE_INTEGER lpNewFilePointer, DWORD dwMoveMethod)
+{
+	int whence = (dwMoveMethod == FILE_END) ? SEEK_END : ((dwMoveMethod == FILE_CURRENT) ? SEEK_CUR : SEEK_SET);
+	off_t pos = lseek(HandleToFd(hFile), (off_t)liDistanceToMove.QuadPart, whence);
+	if (pos < 0)
+		return FailWithErrno();
+	if (lpNewFilePointer)
+		lpNewFilePointer->QuadPart = (LONGLONG)pos;
+	return TRUE;
+}
+
+BOOL SetEndOfFile(HANDLE hFile)
+{
+	int fd = HandleToFd(hFile);
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if ((pos < 0) || ftruncate(fd, pos))
+		return FailWithErrno();
+	return TRUE;
+}
+
+BOOL GetFileInformationByHandle(HANDLE hFile, LPBY_HANDLE_FILE_INFORMATION lpFileInformation)
+{
+	struct stat st;
+	if (fstat(HandleToFd(hFile), &st))
+		return FailWithErrno();
+
+	memset(lpFileInformation, 0, sizeof(BY_HANDLE_FILE_INFORMATION));
+	lpFileInformation->dwFileAttributes = AttributesFromMode(st.st_mode);
+	SetFileTime(lpFileInformation->ftCreationTime, st.st_ctim);
+	SetFileTime(lpFileInformation->ftLastAccessTime, st.st_atim);
+	SetFileTime(lpFileInformation->ftLastWriteTime, st.st_mtim);
+	lpFileInformation->dwVolumeSerialNumber = (DWORD)st.st_dev;
+	lpFileInformation->nFileSizeHigh = (DWORD)((ULONGLONG)st.st_size >> 32);
+	lpFileInformation->nFileSizeLow = (DWORD)st.st_size;
+	lpFileInformation->nNumberOfLinks = (DWORD)st.st_nlink;
+	lpFileInformation->nFileIndexHigh = (DWORD)((ULONGLONG)st.st_ino >> 32);
+	lpFileInformation->nFileIndexLow = (DWORD)st.st_ino;
+	return TRUE;
+}
+
+BOOL GetFileInformationByHandleEx(HANDLE hFile, FILE_INFO_BY_HANDLE_CLASS FileInformationClass, LPVOID lpFileInformation, DWORD dwBufferSize)
+{
+	struct stat st;
+	if ((FileInformationClass != FileBasicInfo) || (dwBufferSize < sizeof(FILE_BASIC_INFO)))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if (fstat(HandleToFd(hFile), &st))
+		return FailWithErrno();
+
+	FILE_BASIC_INFO* pInfo = (FILE_BASIC_INFO*)lpFileInformation;
+	pInfo->CreationTime.QuadPart = (LONGLONG)TimespecToFileTime(st.st_ctim);
+	pInfo->LastAccessTime.QuadPart = (LONGLONG)TimespecToFileTime(st.st_atim);
+	pInfo->LastWriteTime.QuadPart = (LONGLONG)TimespecToFileTime(st.st_mtim);
+	pInfo->ChangeTime.QuadPart = (LONGLONG)TimespecToFileTime(st.st_ctim);
+	pInfo->FileAttributes = AttributesFromMode(st.st_mode);
+	return TRUE;
+}
+
+// byte range locks use open file description locks, which like Windows locks are owned by the handle
+static BOOL LockRange(HANDLE hFile, short type, bool bWait, DWORD lengthLow, DWORD lengthHigh, LPOVERLAPPED lpOverlapped)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = (off_t)(((ULONGLONG)lpOverlapped->OffsetHigh << 32) | lpOverlapped->Offset);
+	fl.l_len = (off_t)(((ULONGLONG)lengthHigh << 32) | lengthLow);
+	int ret;
+	do
+	{
+		ret = fcntl(HandleToFd(hFile), bWait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+	} while (ret && (errno == EINTR));
+	if (ret)
+		return FailWithErrno();
+	return TRUE;
+}
+
+BOOL LockFileEx(HANDLE hFile, DWORD dwFlags, DWORD dwReserved, DWORD nNumberOfBytesToLockLow, DWORD nNumberOfBytesToLockHigh, LPOVERLAPPED lpOverlapped)
+{
+	UNREFERENCED_PARAMETER(dwReserved);
+	return LockRange(hFile, (dwFlags & LOCKFILE_EXCLUSIVE_LOCK) ? F_WRLCK : F_RDLCK, !(dwFlags & LOCKFILE_FAIL_IMMEDIATELY), nNumberOfBytesToLockLow, nNumberOfBytesToLockHigh, lpOverlapped);
+}
+
+BOOL UnlockFileEx(HANDLE hFile, DWORD dwReserved, DWORD nNumberOfBytesToUnlockLow, DWORD nNumberOfBytesToUnlockHigh, LPOVERLAPPED lpOverlapped)
+{
+	UNREFERENCED_PARAMETER(dwReserved);
+	return LockRange(hFile, F_UNLCK, false, nNumberOfBytesToUnlockLow, nNumberOfBytesToUnlockHigh, lpOverlapped);
+}
+
+// size of each mapped view, needed by munmap
+static pthread_mutex_t g_viewsMutex = PTHREAD_MUTEX_INITIALIZER;
+static map<const void*, size_t>& g_views = *new map<const void*, size_t>();
+
+HANDLE CreateFileMappingW(HANDLE hFile, LPSECURITY_ATTRIBUTES lpFileMappingAttributes, DWORD flProtect, DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCWSTR lpName)
+{
+	UNREFERENCED_PARAMETER(lpFileMappingAttributes);
+	UNREFERENCED_PARAMETER(flProtect);
+	UNREFERENCED_PARAMETER(lpName);
+	ULONGLONG size = ((ULONGLONG)dwMaximumSizeHigh << 32) | dwMaximumSizeLow;
+	if (!size)
+	{
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize))
+			return NULL;
+		size = (ULONGLONG)fileSize.QuadPart;
+	}
+	if (!size)
+	{
+		// like on Windows, an empty file can't be mapped
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	return new CMapping(HandleToFd(hFile), size);
+}
+
+LPVOID MapViewOfFile(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+	UNREFERENCED_PARAMETER(dwDesiredAccess);
+	CMapping* pMapping = HandleToObject<CMapping>(hFileMappingObject, HANDLE_KIND_MAPPING);
+	ULONGLONG offset = ((ULONGLONG)dwFileOffsetHigh << 32) | dwFileOffsetLow;
+	if (!pMapping || (offset >= pMapping->m_size))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	size_t size = dwNumberOfBytesToMap ? dwNumberOfBytesToMap : (size_t)(pMapping->m_size - offset);
+	void* pView = mmap(NULL, size, PROT_READ, MAP_SHARED, pMapping->m_fd, (off_t)offset);
+	if (pView == MAP_FAILED)
+	{
+		FailWithErrno();
+		return NULL;
+	}
+	pthread_mutex_lock(&g_viewsMutex);
+	g_views[pView] = size;
+	pthread_mutex_unlock(&g_viewsMutex);
+	return pView;
+}
+
+BOOL UnmapViewOfFile(LPCVOID lpBaseAddress)
+{
+	size_t size = 0;
+	pthread_mutex_lock(&g_viewsMutex);
+	map<const void*, size_t>::iterator It = g_views.find(lpBaseAddress);
+	if (It != g_views.end())
+	{
+		size = It->second;
+		g_views.erase(It);
+	}
+	pthread_mutex_unlock(&g_viewsMutex);
+	if (!size)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	if (munmap((void*)lpBaseAddress, size))
+		return FailWithErrno();
+	return TRUE;
+}
+
+// ---------------------------------------------
+// directory enumeration
+
+struct linux_dirent64
+{
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+// getdents64 buffer sizes. FIND_FIRST_EX_LARGE_FETCH uses a larger one to list big directories with fewer calls
+#define FIND_BUFFER_SIZE			32768
+#define FIND_LARGE_BUFFER_SIZE		262144
+
+// query the attributes of an entry with statx. Only the fields used by the enumeration are requested and,
+// on network file systems, the cached attributes are used instead of asking the server for each entry
+static int StatEntry(int dirFd, const char* szName, int flags, struct stat* pst)
+{
+	struct statx stx;
+	if (statx(dirFd, szName, flags | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME, &stx))
+		return -1;
+	memset(pst, 0, sizeof(struct stat));
+	pst->st_mode = stx.stx_mode;
+	pst->st_size = (off_t)stx.stx_size;
+	pst->st_atim.tv_sec = stx.stx_atime.tv_sec;
+	pst->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	pst->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	pst->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	pst->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	pst->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+}
+
+// fill the next entry of the directory. Symbolic links are followed, like on Windows where the size and the
+// attributes returned for a link are those of the target. Entries other than files and directories are skipped.
+static BOOL ReadNextEntry(CFind* pFind, LPWIN32_FIND_DATAW lpFindFileData)
+{
+	for (;;)
+	{
+		if (pFind->m_pos >= pFind->m_len)
+		{
+			long cb;
+			do
+			{
+				cb = syscall(SYS_getdents64, pFind->m_fd, pFind->m_buffer.data(), pFind->m_buffer.size());
+			} while ((cb < 0) && (errno == EINTR));
+			if (cb < 0)
+				return FailWithErrno();
+			if (cb == 0)
+			{
+				SetLastError(ERROR_NO_MORE_FILES);
+				return FALSE;
+			}
+			pFind->m_pos = 0;
+			pFind->m_len = (size_t)cb;
+		}
+
+		const struct linux_dirent64* pEntry = (const struct linux_dirent64*)(pFind->m_buffer.data() + pFind->m_pos);
+		pFind->m_pos += pEntry->d_reclen;
+
+		struct stat st;
+		DWORD dwAttributes = 0, dwReparseTag = 0;
+		if ((pEntry->d_type == DT_LNK) || (pEntry->d_type == DT_UNKNOWN))
+		{
+			if (StatEntry(pFind->m_fd, pEntry->d_name, AT_SYMLINK_NOFOLLOW, &st))
+				continue;
+			if (S_ISLNK(st.st_mode))
+			{
+				dwAttributes |= FILE_ATTRIBUTE_REPARSE_POINT;
+				dwReparseTag = IO_REPARSE_TAG_SYMLINK;
+				// keep the link itself when its target doesn't exist
+				struct stat target;
+				if (0 == StatEntry(pFind->m_fd, pEntry->d_name, 0, &target))
+					st = target;
+				else
+					st.st_mode = S_IFREG | (st.st_mode & 0777);
+			}
+		}
+		else if ((pEntry->d_type != DT_REG) && (pEntry->d_type != DT_DIR))
+			continue;
+		else if (StatEntry(pFind->m_fd, pEntry->d_name, AT_SYMLINK_NOFOLLOW, &st))
+			continue;
+
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+
+		wstring name = FromUtf8(pEntry->d_name, strlen(pEntry->d_name), true);
+		if (name.length() >= ARRAYSIZE(lpFindFileData->cFileName))
+			continue;
+
+		memset(lpFindFileData, 0, sizeof(WIN32_FIND_DATAW));
+		lpFindFileData->dwFileAttributes = dwAttributes | AttributesFromMode(st.st_mode);
+		lpFindFileData->dwReserved0 = dwReparseTag;
+		SetFileTime(lpFindFileData->ftCreationTime, st.st_ctim);
+		SetFileTime(lpFindFileData->ftLastAccessTime, st.st_atim);
+		SetFileTime(lpFindFileData->ftLastWriteTime, st.st_mtim);
+		if (S_ISREG(st.st_mode))
+		{
+			lpFindFileData->nFileSizeHigh = (DWORD)((ULONGLONG)st.st_size >> 32);
+			lpFindFileData->nFileSizeLow = (DWORD)st.st_size;
+		}
+		memcpy(lpFindFileData->cFileName, name.c_str(), (name.length() + 1) * sizeof(wchar_t));
+		return TRUE;
+	}
+}
+
+HANDLE FindFirstFileW(LPCWSTR lpFileName, LPWIN32_FIND_DATAW lpFindFileData)
+{
+	return FindFirstFileExW(lpFileName, FindExInfoStandard, lpFindFileData, FindExSearchNameMatch, NULL, 0);
+}
+
+// the short names are never filled so FindExInfoBasic is the same as FindExInfoStandard
+HANDLE FindFirstFileExW(LPCWSTR lpFileName, FINDEX_INFO_LEVELS fInfoLevelId, LPVOID lpFindFileData, FINDEX_SEARCH_OPS fSearchOp, LPVOID lpSearchFilter, DWORD dwAdditionalFlags)
+{
+	UNREFERENCED_PARAMETER(fInfoLevelId);
+	UNREFERENCED_PARAMETER(fSearchOp);
+	UNREFERENCED_PARAMETER(lpSearchFilter);
+
+	// only "<dir>/*" patterns are used
+	wstring dir = lpFileName;
+	if (!dir.empty() && (dir[dir.length() - 1] == L'*'))
+		dir.erase(dir.length() - 1);
+	if ((dir.length() > 1) && (dir[dir.length() - 1] == L'/'))
+		dir.erase(dir.length() - 1);
+	if (dir.empty())
+		dir = L".";
+
+	CFind* pFind = new CFind((dwAdditionalFlags & FIND_FIRST_EX_LARGE_FETCH) ? FIND_LARGE_BUFFER_SIZE : FIND_BUFFER_SIZE);
+	pFind->m_fd = open(PathToUtf8(dir.c_str()).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (pFind->m_fd < 0)
+	{
+		DWORD dwError = (errno == ENOENT) ? ERROR_PATH_NOT_FOUND : ErrorFromErrno(errno);
+		delete pFind;
+		SetLastError(dwError);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	if (!ReadNextEntry(pFind, (LPWIN32_FIND_DATAW)lpFindFileData))
+	{
+		DWORD dwError = GetLastError();
+		delete pFind;
+		SetLastError((dwError == ERROR_NO_MORE_FILES) ? ERROR_FILE_NOT_FOUND : dwError);
+		return INVALID_HANDLE_VALUE;
+	}
+	return pFind;
+}
+
+BOOL FindNextFileW(HANDLE hFindFile, LPWIN32_FIND_DATAW lpFindFileData)
+{
+	CFind* pFind = HandleToObject<CFind>(hFindFile, HANDLE_KIND_FIND);
+	if (!pFind)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	return ReadNextEntry(pFind, lpFindFileData);
+}
+
+BOOL FindClose(HANDLE hFindFile)
+{
+	CFind* pFind = HandleToObject<CFind>(hFindFile, HANDLE_KIND_FIND);
+	if (!pFind)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	delete pFind;
+	return TRUE;
+}
+
+DWORD GetFileAttributesW(LPCWSTR lpFileName)
+{
+	string path = PathToUtf8(lpFileName);
+	struct stat st;
+	if (lstat(path.c_str(), &st))
+	{
+		FailWithErrno();
+		return INVALID_FILE_ATTRIBUTES;
+	}
+	if (S_ISLNK(st.st_mode))
+	{
+		struct stat target;
+		return FILE_ATTRIBUTE_REPARSE_POINT | ((0 == stat(path.c_str(), &target)) ? AttributesFromMode(target.st_mode) : FILE_ATTRIBUTE_NORMAL);
+	}
+	return AttributesFromMode(st.st_mode);
+}
+
+BOOL DeleteFileW(LPCWSTR lpFileName)
+{
+	if (unlink(PathToUtf8(lpFileName).c_str()))
+		return FailWithErrno();
+	return TRUE;
+}
+
+BOOL MoveFileExW(LPCWSTR lpExistingFileName, LPCWSTR lpNewFileName, DWORD dwFlags)
+{
+	string source = PathToUtf8(lpExistingFileName);
+	string target = PathToUtf8(lpNewFileName);
+	struct stat st;
+	if (!(dwFlags & MOVEFILE_REPLACE_EXISTING) && (0 == lstat(target.c_str(), &st)))
+	{
+		SetLastError(ERROR_ALREADY_EXISTS);
+		return FALSE;
+	}
+	if (rename(source.c_str(), target.c_str()))
+		return FailWithErrno();
+	if (dwFlags & MOVEFILE_WRITE_THROUGH)
+	{
+		// make the new directory entry durable
+		size_t pos = target.find_last_of('/');
+		string parent = (pos == string::npos) ? string(".") : ((pos == 0) ? string("/") : target.substr(0, pos));
+		int fd = open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			fsync(fd);
+			close(fd);
+		}
+	}
+	return TRUE;
+}
+
+BOOL CreateDirectoryW(LPCWSTR lpPathName, LPSECURITY_ATTRIBUTES lpSecurityAttributes)
+{
+	UNREFERENCED_PARAMETER(lpSecurityAttributes);
+	if (mkdir(PathToUtf8(lpPathName).c_str(), 0777))
+	{
+		SetLastError((errno == ENOENT) ? ERROR_PATH_NOT_FOUND : ErrorFromErrno(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL RemoveDirectoryW(LPCWSTR lpPathName)
+{
+	if (rmdir(PathToUtf8(lpPathName).c_str()))
+		return FailWithErrno();
+	return TRUE;
+}
+
+// copy a string to a caller buffer using the Win32 convention: required size including NUL if too small
+static DWORD CopyToBuffer(const wstring& value, LPWSTR lpBuffer, DWORD nBufferLength)
+{
+	if (!lpBuffer || (nBufferLength <= value.length()))
+		return (DWORD)value.length() + 1;
+	memcpy(lpBuffer, value.c_str(), (value.length() + 1) * sizeof(wchar_t));
+	return (DWORD)value.length();
+}
+
+DWORD GetCurrentDirectoryW(DWORD nBufferLength, LPWSTR lpBuffer)
+{
+	vector<char> buffer(4096);
+	while (!getcwd(buffer.data(), buffer.size()))
+	{
+		if (errno != ERANGE)
+		{
+			FailWithErrno();
+			return 0;
+		}
+		buffer.resize(buffer.size() * 2);
+	}
+	return CopyToBuffer(FromUtf8(buffer.data(), strlen(buffer.data()), true), lpBuffer, nBufferLength);
+}
+
+DWORD GetModuleFileNameW(HMODULE hModule, LPWSTR lpFilename, DWORD nSize)
+{
+	UNREFERENCED_PARAMETER(hModule);
+	char szPath[4096];
+	ssize_t len = readlink("/proc/self/exe", szPath, sizeof(szPath) - 1);
+	if ((len <= 0) || !nSize)
+	{
+		FailWithErrno();
+		return 0;
+	}
+	wstring path = FromUtf8(szPath, (size_t)len, true);
+	if (path.length() >= nSize)
+	{
+		// truncated, like on Windows
+		memcpy(lpFilename, path.c_str(), (nSize - 1) * sizeof(wchar_t));
+		lpFilename[nSize - 1] = 0;
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return nSize;
+	}
+	memcpy(lpFilename, path.c_str(), (path.length() + 1) * sizeof(wchar_t));
+	return (DWORD)path.length();
+}
+
+HMODULE GetModuleHandleW(LPCWSTR lpModuleName)
+{
+	UNREFERENCED_PARAMETER(lpModuleName);
+	SetLastError(ERROR_MOD_NOT_FOUND);
+	return NULL;
+}
+
+FARPROC GetProcAddress(HMODULE hModule, LPCSTR lpProcName)
+{
+	UNREFERENCED_PARAMETER(hModule);
+	UNREFERENCED_PARAMETER(lpProcName);
+	SetLastError(ERROR_PROC_NOT_FOUND);
+	return NULL;
+}
+
+// ---------------------------------------------
+// threads and processes
+
+static void* ThreadStart(void* pArg)
+{
+	CThread* pThread = (CThread*)pArg;
+	DWORD exitCode = pThread->m_pRoutine(pThread->m_pParameter);
+	pthread_mutex_lock(&g_syncMutex);
+	pThread->m_exitCode = exitCode;
+	pThread->m_bFinished = true;
+	pthread_cond_broadcast(&g_syncCond);
+	pthread_mutex_unlock(&g_syncMutex);
+	ReleaseThread(pThread);
+	return NULL;
+}
+
+HANDLE CreateThread(LPSECURITY_ATTRIBUTES lpThreadAttributes, SIZE_T dwStackSize, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter, DWORD dwCreationFlags, LPDWORD lpThreadId)
+{
+	UNREFERENCED_PARAMETER(lpThreadAttributes);
+	UNREFERENCED_PARAMETER(dwCreationFlags);
+	CThread* pThread = new CThread(lpStartAddress, lpParameter);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	// worker threads use large stack buffers: use at least the Windows default of 1 MB
+	pthread_attr_setstacksize(&attr, (dwStackSize > (1024 * 1024)) ? dwStackSize : (8 * 1024 * 1024));
+	int err = pthread_create(&pThread->m_thread, &attr, ThreadStart, pThread);
+	pthread_attr_destroy(&attr);
+	if (err)
+	{
+		delete pThread;
+		SetLastError(ErrorFromErrno(err));
+		return NULL;
+	}
+	if (lpThreadId)
+		*lpThreadId = 0;
+	return pThread;
+}
+
+HANDLE GetCurrentThread()
+{
+	// pseudo handle, like on Windows
+	return (HANDLE)(LONG_PTR)-2;
+}
+
+DWORD GetCurrentThreadId()
+{
+	return (DWORD)syscall(SYS_gettid);
+}
+
+// split a command line using the rules of the Microsoft C runtime
+static vector<string> SplitCommandLine(LPCWSTR szCommandLine)
+{
+	vector<string> args;
+	const wchar_t* p = szCommandLine;
+	for (;;)
+	{
+		while (*p == L' ' || *p == L'\t')
+			p++;
+		if (!*p)
+			break;
+
+		wstring arg;
+		bool bInQuotes = false;
+		while (*p && (bInQuotes || ((*p != L' ') && (*p != L'\t'))))
+		{
+			size_t backslashes = 0;
+			while (*p == L'\\')
+			{
+				backslashes++;
+				p++;
+			}
+			if (*p == L'"')
+			{
+				arg.append(backslashes / 2, L'\\');
+				if (backslashes % 2)
+					arg += L'"';
+				else if (bInQuotes && (p[1] == L'"'))
+				{
+					arg += L'"';
+					p++;
+				}
+				else
+					bInQuotes = !bInQuotes;
+				p++;
+			}
+			else
+			{
+				arg.append(backslashes, L'\\');
+				if (*p && (bInQuotes || ((*p != L' ') && (*p != L'\t'))))
+					arg += *p++;
+			}
+		}
+		args.push_back(ToUtf8(arg.c_str(), arg.length(), true));
+	}
+	return args;
+}
+
+BOOL CreateProcessW(LPCWSTR lpApplicationName, LPWSTR lpCommandLine, LPSECURITY_ATTRIBUTES lpProcessAttributes, LPSECURITY_ATTRIBUTES lpThreadAttributes, BOOL bInheritHandles, DWORD dwCreationFlags, LPVOID lpEnvironment, LPCWSTR lpCurrentDirectory, LPSTARTUPINFOW lpStartupInfo, LPPROCESS_INFORMATION lpProcessInformation)
+{
+	UNREFERENCED_PARAMETER(lpProcessAttributes);
+	UNREFERENCED_PARAMETER(lpThreadAttributes);
+	UNREFERENCED_PARAMETER(bInheritHandles);
+	UNREFERENCED_PARAMETER(dwCreationFlags);
+	UNREFERENCED_PARAMETER(lpEnvironment);
+
+	vector<string> args = SplitCommandLine(lpCommandLine);
+	if (args.empty() || lpCurrentDirectory)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	string application = lpApplicationName ? PathToUtf8(lpApplicationName) : args[0];
+	vector<char*> argv;
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back(&args[i][0]);
+	argv.push_back(NULL);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (lpStartupInfo && (lpStartupInfo->dwFlags & STARTF_USESTDHANDLES))
+	{
+		if (lpStartupInfo->hStdInput && (lpStartupInfo->hStdInput != INVALID_HANDLE_VALUE))
+			posix_spawn_file_actions_adddup2(&actions, HandleToFd(lpStartupInfo->hStdInput), STDIN_FILENO);
+		if (lpStartupInfo->hStdOutput && (lpStartupInfo->hStdOutput != INVALID_HANDLE_VALUE))
+			posix_spawn_file_actions_adddup2(&actions, HandleToFd(lpStartupInfo->hStdOutput), STDOUT_FILENO);
+		if (lpStartupInfo->hStdError && (lpStartupInfo->hStdError != INVALID_HANDLE_VALUE))
+			posix_spawn_file_actions_adddup2(&actions, HandleToFd(lpStartupInfo->hStdError), STDERR_FILENO);
+	}
+
+	pid_t pid;
+	int err = posix_spawnp(&pid, application.c_str(), &actions, NULL, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err)
+	{
+		SetLastError(ErrorFromErrno(err));
+		return FALSE;
+	}
+
+	lpProcessInformation->hProcess = new CProcess(pid);
+	lpProcessInformation->hThread = NULL;
+	lpProcessInformation->dwProcessId = (DWORD)pid;
+	lpProcessInformation->dwThreadId = 0;
+	return TRUE;
+}
+
+// must be called with g_syncMutex held
+static bool IsProcessFinished(CProcess* pProcess)
+{
+	if (!pProcess->m_bFinished)
+	{
+		int status;
+		if (pProcess->m_pid == waitpid(pProcess->m_pid, &status, WNOHANG))
+		{
+			pProcess->m_bFinished = true;
+			pProcess->m_exitCode = WIFEXITED(status) ? (DWORD)WEXITSTATUS(status) : (DWORD)(128 + WTERMSIG(status));
+		}
+	}
+	return pProcess->m_bFinished;
+}
+
+BOOL GetExitCodeProcess(HANDLE hProcess, LPDWORD lpExitCode)
+{
+	CProcess* pProcess = HandleToObject<CProcess>(hProcess, HANDLE_KIND_PROCESS);
+	if (!pProcess)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	pthread_mutex_lock(&g_syncMutex);
+	*lpExitCode = IsProcessFinished(pProcess) ? pProcess->m_exitCode : 259 /* STILL_ACTIVE */;
+	pthread_mutex_unlock(&g_syncMutex);
+	return TRUE;
+}
+
+void GetSystemInfo(LPSYSTEM_INFO lpSystemInfo)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	cpu_set_t cpus;
+	int count = 0;
+	if (0 == sched_getaffinity(0, sizeof(cpus), &cpus))
+		count = CPU_COUNT(&cpus);
+	if (count <= 0)
+		count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	lpSystemInfo->dwPageSize = (pageSize > 0) ? (DWORD)pageSize : 4096;
+	lpSystemInfo->dwNumberOfProcessors = (count > 0) ? (DWORD)count : 1;
+	lpSystemInfo->dwAllocationGranularity = lpSystemInfo->dwPageSize;
+}
+
+void Sleep(DWORD dwMilliseconds)
+{
+	struct timespec ts;
+	ts.tv_sec = dwMilliseconds / 1000;
+	ts.tv_nsec = (long)(dwMilliseconds % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) && (errno == EINTR));
+}
+
+// ---------------------------------------------
+// synchronization
+
+HANDLE CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes, BOOL bManualReset, BOOL bInitialState, LPCWSTR lpName)
+{
+	UNREFERENCED_PARAMETER(lpEventAttributes);
+	UNREFERENCED_PARAMETER(lpName);
+	return new CEvent(bManualReset ? true : false, bInitialState ? true : false);
+}
+
+static BOOL SetEventState(HANDLE hEvent, bool bSignaled)
+{
+	CEvent* pEvent = HandleToObject<CEvent>(hEvent, HANDLE_KIND_EVENT);
+	if (!pEvent)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	pthread_mutex_lock(&g_syncMutex);
+	if (pEvent->m_bSignaled != bSignaled)
+	{
+		pEvent->m_bSignaled = bSignaled;
+		if (bSignaled)
+			pthread_cond_broadcast(&g_syncCond);
+	}
+	pthread_mutex_unlock(&g_syncMutex);
+	return TRUE;
+}
+
+BOOL SetEvent(HANDLE hEvent)
+{
+	return SetEventState(hEvent, true);
+}
+
+BOOL ResetEvent(HANDLE hEvent)
+{
+	return SetEventState(hEvent, false);
+}
+
+// must be called with g_syncMutex held. bConsume resets auto-reset events
+static bool IsSignaled(HANDLE h, bool bConsume, bool& bPolled)
+{
+	if (!h || IsFdHandle(h))
+		return false;
+	CHandleObject* pObject = (CHandleObject*)h;
+	switch (pObject->m_kind)
+	{
+	case HANDLE_KIND_EVENT:
+	{
+		CEvent* pEvent = (CEvent*)pObject;
+		bool bRet = pEvent->m_bSignaled;
+		if (bRet && bConsume && !pEvent->m_bManualReset)
+			pEvent->m_bSignaled = false;
+		return bRet;
+	}
+	case HANDLE_KIND_THREAD:
+		return ((CThread*)pObject)->m_bFinished;
+	case HANDLE_KIND_PROCESS:
+		// process termination is not broadcast: it is polled
+		bPolled = true;
+		return IsProcessFinished((CProcess*)pObject);
+	default:
+		return false;
+	}
+}
+
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE* lpHandles, BOOL bWaitAll, DWORD dwMilliseconds)
+{
+	// like Windows, fail instead of waiting forever on a handle that can never be signaled
+	for (DWORD i = 0; i < nCount; i++)
+	{
+		if (!lpHandles[i] || (lpHandles[i] == INVALID_HANDLE_VALUE))
+		{
+			SetLastError(ERROR_INVALID_HANDLE);
+			return WAIT_FAILED;
+		}
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (dwMilliseconds != INFINITE)
+	{
+		deadline.tv_sec += dwMilliseconds / 1000;
+		deadline.tv_nsec += (long)(dwMilliseconds % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	DWORD dwRet = WAIT_TIMEOUT;
+	pthread_mutex_lock(&g_syncMutex);
+	for (;;)
+	{
+		bool bPolled = false;
+		if (bWaitAll)
+		{
+			DWORD i;
+			for (i = 0; i < nCount; i++)
+			{
+				if (!IsSignaled(lpHandles[i], false, bPolled))
+					break;
+			}
+			if (i == nCount)
+			{
+				for (i = 0; i < nCount; i++)
+					IsSignaled(lpHandles[i], true, bPolled);
+				dwRet = WAIT_OBJECT_0;
+				break;
+			}
+		}
+		else
+		{
+			DWORD i;
+			for (i = 0; i < nCount; i++)
+			{
+				if (IsSignaled(lpHandles[i], true, bPolled))
+					break;
+			}
+			if (i < nCount)
+			{
+				dwRet = WAIT_OBJECT_0 + i;
+				break;
+			}
+		}
+
+		struct timespec now, wakeup;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if ((dwMilliseconds != INFINITE) && ((now.tv_sec > deadline.tv_sec) || ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec >= deadline.tv_nsec))))
+			break;
+
+		wakeup = deadline;
+		if (bPolled || (dwMilliseconds == INFINITE))
+		{
+			// wake up regularly to poll processes and to be robust to clock changes
+			wakeup = now;
+			wakeup.tv_nsec += bPolled ? 10000000L : 500000000L;
+			if (wakeup.tv_nsec >= 1000000000L)
+			{
+				wakeup.tv_sec++;
+				wakeup.tv_nsec -= 1000000000L;
+			}
+			if ((dwMilliseconds != INFINITE) && ((wakeup.tv_sec > deadline.tv_sec) || ((wakeup.tv_sec == deadline.tv_sec) && (wakeup.tv_nsec > deadline.tv_nsec))))
+				wakeup = deadline;
+		}
+		pthread_cond_timedwait(&g_syncCond, &g_syncMutex, &wakeup);
+	}
+	pthread_mutex_unlock(&g_syncMutex);
+	return dwRet;
+}
+
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+	return WaitForMultipleObjects(1, &hHandle, TRUE, dwMilliseconds);
+}
+
+void InitializeCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&lpCriticalSection->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void DeleteCriticalSection(LPCRITICAL_SECTION lpCriticalSection)
+{
+	pthread_mutex_destroy(&lpCriticalSection->mutex);
+}
+
+static inline void LockSList(PSLIST_HEADER ListHead)
+{
+	while (__atomic_exchange_n(&ListHead->Lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(&ListHead->Lock, __ATOMIC_RELAXED))
+			sched_yield();
+	}
+}
+
+static inline void UnlockSList(PSLIST_HEADER ListHead)
+{
+	__atomic_store_n(&ListHead->Lock, 0, __ATOMIC_RELEASE);
+}
+
+void InitializeSListHead(PSLIST_HEADER ListHead)
+{
+	ListHead->Next = NULL;
+	ListHead->Lock = 0;
+	ListHead->Depth = 0;
+}
+
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER ListHead, PSLIST_ENTRY ListEntry)
+{
+	LockSList(ListHead);
+	PSLIST_ENTRY pFirst = ListHead->Next;
+	ListEntry->Next = pFirst;
+	ListHead->Next = ListEntry;
+	ListHead->Depth++;
+	UnlockSList(ListHead);
+	return pFirst;
+}
+
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER ListHead)
+{
+	LockSList(ListHead);
+	PSLIST_ENTRY pFirst = ListHead->Next;
+	if (pFirst)
+	{
+		ListHead->Next = pFirst->Next;
+		ListHead->Depth--;
+	}
+	UnlockSList(ListHead);
+	return pFirst;
+}
+
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER ListHead)
+{
+	LockSList(ListHead);
+	PSLIST_ENTRY pFirst = ListHead->Next;
+	ListHead->Next = NULL;
+	ListHead->Depth = 0;
+	UnlockSList(ListHead);
+	return pFirst;
+}
+
+USHORT QueryDepthSList(PSLIST_HEADER ListHead)
+{
+	return __atomic_load_n(&ListHead->Depth, __ATOMIC_RELAXED);
+}
+
+// ---------------------------------------------
+// time
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lpPerformanceCount->QuadPart = (LONGLONG)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency)
+{
+	lpFrequency->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+ULONGLONG GetTickCount64()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG)ts.tv_sec * 1000ULL + (ULONGLONG)ts.tv_nsec / 1000000ULL;
+}
+
+void GetSystemTimeAsFileTime(LPFILETIME lpSystemTimeAsFileTime)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	SetFileTime(*lpSystemTimeAsFileTime, ts);
+}
+
+// ---------------------------------------------
+// console
+
+HANDLE GetStdHandle(DWORD nStdHandle)
+{
+	switch (nStdHandle)
+	{
+	case STD_INPUT_HANDLE: return FdToHandle(STDIN_FILENO);
+	case STD_OUTPUT_HANDLE: return FdToHandle(STDOUT_FILENO);
+	case STD_ERROR_HANDLE: return FdToHandle(STDERR_FILENO);
+	default:
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return INVALID_HANDLE_VALUE;
+	}
+}
+
+BOOL GetConsoleScreenBufferInfo(HANDLE hConsoleOutput, CONSOLE_SCREEN_BUFFER_INFO* lpConsoleScreenBufferInfo)
+{
+	int fd = HandleToFd(hConsoleOutput);
+	if ((fd < 0) || !isatty(fd))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	struct winsize ws;
+	memset(&ws, 0, sizeof(ws));
+	if (ioctl(fd, TIOCGWINSZ, &ws) || !ws.ws_col)
+	{
+		ws.ws_col = 80;
+		ws.ws_row = 25;
+	}
+	memset(lpConsoleScreenBufferInfo, 0, sizeof(CONSOLE_SCREEN_BUFFER_INFO));
+	lpConsoleScreenBufferInfo->dwSize.X = ws.ws_col;
+	lpConsoleScreenBufferInfo->dwSize.Y = ws.ws_row;
+	lpConsoleScreenBufferInfo->srWindow.Right = (short)(ws.ws_col - 1);
+	lpConsoleScreenBufferInfo->srWindow.Bottom = (short)(ws.ws_row - 1);
+	lpConsoleScreenBufferInfo->dwMaximumWindowSize = lpConsoleScreenBufferInfo->dwSize;
+	lpConsoleScreenBufferInfo->wAttributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	return TRUE;
+}
+
+// text attributes are rendered with ANSI escape sequences, only when the output is a terminal
+BOOL SetConsoleTextAttribute(HANDLE hConsoleOutput, WORD wAttributes)
+{
+	static int isTerminal[3] = { -1, -1, -1 };
+	int fd = HandleToFd(hConsoleOutput);
+	if ((fd != STDOUT_FILENO) && (fd != STDERR_FILENO))
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	if (isTerminal[fd] < 0)
+		isTerminal[fd] = isatty(fd) ? 1 : 0;
+	if (!isTerminal[fd])
+		return TRUE;
+
+	FILE* stream = (fd == STDOUT_FILENO) ? stdout : stderr;
+	WORD color = wAttributes & (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+	if (color == (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE) && !(wAttributes & FOREGROUND_INTENSITY))
+		fputws(L"\x1b[0m", stream);
+	else
+	{
+		int ansi = ((color & FOREGROUND_RED) ? 1 : 0) + ((color & FOREGROUND_GREEN) ? 2 : 0) + ((color & FOREGROUND_BLUE) ? 4 : 0);
+		fwprintf(stream, L"\x1b[0;%dm", ((wAttributes & FOREGROUND_INTENSITY) ? 90 : 30) + ansi);
+	}
+	return TRUE;
+}
+
+BOOL SetConsoleTitleW(LPCWSTR lpConsoleTitle)
+{
+	UNREFERENCED_PARAMETER(lpConsoleTitle);
+	return TRUE;
+}
+
+UINT GetConsoleOutputCP()
+{
+	return CP_UTF8;
+}
+
+BOOL SetConsoleOutputCP(UINT wCodePageID)
+{
+	UNREFERENCED_PARAMETER(wCodePageID);
+	return TRUE;
+}
+
+static PHANDLER_ROUTINE g_pCtrlHandler = NULL;
+static sigset_t g_ctrlSignals;
+
+static void* CtrlSignalThread(void*)
+{
+	for (;;)
+	{
+		int sig = 0;
+		if (sigwait(&g_ctrlSignals, &sig))
+			continue;
+		PHANDLER_ROUTINE pHandler = g_pCtrlHandler;
+		if (pHandler && pHandler((sig == SIGINT) ? CTRL_C_EVENT : CTRL_CLOSE_EVENT))
+			continue;
+
+		// not handled: default processing terminates the process
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, sig);
+		signal(sig, SIG_DFL);
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		raise(sig);
+	}
+	return NULL;
+}
+
+BOOL SetConsoleCtrlHandler(PHANDLER_ROUTINE HandlerRoutine, BOOL Add)
+{
+	static bool bThreadStarted = false;
+	g_pCtrlHandler = Add ? HandlerRoutine : NULL;
+	if (Add && !bThreadStarted)
+	{
+		// signals are blocked in all threads created afterwards and delivered to a dedicated thread
+		sigemptyset(&g_ctrlSignals);
+		sigaddset(&g_ctrlSignals, SIGINT);
+		sigaddset(&g_ctrlSignals, SIGTERM);
+		sigaddset(&g_ctrlSignals, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &g_ctrlSignals, NULL);
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, CtrlSignalThread, NULL))
+		{
+			pthread_sigmask(SIG_UNBLOCK, &g_ctrlSignals, NULL);
+			return FALSE;
+		}
+		pthread_detach(thread);
+		bThreadStarted = true;
+	}
+	return TRUE;
+}
+
+// ---------------------------------------------
+// configuration
+
+static wstring Trim(const wstring& str)
+{
+	size_t start = str.find_first_not_of(L" \t\r\n");
+	if (start == wstring::npos)
+		return wstring();
+	size_t end = str.find_last_not_of(L" \t\r\n");
+	return str.substr(start, end - start + 1);
+}
+
+DWORD GetPrivateProfileStringW(LPCWSTR lpAppName, LPCWSTR lpKeyName, LPCWSTR lpDefault, LPWSTR lpReturnedString, DWORD nSize, LPCWSTR lpFileName)
+{
+	wstring value = lpDefault ? lpDefault : L"";
+	FILE* f = fopen(PathToUtf8(lpFileName).c_str(), "rb");
+	if (f)
+	{
+		string content;
+		char buffer[4096];
+		size_t cb;
+		while ((cb = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			content.append(buffer, cb);
+		fclose(f);
+		if ((content.length() >= 3) && (0 == memcmp(content.data(), "\xEF\xBB\xBF", 3)))
+			content.erase(0, 3);
+
+		wstring text = FromUtf8(content.data(), content.length(), false);
+		bool bInSection = false;
+		size_t pos = 0;
+		while (pos < text.length())
+		{
+			size_t eol = text.find(L'\n', pos);
+			if (eol == wstring::npos)
+				eol = text.length();
+			wstring line = Trim(text.substr(pos, eol - pos));
+			pos = eol + 1;
+
+			if (line.empty() || (line[0] == L';'))
+				continue;
+			if (line[0] == L'[')
+			{
+				size_t close = line.find(L']');
+				bInSection = (close != wstring::npos) && (0 == _wcsicmp(Trim(line.substr(1, close - 1)).c_str(), lpAppName));
+			}
+			else if (bInSection)
+			{
+				size_t equal = line.find(L'=');
+				if ((equal != wstring::npos) && (0 == _wcsicmp(Trim(line.substr(0, equal)).c_str(), lpKeyName)))
+				{
+					value = Trim(line.substr(equal + 1));
+					break;
+				}
+			}
+		}
+	}
+
+	if (!nSize)
+		return 0;
+	size_t len = (value.length() < nSize) ? value.length() : (nSize - 1);
+	memcpy(lpReturnedString, value.c_str(), len * sizeof(wchar_t));
+	lpReturnedString[len] = 0;
+	return (DWORD)len;
+}
+
+// ---------------------------------------------
+// paths. Canonicalization is lexical, like on Windows: "." and ".." are resolved without accessing the disk.
+
+static wstring CanonicalizePath(const wstring& path)
+{
+	bool bAbsolute = !path.empty() && (path[0] == L'/');
+	bool bTrailing = (path.length() > 1) && (path[path.length() - 1] == L'/');
+	vector<wstring> parts;
+	size_t pos = 0;
+	while (pos <= path.length())
+	{
+		size_t next = path.find(L'/', pos);
+		if (next == wstring::npos)
+			next = path.length();
+		wstring part = path.substr(pos, next - pos);
+		pos = next + 1;
+		if (part.empty() || (part == L"."))
+			continue;
+		if (part == L"..")
+		{
+			if (!parts.empty() && (parts.back() != L".."))
+				parts.pop_back();
+			else if (!bAbsolute)
+				parts.push_back(part);
+			continue;
+		}
+		parts.push_back(part);
+	}
+
+	wstring ret = bAbsolute ? L"/" : L"";
+	for (size_t i = 0; i < parts.size(); i++)
+	{
+		if (i)
+			ret += L'/';
+		ret += parts[i];
+	}
+	if (bTrailing && !parts.empty())
+		ret += L'/';
+	return ret;
+}
+
+static wstring CombinePath(LPCWSTR pszDir, LPCWSTR pszFile)
+{
+	if (!pszFile || !*pszFile)
+		return CanonicalizePath(pszDir ? pszDir : L"");
+	if ((pszFile[0] == L'/') || !pszDir || !*pszDir)
+		return CanonicalizePath(pszFile);
+	wstring path = pszDir;
+	if (path[path.length() - 1] != L'/')
+		path += L'/';
+	return CanonicalizePath(path + pszFile);
+}
+
+static HRESULT AllocString(const wstring& value, PWSTR* ppszOut)
+{
+	*ppszOut = (PWSTR)malloc((value.length() + 1) * sizeof(wchar_t));
+	if (!*ppszOut)
+		return E_OUTOFMEMORY;
+	memcpy(*ppszOut, value.c_str(), (value.length() + 1) * sizeof(wchar_t));
+	return S_OK;
+}
+
+BOOL PathIsRelativeW(LPCWSTR pszPath)
+{
+	return (pszPath && (pszPath[0] == L'/')) ? FALSE : TRUE;
+}
+
+BOOL PathCanonicalizeW(LPWSTR pszBuf, LPCWSTR pszPath)
+{
+	wstring path = CanonicalizePath(pszPath);
+	if (path.length() >= MAX_PATH)
+	{
+		SetLastError(ERROR_FILENAME_EXCED_RANGE);
+		return FALSE;
+	}
+	memcpy(pszBuf, path.c_str(), (path.length() + 1) * sizeof(wchar_t));
+	return TRUE;
+}
+
+LPWSTR PathCombineW(LPWSTR pszDest, LPCWSTR pszDir, LPCWSTR pszFile)
+{
+	wstring path = CombinePath(pszDir, pszFile);
+	if (path.length() >= MAX_PATH)
+	{
+		pszDest[0] = 0;
+		return NULL;
+	}
+	memcpy(pszDest, path.c_str(), (path.length() + 1) * sizeof(wchar_t));
+	return pszDest;
+}
+
+HRESULT PathAllocCanonicalize(PCWSTR pszPathIn, ULONG dwFlags, PWSTR* ppszPathOut)
+{
+	UNREFERENCED_PARAMETER(dwFlags);
+	return AllocString(CanonicalizePath(pszPathIn), ppszPathOut);
+}
+
+HRESULT PathAllocCombine(PCWSTR pszPathIn, PCWSTR pszMore, ULONG dwFlags, PWSTR* ppszPathOut)
+{
+	UNREFERENCED_PARAMETER(dwFlags);
+	return AllocString(CombinePath(pszPathIn, pszMore), ppszPathOut);
+}
+
+HRESULT PathCchSkipRoot(PCWSTR pszPath, PCWSTR* ppszRootEnd)
+{
+	if (!pszPath || (pszPath[0] != L'/'))
+		return E_INVALIDARG;
+	*ppszRootEnd = pszPath + 1;
+	return S_OK;
+}
+
+// case insensitive wildcard match with '*' and '?'
+static bool MatchWildcard(const wchar_t* name, const wchar_t* nameEnd, const wchar_t* spec, const wchar_t* specEnd)
+{
+	const wchar_t* starSpec = NULL;
+	const wchar_t* starName = NULL;
+	while (name < nameEnd)
+	{
+		if ((spec < specEnd) && (*spec == L'*'))
+		{
+			starSpec = ++spec;
+			starName = name;
+		}
+		else if ((spec < specEnd) && ((*spec == L'?') || (towlower(*spec) == towlower(*name))))
+		{
+			spec++;
+			name++;
+		}
+		else if (starSpec)
+		{
+			spec = starSpec;
+			name = ++starName;
+		}
+		else
+			return false;
+	}
+	while ((spec < specEnd) && (*spec == L'*'))
+		spec++;
+	return spec == specEnd;
+}
+
+BOOL PathMatchSpecW(LPCWSTR pszFile, LPCWSTR pszSpec)
+{
+	const wchar_t* nameEnd = pszFile + wcslen(pszFile);
+	const wchar_t* p = pszSpec;
+	while (*p)
+	{
+		while (*p == L' ')
+			p++;
+		const wchar_t* end = wcschr(p, L';');
+		if (!end)
+			end = p + wcslen(p);
+		const wchar_t* specEnd = end;
+		while ((specEnd > p) && (specEnd[-1] == L' '))
+			specEnd--;
+		// "*.*" matches every name, including names without extension
+		if (((specEnd - p) == 3) && (0 == wcsncmp(p, L"*.*", 3)))
+			return TRUE;
+		if ((specEnd > p) && MatchWildcard(pszFile, nameEnd, p, specEnd))
+			return TRUE;
+		p = *end ? end + 1 : end;
+	}
+	return FALSE;
+}
+
+// ---------------------------------------------
+// memory and strings
+
+void* LocalFree(void* hMem)
+{
+	free(hMem);
+	return NULL;
+}
+
+HRESULT StringCchCopyW(LPWSTR pszDest, size_t cchDest, LPCWSTR pszSrc)
+{
+	if (!cchDest)
+		return E_INVALIDARG;
+	size_t len = wcslen(pszSrc);
+	HRESULT hr = S_OK;
+	if (len >= cchDest)
+	{
+		len = cchDest - 1;
+		hr = STRSAFE_E_INSUFFICIENT_BUFFER;
+	}
+	memcpy(pszDest, pszSrc, len * sizeof(wchar_t));
+	pszDest[len] = 0;
+	return hr;
+}
+
+HRESULT StringCbCatW(LPWSTR pszDest, size_t cbDest, LPCWSTR pszSrc)
+{
+	size_t cchDest = cbDest / sizeof(wchar_t);
+	size_t len = wcslen(pszDest);
+	if (len >= cchDest)
+		return E_INVALIDARG;
+	return StringCchCopyW(pszDest + len, cchDest - len, pszSrc);
+}
+
+// ---------------------------------------------
+// CNG hash primitives, implemented with OpenSSL
+
+typedef struct
+{
+	const EVP_MD* md;
+} CNG_ALGORITHM;
+
+NTSTATUS BCryptOpenAlgorithmProvider(BCRYPT_ALG_HANDLE* phAlgorithm, LPCWSTR pszAlgId, LPCWSTR pszImplementation, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(pszImplementation);
+	UNREFERENCED_PARAMETER(dwFlags);
+	const EVP_MD* md = NULL;
+	if (0 == wcscmp(pszAlgId, BCRYPT_MD5_ALGORITHM))
+		md = EVP_md5();
+	else if (0 == wcscmp(pszAlgId, BCRYPT_SHA1_ALGORITHM))
+		md = EVP_sha1();
+	else if (0 == wcscmp(pszAlgId, BCRYPT_SHA256_ALGORITHM))
+		md = EVP_sha256();
+	else if (0 == wcscmp(pszAlgId, BCRYPT_SHA384_ALGORITHM))
+		md = EVP_sha384();
+	else if (0 == wcscmp(pszAlgId, BCRYPT_SHA512_ALGORITHM))
+		md = EVP_sha512();
+	if (!md)
+		return STATUS_NOT_SUPPORTED;
+	CNG_ALGORITHM* pAlgorithm = new CNG_ALGORITHM;
+	pAlgorithm->md = md;
+	*phAlgorithm = pAlgorithm;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptCloseAlgorithmProvider(BCRYPT_ALG_HANDLE hAlgorithm, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(dwFlags);
+	delete (CNG_ALGORITHM*)hAlgorithm;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptGetProperty(BCRYPT_ALG_HANDLE hObject, LPCWSTR pszProperty, PUCHAR pbOutput, ULONG cbOutput, ULONG* pcbResult, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(hObject);
+	UNREFERENCED_PARAMETER(dwFlags);
+	if (wcscmp(pszProperty, BCRYPT_OBJECT_LENGTH) || (cbOutput < sizeof(ULONG)))
+		return STATUS_NOT_SUPPORTED;
+	// the hash state is allocated by OpenSSL: the caller provided object buffer is not used
+	ULONG objectLength = 16;
+	memcpy(pbOutput, &objectLength, sizeof(ULONG));
+	*pcbResult = sizeof(ULONG);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptCreateHash(BCRYPT_ALG_HANDLE hAlgorithm, BCRYPT_HASH_HANDLE* phHash, PUCHAR pbHashObject, ULONG cbHashObject, PUCHAR pbSecret, ULONG cbSecret, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(pbHashObject);
+	UNREFERENCED_PARAMETER(cbHashObject);
+	UNREFERENCED_PARAMETER(pbSecret);
+	UNREFERENCED_PARAMETER(cbSecret);
+	UNREFERENCED_PARAMETER(dwFlags);
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, ((CNG_ALGORITHM*)hAlgorithm)->md, NULL))
+	{
+		EVP_MD_CTX_free(ctx);
+		return STATUS_NOT_SUPPORTED;
+	}
+	*phHash = ctx;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS BCryptHashData(BCRYPT_HASH_HANDLE hHash, PUCHAR pbInput, ULONG cbInput, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(dwFlags);
+	return EVP_DigestUpdate((EVP_MD_CTX*)hHash, pbInput, cbInput) ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS BCryptFinishHash(BCRYPT_HASH_HANDLE hHash, PUCHAR pbOutput, ULONG cbOutput, ULONG dwFlags)
+{
+	UNREFERENCED_PARAMETER(dwFlags);
+	EVP_MD_CTX* ctx = (EVP_MD_CTX*)hHash;
+	if (cbOutput != (ULONG)EVP_MD_CTX_size(ctx))
+		return STATUS_NOT_SUPPORTED;
+	return EVP_DigestFinal_ex(ctx, pbOutput, NULL) ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS BCryptDestroyHash(BCRYPT_HASH_HANDLE hHash)
+{
+	EVP_MD_CTX_free((EVP_MD_CTX*)hHash);
+	return STATUS_SUCCESS;
+}
+
+// ---------------------------------------------
+// Microsoft C runtime
+
+// ordinal comparison after ASCII case folding, like the C locale of the Microsoft runtime. Characters are
+// compared in UTF-16 order so that sorting is the same as on Windows for characters outside the BMP.
+static inline unsigned int CompareKey(wchar_t c)
+{
+	unsigned int u = (unsigned int)c;
+	if ((u >= L'A') && (u <= L'Z'))
+		return u + (L'a' - L'A');
+	if ((u >= 0xE000) && (u <= 0xFFFF))
+		return u + 0x200000;
+	return u;
+}
+
+int _wcsnicmp(const wchar_t* string1, const wchar_t* string2, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		unsigned int c1 = CompareKey(string1[i]);
+		unsigned int c2 = CompareKey(string2[i]);
+		if (c1 != c2)
+			return (c1 < c2) ? -1 : 1;
+		if (!c1)
+			break;
+	}
+	return 0;
+}
+
+int _wcsicmp(const wchar_t* string1, const wchar_t* string2)
+{
+	return _wcsnicmp(string1, string2, (size_t)-1);
+}
+
+// translate a Microsoft format string to the C99 one: %s and %c take wide strings, %S and %hs narrow ones,
+// I64 is 64-bit, I is pointer sized and l is 32-bit for integers like on Windows
+static wstring TranslateFormat(const wchar_t* format)
+{
+	wstring out;
+	out.reserve(wcslen(format) + 16);
+	const wchar_t* p = format;
+	while (*p)
+	{
+		if (*p != L'%')
+		{
+			out += *p++;
+			continue;
+		}
+		out += *p++;
+		if (*p == L'%')
+		{
+			out += *p++;
+			continue;
+		}
+		while (*p && wcschr(L"-+ #0", *p))
+			out += *p++;
+		while (*p && (iswdigit(*p) || (*p == L'*')))
+			out += *p++;
+		if (*p == L'.')
+		{
+			out += *p++;
+			while (*p && (iswdigit(*p) || (*p == L'*')))
+				out += *p++;
+		}
+
+		wstring length;
+		if ((p[0] == L'I') && (p[1] == L'6') && (p[2] == L'4'))
+		{
+			length = L"ll";
+			p += 3;
+		}
+		else if ((p[0] == L'I') && (p[1] == L'3') && (p[2] == L'2'))
+			p += 3;
+		else if (p[0] == L'I')
+		{
+			length = L"z";
+			p++;
+		}
+		else
+		{
+			while (*p && wcschr(L"hlLzjtw", *p))
+				length += *p++;
+		}
+
+		wchar_t conversion = *p;
+		if (!conversion)
+			break;
+		p++;
+		switch (conversion)
+		{
+		case L's':
+			out += ((length == L"h") ? L"s" : L"ls");
+			break;
+		case L'S':
+			out += ((length == L"l") || (length == L"w")) ? L"ls" : L"s";
+			break;
+		case L'c':
+			out += ((length == L"h") ? L"c" : L"lc");
+			break;
+		case L'C':
+			out += ((length == L"l") || (length == L"w")) ? L"lc" : L"c";
+			break;
+		case L'd': case L'i': case L'u': case L'x': case L'X': case L'o':
+			// long is 32-bit on Windows
+			out += ((length == L"l") ? L"" : length);
+			out += conversion;
+			break;
+		default:
+			out += length;
+			out += conversion;
+			break;
+		}
+	}
+	return out;
+}
+
+int _vscwprintf(const wchar_t* format, va_list argptr)
+{
+	wstring fmt = TranslateFormat(format);
+	vector<wchar_t> buffer(1024);
+	for (;;)
+	{
+		va_list args;
+		va_copy(args, argptr);
+		int ret = vswprintf(buffer.data(), buffer.size(), fmt.c_str(), args);
+		va_end(args);
+		if (ret >= 0)
+			return ret;
+		if (buffer.size() >= (64 * 1024 * 1024))
+			return -1;
+		buffer.resize(buffer.size() * 4);
+	}
+}
+
+int _vsnwprintf(wchar_t* buffer, size_t count, const wchar_t* format, va_list argptr)
+{
+	return vswprintf(buffer, count, TranslateFormat(format).c_str(), argptr);
+}
+
+int _vftprintf(FILE* stream, const wchar_t* format, va_list argptr)
+{
+	return vfwprintf(stream, TranslateFormat(format).c_str(), argptr);
+}
+
+int _ftprintf(FILE* stream, const wchar_t* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int ret = _vftprintf(stream, format, args);
+	va_end(args);
+	return ret;
+}
+
+int _vtprintf(const wchar_t* format, va_list argptr)
+{
+	return _vftprintf(stdout, format, argptr);
+}
+
+int _tprintf(const wchar_t* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int ret = _vftprintf(stdout, format, args);
+	va_end(args);
+	return ret;
+}
+
+// Text mode streams use the native conventions: UTF-8 without BOM and "\n" line endings. When reading with
+// "ccs=UTF-8", a leading BOM is skipped so that files written on Windows can be read. The "\r" of CRLF line
+// endings is left to the caller.
+FILE* _wfopen(const wchar_t* filename, const wchar_t* mode)
+{
+	wstring modeStr = mode;
+	size_t comma = modeStr.find(L',');
+	wstring flagsStr = modeStr.substr(0, comma);
+	bool bUtf8 = (comma != wstring::npos) && (modeStr.find(L"ccs=", comma) != wstring::npos);
+	bool bUpdate = (flagsStr.find(L'+') != wstring::npos);
+	string path = PathToUtf8(filename);
+
+	string narrowMode;
+	for (size_t i = 0; i < flagsStr.length(); i++)
+	{
+		if (wcschr(L"rwab+x", flagsStr[i]))
+			narrowMode += (char)flagsStr[i];
+	}
+	narrowMode += "e"; // O_CLOEXEC
+
+	if (!bUtf8 || (flagsStr.empty() ? true : (flagsStr[0] != L'r')))
+		return fopen(path.c_str(), narrowMode.c_str());
+
+	int fd = open(path.c_str(), (bUpdate ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	char bom[3];
+	ssize_t cb;
+	do
+	{
+		cb = read(fd, bom, sizeof(bom));
+	} while ((cb < 0) && (errno == EINTR));
+	if ((cb != 3) || memcmp(bom, "\xEF\xBB\xBF", 3))
+		lseek(fd, 0, SEEK_SET);
+
+	FILE* f = fdopen(fd, narrowMode.c_str());
+	if (!f)
+		close(fd);
+	return f;
+}
+
+int _fileno(FILE* stream)
+{
+	return fileno(stream);
+}
+
+intptr_t _get_osfhandle(int fd)
+{
+	return (intptr_t)FdToHandle(fd);
+}
+
+long long _filelengthi64(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st))
+		return -1;
+	return (long long)st.st_size;
+}
+
+int _setmode(int fd, int mode)
+{
+	UNREFERENCED_PARAMETER(fd);
+	UNREFERENCED_PARAMETER(mode);
+	// the standard streams are wide oriented and the locale is UTF-8
+	return 0x4000; // _O_TEXT
+}
+
+int _wstat64(const wchar_t* path, struct _stat64* buffer)
+{
+	struct stat st;
+	if (stat(PathToUtf8(path).c_str(), &st))
+		return -1;
+	buffer->st_mode = S_ISDIR(st.st_mode) ? _S_IFDIR : (S_ISREG(st.st_mode) ? _S_IFREG : 0);
+	buffer->st_size = (long long)st.st_size;
+	return 0;
+}
+
+#ifndef DIRHASH_LIBRARY
+int main(int argc, char* argv[])
+{
+	// wide character I/O is converted to UTF-8 whatever the user locale is
+	if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8"))
+		setlocale(LC_CTYPE, "");
+
+	vector<wstring> args;
+	vector<wchar_t*> wargv;
+	for (int i = 0; i < argc; i++)
+		args.push_back(FromUtf8(argv[i], strlen(argv[i]), true));
+	for (int i = 0; i < argc; i++)
+		wargv.push_back(&args[i][0]);
+	wargv.push_back(NULL);
+	return wmain(argc, wargv.data());
+}
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+# A -daemon started with -cache must not serve the digests of -hashnames requests from the cache: they depend on
+# the file names while cache entries are identified by the file ID.
+# Usage: DaemonCacheTest.sh DirHashPath WorkDirectory
+
+DIRHASH="$1"
+WORK="$2"
+
+fail()
+{
+	echo "$1" >&2
+	exit 1
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/tree/sub" || exit 1
+echo a > "$WORK/tree/a"
+echo b > "$WORK/tree/sub/b"
+# files modified within the last 2 seconds are not cached
+sleep 3
+
+"$DIRHASH" -daemon "$WORK/socket" -cache "$WORK/cache" -nologo -quiet &
+DAEMON_PID=$!
+trap 'kill $DAEMON_PID 2>/dev/null' EXIT
+i=0
+while [ ! -S "$WORK/socket" ]; do
+	i=$((i + 1))
+	[ $i -le 50 ] || fail "the daemon didn't start"
+	sleep 0.1
+done
+
+# the digests of the file records, in enumeration order
+digests()
+{
+	grep '"type":"file"' "$1" | sed 's/.*"digests":{\([^}]*\)}.*/\1/'
+}
+
+"$DIRHASH" -client "$WORK/socket" "$WORK/tree" -sum -hashnames > "$WORK/names.json" || fail "-sum -hashnames failed"
+"$DIRHASH" -client "$WORK/socket" "$WORK/tree" -sum -hashnames -stripnames > "$WORK/stripped.json" || fail "-sum -hashnames -stripnames failed"
+grep -q '"status":"cached"' "$WORK/names.json" "$WORK/stripped.json" && fail "-hashnames digests were taken from the cache"
+[ "$(digests "$WORK/names.json" | wc -l)" -eq 2 ] || fail "unexpected -hashnames records"
+[ "$(digests "$WORK/names.json")" != "$(digests "$WORK/stripped.json")" ] || fail "-stripnames didn't change the digests"
+
+# the cache is still used by the other requests
+"$DIRHASH" -client "$WORK/socket" "$WORK/tree" -sum > /dev/null || fail "-sum failed"
+"$DIRHASH" -client "$WORK/socket" "$WORK/tree" -sum > "$WORK/sum.json" || fail "-sum failed"
+[ "$(grep -c '"status":"cached"' "$WORK/sum.json")" -eq 2 ] || fail "-sum digests were not taken from the cache"
+
+"$DIRHASH" -client "$WORK/socket" -shutdown > /dev/null
+wait $DAEMON_PID
+trap - EXIT
+exit 0
@@ -0,0 +1,50 @@
+#!/bin/sh
+# A -daemon must serve the request of a client while a long request of another client is running instead of queuing
+# it behind the long one.
+# Usage: DaemonParallelTest.sh DirHashPath WorkDirectory
+
+DIRHASH="$1"
+WORK="$2"
+
+fail()
+{
+	echo "$1" >&2
+	exit 1
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/large" "$WORK/small/sub" || exit 1
+# sparse files: long to hash but they don't use disk space
+for i in 1 2 3 4 5 6 7 8; do
+	truncate -s 400M "$WORK/large/f$i" || exit 1
+done
+echo a > "$WORK/small/a"
+echo b > "$WORK/small/sub/b"
+
+"$DIRHASH" -daemon "$WORK/socket" -nologo -quiet &
+DAEMON_PID=$!
+trap 'kill $DAEMON_PID 2>/dev/null' EXIT
+i=0
+while [ ! -S "$WORK/socket" ]; do
+	i=$((i + 1))
+	[ $i -le 50 ] || fail "the daemon didn't start"
+	sleep 0.1
+done
+
+"$DIRHASH" -client "$WORK/socket" "$WORK/large" SHA512 -sum > "$WORK/large.json" &
+LARGE_PID=$!
+# let the daemon start the long request
+sleep 1
+kill -0 $LARGE_PID 2>/dev/null || fail "the long request completed too early to test the daemon"
+
+"$DIRHASH" -client "$WORK/socket" "$WORK/small" -sum > "$WORK/small.json" || fail "the short request failed"
+kill -0 $LARGE_PID 2>/dev/null || fail "the short request waited for the end of the long one"
+[ "$(grep -c '"type":"file"' "$WORK/small.json")" -eq 2 ] || fail "unexpected records for the short request"
+
+wait $LARGE_PID || fail "the long request failed"
+[ "$(grep -c '"type":"file"' "$WORK/large.json")" -eq 8 ] || fail "unexpected records for the long request"
+
+"$DIRHASH" -client "$WORK/socket" -shutdown > /dev/null
+wait $DAEMON_PID
+trap - EXIT
+exit 0
@@ -0,0 +1,46 @@
+#!/bin/sh
+# A -sum computation interrupted by SIGINT long before the periodic checkpoint must leave a checkpoint that -resume
+# uses to produce the same SUM file as an uninterrupted run.
+# Usage: InterruptResumeTest.sh DirHashPath WorkDirectory
+
+DIRHASH="$1"
+WORK="$2"
+
+fail()
+{
+	echo "$1" >&2
+	exit 1
+}
+
+rm -rf "$WORK"
+mkdir -p "$WORK/tree/sub" || exit 1
+# sparse files: long to hash but they don't use disk space
+for i in 1 2 3 4 5 6 7 8; do
+	truncate -s 200M "$WORK/tree/f$i" || exit 1
+	echo "$i" > "$WORK/tree/sub/s$i"
+done
+
+for THREADS in "" "-threads"; do
+	# the entries are sorted at the end with -threads
+	rm -f "$WORK/reference.sum" "$WORK/interrupted.sum" "$WORK/interrupted.sum.dirhash_checkpoint"
+	"$DIRHASH" "$WORK/tree" SHA512 -sum -t "$WORK/reference.sum" $THREADS -nologo -quiet -nowait || fail "the reference computation $THREADS failed"
+
+	"$DIRHASH" "$WORK/tree" SHA512 -sum -t "$WORK/interrupted.sum" $THREADS -nologo -quiet -nowait &
+	PID=$!
+	i=0
+	while [ ! -f "$WORK/interrupted.sum" ]; do
+		i=$((i + 1))
+		[ $i -le 50 ] || fail "the computation didn't start"
+		sleep 0.1
+	done
+	sleep 1
+	kill -INT $PID
+	wait $PID && fail "the computation $THREADS completed before being interrupted"
+	[ -f "$WORK/interrupted.sum.dirhash_checkpoint" ] || fail "no checkpoint written when interrupted $THREADS"
+
+	"$DIRHASH" "$WORK/tree" SHA512 -sum -t "$WORK/interrupted.sum" $THREADS -resume -nologo -quiet -nowait || fail "the resumed computation $THREADS failed"
+	[ ! -f "$WORK/interrupted.sum.dirhash_checkpoint" ] || fail "the checkpoint was kept after the resumed computation $THREADS"
+	cmp -s "$WORK/reference.sum" "$WORK/interrupted.sum" || fail "the resumed SUM file $THREADS differs from the reference"
+done
+
+exit 0
@@ -0,0 +1,265 @@
+/*
+* Tests of libdirhash, run by ctest. The first argument is a work directory that is
+* created again by each run.
+*
+* Copyright (c) 2010-2024 Mounir IDRASSI <mounir.idrassi@idrix.fr>. All rights reserved.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+* or FITNESS FOR A PARTICULAR PURPOSE.
+*
+*/
+
+#include "DirHashLib.h"
+#include <stdio.h>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+static int g_failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); g_failures++; } } while (0)
+
+typedef struct _FILE_RECORD
+{
+	wstring path;
+	wstring status;
+	string digestHex; // digest of the first algorithm
+} FILE_RECORD;
+
+static void CollectFile(void* pUserData, const DIRHASH_FILE_RESULT* pResult)
+{
+	FILE_RECORD record;
+	record.path = pResult->szPath;
+	record.status = pResult->szStatus;
+	for (int i = 0; pResult->digestsCount && (i < pResult->pcbDigests[0]); i++)
+	{
+		char szHex[3];
+		snprintf(szHex, sizeof(szHex), "%.2X", pResult->pbDigests[0][i]);
+		record.digestHex += szHex;
+	}
+	((vector<FILE_RECORD>*)pUserData)->push_back(record);
+}
+
+static unsigned int Compute(DIRHASH_CONTEXT hContext, const fs::path& input, const DIRHASH_OPTIONS& options, vector<FILE_RECORD>& records)
+{
+	records.clear();
+	return DirHashCompute(hContext, input.wstring().c_str(), &options, CollectFile, NULL, &records, NULL, NULL);
+}
+
+static void WriteFile(const fs::path& path, const string& content)
+{
+	ofstream f(path, ios::binary);
+	f << content;
+}
+
+#ifndef _WIN32
+// a plain SUM line whose path starts with ':' and looks like the metadata of an extended SUM line
+static void TestSumPathStartingWithColon(DIRHASH_CONTEXT hContext, const fs::path& work)
+{
+	const string name = ":5:0:00000000-0000000000000000:  a";
+	fs::path dir = work / "colon";
+	fs::create_directories(dir);
+	WriteFile(dir / name, "hello\n");
+
+	DIRHASH_OPTIONS options = {};
+	vector<FILE_RECORD> records;
+	options.flags = DIRHASH_FLAG_SUM;
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK(records.size() == 1);
+	if (records.size() != 1)
+		return;
+	string digestHex = records[0].digestHex;
+
+	// relative entries are resolved against the input directory
+	fs::path sumFile = work / "colon.sum";
+	wstring szSumFile = sumFile.wstring();
+	WriteFile(sumFile, digestHex + "  " + name + "\n");
+	options.szVerifyFile = szSumFile.c_str();
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK((records.size() == 1) && (records[0].status == L"ok"));
+
+	// the same path in an extended SUM line
+	WriteFile(sumFile, digestHex + ":6:0:00000000-0000000000000000  " + name + "\n");
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK((records.size() == 1) && (records[0].status == L"ok"));
+
+	// the recorded size is used
+	WriteFile(sumFile, digestHex + ":7:0:00000000-0000000000000000  " + name + "\n");
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_ERROR_MISMATCH);
+	CHECK((records.size() == 1) && (records[0].status == L"mismatch"));
+}
+#endif
+
+// cache entries can't hold the digests of -hashnames since they don't depend on the file names
+static void TestCacheWithHashNames(DIRHASH_CONTEXT hContext, const fs::path& work)
+{
+	fs::path dir = work / "names";
+	fs::create_directories(dir / "sub");
+	WriteFile(dir / "a", "a\n");
+	WriteFile(dir / "sub" / "b", "b\n");
+	// files modified within the last 2 seconds are not cached
+	this_thread::sleep_for(chrono::milliseconds(2500));
+
+	DIRHASH_OPTIONS options = {};
+	vector<FILE_RECORD> records;
+	wstring szCacheFile = (work / "names.cache").wstring();
+	options.flags = DIRHASH_FLAG_SUM;
+	options.szCacheFile = szCacheFile.c_str();
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK((records.size() == 2) && (records[0].status == L"cached") && (records[1].status == L"cached"));
+
+	options.flags = DIRHASH_FLAG_SUM | DIRHASH_FLAG_HASHNAMES;
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_ERROR_INVALID_PARAMETER);
+	CHECK(records.empty());
+	options.flags = DIRHASH_FLAG_SUM | DIRHASH_FLAG_HASHNAMES | DIRHASH_FLAG_STRIPNAMES;
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_ERROR_INVALID_PARAMETER);
+	CHECK(records.empty());
+
+	// without the cache, the digests depend on the names
+	vector<FILE_RECORD> strippedRecords;
+	options.szCacheFile = NULL;
+	CHECK(Compute(hContext, dir, options, strippedRecords) == DIRHASH_OK);
+	options.flags = DIRHASH_FLAG_SUM | DIRHASH_FLAG_HASHNAMES;
+	CHECK(Compute(hContext, dir, options, records) == DIRHASH_OK);
+	CHECK((records.size() == 2) && (strippedRecords.size() == 2));
+	for (size_t i = 0; (i < records.size()) && (i < strippedRecords.size()); i++)
+	{
+		CHECK((records[i].status == L"ok") && (strippedRecords[i].status == L"ok"));
+		CHECK(records[i].digestHex != strippedRecords[i].digestHex);
+	}
+}
+
+static bool CompareRecords(const FILE_RECORD& a, const FILE_RECORD& b)
+{
+	return a.path < b.path;
+}
+
+typedef struct _WAIT_STATE
+{
+	atomic<bool> bOtherDone;
+	bool bWaited;
+	bool bOverlapped;
+
+	_WAIT_STATE() : bOtherDone(false), bWaited(false), bOverlapped(false) {}
+} WAIT_STATE;
+
+// the first file waits for the end of the operation of another context
+static void WaitOtherContext(void* pUserData, const DIRHASH_FILE_RESULT*)
+{
+	WAIT_STATE* pState = (WAIT_STATE*)pUserData;
+	if (pState->bWaited)
+		return;
+	pState->bWaited = true;
+	for (int i = 0; (i < 1000) && !pState->bOtherDone; i++)
+		this_thread::sleep_for(chrono::milliseconds(10));
+	pState->bOverlapped = pState->bOtherDone;
+}
+
+// contexts used by different threads hash at the same time with their own options
+static void TestConcurrentContexts(DIRHASH_CONTEXT hContext, const fs::path& work)
+{
+	fs::path dir = work / "concurrent";
+	for (int i = 0; i < 200; i++)
+	{
+		fs::path sub = dir / ("d" + to_string(i % 10));
+		fs::create_directories(sub);
+		WriteFile(sub / ("f" + to_string(i)), string(1000 + i * 37, (char)('a' + i % 26)));
+		WriteFile(sub / ("f" + to_string(i) + ".skip"), to_string(i));
+	}
+
+	const wchar_t* pszExclude[] = { L"*.skip" };
+	DIRHASH_OPTIONS excludeOptions = {};
+	excludeOptions.flags = DIRHASH_FLAG_SUM | DIRHASH_FLAG_THREADS;
+	excludeOptions.pszExclude = pszExclude;
+	excludeOptions.excludeCount = 1;
+	DIRHASH_OPTIONS namesOptions = {};
+	namesOptions.flags = DIRHASH_FLAG_SUM | DIRHASH_FLAG_HASHNAMES;
+	namesOptions.szHashAlgo = L"SHA256";
+
+	vector<FILE_RECORD> excludeReference, namesReference;
+	CHECK(Compute(hContext, dir, excludeOptions, excludeReference) == DIRHASH_OK);
+	CHECK(Compute(hContext, dir, namesOptions, namesReference) == DIRHASH_OK);
+	CHECK((excludeReference.size() == 200) && (namesReference.size() == 400));
+	sort(excludeReference.begin(), excludeReference.end(), CompareRecords);
+	sort(namesReference.begin(), namesReference.end(), CompareRecords);
+
+	DIRHASH_CONTEXT hOtherContext = DirHashCreateContext();
+	for (int i = 0; i < 5; i++)
+	{
+		vector<FILE_RECORD> excludeRecords, namesRecords;
+		unsigned int excludeResult = DIRHASH_OK, namesResult = DIRHASH_OK;
+		thread excludeThread([&]() { excludeResult = Compute(hContext, dir, excludeOptions, excludeRecords); });
+		thread namesThread([&]() { namesResult = Compute(hOtherContext, dir, namesOptions, namesRecords); });
+		excludeThread.join();
+		namesThread.join();
+		sort(excludeRecords.begin(), excludeRecords.end(), CompareRecords);
+		sort(namesRecords.begin(), namesRecords.end(), CompareRecords);
+		CHECK(excludeResult == DIRHASH_OK);
+		CHECK(namesResult == DIRHASH_OK);
+		CHECK(excludeRecords.size() == excludeReference.size());
+		CHECK(namesRecords.size() == namesReference.size());
+		for (size_t j = 0; (j < excludeRecords.size()) && (j < excludeReference.size()); j++)
+			CHECK((excludeRecords[j].path == excludeReference[j].path) && (excludeRecords[j].digestHex == excludeReference[j].digestHex));
+		for (size_t j = 0; (j < namesRecords.size()) && (j < namesReference.size()); j++)
+			CHECK((namesRecords[j].path == namesReference[j].path) && (namesRecords[j].digestHex == namesReference[j].digestHex));
+	}
+
+	// an operation completes while the first file of another context is being reported
+	WAIT_STATE waitState;
+	thread waitingThread([&]() { DirHashCompute(hContext, dir.wstring().c_str(), &namesOptions, WaitOtherContext, NULL, &waitState, NULL, NULL); });
+	this_thread::sleep_for(chrono::milliseconds(100));
+	vector<FILE_RECORD> namesRecords;
+	CHECK(Compute(hOtherContext, dir, namesOptions, namesRecords) == DIRHASH_OK);
+	waitState.bOtherDone = true;
+	waitingThread.join();
+	CHECK(waitState.bOverlapped);
+
+	// cancelling a context doesn't stop the operation of another one
+	vector<FILE_RECORD> excludeRecords, cancelledRecords;
+	unsigned int excludeResult = DIRHASH_OK, cancelledResult = DIRHASH_OK;
+	thread excludeThread([&]() { excludeResult = Compute(hContext, dir, excludeOptions, excludeRecords); });
+	thread cancelledThread([&]() { cancelledResult = Compute(hOtherContext, dir, excludeOptions, cancelledRecords); });
+	for (int i = 0; i < 100; i++)
+		DirHashCancel(hOtherContext);
+	excludeThread.join();
+	cancelledThread.join();
+	CHECK(excludeResult == DIRHASH_OK);
+	CHECK(excludeRecords.size() == excludeReference.size());
+	CHECK((cancelledResult == DIRHASH_OK) || (cancelledResult == DIRHASH_ERROR_CANCELLED));
+	DirHashDestroyContext(hOtherContext);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: LibraryTests WorkDirectory\n");
+		return 2;
+	}
+
+	fs::path work = fs::absolute(argv[1]);
+	fs::remove_all(work);
+	fs::create_directories(work);
+
+	DIRHASH_CONTEXT hContext = DirHashCreateContext();
+#ifndef _WIN32
+	TestSumPathStartingWithColon(hContext, work);
+#endif
+	TestCacheWithHashNames(hContext, work);
+	TestConcurrentContexts(hContext, work);
+	DirHashDestroyContext(hContext);
+
+	if (g_failures)
+		fprintf(stderr, "%d check(s) failed\n", g_failures);
+	return g_failures ? 1 : 0;
+}